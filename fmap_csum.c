@@ -42,18 +42,24 @@
 #include <errno.h>
 #include <string.h>
 #include <getopt.h>
+#include <limits.h>
 
 #include "lib/fmap.h"
 
 static struct option const long_options[] =
 {
+  {"checkpoint", required_argument, NULL, 'c'},
+  {"coalesced", no_argument, NULL, 'C'},
   {"digest", required_argument, NULL, 'd'},
   {"list", no_argument, NULL, 'l'},
+  {"per-area", no_argument, NULL, 'p'},
+  {"stream", no_argument, NULL, 's'},
+  {"threads", required_argument, NULL, 't'},
   {"version", no_argument, NULL, 'v'},
   {NULL, 0, NULL, 0}
 };
 
-void print_csum(uint8_t *digest, size_t len)
+void print_csum(uint8_t *digest, size_t len, const char *label)
 {
 	char *str;
 	char tmp[3];
@@ -67,38 +73,129 @@ void print_csum(uint8_t *digest, size_t len)
 		strncat(str, tmp, 3);
 	}
 
-	printf("%s\n", str);
+	if (label)
+		printf("%s  %s\n", str, label);
+	else
+		printf("%s\n", str);
 	free(str);
 }
 
 void print_help()
 {
+	int i;
+
 	printf("Usage: fmap_csum [OPTION]... [FILE]\n"
-	        "Print sha1sum of static regions of FMAP-compliant binary\n"
+	        "Print checksum of static regions of FMAP-compliant binary\n"
+	        "With FILE of -, read standard input (implies --stream)\n"
 	        "Arguments:\n"
+	        "\t-c, --checkpoint <file>\treuse and update SHA-1 "
+	        "midstates saved in file\n"
+	        "\t\t\t\t(not collision resistant, do not use to verify "
+	        "untrusted images)\n"
+	        "\t-C, --coalesced\t\thash each static byte once, in offset "
+	        "order\n"
+	        "\t-d, --digest <alg>\tdigest algorithm (default: sha1)\n"
 	        "\t-h, --help\t\tprint this help menu\n"
-	        "\t-v, --version\t\tdisplay version\n");
+	        "\t-p, --per-area\t\tprint checksum of each static area "
+	        "and their merkle root\n"
+	        "\t-s, --stream\t\tread the file in a pipeline instead of "
+	        "mapping it\n"
+	        "\t-t, --threads <n>\tsearch for fmap and hash areas using "
+	        "n threads (0: one per CPU)\n"
+	        "\t-v, --version\t\tdisplay version\n"
+	        "Digest algorithms:\n");
+	for (i = 0; fmap_digests[i]; i++)
+		printf("\t%s\n", fmap_digests[i]->name);
+}
+
+/* print one line per static area followed by their merkle root */
+int print_area_csums(const uint8_t *image, unsigned int image_len,
+                     long int fmap_offset, const struct fmap_digest *alg,
+                     int nthreads)
+{
+	struct fmap_view view;
+	struct fmap_view_area area;
+	struct fmap_area_csum *csums = NULL;
+	uint8_t root[FMAP_DIGEST_MAX_SIZE];
+	char name[FMAP_STRLEN + 1];
+	int i, n;
+
+	n = fmap_get_area_csums(image, image_len, fmap_offset, alg,
+	                        FMAP_AREA_STATIC, nthreads, &csums, root);
+	if ((n < 0) || (fmap_view_init(&view, image, image_len,
+	                               fmap_offset) < 0)) {
+		fprintf(stderr, "unable to obtain checksum\n");
+		free(csums);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < n; i++) {
+		fmap_view_area(&view, csums[i].area, &area);
+		snprintf(name, sizeof(name), "%.*s",
+		         (int)area.name.len, area.name.ptr);
+		print_csum(csums[i].digest, alg->size, name);
+	}
+	print_csum(root, alg->size, "(merkle root)");
+
+	free(csums);
+	return EXIT_SUCCESS;
 }
 
 int main(int argc, char *argv[])
 {
 	int fd, len, rc = EXIT_SUCCESS;
 	struct stat s;
-	char *filename = NULL;
+	char *filename = NULL, *checkpoint = NULL;
 	uint8_t *image;
-	int argflag;
+	int argflag, nthreads = -1, per_area = 0, stream = 0;
+	long int fmap_offset;
 	uint8_t *digest = NULL;
+	const struct fmap_digest *alg = &fmap_digest_sha1;
+	enum fmap_csum_mode mode = FMAP_CSUM_LEGACY;
+	long long num;
 
-	while ((argflag = getopt_long(argc, argv, "d:hlv",
+	while ((argflag = getopt_long(argc, argv, "Cc:d:hlpst:v",
 	                      long_options, NULL)) > 0) {
 		switch (argflag) {
 		case 'v':
 			printf("fmap suite version: %d.%d\n",
 			       VERSION_MAJOR, VERSION_MINOR);;
 			goto do_exit_1;
+		case 'C':
+			mode = FMAP_CSUM_COALESCED;
+			break;
+		case 'c':
+			checkpoint = optarg;
+			break;
+		case 'd':
+			alg = fmap_digest_find(optarg);
+			if (alg == NULL) {
+				fprintf(stderr, "unknown digest algorithm "
+				                "\"%s\"\n", optarg);
+				print_help();
+				rc = EXIT_FAILURE;
+				goto do_exit_1;
+			}
+			break;
 		case 'h':
 			print_help();
 			goto do_exit_1;
+		case 'p':
+			per_area = 1;
+			break;
+		case 's':
+			stream = 1;
+			break;
+		case 't':
+			if (str2num(optarg, 0, INT_MAX, &num) < 0) {
+				fprintf(stderr, "invalid number of threads "
+				        "\"%s\"\n", optarg);
+				print_help();
+				rc = EXIT_FAILURE;
+				goto do_exit_1;
+			}
+			nthreads = num;
+			break;
 		default:
 			print_help();
 			rc = EXIT_FAILURE;
@@ -106,6 +203,23 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* checkpoints hold SHA-1 midstates of the combined checksum */
+	if (checkpoint && (per_area || alg != &fmap_digest_sha1 ||
+	                   mode != FMAP_CSUM_LEGACY)) {
+		fprintf(stderr, "--checkpoint only works with the sha1 "
+		                "checksum of all static areas\n");
+		rc = EXIT_FAILURE;
+		goto do_exit_1;
+	}
+
+	/* per-area digests do not depend on the order of areas */
+	if (per_area && mode != FMAP_CSUM_LEGACY) {
+		fprintf(stderr, "--coalesced cannot be combined with "
+		                "--per-area\n");
+		rc = EXIT_FAILURE;
+		goto do_exit_1;
+	}
+
 	/* quit if filename not specified */
 	if (argv[optind]) {
 		filename = argv[optind];
@@ -115,13 +229,40 @@ int main(int argc, char *argv[])
 		goto do_exit_1;
 	}
 
-	fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "unable to open file \"%s\": %s\n",
-		                filename, strerror(errno));
-		rc = EXIT_FAILURE;
-		goto do_exit_1;
+	if (!strcmp(filename, "-")) {
+		fd = STDIN_FILENO;
+		stream = 1;
+	} else {
+		fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "unable to open file \"%s\": %s\n",
+			                filename, strerror(errno));
+			rc = EXIT_FAILURE;
+			goto do_exit_1;
+		}
+	}
+
+	/* overlap reading and hashing with a fixed amount of memory */
+	if (stream) {
+		if (per_area || checkpoint || nthreads >= 0) {
+			fprintf(stderr, "--stream cannot be combined with "
+			                "--per-area, --checkpoint or "
+			                "--threads\n");
+			rc = EXIT_FAILURE;
+			goto do_exit_2;
+		}
+
+		if ((len = fmap_get_csum_fd(fd, alg, mode, &digest)) < 0) {
+			fprintf(stderr, "unable to obtain checksum\n");
+			rc = EXIT_FAILURE;
+			goto do_exit_2;
+		}
+
+		print_csum(digest, len, NULL);
+		free(digest);
+		goto do_exit_2;
 	}
+
 	if (fstat(fd, &s) < 0) {
 		fprintf(stderr, "unable to stat file \"%s\": %s\n",
 		                filename, strerror(errno));
@@ -137,13 +278,34 @@ int main(int argc, char *argv[])
 		goto do_exit_2;
 	}
 
-	if ((len = fmap_get_csum(image, s.st_size, &digest)) < 0) {
+	if (nthreads >= 0)
+		fmap_offset = fmap_find_parallel(image, s.st_size, nthreads);
+	else
+		fmap_offset = fmap_find(image, s.st_size);
+
+	/* digests such as sha256-tree start no more threads than asked for */
+	if (nthreads >= 0)
+		fmap_digest_threads(nthreads);
+
+	if (per_area) {
+		rc = print_area_csums(image, s.st_size, fmap_offset, alg,
+		                      nthreads < 0 ? 0 : nthreads);
+		goto do_exit_3;
+	}
+
+	if (checkpoint)
+		len = fmap_get_csum_checkpoint(image, s.st_size, fmap_offset,
+		                               checkpoint, &digest);
+	else
+		len = fmap_get_csum_digest(image, s.st_size, fmap_offset,
+		                           alg, mode, &digest);
+	if (len < 0) {
 		fprintf(stderr, "unable to obtain checksum\n");
 		rc = EXIT_FAILURE;
 		goto do_exit_3;
 	}
 
-	print_csum(digest, len);
+	print_csum(digest, len, NULL);
 
 do_exit_3:
 	munmap(image, s.st_size);
@@ -42,9 +42,75 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
 
 #include "lib/fmap.h"
 
+static struct option const long_options[] =
+{
+  {"help", no_argument, NULL, 'h'},
+  {"threads", required_argument, NULL, 't'},
+  {"validate", no_argument, NULL, 'V'},
+  {"align", required_argument, NULL, 'a'},
+  {"format", required_argument, NULL, 'f'},
+  {NULL, 0, NULL, 0}
+};
+
+static void print_help(const char *name)
+{
+	printf("usage: %s [OPTION]... <filename>\n"
+	       "Print FMAP contained in <filename>, or standard input if "
+	       "<filename> is -\n"
+	       "Arguments:\n"
+	       "\t-a, --align <n>\t\twith --validate, require areas to be "
+	       "aligned to n bytes\n\t\t\t\t(a power of two)\n"
+	       "\t-f, --format <fmt>\toutput format: pair (default), value, "
+	       "long,\n\t\t\t\tjson, csv or tlv (binary)\n"
+	       "\t-h, --help\t\tprint this help menu\n"
+	       "\t-t, --threads <n>\tsearch for fmap using n threads "
+	       "(0: one per CPU)\n"
+	       "\t-V, --validate\t\tcheck the area layout instead of "
+	       "printing it\n", name);
+}
+
+static void print_area_name(const char *key, const struct fmap *fmap, int i)
+{
+	if (i < 0)
+		return;
+	printf("%s=\"%.*s\" ", key, FMAP_STRLEN,
+	       (const char *)fmap->areas[i].name);
+}
+
+/* print layout issues, returns EXIT_FAILURE if any is an error */
+static int validate(const struct fmap *fmap, uint32_t align)
+{
+	struct fmap_issue *issues;
+	int i, n, rc = EXIT_SUCCESS;
+
+	n = fmap_validate(fmap, align, &issues);
+	if (n < 0) {
+		fprintf(stderr, "unable to validate fmap\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < n; i++) {
+		printf("issue=\"%s\" ",
+		       fmap_issue_type_to_string(issues[i].type));
+		print_area_name("area_name", fmap, issues[i].area);
+		print_area_name("other_name", fmap, issues[i].other);
+		printf("offset=\"0x%08" PRIx64 "\" size=\"0x%08" PRIx64 "\"\n",
+		       issues[i].offset, issues[i].size);
+
+		if (issues[i].type != FMAP_ISSUE_NESTED)
+			rc = EXIT_FAILURE;
+	}
+
+	free(issues);
+	return rc;
+}
+
 int main(int argc, char *argv[])
 {
 	int fd;
@@ -53,21 +119,106 @@ int main(int argc, char *argv[])
 	char *filename;
 	uint8_t *blob;
 	off_t fmap_offset;
+	struct fmap_view view;
+	int argflag, nthreads = -1, do_validate = 0, align_set = 0;
+	uint32_t align = 0;
+	long long num;
+	struct fmap_output *out;
+
+	out = fmap_output_create_file(stdout);
+	if (!out)
+		return EXIT_FAILURE;
+
+	while ((argflag = getopt_long(argc, argv, "a:f:ht:V",
+	                              long_options, NULL)) > 0) {
+		switch (argflag) {
+		case 'a':
+			if (str2num(optarg, 0, UINT32_MAX, &num) < 0 ||
+			    (num & (num - 1))) {
+				fprintf(stderr, "invalid alignment \"%s\", "
+				        "must be a power of two\n", optarg);
+				print_help(argv[0]);
+				rc = EXIT_FAILURE;
+				goto do_exit_1;
+			}
+			align = num;
+			align_set = 1;
+			break;
+		case 'f':
+			if (fmap_output_set_format(out, optarg) < 0) {
+				fprintf(stderr, "unknown format \"%s\"\n",
+				        optarg);
+				print_help(argv[0]);
+				rc = EXIT_FAILURE;
+				goto do_exit_1;
+			}
+			break;
+		case 'h':
+			print_help(argv[0]);
+			goto do_exit_1;
+		case 't':
+			if (str2num(optarg, 0, INT_MAX, &num) < 0) {
+				fprintf(stderr, "invalid number of threads "
+				        "\"%s\"\n", optarg);
+				print_help(argv[0]);
+				rc = EXIT_FAILURE;
+				goto do_exit_1;
+			}
+			nthreads = num;
+			break;
+		case 'V':
+			do_validate = 1;
+			break;
+		default:
+			print_help(argv[0]);
+			rc = EXIT_FAILURE;
+			goto do_exit_1;
+		}
+	}
 
-	if (argc != 2) {
-		printf("usage: %s <filename>\n", argv[0]);
+	if (align_set && !do_validate) {
+		fprintf(stderr, "--align only applies to --validate\n");
+		print_help(argv[0]);
 		rc = EXIT_FAILURE;
 		goto do_exit_1;
 	}
-	filename = argv[1];
 
-	fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		printf("unable to open file \"%s\": %s\n",
-		       filename, strerror(errno));
+	if (optind != argc - 1) {
+		print_help(argv[0]);
 		rc = EXIT_FAILURE;
+		goto do_exit_1;
+	}
+	filename = argv[optind];
+
+	if (!strcmp(filename, "-")) {
+		fd = STDIN_FILENO;
+	} else {
+		fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			printf("unable to open file \"%s\": %s\n",
+			       filename, strerror(errno));
+			rc = EXIT_FAILURE;
+			goto do_exit_1;
+		}
+	}
+
+	/* stream the file unless a parallel search of the whole image is
+	   requested, so pipes and devices work and memory use is bounded */
+	if (nthreads < 0) {
+		struct fmap *fmap = NULL;
+
+		if (fmap_find_fd(fd, &fmap) < 0) {
+			rc = EXIT_FAILURE;
+			goto do_exit_2;
+		}
+		if (do_validate)
+			rc = validate(fmap, align);
+		else if (fmap_output_print(out, fmap) < 0)
+			rc = EXIT_FAILURE;
+		fmap_destroy(fmap);
 		goto do_exit_2;
 	}
+
 	if (fstat(fd, &s) < 0) {
 		printf("unable to stat file \"%s\": %s\n",
 		       filename, strerror(errno));
@@ -83,12 +234,15 @@ int main(int argc, char *argv[])
 		goto do_exit_2;
 	}
 
-	fmap_offset = fmap_find(blob, s.st_size);
-	if (fmap_offset < 0) {
+	fmap_offset = fmap_find_parallel(blob, s.st_size, nthreads);
+	if (fmap_view_init(&view, blob, s.st_size, fmap_offset) < 0) {
 		rc = EXIT_FAILURE;
 		goto do_exit_3;
-	} else {
-		fmap_print((struct fmap *)(blob + fmap_offset));
+	} else if (do_validate) {
+		rc = validate((struct fmap *)(view.image + view.offset), align);
+	} else if (fmap_output_print(out, (struct fmap *)(view.image +
+	                                                  view.offset)) < 0) {
+		rc = EXIT_FAILURE;
 	}
 
 do_exit_3:
@@ -96,5 +250,6 @@ do_exit_3:
 do_exit_2:
 	close(fd);
 do_exit_1:
+	fmap_output_destroy(out);
 	return rc;
 }
@@ -35,6 +35,7 @@
 
 #include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -48,7 +49,19 @@ static void print_usage()
 	       "Options:\n"
 	       "\t-h | --help                        print this help text\n"
 	       "\t-i | --interactive <output>        interactive setup\n"
-	       "\t-k | --kv <input> <output>         generate binary from kv-pairs\n"
+	       "\t-k | --kv <input> <output> [...]   generate binary from kv-pairs,\n"
+	       "\t                                   more input/output pairs may follow\n"
+	       "\t-b | --batch <manifest>            generate a binary for each\n"
+	       "\t                                   \"<input> <output>\" line of manifest\n"
+	       "\t-j | --jobs <n>                    encode pairs using n threads\n"
+	       "\t                                   (default: one per CPU)\n"
+	       "\t-u | --update <input> <image>      write fmap from kv-pairs into an\n"
+	       "\t                                   existing image, in place\n"
+	       "\t-o | --offset <n>                  offset of fmap for --update\n"
+	       "\t                                   (default: replace fmap in image)\n"
+	       "\t-s | --size <n>                    bytes set aside for the fmap at\n"
+	       "\t                                   --offset (default: size of the\n"
+	       "\t                                   fmap there, which must exist)\n"
 //	       "\t-x | --xml <input> <output>        generate binary from xml\n"
 	       "\n"
 	);
@@ -57,46 +70,124 @@ static void print_usage()
 int main(int argc, char *argv[])
 {
 	int rc = EXIT_SUCCESS;
-	int opt, option_index = 0;
-	static const char optstring[] = "hi:k:";
+	int opt, option_index = 0, nthreads = 0;
+	long int offset = -1, room = 0;
+	long long num;
+	static const char optstring[] = "b:hi:j:k:o:s:u:";
 	static const struct option long_options[] = {
+		{"batch", required_argument, NULL, 'b'},
 		{"help", no_argument, NULL, 'h'},
 		{"interactive", required_argument, NULL, 'i'},
+		{"jobs", required_argument, NULL, 'j'},
 		{"kv", required_argument, NULL, 'k'},
+		{"offset", required_argument, NULL, 'o'},
+		{"size", required_argument, NULL, 's'},
+		{"update", required_argument, NULL, 'u'},
 		{NULL, 0, NULL, 0}
 	};
-	char *input = NULL, *output = NULL;
+	char *manifest = NULL, *interactive = NULL, *kv = NULL;
+	char *update = NULL;
+	char **pairs = NULL;
+	int npairs, i;
 
-	opt = getopt_long(argc, argv, optstring, long_options, &option_index);
-	switch(opt) {
-	case 'h':
+	while ((opt = getopt_long(argc, argv, optstring,
+	                          long_options, &option_index)) != -1) {
+		switch(opt) {
+		case 'b':
+			manifest = optarg;
+			break;
+		case 'h':
+			print_usage();
+			goto exit;
+		case 'i':
+			interactive = optarg;
+			break;
+		case 'j':
+			if (str2num(optarg, 0, INT_MAX, &num) < 0) {
+				printf("Error: invalid number of jobs\n");
+				rc = EXIT_FAILURE;
+				goto exit;
+			}
+			nthreads = num;
+			break;
+		case 'k':
+			kv = optarg;
+			break;
+		case 'o':
+			if (str2num(optarg, 0, LONG_MAX, &num) < 0) {
+				printf("Error: invalid offset\n");
+				rc = EXIT_FAILURE;
+				goto exit;
+			}
+			offset = num;
+			break;
+		case 's':
+			if (str2num(optarg, 1, LONG_MAX, &num) < 0) {
+				printf("Error: invalid size\n");
+				rc = EXIT_FAILURE;
+				goto exit;
+			}
+			room = num;
+			break;
+		case 'u':
+			update = optarg;
+			break;
+		default:
+			print_usage();
+			rc = EXIT_FAILURE;
+			goto exit;
+		}
+	}
+
+	/* these say where to write into an image, never assume one */
+	if ((offset >= 0 || room) && !update) {
+		printf("Error: --offset and --size only apply to --update\n");
 		print_usage();
-		break;
-	case 'i':
-		output = strdup(optarg);
-		rc = input_interactive(output);
-		break;
-	case 'k':
-		if (!optarg || !argv[optind]) {
+		rc = EXIT_FAILURE;
+		goto exit;
+	}
+
+	if (interactive) {
+		rc = input_interactive(interactive);
+	} else if (update) {
+		if (argc - optind != 1) {
 			printf("Error: missing argument\n");
 			print_usage();
 			rc = EXIT_FAILURE;
-			break;
+			goto exit;
+		}
+		rc = input_kv_pair_update(update, argv[optind], offset, room);
+	} else if (kv) {
+		/* the output for -k, then any further input/output pairs */
+		npairs = (argc - optind + 1) / 2;
+		if (optind == argc || (argc - optind) % 2 != 1) {
+			printf("Error: missing argument\n");
+			print_usage();
+			rc = EXIT_FAILURE;
+			goto exit;
+		}
+
+		if (npairs == 1) {
+			rc = input_kv_pair(kv, argv[optind]);
+			goto exit;
+		}
+
+		pairs = malloc(npairs * 2 * sizeof(*pairs));
+		if (!pairs) {
+			rc = EXIT_FAILURE;
+			goto exit;
 		}
-		input = strdup(optarg);
-		output = strdup(argv[optind]);
-		rc = input_kv_pair(input, output);
-		if (optind != (argc - 1))
-			optind++;
-		break;
-	default:
+		pairs[0] = kv;
+		for (i = optind; i < argc; i++)
+			pairs[i - optind + 1] = argv[i];
+		rc = input_kv_pair_batch(pairs, npairs, nthreads);
+	} else if (manifest) {
+		rc = input_kv_pair_manifest(manifest, nthreads);
+	} else {
 		print_usage();	/* FIXME: implement this */
-		break;
 	}
 
-	if (input)
-		free(input);
-	if (output)
-		free(output);
+exit:
+	free(pairs);
 	return rc;
 }
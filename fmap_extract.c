@@ -0,0 +1,275 @@
+/* Copyright 2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *    * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "lib/fmap.h"
+
+static struct option const long_options[] =
+{
+  {"directory", required_argument, NULL, 'd'},
+  {"help", no_argument, NULL, 'h'},
+  {"version", no_argument, NULL, 'v'},
+  {NULL, 0, NULL, 0}
+};
+
+void print_help()
+{
+	printf("Usage: fmap_extract [OPTION]... FILE [AREA[:OUTPUT]]...\n"
+	        "Copy areas of FMAP-compliant binary FILE to files\n"
+	        "Each AREA is written to a file named after it, or to OUTPUT "
+	        "if given.\n"
+	        "AREA may be a shell pattern such as 'RW_*', in which case "
+	        "all matching\nareas are written to OUTPUT one after "
+	        "another. OUTPUT of - means\nstandard output. With no "
+	        "AREA, every area is extracted.\n"
+	        "Arguments:\n"
+	        "\t-d, --directory <dir>\twrite files named after areas "
+	        "into dir\n"
+	        "\t-h, --help\t\tprint this help menu\n"
+	        "\t-v, --version\t\tdisplay version\n");
+}
+
+/* copy one area of the image to out */
+static int copy_area(int fd, off_t image_len,
+                     const struct fmap_area *area, int out, const char *path)
+{
+	if ((off_t)area->offset + area->size > image_len) {
+		fprintf(stderr, "area \"%.*s\" lies outside of the image\n",
+		        FMAP_STRLEN, area->name);
+		return -1;
+	}
+
+	if (fmap_copy_fd(fd, area->offset, area->size, out)) {
+		fprintf(stderr, "failed to write area \"%.*s\" to \"%s\": %s\n",
+		        FMAP_STRLEN, area->name, path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* copy areas to path, or to standard output if path is "-" */
+static int extract_to(int fd, off_t image_len,
+                      struct fmap_area *const areas[], int n,
+                      const char *path)
+{
+	int i, out, rc = 0;
+
+	if (!strcmp(path, "-")) {
+		out = STDOUT_FILENO;
+		path = "(standard output)";
+	} else {
+		out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (out < 0) {
+			fprintf(stderr, "unable to open file \"%s\": %s\n",
+			        path, strerror(errno));
+			return -1;
+		}
+	}
+
+	for (i = 0; i < n && !rc; i++)
+		rc = copy_area(fd, image_len, areas[i], out, path);
+
+	if (out != STDOUT_FILENO && close(out)) {
+		fprintf(stderr, "failed to write \"%s\": %s\n",
+		        path, strerror(errno));
+		rc = -1;
+	}
+
+	return rc;
+}
+
+/* copy each area to a file of the same name in dir */
+static int extract_named(int fd, off_t image_len,
+                         struct fmap_area *const areas[], int n,
+                         const char *dir)
+{
+	char name[FMAP_STRLEN + 1], *path, *c;
+	int i, rc = 0;
+
+	path = malloc(strlen(dir) + sizeof(name) + 1);
+	if (!path)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "%.*s",
+		         FMAP_STRLEN, areas[i]->name);
+
+		/* keep files inside dir whatever the area is called */
+		for (c = name; *c; c++) {
+			if (*c == '/')
+				*c = '_';
+		}
+		if (!strcmp(name, "") || !strcmp(name, ".") ||
+		    !strcmp(name, "..")) {
+			fprintf(stderr, "skipping area with unusable name "
+			        "\"%s\"\n", name);
+			rc = -1;
+			continue;
+		}
+
+		sprintf(path, "%s/%s", dir, name);
+		if (extract_to(fd, image_len, &areas[i], 1, path))
+			rc = -1;
+	}
+
+	free(path);
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = ".";
+	struct fmap *fmap = NULL;
+	struct fmap_name_index *idx = NULL;
+	struct fmap_area **areas = NULL, *area;
+	struct stat s;
+	char *pattern, *output;
+	int fd, i, n, argflag, rc = EXIT_SUCCESS;
+
+	while ((argflag = getopt_long(argc, argv, "d:hv",
+	                              long_options, NULL)) > 0) {
+		switch (argflag) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'h':
+			print_help();
+			exit(EXIT_SUCCESS);
+		case 'v':
+			printf("fmap suite version: %d.%d\n",
+			       VERSION_MAJOR, VERSION_MINOR);
+			exit(EXIT_SUCCESS);
+		default:
+			print_help();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind == argc) {
+		print_help();
+		exit(EXIT_FAILURE);
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "unable to open file \"%s\": %s\n",
+		        argv[optind], strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* areas are copied by offset, so the image must be seekable */
+	if (fstat(fd, &s) || !S_ISREG(s.st_mode)) {
+		fprintf(stderr, "\"%s\" is not a regular file\n",
+		        argv[optind]);
+		rc = EXIT_FAILURE;
+		goto do_exit;
+	}
+
+	if (fmap_find_fd(fd, &fmap) < 0) {
+		fprintf(stderr, "unable to find fmap in \"%s\"\n",
+		        argv[optind]);
+		rc = EXIT_FAILURE;
+		goto do_exit;
+	}
+
+	if (optind + 1 == argc) {
+		areas = malloc((fmap->nareas + 1) * sizeof(*areas));
+		if (!areas) {
+			rc = EXIT_FAILURE;
+			goto do_exit;
+		}
+		for (i = 0; i < fmap->nareas; i++)
+			areas[i] = &fmap->areas[i];
+		if (extract_named(fd, s.st_size, areas, fmap->nareas, dir))
+			rc = EXIT_FAILURE;
+		goto do_exit;
+	}
+
+	idx = fmap_name_index_create(fmap);
+	if (!idx) {
+		rc = EXIT_FAILURE;
+		goto do_exit;
+	}
+
+	for (i = optind + 1; i < argc; i++) {
+		pattern = argv[i];
+		output = strchr(pattern, ':');
+		if (output)
+			*output++ = '\0';
+
+		if (strpbrk(pattern, "*?[")) {
+			n = fmap_name_index_glob(idx, pattern, &areas);
+		} else {
+			area = fmap_name_index_find(idx, pattern);
+			n = area ? 1 : 0;
+			areas = area ? malloc(sizeof(*areas)) : NULL;
+			if (areas)
+				areas[0] = area;
+			else if (area)
+				n = -1;
+		}
+
+		if (n <= 0) {
+			fprintf(stderr, n ? "unable to look up \"%s\"\n"
+			                  : "no area matches \"%s\"\n",
+			        pattern);
+			rc = EXIT_FAILURE;
+		} else if (output ? extract_to(fd, s.st_size, areas, n, output)
+		                  : extract_named(fd, s.st_size,
+		                                  areas, n, dir)) {
+			rc = EXIT_FAILURE;
+		}
+
+		free(areas);
+		areas = NULL;
+	}
+
+do_exit:
+	free(areas);
+	fmap_name_index_destroy(idx);
+	fmap_destroy(fmap);
+	close(fd);
+	exit(rc);
+}
@@ -38,13 +38,29 @@
 
 #include "lib/fmap.h"
 #include "lib/input.h"
+#include "lib/kv_pair.h"
+#include "lib/valstr.h"
+#include "lib/mincrypt/sha.h"
+#include "lib/mincrypt/sha256.h"
 
 int main()
 {
 	int rc = 0;
 
 	rc |= input_kv_pair_test();
+	rc |= kv_pair_test();
+	rc |= valstr_test();
 	rc |= fmap_test();
+	rc |= SHA_test();
+	rc |= SHA_mb_test();
+	rc |= SHA256_test();
+	rc |= fmap_digest_test();
+	rc |= fmap_checkpoint_test();
+	rc |= fmap_index_test();
+	rc |= fmap_view_test();
+	rc |= fmap_validate_test();
+	rc |= fmap_output_test();
+	rc |= fmap_extract_test();
 
 	if (!rc) {
 		printf("Tests passed.\n");
@@ -0,0 +1,884 @@
+/*
+ * Copyright 2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * In-memory indexes over the area table of an fmap. They point into the
+ * fmap they were built from, which must not be changed or freed while an
+ * index is in use. The fmap itself, and so the on-disk format, is left
+ * untouched.
+ */
+
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fmap.h>
+
+struct fmap_name_index {
+	struct fmap *fmap;
+	uint32_t mask;		/* hash table size - 1 */
+	int32_t *slots;		/* area index + 1, 0 for empty */
+	int32_t *sorted;	/* area indexes ordered by name */
+};
+
+/* area names are not guaranteed to be terminated */
+static size_t fmap_area_name_len(const struct fmap_area *area)
+{
+	const uint8_t *end = memchr(area->name, '\0', FMAP_STRLEN);
+
+	return end ? end - area->name : FMAP_STRLEN;
+}
+
+static int fmap_area_name_cmp(const struct fmap_area *area, const char *name,
+                              size_t len)
+{
+	size_t alen = fmap_area_name_len(area);
+	int rc;
+
+	rc = memcmp(area->name, name, alen < len ? alen : len);
+	if (rc)
+		return rc;
+	return (alen > len) - (alen < len);
+}
+
+/* FNV-1a */
+static uint32_t fmap_name_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* qsort() has no context argument, so sort (index, area) pairs */
+struct fmap_name_sort {
+	const struct fmap_area *area;
+	int32_t index;
+};
+
+static int fmap_name_sort_cmp(const void *a, const void *b)
+{
+	const struct fmap_name_sort *sa = a, *sb = b;
+	int rc;
+
+	rc = fmap_area_name_cmp(sa->area, (const char *)sb->area->name,
+	                        fmap_area_name_len(sb->area));
+	if (rc)
+		return rc;
+	return sa->index - sb->index;
+}
+
+struct fmap_name_index *fmap_name_index_create(struct fmap *fmap)
+{
+	struct fmap_name_index *idx;
+	struct fmap_name_sort *sort;
+	uint32_t size = 1, h;
+	int i;
+
+	if (fmap == NULL)
+		return NULL;
+
+	/* keep the table at most half full */
+	while (size < 2 * (uint32_t)fmap->nareas)
+		size <<= 1;
+
+	idx = calloc(1, sizeof(*idx));
+	if (idx == NULL)
+		return NULL;
+	idx->fmap = fmap;
+	idx->mask = size - 1;
+	idx->slots = calloc(size, sizeof(*idx->slots));
+	idx->sorted = calloc(fmap->nareas ? fmap->nareas : 1,
+	                     sizeof(*idx->sorted));
+	sort = calloc(fmap->nareas ? fmap->nareas : 1, sizeof(*sort));
+	if (!idx->slots || !idx->sorted || !sort) {
+		free(sort);
+		fmap_name_index_destroy(idx);
+		return NULL;
+	}
+
+	for (i = 0; i < fmap->nareas; i++) {
+		const struct fmap_area *area = &fmap->areas[i];
+		size_t len = fmap_area_name_len(area);
+
+		/* linear probing; the first of several equal names wins */
+		h = fmap_name_hash((const char *)area->name, len) & idx->mask;
+		while (idx->slots[h] &&
+		       fmap_area_name_cmp(&fmap->areas[idx->slots[h] - 1],
+		                          (const char *)area->name, len))
+			h = (h + 1) & idx->mask;
+		if (!idx->slots[h])
+			idx->slots[h] = i + 1;
+
+		sort[i].area = area;
+		sort[i].index = i;
+	}
+
+	qsort(sort, fmap->nareas, sizeof(*sort), fmap_name_sort_cmp);
+	for (i = 0; i < fmap->nareas; i++)
+		idx->sorted[i] = sort[i].index;
+	free(sort);
+
+	return idx;
+}
+
+void fmap_name_index_destroy(struct fmap_name_index *idx)
+{
+	if (idx == NULL)
+		return;
+
+	free(idx->sorted);
+	free(idx->slots);
+	free(idx);
+}
+
+struct fmap_area *fmap_name_index_find(const struct fmap_name_index *idx,
+                                       const char *name)
+{
+	size_t len;
+	uint32_t h;
+
+	if (!idx || !name)
+		return NULL;
+
+	len = strlen(name);
+	if (len > FMAP_STRLEN)
+		return NULL;
+
+	h = fmap_name_hash(name, len) & idx->mask;
+	while (idx->slots[h]) {
+		struct fmap_area *area = &idx->fmap->areas[idx->slots[h] - 1];
+
+		if (!fmap_area_name_cmp(area, name, len))
+			return area;
+		h = (h + 1) & idx->mask;
+	}
+
+	return NULL;
+}
+
+/* first position in the sorted order whose name is >= prefix */
+static int fmap_name_index_lower(const struct fmap_name_index *idx,
+                                 const char *prefix, size_t len)
+{
+	int lo = 0, hi = idx->fmap->nareas, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (fmap_area_name_cmp(&idx->fmap->areas[idx->sorted[mid]],
+		                       prefix, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int fmap_area_has_prefix(const struct fmap_area *area,
+                                const char *prefix, size_t len)
+{
+	return fmap_area_name_len(area) >= len &&
+	       !memcmp(area->name, prefix, len);
+}
+
+/* collect areas matching prefix, and pattern if not NULL */
+static int fmap_name_index_collect(const struct fmap_name_index *idx,
+                                   const char *prefix, size_t len,
+                                   const char *pattern,
+                                   struct fmap_area ***areas)
+{
+	char name[FMAP_STRLEN + 1];
+	struct fmap_area **result;
+	int i, n = 0, first;
+
+	first = fmap_name_index_lower(idx, prefix, len);
+
+	/* size the result for the whole prefix range */
+	for (i = first; i < idx->fmap->nareas; i++) {
+		if (!fmap_area_has_prefix(&idx->fmap->areas[idx->sorted[i]],
+		                          prefix, len))
+			break;
+	}
+
+	result = calloc(i - first ? i - first : 1, sizeof(*result));
+	if (result == NULL)
+		return -1;
+
+	for (i = first; i < idx->fmap->nareas; i++) {
+		struct fmap_area *area = &idx->fmap->areas[idx->sorted[i]];
+
+		if (!fmap_area_has_prefix(area, prefix, len))
+			break;
+
+		if (pattern) {
+			size_t nlen = fmap_area_name_len(area);
+
+			memcpy(name, area->name, nlen);
+			name[nlen] = '\0';
+			if (fnmatch(pattern, name, 0))
+				continue;
+		}
+
+		result[n++] = area;
+	}
+
+	*areas = result;
+	return n;
+}
+
+int fmap_name_index_prefix(const struct fmap_name_index *idx,
+                           const char *prefix, struct fmap_area ***areas)
+{
+	if (!idx || !prefix || !areas)
+		return -1;
+
+	return fmap_name_index_collect(idx, prefix, strlen(prefix),
+	                               NULL, areas);
+}
+
+int fmap_name_index_glob(const struct fmap_name_index *idx,
+                         const char *pattern, struct fmap_area ***areas)
+{
+	if (!idx || !pattern || !areas)
+		return -1;
+
+	/* only names starting with the literal part can match */
+	return fmap_name_index_collect(idx, pattern,
+	                               strcspn(pattern, "*?[\\"),
+	                               pattern, areas);
+}
+
+/*
+ * The interval index is an implicit augmented binary search tree over the
+ * areas sorted by offset: the node at position i of the sorted array sits
+ * at the level given by the number of trailing one bits of i, and stores
+ * the largest end offset found in its subtree, so whole subtrees ending
+ * before a query can be skipped.
+ */
+struct fmap_interval {
+	uint64_t start;
+	uint64_t end;		/* exclusive */
+	uint64_t max;		/* largest end in this subtree */
+	int32_t area;
+};
+
+struct fmap_area_index {
+	struct fmap *fmap;
+	int n;
+	int levels;
+	struct fmap_interval nodes[];
+};
+
+static int fmap_interval_cmp(const void *a, const void *b)
+{
+	const struct fmap_interval *ia = a, *ib = b;
+
+	if (ia->start != ib->start)
+		return ia->start < ib->start ? -1 : 1;
+	if (ia->end != ib->end)
+		return ia->end < ib->end ? -1 : 1;
+	return ia->area - ib->area;
+}
+
+static int fmap_interval_augment(struct fmap_interval *a, int n)
+{
+	uint64_t last = 0, el, er, e;
+	int i, k, last_i = 0;
+
+	for (i = 0; i < n; i += 2) {
+		last_i = i;
+		last = a[i].max = a[i].end;
+	}
+
+	for (k = 1; (1 << k) <= n; k++) {
+		int x = 1 << (k - 1), i0 = (x << 1) - 1, step = x << 2;
+
+		for (i = i0; i < n; i += step) {
+			el = a[i - x].max;
+			er = i + x < n ? a[i + x].max : last;
+			e = a[i].end;
+			e = e > el ? e : el;
+			e = e > er ? e : er;
+			a[i].max = e;
+		}
+		last_i = (last_i >> k) & 1 ? last_i - x : last_i + x;
+		if (last_i < n && a[last_i].max > last)
+			last = a[last_i].max;
+	}
+
+	return k - 1;
+}
+
+struct fmap_area_index *fmap_area_index_create(struct fmap *fmap)
+{
+	struct fmap_area_index *idx;
+	int i;
+
+	if (fmap == NULL)
+		return NULL;
+
+	idx = malloc(sizeof(*idx) + fmap->nareas * sizeof(idx->nodes[0]));
+	if (idx == NULL)
+		return NULL;
+
+	idx->fmap = fmap;
+	idx->n = fmap->nareas;
+	for (i = 0; i < idx->n; i++) {
+		idx->nodes[i].start = fmap->areas[i].offset;
+		idx->nodes[i].end = (uint64_t)fmap->areas[i].offset +
+		                    fmap->areas[i].size;
+		idx->nodes[i].area = i;
+	}
+	qsort(idx->nodes, idx->n, sizeof(idx->nodes[0]), fmap_interval_cmp);
+	idx->levels = idx->n ? fmap_interval_augment(idx->nodes, idx->n) : 0;
+
+	return idx;
+}
+
+void fmap_area_index_destroy(struct fmap_area_index *idx)
+{
+	free(idx);
+}
+
+/*
+ * Visit the nodes overlapping [start, end) in offset order, calling fn()
+ * on each until it returns non-zero.
+ */
+static void fmap_area_index_walk(const struct fmap_area_index *idx,
+                                 uint64_t start, uint64_t end,
+                                 int (*fn)(const struct fmap_interval *node,
+                                           void *arg),
+                                 void *arg)
+{
+	const struct fmap_interval *a = idx->nodes;
+	struct { int x, k, w; } stack[64];
+	int t = 0, i, i0, i1, y;
+
+	if (idx->n == 0 || start >= end)
+		return;
+
+	stack[t].x = (1 << idx->levels) - 1;
+	stack[t].k = idx->levels;
+	stack[t++].w = 0;
+	while (t) {
+		int x = stack[--t].x, k = stack[t].k, w = stack[t].w;
+
+		if (k <= 3) {
+			/* small subtree, scan it */
+			i0 = x >> k << k;
+			i1 = i0 + (1 << (k + 1)) - 1;
+			if (i1 > idx->n)
+				i1 = idx->n;
+			for (i = i0; i < i1 && a[i].start < end; i++) {
+				if (start < a[i].end && fn(&a[i], arg))
+					return;
+			}
+		} else if (w == 0) {
+			/* revisit this node after its left subtree */
+			y = x - (1 << (k - 1));
+			stack[t].x = x;
+			stack[t].k = k;
+			stack[t++].w = 1;
+			if (y >= idx->n || a[y].max > start) {
+				stack[t].x = y;
+				stack[t].k = k - 1;
+				stack[t++].w = 0;
+			}
+		} else if (x < idx->n && a[x].start < end) {
+			if (start < a[x].end && fn(&a[x], arg))
+				return;
+			stack[t].x = x + (1 << (k - 1));
+			stack[t].k = k - 1;
+			stack[t++].w = 0;
+		}
+	}
+}
+
+struct fmap_overlap_result {
+	struct fmap *fmap;
+	struct fmap_area **areas;
+	int max;
+	int n;
+};
+
+static int fmap_overlap_collect(const struct fmap_interval *node, void *arg)
+{
+	struct fmap_overlap_result *r = arg;
+
+	if (r->n < r->max)
+		r->areas[r->n] = &r->fmap->areas[node->area];
+	r->n++;
+	return 0;
+}
+
+int fmap_area_index_overlap(const struct fmap_area_index *idx,
+                            uint64_t offset, uint64_t size,
+                            struct fmap_area **areas, int max)
+{
+	struct fmap_overlap_result r;
+
+	if (!idx || (max && !areas) || max < 0)
+		return -1;
+
+	r.fmap = idx->fmap;
+	r.areas = areas;
+	r.max = max;
+	r.n = 0;
+	fmap_area_index_walk(idx, offset,
+	                     size > UINT64_MAX - offset ? UINT64_MAX :
+	                     offset + size, fmap_overlap_collect, &r);
+
+	return r.n;
+}
+
+/*
+ * Of several areas covering an offset, the innermost is preferred: the
+ * one starting last, then the shortest, then the first in the fmap.
+ */
+static int fmap_interval_inner(const struct fmap_interval *a,
+                               const struct fmap_interval *b)
+{
+	if (a->start != b->start)
+		return a->start > b->start;
+	if (a->end != b->end)
+		return a->end < b->end;
+	return a->area < b->area;
+}
+
+static int fmap_area_at_collect(const struct fmap_interval *node, void *arg)
+{
+	const struct fmap_interval **best = arg;
+
+	if (*best == NULL || fmap_interval_inner(node, *best))
+		*best = node;
+	return 0;
+}
+
+struct fmap_area *fmap_area_at(const struct fmap_area_index *idx,
+                               uint64_t offset)
+{
+	const struct fmap_interval *best = NULL;
+
+	if (idx == NULL || offset == UINT64_MAX)
+		return NULL;
+
+	fmap_area_index_walk(idx, offset, offset + 1,
+	                     fmap_area_at_collect, &best);
+
+	return best ? &idx->fmap->areas[best->area] : NULL;
+}
+
+/* max-heap of candidate areas, innermost on top */
+static void fmap_heap_push(const struct fmap_interval **heap, int n,
+                           const struct fmap_interval *node)
+{
+	int i = n, parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!fmap_interval_inner(node, heap[parent]))
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = node;
+}
+
+static void fmap_heap_pop(const struct fmap_interval **heap, int n)
+{
+	const struct fmap_interval *node = heap[--n];
+	int i = 0, child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n &&
+		    fmap_interval_inner(heap[child + 1], heap[child]))
+			child++;
+		if (!fmap_interval_inner(heap[child], node))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = node;
+}
+
+int fmap_area_at_batch(const struct fmap_area_index *idx,
+                       const uint64_t *offsets, size_t count, int *areas)
+{
+	const struct fmap_interval **heap;
+	size_t i;
+	int j = 0, n = 0;
+
+	if (!idx || (count && (!offsets || !areas)))
+		return -1;
+
+	for (i = 1; i < count; i++) {
+		if (offsets[i] < offsets[i - 1])
+			return -1;
+	}
+
+	heap = malloc((idx->n ? idx->n : 1) * sizeof(*heap));
+	if (heap == NULL)
+		return -1;
+
+	/*
+	 * Sweep offsets and areas together. Areas enter the heap once they
+	 * start; an area on top of the heap that has already ended can never
+	 * cover a later offset, so it is dropped for good.
+	 */
+	for (i = 0; i < count; i++) {
+		while (j < idx->n && idx->nodes[j].start <= offsets[i])
+			fmap_heap_push(heap, n++, &idx->nodes[j++]);
+		while (n && heap[0]->end <= offsets[i])
+			fmap_heap_pop(heap, n--);
+		areas[i] = n ? heap[0]->area : -1;
+	}
+
+	free(heap);
+	return 0;
+}
+
+/*
+ * LCOV_EXCL_START
+ * Unit testing stuff done here so we do not need to expose static functions.
+ */
+static int fmap_name_index_test(void)
+{
+	struct fmap *fmap;
+	struct fmap_name_index *idx = NULL;
+	struct fmap_area **areas = NULL;
+	char name[FMAP_STRLEN + 1];
+	int i, n, rc = 1;
+
+	/* a few thousand generated areas, in no particular order */
+	fmap = fmap_create(0, 0x1000000, (uint8_t *)"names");
+	for (i = 0; i < 3000; i++) {
+		snprintf(name, sizeof(name), "%s_%04d",
+		         i % 3 ? "RW" : "RO", (i * 7919) % 3000);
+		if (fmap_append_area(&fmap, i * 0x1000, 0x1000,
+		                     (const uint8_t *)name, 0) < 0) {
+			printf("FAILURE: failed to append area\n");
+			goto fmap_name_index_test_exit;
+		}
+	}
+	/* a duplicate name resolves to the first area, as fmap_find_area */
+	fmap_append_area(&fmap, 0, 0x10, (const uint8_t *)"RW_0001", 0);
+
+	if (fmap_name_index_create(NULL) ||
+	    fmap_name_index_find(NULL, "RW_0001")) {
+		printf("FAILURE: failed to abort on NULL pointer input\n");
+		goto fmap_name_index_test_exit;
+	}
+
+	idx = fmap_name_index_create(fmap);
+	if (idx == NULL) {
+		printf("FAILURE: failed to create name index\n");
+		goto fmap_name_index_test_exit;
+	}
+
+	for (i = 0; i < fmap->nareas; i++) {
+		const char *area_name = (const char *)fmap->areas[i].name;
+
+		if (fmap_name_index_find(idx, area_name) !=
+		    fmap_find_area(fmap, area_name)) {
+			printf("FAILURE: index lookup of \"%s\" differs\n",
+			       area_name);
+			goto fmap_name_index_test_exit;
+		}
+	}
+	if (fmap_name_index_find(idx, "RW_3000") ||
+	    fmap_name_index_find(idx, "RW_") ||
+	    fmap_name_index_find(idx, "")) {
+		printf("FAILURE: index found a missing name\n");
+		goto fmap_name_index_test_exit;
+	}
+
+	/* prefix results come back sorted by name */
+	n = fmap_name_index_prefix(idx, "RW_", &areas);
+	if (n != 2001) {
+		printf("FAILURE: prefix query returned %d areas\n", n);
+		goto fmap_name_index_test_exit;
+	}
+	for (i = 1; i < n; i++) {
+		if (strncmp((const char *)areas[i - 1]->name,
+		            (const char *)areas[i]->name, FMAP_STRLEN) > 0) {
+			printf("FAILURE: prefix query is not sorted\n");
+			goto fmap_name_index_test_exit;
+		}
+	}
+	free(areas);
+	areas = NULL;
+
+	n = fmap_name_index_glob(idx, "R?_00[0-4]?", &areas);
+	if (n != 51) {
+		printf("FAILURE: glob query returned %d areas\n", n);
+		goto fmap_name_index_test_exit;
+	}
+	free(areas);
+	areas = NULL;
+
+	n = fmap_name_index_glob(idx, "*_2999", &areas);
+	if ((n != 1) || strcmp((const char *)areas[0]->name + 2, "_2999")) {
+		printf("FAILURE: glob query without prefix failed\n");
+		goto fmap_name_index_test_exit;
+	}
+	free(areas);
+	areas = NULL;
+
+	if (fmap_name_index_prefix(idx, "XX", &areas) != 0) {
+		printf("FAILURE: prefix query matched nothing\n");
+		goto fmap_name_index_test_exit;
+	}
+
+	rc = 0;
+fmap_name_index_test_exit:
+	free(areas);
+	fmap_name_index_destroy(idx);
+	fmap_destroy(fmap);
+	return rc;
+}
+
+/* reference answers by scanning every area */
+static struct fmap_area *fmap_area_at_scan(struct fmap *fmap, uint64_t offset)
+{
+	struct fmap_area *best = NULL, *area;
+	int i;
+
+	for (i = 0; i < fmap->nareas; i++) {
+		area = &fmap->areas[i];
+		if (offset < area->offset ||
+		    offset >= (uint64_t)area->offset + area->size)
+			continue;
+		if (!best || area->offset > best->offset ||
+		    (area->offset == best->offset && area->size < best->size))
+			best = area;
+	}
+
+	return best;
+}
+
+static int fmap_area_index_test(void)
+{
+	struct fmap *fmap;
+	struct fmap_area_index *idx = NULL;
+	struct fmap_area *found[16], *area;
+	uint64_t *offsets = NULL, offset, size, end;
+	int *batch = NULL;
+	uint32_t seed = 1;
+	int i, j, n, expected, rc = 1;
+
+	/* nested sections with overlapping sub-areas and some empty areas */
+	fmap = fmap_create(0, 0x1000000, (uint8_t *)"intervals");
+	for (i = 0; i < 256; i++) {
+		fmap_append_area(&fmap, i * 0x10000, 0x10000,
+		                 (const uint8_t *)"SECTION", 0);
+		for (j = 0; j < 4; j++) {
+			seed = seed * 1103515245 + 12345;
+			fmap_append_area(&fmap,
+			                 i * 0x10000 + (seed >> 16) % 0xc000,
+			                 (seed >> 8) % 0x4000,
+			                 (const uint8_t *)"SUB", 0);
+		}
+	}
+	fmap_append_area(&fmap, 0xffffff00, 0xff, (const uint8_t *)"TOP", 0);
+
+	if (fmap_area_index_create(NULL) || fmap_area_at(NULL, 0) ||
+	    fmap_area_index_overlap(NULL, 0, 1, found, 16) >= 0) {
+		printf("FAILURE: failed to abort on NULL pointer input\n");
+		goto fmap_area_index_test_exit;
+	}
+
+	idx = fmap_area_index_create(fmap);
+	if (idx == NULL) {
+		printf("FAILURE: failed to create area index\n");
+		goto fmap_area_index_test_exit;
+	}
+
+	for (offset = 0; offset < 0x1010000; offset += 0x3f7) {
+		if (fmap_area_at(idx, offset) != fmap_area_at_scan(fmap, offset)) {
+			printf("FAILURE: wrong area at 0x%" PRIx64 "\n", offset);
+			goto fmap_area_index_test_exit;
+		}
+	}
+	if (!fmap_area_at(idx, 0xffffffff - 1) ||
+	    fmap_area_at(idx, 0xffffffff) || fmap_area_at(idx, UINT64_MAX)) {
+		printf("FAILURE: wrong area at end of address space\n");
+		goto fmap_area_index_test_exit;
+	}
+
+	for (offset = 0; offset < 0x1010000; offset += 0x7ff1) {
+		size = offset % 0x20000;
+		end = offset + size;
+
+		expected = 0;
+		for (i = 0; i < fmap->nareas; i++) {
+			area = &fmap->areas[i];
+			if (offset < (uint64_t)area->offset + area->size &&
+			    area->offset < end)
+				expected++;
+		}
+
+		n = fmap_area_index_overlap(idx, offset, size, found, 16);
+		if (n != expected) {
+			printf("FAILURE: %d areas overlap 0x%" PRIx64 "+0x%"
+			       PRIx64 ", expected %d\n", n, offset, size,
+			       expected);
+			goto fmap_area_index_test_exit;
+		}
+		for (i = 1; i < n && i < 16; i++) {
+			if (found[i - 1]->offset > found[i]->offset) {
+				printf("FAILURE: overlap results not sorted\n");
+				goto fmap_area_index_test_exit;
+			}
+		}
+	}
+
+	/* batch answers match single lookups */
+	n = 0x1010000 / 0x101;
+	offsets = calloc(n, sizeof(*offsets));
+	batch = calloc(n, sizeof(*batch));
+	for (i = 0; i < n; i++)
+		offsets[i] = (uint64_t)i * 0x101;
+	if (fmap_area_at_batch(idx, offsets, n, batch)) {
+		printf("FAILURE: failed to run batch lookup\n");
+		goto fmap_area_index_test_exit;
+	}
+	for (i = 0; i < n; i++) {
+		area = fmap_area_at(idx, offsets[i]);
+		if (area != (batch[i] < 0 ? NULL : &fmap->areas[batch[i]])) {
+			printf("FAILURE: batch lookup differs at 0x%" PRIx64
+			       "\n", offsets[i]);
+			goto fmap_area_index_test_exit;
+		}
+	}
+
+	offsets[1] = 0x1000000;
+	if (fmap_area_at_batch(idx, offsets, n, batch) >= 0) {
+		printf("FAILURE: failed to reject unsorted offsets\n");
+		goto fmap_area_index_test_exit;
+	}
+
+	rc = 0;
+fmap_area_index_test_exit:
+	free(batch);
+	free(offsets);
+	fmap_area_index_destroy(idx);
+	fmap_destroy(fmap);
+	return rc;
+}
+
+/* compare the index against brute force on many small random layouts */
+static int fmap_area_index_fuzz_test(void)
+{
+	struct fmap *fmap = NULL;
+	struct fmap_area_index *idx = NULL;
+	struct fmap_area *found[64], *area;
+	uint64_t offset, size, end;
+	uint32_t seed = 0x13579bdf;
+	int layout, nareas, q, i, n, expected, rc = 1;
+
+#define FUZZ_RAND() (seed = seed * 1103515245 + 12345, seed >> 8)
+	for (layout = 0; layout < 3000; layout++) {
+		fmap = fmap_create(0, 0x1000, (uint8_t *)"fuzz");
+		nareas = 1 + FUZZ_RAND() % 64;
+		for (i = 0; i < nareas; i++) {
+			offset = FUZZ_RAND() % 0x1000;
+			size = FUZZ_RAND() % 0x400;
+			fmap_append_area(&fmap, offset, size,
+			                 (const uint8_t *)"FUZZ", 0);
+		}
+
+		idx = fmap_area_index_create(fmap);
+		if (idx == NULL) {
+			printf("FAILURE: failed to create area index\n");
+			goto fmap_area_index_fuzz_test_exit;
+		}
+
+		for (q = 0; q < 64; q++) {
+			offset = FUZZ_RAND() % 0x1400;
+			if (fmap_area_at(idx, offset) !=
+			    fmap_area_at_scan(fmap, offset)) {
+				printf("FAILURE: layout %d: wrong area at 0x%"
+				       PRIx64 "\n", layout, offset);
+				goto fmap_area_index_fuzz_test_exit;
+			}
+
+			size = 1 + FUZZ_RAND() % 0x400;
+			end = offset + size;
+			expected = 0;
+			for (i = 0; i < fmap->nareas; i++) {
+				area = &fmap->areas[i];
+				if (offset < (uint64_t)area->offset + area->size &&
+				    area->offset < end)
+					expected++;
+			}
+			n = fmap_area_index_overlap(idx, offset, size,
+			                            found, 64);
+			if (n != expected) {
+				printf("FAILURE: layout %d: %d areas overlap 0x%"
+				       PRIx64 "+0x%" PRIx64 ", expected %d\n",
+				       layout, n, offset, size, expected);
+				goto fmap_area_index_fuzz_test_exit;
+			}
+		}
+
+		fmap_area_index_destroy(idx);
+		idx = NULL;
+		fmap_destroy(fmap);
+		fmap = NULL;
+	}
+#undef FUZZ_RAND
+
+	rc = 0;
+fmap_area_index_fuzz_test_exit:
+	fmap_area_index_destroy(idx);
+	fmap_destroy(fmap);
+	return rc;
+}
+
+int fmap_index_test(void)
+{
+	int rc = 0;
+
+	rc |= fmap_name_index_test();
+	rc |= fmap_area_index_test();
+	rc |= fmap_area_index_fuzz_test();
+
+	return rc;
+}
+/* LCOV_EXCL_STOP */
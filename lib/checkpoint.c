@@ -0,0 +1,503 @@
+/*
+ * Copyright 2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Checkpoints for the legacy SHA-1 checksum of static areas.
+ *
+ * The checksum is a single SHA-1 stream over all static areas, so a change
+ * in the last area would normally mean rehashing everything before it.
+ * A checkpoint file records the SHA-1 midstate after each static area,
+ * together with a fingerprint of all static areas up to that point. On
+ * the next run the fingerprints are recomputed from the start until the
+ * first mismatch, and SHA-1 resumes from the last matching midstate.
+ *
+ * The fingerprint is a fast 64-bit hash that runs at memory speed, so only
+ * the changed tail costs SHA-1 time. A cryptographic hash would not help:
+ * checking the prefix with it would cost as much as rehashing it with
+ * SHA-1 in the first place.
+ *
+ * NOT COLLISION RESISTANT: the fingerprint catches accidental changes
+ * only. Anyone who can choose image contents can craft a change to an
+ * area that keeps its fingerprint, and resuming from the checkpoint then
+ * yields the stale SHA-1 of the old contents. The checkpoint file is a
+ * build cache: only use it for images from a trusted source, and never
+ * for verifying images received from elsewhere.
+ *
+ * File format, all integers little-endian:
+ *   "FMAPCKPT", u32 version, u32 number of entries
+ *   per entry: u32 area offset, u32 area size, u64 fingerprint,
+ *              u64 SHA-1 byte count, u32 SHA-1 state[5], u8 SHA-1 buf[64]
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fmap.h>
+
+#include "mincrypt/sha.h"
+
+#define FMAP_CKPT_MAGIC		"FMAPCKPT"
+#define FMAP_CKPT_VERSION	1
+#define FMAP_CKPT_HDR_SIZE	16
+#define FMAP_CKPT_ENTRY_SIZE	(4 + 4 + 8 + 8 + 5 * 4 + 64)
+
+struct fmap_ckpt_entry {
+	uint32_t offset;
+	uint32_t size;
+	uint64_t fingerprint;	/* all static areas up to this one */
+	SHA_CTX ctx;		/* midstate after this area */
+};
+
+#define FP_P1	0x9e3779b185ebca87ULL
+#define FP_P2	0xc2b2ae3d27d4eb4fULL
+#define FP_P3	0x165667b19e3779f9ULL
+#define FP_P4	0x85ebca77c2b2ae63ULL
+
+static uint64_t fp_rotl(uint64_t x, int bits)
+{
+	return (x << bits) | (x >> (64 - bits));
+}
+
+static uint64_t fp_le64(const uint8_t *p)
+{
+	uint64_t x;
+
+	memcpy(&x, p, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	return x;
+}
+
+static uint64_t fp_round(uint64_t acc, uint64_t word)
+{
+	acc += word * FP_P2;
+	return fp_rotl(acc, 31) * FP_P1;
+}
+
+/* fast 64-bit fingerprint of data, chained on seed */
+static uint64_t fmap_fingerprint(uint64_t seed, const uint8_t *p, size_t len)
+{
+	uint64_t v[4], h;
+	size_t i;
+
+	v[0] = seed + FP_P1 + FP_P2;
+	v[1] = seed + FP_P2;
+	v[2] = seed;
+	v[3] = seed - FP_P1;
+
+	/* four independent lanes keep the multipliers busy */
+	for (i = 0; i + 32 <= len; i += 32) {
+		v[0] = fp_round(v[0], fp_le64(p + i));
+		v[1] = fp_round(v[1], fp_le64(p + i + 8));
+		v[2] = fp_round(v[2], fp_le64(p + i + 16));
+		v[3] = fp_round(v[3], fp_le64(p + i + 24));
+	}
+
+	h = fp_rotl(v[0], 1) + fp_rotl(v[1], 7) +
+	    fp_rotl(v[2], 12) + fp_rotl(v[3], 18);
+	h += len;
+
+	for (; i + 8 <= len; i += 8)
+		h = fp_rotl(h ^ fp_round(0, fp_le64(p + i)), 27) * FP_P1 + FP_P4;
+	for (; i < len; i++)
+		h = fp_rotl(h ^ (p[i] * FP_P3), 11) * FP_P1;
+
+	h ^= h >> 33;
+	h *= FP_P2;
+	h ^= h >> 29;
+	h *= FP_P3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+static void put_le32(uint8_t *p, uint32_t x)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		p[i] = x >> (i * 8);
+}
+
+static void put_le64(uint8_t *p, uint64_t x)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = x >> (i * 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+/*
+ * read checkpoint entries from path, returns number of entries or <0 if
+ * there is no usable checkpoint
+ */
+static int fmap_ckpt_read(const char *path, struct fmap_ckpt_entry **entries)
+{
+	uint8_t hdr[FMAP_CKPT_HDR_SIZE], buf[FMAP_CKPT_ENTRY_SIZE];
+	struct fmap_ckpt_entry *e = NULL;
+	uint32_t count, i;
+	FILE *fp;
+	int j;
+
+	*entries = NULL;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		return -1;
+
+	if ((fread(hdr, sizeof(hdr), 1, fp) != 1) ||
+	    memcmp(hdr, FMAP_CKPT_MAGIC, 8) ||
+	    (get_le32(hdr + 8) != FMAP_CKPT_VERSION))
+		goto fmap_ckpt_read_fail;
+
+	/* an fmap cannot have more areas than this */
+	count = get_le32(hdr + 12);
+	if (count > UINT16_MAX)
+		goto fmap_ckpt_read_fail;
+
+	e = calloc(count ? count : 1, sizeof(*e));
+	if (e == NULL)
+		goto fmap_ckpt_read_fail;
+
+	for (i = 0; i < count; i++) {
+		const uint8_t *p = buf;
+
+		if (fread(buf, sizeof(buf), 1, fp) != 1)
+			goto fmap_ckpt_read_fail;
+
+		e[i].offset = get_le32(p);
+		e[i].size = get_le32(p + 4);
+		e[i].fingerprint = get_le64(p + 8);
+		e[i].ctx.count = get_le64(p + 16);
+		for (j = 0; j < 5; j++)
+			e[i].ctx.state[j] = get_le32(p + 24 + j * 4);
+		memcpy(e[i].ctx.buf, p + 44, sizeof(e[i].ctx.buf));
+	}
+
+	fclose(fp);
+	*entries = e;
+	return count;
+
+fmap_ckpt_read_fail:
+	free(e);
+	fclose(fp);
+	return -1;
+}
+
+/*
+ * write entries to a temporary file and move it over path, returns 0 if
+ * successful or -errno of the call which failed
+ */
+static int fmap_ckpt_write(const char *path,
+                           const struct fmap_ckpt_entry *entries, int count)
+{
+	uint8_t hdr[FMAP_CKPT_HDR_SIZE], buf[FMAP_CKPT_ENTRY_SIZE];
+	char *tmp;
+	FILE *fp;
+	int i, j, rc = 0;
+
+	tmp = malloc(strlen(path) + sizeof(".tmp"));
+	if (tmp == NULL)
+		return -ENOMEM;
+	sprintf(tmp, "%s.tmp", path);
+
+	fp = fopen(tmp, "wb");
+	if (fp == NULL) {
+		rc = -errno;
+		goto fmap_ckpt_write_exit;
+	}
+
+	memcpy(hdr, FMAP_CKPT_MAGIC, 8);
+	put_le32(hdr + 8, FMAP_CKPT_VERSION);
+	put_le32(hdr + 12, count);
+	if (fwrite(hdr, sizeof(hdr), 1, fp) != 1) {
+		rc = -errno;
+		goto fmap_ckpt_write_close;
+	}
+
+	for (i = 0; i < count; i++) {
+		uint8_t *p = buf;
+
+		put_le32(p, entries[i].offset);
+		put_le32(p + 4, entries[i].size);
+		put_le64(p + 8, entries[i].fingerprint);
+		put_le64(p + 16, entries[i].ctx.count);
+		for (j = 0; j < 5; j++)
+			put_le32(p + 24 + j * 4, entries[i].ctx.state[j]);
+		memcpy(p + 44, entries[i].ctx.buf, sizeof(entries[i].ctx.buf));
+
+		if (fwrite(buf, sizeof(buf), 1, fp) != 1) {
+			rc = -errno;
+			goto fmap_ckpt_write_close;
+		}
+	}
+
+fmap_ckpt_write_close:
+	if (fclose(fp) && !rc)
+		rc = -errno;
+	if (!rc && rename(tmp, path))
+		rc = -errno;
+	if (rc)
+		unlink(tmp);
+fmap_ckpt_write_exit:
+	free(tmp);
+	return rc;
+}
+
+/* same as fmap_get_csum_checkpoint(), also reports areas reused */
+static int fmap_get_csum_resume(const uint8_t *image, unsigned int image_len,
+                                long int fmap_offset, const char *path,
+                                uint8_t **digest, int *resumed)
+{
+	struct fmap_ckpt_entry *old = NULL, *cur = NULL;
+	const struct fmap *fmap;
+	uint64_t fingerprint = 0;
+	SHA_CTX ctx;
+	int i, n, nold, err, good = 0, rc = -1;
+
+	if ((image == NULL) || (path == NULL) || (digest == NULL))
+		return -1;
+
+	if ((fmap_offset < 0) ||
+	    ((uint64_t)fmap_offset + sizeof(*fmap) > image_len))
+		return -1;
+	fmap = (const struct fmap *)(image + fmap_offset);
+	if ((uint64_t)fmap_offset + fmap_size((struct fmap *)fmap) > image_len)
+		return -1;
+
+	cur = calloc(fmap->nareas ? fmap->nareas : 1, sizeof(*cur));
+	if (cur == NULL)
+		return -1;
+
+	nold = fmap_ckpt_read(path, &old);
+
+	SHA_init(&ctx);
+
+	for (i = 0, n = 0; i < fmap->nareas; i++) {
+		const struct fmap_area *area = &fmap->areas[i];
+		const uint8_t *data = image + area->offset;
+
+		/* skip non-static areas */
+		if (!(area->flags & FMAP_AREA_STATIC))
+			continue;
+
+		/* sanity check the offset */
+		if ((uint64_t)area->offset + area->size > image_len) {
+			fprintf(stderr,
+			        "(%s) invalid parameter detected in area %d\n",
+			        __func__, i);
+			goto fmap_get_csum_resume_exit;
+		}
+
+		fingerprint = fmap_fingerprint(fingerprint ^ area->offset ^
+		                               (uint64_t)area->size << 32,
+		                               data, area->size);
+		cur[n].offset = area->offset;
+		cur[n].size = area->size;
+		cur[n].fingerprint = fingerprint;
+
+		/* still on the unchanged prefix: take the saved midstate */
+		if ((good == n) && (n < nold) &&
+		    (old[n].offset == area->offset) &&
+		    (old[n].size == area->size) &&
+		    (old[n].fingerprint == fingerprint)) {
+			ctx = old[n].ctx;
+			good++;
+		} else {
+			SHA_update(&ctx, data, area->size);
+		}
+
+		cur[n].ctx = ctx;
+		n++;
+	}
+
+	err = fmap_ckpt_write(path, cur, n);
+	if (err < 0)
+		fprintf(stderr, "(%s) unable to write checkpoint \"%s\": %s\n",
+		        __func__, path, strerror(-err));
+
+	*digest = malloc(SHA_DIGEST_SIZE);
+	if (*digest == NULL)
+		goto fmap_get_csum_resume_exit;
+	memcpy(*digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+
+	if (resumed)
+		*resumed = good;
+	rc = SHA_DIGEST_SIZE;
+
+fmap_get_csum_resume_exit:
+	free(old);
+	free(cur);
+	return rc;
+}
+
+int fmap_get_csum_checkpoint(const uint8_t *image, unsigned int image_len,
+                             long int fmap_offset, const char *path,
+                             uint8_t **digest)
+{
+	return fmap_get_csum_resume(image, image_len, fmap_offset,
+	                            path, digest, NULL);
+}
+
+/*
+ * LCOV_EXCL_START
+ * Unit testing stuff done here so we do not need to expose static functions.
+ */
+int fmap_checkpoint_test(void)
+{
+	const struct {
+		uint32_t offset, size;
+		uint16_t flags;
+	} areas[] = {
+		{ 0x0400, 0x1c00, FMAP_AREA_STATIC },
+		{ 0x2000, 0x1000, 0 },
+		{ 0x3000, 0x0123, FMAP_AREA_STATIC },
+		{ 0x4000, 0x4000, FMAP_AREA_STATIC },
+	};
+	char path[] = "/tmp/fmap_checkpoint_XXXXXX";
+	int image_size = 0x8000;
+	struct fmap *fmap = NULL;
+	uint8_t *image = NULL, *digest = NULL, *expected = NULL;
+	int i, fd, resumed, rc = 1;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		printf("FAILURE: unable to create checkpoint file\n");
+		return 1;
+	}
+	close(fd);
+
+	fmap = fmap_create(0, image_size, (uint8_t *)"test");
+	for (i = 0; i < sizeof(areas) / sizeof(areas[0]); i++)
+		fmap_append_area(&fmap, areas[i].offset, areas[i].size,
+		                 (const uint8_t *)"area", areas[i].flags);
+	image = malloc(image_size);
+	for (i = 0; i < image_size; i++)
+		image[i] = i ^ (i >> 8);
+	memcpy(image, fmap, fmap_size(fmap));
+
+	/* an empty file is no checkpoint at all */
+	if ((fmap_get_csum_resume(image, image_size, 0, path,
+	                          &digest, &resumed) != SHA_DIGEST_SIZE) ||
+	    (fmap_get_csum(image, image_size, &expected) != SHA_DIGEST_SIZE) ||
+	    memcmp(digest, expected, SHA_DIGEST_SIZE) || (resumed != 0)) {
+		printf("FAILURE: checksum without checkpoint is incorrect\n");
+		goto fmap_checkpoint_test_exit;
+	}
+	free(digest);
+	digest = NULL;
+
+	/* nothing changed, everything is reused */
+	if ((fmap_get_csum_resume(image, image_size, 0, path,
+	                          &digest, &resumed) != SHA_DIGEST_SIZE) ||
+	    memcmp(digest, expected, SHA_DIGEST_SIZE) || (resumed != 3)) {
+		printf("FAILURE: unchanged checksum from checkpoint is "
+		       "incorrect\n");
+		goto fmap_checkpoint_test_exit;
+	}
+	free(digest);
+	digest = NULL;
+	free(expected);
+	expected = NULL;
+
+	/* the last area changed, so only that one is rehashed */
+	image[0x7000]++;
+	if ((fmap_get_csum_resume(image, image_size, 0, path,
+	                          &digest, &resumed) != SHA_DIGEST_SIZE) ||
+	    (fmap_get_csum(image, image_size, &expected) != SHA_DIGEST_SIZE) ||
+	    memcmp(digest, expected, SHA_DIGEST_SIZE) || (resumed != 2)) {
+		printf("FAILURE: resumed checksum is incorrect\n");
+		goto fmap_checkpoint_test_exit;
+	}
+	free(digest);
+	digest = NULL;
+
+	/* non-static areas do not matter */
+	image[0x2000]++;
+	if ((fmap_get_csum_resume(image, image_size, 0, path,
+	                          &digest, &resumed) != SHA_DIGEST_SIZE) ||
+	    memcmp(digest, expected, SHA_DIGEST_SIZE) || (resumed != 3)) {
+		printf("FAILURE: checksum after non-static change is "
+		       "incorrect\n");
+		goto fmap_checkpoint_test_exit;
+	}
+	free(digest);
+	digest = NULL;
+	free(expected);
+	expected = NULL;
+
+	/* the first area changed, nothing can be reused */
+	image[0x0500]++;
+	if ((fmap_get_csum_resume(image, image_size, 0, path,
+	                          &digest, &resumed) != SHA_DIGEST_SIZE) ||
+	    (fmap_get_csum(image, image_size, &expected) != SHA_DIGEST_SIZE) ||
+	    memcmp(digest, expected, SHA_DIGEST_SIZE) || (resumed != 0)) {
+		printf("FAILURE: checksum after first area changed is "
+		       "incorrect\n");
+		goto fmap_checkpoint_test_exit;
+	}
+	free(digest);
+	digest = NULL;
+
+	/* a truncated checkpoint is ignored */
+	if (truncate(path, FMAP_CKPT_HDR_SIZE + 10) ||
+	    (fmap_get_csum_resume(image, image_size, 0, path,
+	                          &digest, &resumed) != SHA_DIGEST_SIZE) ||
+	    memcmp(digest, expected, SHA_DIGEST_SIZE) || (resumed != 0)) {
+		printf("FAILURE: truncated checkpoint not ignored\n");
+		goto fmap_checkpoint_test_exit;
+	}
+
+	rc = 0;
+fmap_checkpoint_test_exit:
+	unlink(path);
+	free(digest);
+	free(expected);
+	free(image);
+	fmap_destroy(fmap);
+	return rc;
+}
+/* LCOV_EXCL_STOP */
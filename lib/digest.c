@@ -0,0 +1,476 @@
+/*
+ * Copyright 2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <fmap.h>
+
+#include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
+
+#define FMAP_DIGEST_MAX_UPDATE	(1 << 30)
+
+static void fmap_sha1_init(void *ctx)
+{
+	SHA_init(ctx);
+}
+
+static void fmap_sha1_update(void *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	/* the mincrypt interface takes an int length */
+	while (len > FMAP_DIGEST_MAX_UPDATE) {
+		SHA_update(ctx, p, FMAP_DIGEST_MAX_UPDATE);
+		p += FMAP_DIGEST_MAX_UPDATE;
+		len -= FMAP_DIGEST_MAX_UPDATE;
+	}
+	SHA_update(ctx, p, len);
+}
+
+static void fmap_sha1_final(void *ctx, uint8_t *digest)
+{
+	memcpy(digest, SHA_final(ctx), SHA_DIGEST_SIZE);
+}
+
+const struct fmap_digest fmap_digest_sha1 = {
+	.name		= "sha1",
+	.size		= SHA_DIGEST_SIZE,
+	.ctx_size	= sizeof(SHA_CTX),
+	.init		= fmap_sha1_init,
+	.update		= fmap_sha1_update,
+	.final		= fmap_sha1_final,
+};
+
+static void fmap_sha256_init(void *ctx)
+{
+	SHA256_init(ctx);
+}
+
+static void fmap_sha256_update(void *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	/* the mincrypt interface takes an int length */
+	while (len > FMAP_DIGEST_MAX_UPDATE) {
+		SHA256_update(ctx, p, FMAP_DIGEST_MAX_UPDATE);
+		p += FMAP_DIGEST_MAX_UPDATE;
+		len -= FMAP_DIGEST_MAX_UPDATE;
+	}
+	SHA256_update(ctx, p, len);
+}
+
+static void fmap_sha256_final(void *ctx, uint8_t *digest)
+{
+	memcpy(digest, SHA256_final(ctx), SHA256_DIGEST_SIZE);
+}
+
+const struct fmap_digest fmap_digest_sha256 = {
+	.name		= "sha256",
+	.size		= SHA256_DIGEST_SIZE,
+	.ctx_size	= sizeof(SHA256_CTX),
+	.init		= fmap_sha256_init,
+	.update		= fmap_sha256_update,
+	.final		= fmap_sha256_final,
+};
+
+/*
+ * sha256-tree: the input is split into FMAP_TREE_CHUNK_SIZE chunks, each
+ * hashed on its own as SHA-256(0x00 || chunk). The digest is
+ * SHA-256(0x01 || leaf digests in order || 64-bit little-endian length).
+ * Whole chunks passed to a single update are hashed by one pool of threads
+ * per update, as many as fmap_digest_threads() allows.
+ */
+#define FMAP_TREE_CHUNK_SIZE	(1 << 20)
+
+/* limit set with fmap_digest_threads(), 0 for one thread per CPU */
+static __thread int fmap_digest_nthreads;
+
+int fmap_digest_threads(int nthreads)
+{
+	int prev = fmap_digest_nthreads;
+
+	if (nthreads < 0)
+		return -1;
+
+	fmap_digest_nthreads = nthreads;
+	return prev;
+}
+
+struct fmap_tree_ctx {
+	SHA256_CTX leaf;	/* chunk in progress */
+	SHA256_CTX root;	/* running hash of leaf digests */
+	uint64_t count;		/* bytes hashed so far */
+};
+
+struct fmap_tree_job {
+	const uint8_t *data;
+	size_t nchunks;
+	size_t next_chunk;	/* next chunk to be claimed by a worker */
+	uint8_t (*leaves)[SHA256_DIGEST_SIZE];
+};
+
+static void fmap_tree_leaf_init(SHA256_CTX *leaf)
+{
+	SHA256_init(leaf);
+	SHA256_update(leaf, "\x00", 1);
+}
+
+static void fmap_tree_leaf(const uint8_t *data, uint8_t *digest)
+{
+	SHA256_CTX leaf;
+
+	fmap_tree_leaf_init(&leaf);
+	SHA256_update(&leaf, data, FMAP_TREE_CHUNK_SIZE);
+	memcpy(digest, SHA256_final(&leaf), SHA256_DIGEST_SIZE);
+}
+
+static void *fmap_tree_worker(void *arg)
+{
+	struct fmap_tree_job *job = arg;
+	size_t chunk;
+
+	while ((chunk = __atomic_fetch_add(&job->next_chunk, 1,
+	                                   __ATOMIC_RELAXED)) < job->nchunks)
+		fmap_tree_leaf(job->data + chunk * FMAP_TREE_CHUNK_SIZE,
+		               job->leaves[chunk]);
+
+	return NULL;
+}
+
+/* hash nchunks whole chunks with up to nthreads threads */
+static void fmap_tree_chunks(struct fmap_tree_ctx *ctx, const uint8_t *data,
+                             size_t nchunks, int nthreads)
+{
+	uint8_t leaf[SHA256_DIGEST_SIZE];
+	struct fmap_tree_job job;
+	pthread_t *threads = NULL;
+	size_t i;
+	int started = 0;
+
+	if (nthreads > nchunks)
+		nthreads = nchunks;
+
+	job.data = data;
+	job.nchunks = nchunks;
+	job.next_chunk = 0;
+	job.leaves = NULL;
+	if (nthreads > 1)
+		job.leaves = malloc(nchunks * sizeof(*job.leaves));
+
+	if (job.leaves == NULL) {
+		for (i = 0; i < nchunks; i++) {
+			fmap_tree_leaf(data + i * FMAP_TREE_CHUNK_SIZE, leaf);
+			SHA256_update(&ctx->root, leaf, SHA256_DIGEST_SIZE);
+		}
+		return;
+	}
+
+	/* the calling thread is one of the workers */
+	threads = calloc(nthreads - 1, sizeof(*threads));
+	if (threads) {
+		for (i = 0; i < nthreads - 1; i++) {
+			if (pthread_create(&threads[started], NULL,
+			                   fmap_tree_worker, &job))
+				break;
+			started++;
+		}
+	}
+
+	fmap_tree_worker(&job);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < nchunks; i++)
+		SHA256_update(&ctx->root, job.leaves[i], SHA256_DIGEST_SIZE);
+	free(job.leaves);
+}
+
+static void fmap_tree_update_threads(struct fmap_tree_ctx *ctx,
+                                     const uint8_t *data, size_t len,
+                                     int nthreads)
+{
+	size_t used = ctx->count % FMAP_TREE_CHUNK_SIZE;
+	size_t n;
+
+	ctx->count += len;
+
+	/* top up the chunk in progress */
+	if (used) {
+		n = FMAP_TREE_CHUNK_SIZE - used;
+		if (n > len)
+			n = len;
+		SHA256_update(&ctx->leaf, data, n);
+		data += n;
+		len -= n;
+		if (used + n < FMAP_TREE_CHUNK_SIZE)
+			return;
+
+		SHA256_update(&ctx->root, SHA256_final(&ctx->leaf),
+		              SHA256_DIGEST_SIZE);
+		fmap_tree_leaf_init(&ctx->leaf);
+	}
+
+	n = len / FMAP_TREE_CHUNK_SIZE;
+	fmap_tree_chunks(ctx, data, n, nthreads);
+	data += n * FMAP_TREE_CHUNK_SIZE;
+	len -= n * FMAP_TREE_CHUNK_SIZE;
+
+	SHA256_update(&ctx->leaf, data, len);
+}
+
+static void fmap_tree_init(void *ctx)
+{
+	struct fmap_tree_ctx *tree = ctx;
+
+	fmap_tree_leaf_init(&tree->leaf);
+	SHA256_init(&tree->root);
+	SHA256_update(&tree->root, "\x01", 1);
+	tree->count = 0;
+}
+
+static void fmap_tree_update(void *ctx, const void *data, size_t len)
+{
+	fmap_tree_update_threads(ctx, data, len,
+	                         fmap_digest_nthreads ? fmap_digest_nthreads :
+	                         sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+static void fmap_tree_final(void *ctx, uint8_t *digest)
+{
+	struct fmap_tree_ctx *tree = ctx;
+	uint8_t len[8];
+	int i;
+
+	if (tree->count % FMAP_TREE_CHUNK_SIZE)
+		SHA256_update(&tree->root, SHA256_final(&tree->leaf),
+		              SHA256_DIGEST_SIZE);
+
+	for (i = 0; i < sizeof(len); i++)
+		len[i] = tree->count >> (i * 8);
+	SHA256_update(&tree->root, len, sizeof(len));
+
+	memcpy(digest, SHA256_final(&tree->root), SHA256_DIGEST_SIZE);
+}
+
+const struct fmap_digest fmap_digest_sha256_tree = {
+	.name		= "sha256-tree",
+	.size		= SHA256_DIGEST_SIZE,
+	.ctx_size	= sizeof(struct fmap_tree_ctx),
+	.init		= fmap_tree_init,
+	.update		= fmap_tree_update,
+	.final		= fmap_tree_final,
+};
+
+const struct fmap_digest *const fmap_digests[] = {
+	&fmap_digest_sha1,
+	&fmap_digest_sha256,
+	&fmap_digest_sha256_tree,
+	NULL,
+};
+
+const struct fmap_digest *fmap_digest_find(const char *name)
+{
+	int i;
+
+	if (name == NULL)
+		return NULL;
+
+	for (i = 0; fmap_digests[i]; i++) {
+		if (strcasecmp(fmap_digests[i]->name, name) == 0)
+			return fmap_digests[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * LCOV_EXCL_START
+ * Unit testing stuff done here so we do not need to expose static functions.
+ */
+static int fmap_digest_provider_test(void)
+{
+	uint8_t msg[1000], digest[SHA256_DIGEST_SIZE];
+	uint8_t expected[SHA256_DIGEST_SIZE];
+	union {
+		SHA_CTX sha1;
+		SHA256_CTX sha256;
+	} ctx;
+	int rc = 0;
+
+	memset(msg, 0x5a, sizeof(msg));
+
+	/* pieces of odd sizes must give the plain algorithm's digest */
+	fmap_digest_sha1.init(&ctx);
+	fmap_digest_sha1.update(&ctx, msg, 333);
+	fmap_digest_sha1.update(&ctx, msg + 333, sizeof(msg) - 333);
+	fmap_digest_sha1.final(&ctx, digest);
+	SHA(msg, sizeof(msg), expected);
+	if (memcmp(digest, expected, SHA_DIGEST_SIZE)) {
+		printf("FAILURE: sha1 digest provider mismatch\n");
+		rc |= 1;
+	}
+
+	fmap_digest_sha256.init(&ctx);
+	fmap_digest_sha256.update(&ctx, msg, 333);
+	fmap_digest_sha256.update(&ctx, msg + 333, sizeof(msg) - 333);
+	fmap_digest_sha256.final(&ctx, digest);
+	SHA256(msg, sizeof(msg), expected);
+	if (memcmp(digest, expected, SHA256_DIGEST_SIZE)) {
+		printf("FAILURE: sha256 digest provider mismatch\n");
+		rc |= 1;
+	}
+
+	if ((fmap_digest_find("SHA256") != &fmap_digest_sha256) ||
+	    (fmap_digest_find("sha256-tree") != &fmap_digest_sha256_tree) ||
+	    (fmap_digest_find("md5") != NULL) ||
+	    (fmap_digest_find(NULL) != NULL)) {
+		printf("FAILURE: digest lookup by name failed\n");
+		rc |= 1;
+	}
+
+	return rc;
+}
+
+static int fmap_digest_tree_test(void)
+{
+	/* three and a half chunks, plus an empty message */
+	size_t len = FMAP_TREE_CHUNK_SIZE * 7 / 2, i;
+	uint8_t *msg = malloc(len);
+	uint8_t digest[SHA256_DIGEST_SIZE], expected[SHA256_DIGEST_SIZE];
+	uint8_t leaf[SHA256_DIGEST_SIZE];
+	struct fmap_tree_ctx ctx;
+	SHA256_CTX ref;
+	int rc = 0;
+
+	if (msg == NULL)
+		return 1;
+	for (i = 0; i < len; i++)
+		msg[i] = i * 7 + (i >> 12);
+
+	/* reference digest built straight from the definition */
+	SHA256_init(&ref);
+	SHA256_update(&ref, "\x01", 1);
+	for (i = 0; i < len; i += FMAP_TREE_CHUNK_SIZE) {
+		SHA256_CTX chunk;
+		size_t n = len - i;
+
+		if (n > FMAP_TREE_CHUNK_SIZE)
+			n = FMAP_TREE_CHUNK_SIZE;
+		SHA256_init(&chunk);
+		SHA256_update(&chunk, "\x00", 1);
+		SHA256_update(&chunk, msg + i, n);
+		memcpy(leaf, SHA256_final(&chunk), SHA256_DIGEST_SIZE);
+		SHA256_update(&ref, leaf, SHA256_DIGEST_SIZE);
+	}
+	for (i = 0; i < 8; i++) {
+		uint8_t tmp = (uint64_t)len >> (i * 8);
+		SHA256_update(&ref, &tmp, 1);
+	}
+	memcpy(expected, SHA256_final(&ref), SHA256_DIGEST_SIZE);
+
+	/* one update, hashed by several threads */
+	fmap_tree_init(&ctx);
+	fmap_tree_update_threads(&ctx, msg, len, 4);
+	fmap_tree_final(&ctx, digest);
+	if (memcmp(digest, expected, SHA256_DIGEST_SIZE)) {
+		printf("FAILURE: threaded sha256-tree digest mismatch\n");
+		rc |= 1;
+	}
+
+	/* the same with the thread limits callers may set */
+	if (fmap_digest_threads(-1) >= 0 || fmap_digest_threads(1) != 0) {
+		printf("FAILURE: digests do not start out on every CPU\n");
+		rc |= 1;
+	}
+	fmap_digest_sha256_tree.init(&ctx);
+	fmap_digest_sha256_tree.update(&ctx, msg, len);
+	fmap_digest_sha256_tree.final(&ctx, digest);
+	if (fmap_digest_threads(3) != 1 ||
+	    memcmp(digest, expected, SHA256_DIGEST_SIZE)) {
+		printf("FAILURE: serial sha256-tree digest mismatch\n");
+		rc |= 1;
+	}
+	fmap_digest_sha256_tree.init(&ctx);
+	fmap_digest_sha256_tree.update(&ctx, msg, len);
+	fmap_digest_sha256_tree.final(&ctx, digest);
+	if (fmap_digest_threads(0) != 3 ||
+	    memcmp(digest, expected, SHA256_DIGEST_SIZE)) {
+		printf("FAILURE: limited sha256-tree digest mismatch\n");
+		rc |= 1;
+	}
+
+	/* pieces straddling chunk boundaries */
+	fmap_tree_init(&ctx);
+	fmap_tree_update_threads(&ctx, msg, 1000, 1);
+	fmap_tree_update_threads(&ctx, msg + 1000,
+	                         FMAP_TREE_CHUNK_SIZE * 2, 2);
+	fmap_tree_update_threads(&ctx, msg + 1000 + FMAP_TREE_CHUNK_SIZE * 2,
+	                         len - 1000 - FMAP_TREE_CHUNK_SIZE * 2, 1);
+	fmap_tree_final(&ctx, digest);
+	if (memcmp(digest, expected, SHA256_DIGEST_SIZE)) {
+		printf("FAILURE: piecewise sha256-tree digest mismatch\n");
+		rc |= 1;
+	}
+
+	/* empty input has no leaves, only the length */
+	SHA256_init(&ref);
+	SHA256_update(&ref, "\x01\0\0\0\0\0\0\0\0", 9);
+	memcpy(expected, SHA256_final(&ref), SHA256_DIGEST_SIZE);
+	fmap_digest_sha256_tree.init(&ctx);
+	fmap_digest_sha256_tree.final(&ctx, digest);
+	if (memcmp(digest, expected, SHA256_DIGEST_SIZE)) {
+		printf("FAILURE: empty sha256-tree digest mismatch\n");
+		rc |= 1;
+	}
+
+	free(msg);
+	return rc;
+}
+
+int fmap_digest_test(void)
+{
+	int rc = 0;
+
+	rc |= fmap_digest_provider_test();
+	rc |= fmap_digest_tree_test();
+
+	return rc;
+}
+/* LCOV_EXCL_STOP */
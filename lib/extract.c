@@ -0,0 +1,260 @@
+/*
+ * Copyright 2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Copying ranges of an image to other files. The kernel is asked to move
+ * the data itself, with copy_file_range() between regular files and
+ * sendfile() to pipes and sockets; read() and write() through a buffer
+ * are only used where neither is supported.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <fmap.h>
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+/* size of bounce buffer when the kernel cannot copy for us */
+#define FMAP_COPY_BUF_SIZE	(128 * 1024)
+
+/* largest count a single sendfile() or copy_file_range() call moves */
+#define FMAP_COPY_MAX_CHUNK	0x7ffff000
+
+/* errors after which a different way of copying may still work */
+static int fmap_copy_unsupported(int err)
+{
+	return err == EINVAL || err == ENOSYS || err == EXDEV ||
+	       err == EOPNOTSUPP || err == EBADF;
+}
+
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define FMAP_HAVE_COPY_FILE_RANGE
+#endif
+
+int fmap_copy_fd(int in_fd, off_t offset, size_t len, int out_fd)
+{
+	uint8_t *buf;
+	ssize_t ret;
+	size_t n;
+
+	if (in_fd < 0 || out_fd < 0 || offset < 0)
+		return -1;
+
+#ifdef FMAP_HAVE_COPY_FILE_RANGE
+	while (len) {
+		n = len < FMAP_COPY_MAX_CHUNK ? len : FMAP_COPY_MAX_CHUNK;
+		ret = copy_file_range(in_fd, &offset, out_fd, NULL, n, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && fmap_copy_unsupported(errno))
+			break;
+		if (ret <= 0)
+			return -1;	/* error, or range past end of file */
+		len -= ret;
+	}
+#endif
+
+#ifdef __linux__
+	while (len) {
+		n = len < FMAP_COPY_MAX_CHUNK ? len : FMAP_COPY_MAX_CHUNK;
+		ret = sendfile(out_fd, in_fd, &offset, n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && fmap_copy_unsupported(errno))
+			break;
+		if (ret <= 0)
+			return -1;
+		len -= ret;
+	}
+#endif
+
+	if (!len)
+		return 0;
+
+	buf = malloc(FMAP_COPY_BUF_SIZE);
+	if (!buf)
+		return -1;
+
+	while (len) {
+		size_t done = 0;
+
+		n = len < FMAP_COPY_BUF_SIZE ? len : FMAP_COPY_BUF_SIZE;
+		ret = pread(in_fd, buf, n, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		n = ret;
+
+		while (done < n) {
+			ret = write(out_fd, buf + done, n - done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				goto fmap_copy_fd_exit;
+			done += ret;
+		}
+
+		offset += n;
+		len -= n;
+	}
+
+fmap_copy_fd_exit:
+	free(buf);
+	return len ? -1 : 0;
+}
+
+/*
+ * LCOV_EXCL_START
+ * Unit testing stuff done here so we do not need to expose static functions.
+ */
+int fmap_extract_test(void)
+{
+	int status = EXIT_FAILURE;
+	size_t image_len = 3 * FMAP_COPY_BUF_SIZE + 123, i;
+	uint8_t *image = NULL, *check = NULL;
+	FILE *src = NULL, *dst = NULL;
+	int pipefd[2] = { -1, -1 }, append_fd = -1;
+	char path[] = "/tmp/fmap_extract_test_XXXXXX";
+	const struct {
+		off_t offset;
+		size_t len;
+	} ranges[] = {
+		{ 0, 0 },
+		{ 0, 1 },
+		{ 7, FMAP_COPY_BUF_SIZE + 1 },
+		{ 4096, 2 * FMAP_COPY_BUF_SIZE },
+		{ 0, 3 * FMAP_COPY_BUF_SIZE + 123 },
+	};
+
+	image = malloc(image_len);
+	check = malloc(image_len + 1);
+	src = tmpfile();
+	dst = tmpfile();
+	if (!image || !check || !src || !dst || pipe(pipefd)) {
+		printf("FAILURE: unable to set up fmap_copy_fd test\n");
+		goto fmap_extract_test_exit;
+	}
+
+	for (i = 0; i < image_len; i++)
+		image[i] = i * 7 + (i >> 8);
+	if (pwrite(fileno(src), image, image_len, 0) != image_len) {
+		printf("FAILURE: unable to write test file\n");
+		goto fmap_extract_test_exit;
+	}
+
+	if (fmap_copy_fd(-1, 0, 1, fileno(dst)) == 0 ||
+	    fmap_copy_fd(fileno(src), 0, 1, -1) == 0 ||
+	    fmap_copy_fd(fileno(src), -1, 1, fileno(dst)) == 0) {
+		printf("FAILURE: failed to abort on invalid input\n");
+		goto fmap_extract_test_exit;
+	}
+
+	/* ranges are appended one after another at the current position */
+	for (i = 0; i < ARRAY_SIZE(ranges); i++) {
+		if (ftruncate(fileno(dst), 0) ||
+		    lseek(fileno(dst), 0, SEEK_SET) ||
+		    fmap_copy_fd(fileno(src), ranges[i].offset, ranges[i].len,
+		                 fileno(dst)) ||
+		    fmap_copy_fd(fileno(src), 0, 1, fileno(dst)) ||
+		    pread(fileno(dst), check, image_len + 1, 0) !=
+		    ranges[i].len + 1 ||
+		    memcmp(check, &image[ranges[i].offset], ranges[i].len) ||
+		    check[ranges[i].len] != image[0]) {
+			printf("FAILURE: fmap_copy_fd failed to copy %zu bytes "
+			       "at 0x%lx to a file\n", ranges[i].len,
+			       (long)ranges[i].offset);
+			goto fmap_extract_test_exit;
+		}
+	}
+
+	/* neither copy_file_range() nor sendfile() append to files */
+	append_fd = mkstemp(path);
+	if (append_fd >= 0) {
+		close(append_fd);
+		append_fd = open(path, O_RDWR | O_APPEND);
+		unlink(path);
+	}
+	if (append_fd < 0 ||
+	    fmap_copy_fd(fileno(src), 5, FMAP_COPY_BUF_SIZE * 2,
+	                 append_fd) ||
+	    pread(append_fd, check, image_len, 0) !=
+	    FMAP_COPY_BUF_SIZE * 2 ||
+	    memcmp(check, &image[5], FMAP_COPY_BUF_SIZE * 2)) {
+		printf("FAILURE: fmap_copy_fd failed to append\n");
+		goto fmap_extract_test_exit;
+	}
+
+	/* pipes, kept below the default pipe buffer size */
+	if (fmap_copy_fd(fileno(src), 1000, 4000, pipefd[1]) ||
+	    read(pipefd[0], check, 4000) != 4000 ||
+	    memcmp(check, &image[1000], 4000)) {
+		printf("FAILURE: fmap_copy_fd failed to copy to a pipe\n");
+		goto fmap_extract_test_exit;
+	}
+
+	/* range running past the end of the file */
+	if (fmap_copy_fd(fileno(src), image_len - 10, 20, fileno(dst)) == 0) {
+		printf("FAILURE: fmap_copy_fd failed to catch overrun\n");
+		goto fmap_extract_test_exit;
+	}
+
+	status = EXIT_SUCCESS;
+
+fmap_extract_test_exit:
+	if (append_fd >= 0)
+		close(append_fd);
+	if (pipefd[0] >= 0)
+		close(pipefd[0]);
+	if (pipefd[1] >= 0)
+		close(pipefd[1]);
+	if (dst)
+		fclose(dst);
+	if (src)
+		fclose(src);
+	free(check);
+	free(image);
+	return status;
+}
+/* LCOV_EXCL_STOP */
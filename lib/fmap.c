@@ -40,19 +40,27 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <fmap.h>
 #include <valstr.h>
 
-#include "kv_pair.h"
 #include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
+/* amount of image each fmap_find_parallel() worker scans at a time */
+#define FMAP_FIND_CHUNK_SIZE	(4 << 20)
+
+/* amount of file fmap_find_fd() reads at a time */
+#define FMAP_FIND_WINDOW_SIZE	(1 << 20)
+
 const struct valstr flag_lut[] = {
 	{ FMAP_AREA_STATIC, "static" },
 	{ FMAP_AREA_COMPRESSED, "compressed" },
@@ -65,252 +73,1774 @@ int fmap_size(struct fmap *fmap)
 	if (!fmap)
 		return -1;
 
-	return sizeof(*fmap) + (fmap->nareas * sizeof(struct fmap_area));
+	return sizeof(*fmap) + (fmap->nareas * sizeof(struct fmap_area));
+}
+
+/*
+ * Every fmap the library allocates has room for its number of areas
+ * rounded up to a power of 2, so fmap_append_area() only has to grow it
+ * when that number crosses one, and appending n areas costs O(n) copies.
+ */
+static size_t fmap_area_capacity(unsigned int nareas)
+{
+	size_t capacity = 1;
+
+	while (capacity < nareas)
+		capacity *= 2;
+
+	return capacity;
+}
+
+static struct fmap *fmap_alloc(unsigned int nareas)
+{
+	return malloc(sizeof(struct fmap) +
+	              fmap_area_capacity(nareas) * sizeof(struct fmap_area));
+}
+
+/*
+ * Signature scanning
+ *
+ * The scanners below return the offset of the first FMAP signature which
+ * begins at or after @start and lies entirely within @len bytes, or -1 if
+ * there is none. Vector versions compare two of the signature's bytes
+ * ('F' and 'P', which are rare in firmware images compared to '_') at
+ * sixteen or thirty-two positions at a time and only call memcmp() for the
+ * positions where both match.
+ */
+#define FMAP_SIG_LEN		(sizeof(FMAP_SIGNATURE) - 1)
+
+typedef long int (*fmap_scan_fn)(const uint8_t *image,
+                                 size_t len, size_t start);
+
+static long int fmap_scan_scalar(const uint8_t *image, size_t len, size_t start)
+{
+	const uint8_t *p;
+	size_t offset = start;
+
+	if (len < FMAP_SIG_LEN)
+		return -1;
+
+	/* memchr() is already well-optimized, so use it to find candidates */
+	while (offset <= len - FMAP_SIG_LEN) {
+		p = memchr(&image[offset + 2], 'F', len - FMAP_SIG_LEN - offset + 1);
+		if (!p)
+			break;
+
+		offset = p - image - 2;
+		if (!memcmp(&image[offset], FMAP_SIGNATURE, FMAP_SIG_LEN))
+			return offset;
+		offset++;
+	}
+
+	return -1;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+#define FMAP_SCAN_HAVE_SIMD
+
+__attribute__((target("sse2")))
+static long int fmap_scan_sse2(const uint8_t *image, size_t len, size_t start)
+{
+	const __m128i f = _mm_set1_epi8('F');
+	const __m128i p = _mm_set1_epi8('P');
+	size_t offset = start;
+
+	/* each iteration reads image[offset + 2] through image[offset + 20] */
+	while (len >= FMAP_SIG_LEN + 16 && offset <= len - FMAP_SIG_LEN - 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)&image[offset + 2]);
+		__m128i y = _mm_loadu_si128((const __m128i *)&image[offset + 5]);
+		unsigned int mask;
+
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, f),
+		                                       _mm_cmpeq_epi8(y, p)));
+		while (mask) {
+			size_t candidate = offset + __builtin_ctz(mask);
+
+			if (!memcmp(&image[candidate],
+			            FMAP_SIGNATURE, FMAP_SIG_LEN))
+				return candidate;
+			mask &= mask - 1;
+		}
+		offset += 16;
+	}
+
+	return fmap_scan_scalar(image, len, offset);
+}
+
+__attribute__((target("avx2")))
+static long int fmap_scan_avx2(const uint8_t *image, size_t len, size_t start)
+{
+	const __m256i f = _mm256_set1_epi8('F');
+	const __m256i p = _mm256_set1_epi8('P');
+	size_t offset = start;
+
+	/* each iteration reads image[offset + 2] through image[offset + 36] */
+	while (len >= FMAP_SIG_LEN + 32 && offset <= len - FMAP_SIG_LEN - 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)&image[offset + 2]);
+		__m256i y = _mm256_loadu_si256((const __m256i *)&image[offset + 5]);
+		unsigned int mask;
+
+		mask = _mm256_movemask_epi8(
+		               _mm256_and_si256(_mm256_cmpeq_epi8(x, f),
+		                                _mm256_cmpeq_epi8(y, p)));
+		while (mask) {
+			size_t candidate = offset + __builtin_ctz(mask);
+
+			if (!memcmp(&image[candidate],
+			            FMAP_SIGNATURE, FMAP_SIG_LEN))
+				return candidate;
+			mask &= mask - 1;
+		}
+		offset += 32;
+	}
+
+	return fmap_scan_sse2(image, len, offset);
+}
+#endif
+
+/* pick the fastest scanner supported by the CPU we are running on */
+static fmap_scan_fn fmap_scan_select(void)
+{
+#ifdef FMAP_SCAN_HAVE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return fmap_scan_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return fmap_scan_sse2;
+#endif
+	return fmap_scan_scalar;
+}
+
+static fmap_scan_fn fmap_scan_selected;
+static pthread_once_t fmap_scan_once = PTHREAD_ONCE_INIT;
+
+static void fmap_scan_init(void)
+{
+	fmap_scan_selected = fmap_scan_select();
+}
+
+static long int fmap_scan(const uint8_t *image, size_t len, size_t start)
+{
+	pthread_once(&fmap_scan_once, fmap_scan_init);
+	return fmap_scan_selected(image, len, start);
+}
+
+/* returns offset if a complete fmap fits in the image at offset, else -1 */
+static long int fmap_check_fit(const uint8_t *image, size_t len, long int offset)
+{
+	if (offset < 0)
+		return -1;
+
+	if (offset + sizeof(struct fmap) > len)
+		return -1;
+
+	if (offset + fmap_size((struct fmap *)&image[offset]) > len)
+		return -1;
+
+	return offset;
+}
+
+/* returns a mask of enum fmap_candidate_errors for the fmap at offset */
+static unsigned int fmap_candidate_errors(const uint8_t *image, size_t len,
+                                          long int offset)
+{
+	const struct fmap *fmap = (const struct fmap *)&image[offset];
+	unsigned int errors = 0;
+	int i;
+
+	if (offset + sizeof(*fmap) > len)
+		return FMAP_ERR_HEADER_TRUNCATED;
+
+	if (fmap->ver_major > FMAP_VER_MAJOR)
+		errors |= FMAP_ERR_VERSION;
+	if (!memchr(fmap->name, '\0', FMAP_STRLEN))
+		errors |= FMAP_ERR_NAME;
+
+	if (offset + fmap_size((struct fmap *)fmap) > len)
+		return errors | FMAP_ERR_AREAS_TRUNCATED;
+
+	for (i = 0; i < fmap->nareas; i++) {
+		const struct fmap_area *area = &fmap->areas[i];
+
+		if ((uint64_t)area->offset + area->size > fmap->size)
+			errors |= FMAP_ERR_AREA_BOUNDS;
+		if (!memchr(area->name, '\0', FMAP_STRLEN))
+			errors |= FMAP_ERR_NAME;
+	}
+
+	return errors;
+}
+
+static int fmap_extent_cmp(const void *a, const void *b)
+{
+	const struct fmap_extent *ea = a, *eb = b;
+
+	if (ea->offset != eb->offset)
+		return ea->offset < eb->offset ? -1 : 1;
+	if (ea->size != eb->size)
+		return ea->size < eb->size ? -1 : 1;
+	return 0;
+}
+
+int fmap_plan_extents(const struct fmap *fmap, uint16_t flags,
+                      struct fmap_extent **extents)
+{
+	struct fmap_extent *e;
+	int i, n = 0, out = 0;
+
+	if ((fmap == NULL) || (extents == NULL))
+		return -1;
+
+	e = calloc(fmap->nareas ? fmap->nareas : 1, sizeof(*e));
+	if (e == NULL)
+		return -1;
+
+	for (i = 0; i < fmap->nareas; i++) {
+		const struct fmap_area *area = &fmap->areas[i];
+
+		if (((area->flags & flags) != flags) || !area->size)
+			continue;
+		e[n].offset = area->offset;
+		e[n].size = area->size;
+		n++;
+	}
+
+	qsort(e, n, sizeof(*e), fmap_extent_cmp);
+
+	/* merge overlapping and touching ranges into maximal extents */
+	for (i = 0; i < n; i++) {
+		uint64_t end = e[i].offset + e[i].size;
+
+		if (out && (e[i].offset <= e[out - 1].offset + e[out - 1].size)) {
+			if (end > e[out - 1].offset + e[out - 1].size)
+				e[out - 1].size = end - e[out - 1].offset;
+			continue;
+		}
+		e[out++] = e[i];
+	}
+
+	*extents = e;
+	return out;
+}
+
+/*
+ * ranges hashed for a checksum: static areas in table order for the
+ * legacy digest, merged and sorted static extents for the coalesced one
+ */
+static int fmap_csum_extents(const struct fmap *fmap,
+                             enum fmap_csum_mode mode,
+                             struct fmap_extent **extents)
+{
+	struct fmap_extent *e;
+	int i, n = 0;
+
+	if (mode == FMAP_CSUM_COALESCED)
+		return fmap_plan_extents(fmap, FMAP_AREA_STATIC, extents);
+	if (mode != FMAP_CSUM_LEGACY)
+		return -1;
+
+	e = calloc(fmap->nareas ? fmap->nareas : 1, sizeof(*e));
+	if (e == NULL)
+		return -1;
+
+	for (i = 0; i < fmap->nareas; i++) {
+		/* skip non-static areas */
+		if (!(fmap->areas[i].flags & FMAP_AREA_STATIC))
+			continue;
+		e[n].offset = fmap->areas[i].offset;
+		e[n].size = fmap->areas[i].size;
+		n++;
+	}
+
+	*extents = e;
+	return n;
+}
+
+/* limit for scanning signatures which start before end */
+static size_t fmap_scan_limit(size_t len, size_t end)
+{
+	/* let signatures starting before end run over into the next range */
+	return end + FMAP_SIG_LEN - 1 < len ? end + FMAP_SIG_LEN - 1 : len;
+}
+
+/* returns alignment of offset, offset 0 being aligned to every stride */
+static long int fmap_align(long int offset)
+{
+	return offset ? offset & -offset : LONG_MAX;
+}
+
+/* every candidate seen by fmap_scan_best(), for fmap_find_all() */
+struct fmap_candidate_list {
+	struct fmap_candidate *list;
+	int count;
+	int capacity;
+};
+
+/*
+ * One pass over the signatures which start in [start, end), validating
+ * each one against the whole image. Every search picks its fmap this way:
+ * the best candidate is the valid one at the most aligned offset, or the
+ * lowest such offset if there is a tie. If found is set, every candidate
+ * is added to it as well.
+ *
+ * Stores offset of the best candidate, or -1, in *best. returns 0 to
+ * indicate success, <0 if found could not be grown.
+ */
+static int fmap_scan_best(const uint8_t *image, size_t len,
+                          size_t start, size_t end,
+                          struct fmap_candidate_list *found, long int *best)
+{
+	size_t limit = fmap_scan_limit(len, end);
+	struct fmap_candidate *tmp;
+	long int offset, best_align = 0;
+	unsigned int errors;
+
+	*best = -1;
+	for (offset = fmap_scan(image, limit, start);
+	     offset >= 0;
+	     offset = fmap_scan(image, limit, offset + 1)) {
+		errors = fmap_candidate_errors(image, len, offset);
+
+		if (found) {
+			if (found->count == found->capacity) {
+				found->capacity = found->capacity ?
+				                  found->capacity * 2 : 4;
+				tmp = realloc(found->list, found->capacity *
+				                           sizeof(*tmp));
+				if (!tmp)
+					return -1;
+				found->list = tmp;
+			}
+			found->list[found->count].offset = offset;
+			found->list[found->count].errors = errors;
+			found->count++;
+		}
+
+		if (!errors && fmap_align(offset) > best_align) {
+			best_align = fmap_align(offset);
+			*best = offset;
+		}
+	}
+
+	return 0;
+}
+
+/* linear search, vectorized where possible */
+static long int fmap_lsearch(const uint8_t *image, size_t len)
+{
+	long int best;
+
+	if (fmap_scan_best(image, len, 0, len, NULL, &best) < 0)
+		return -1;
+
+	return best;
+}
+
+/*
+ * Below this stride, probing individual offsets costs more than scanning the
+ * whole image with fmap_scan(), so bsearch switches strategies.
+ */
+#define FMAP_BSEARCH_MIN_STRIDE	64
+
+/*
+ * Check offsets aligned to FMAP_BSEARCH_MIN_STRIDE or more for a valid
+ * fmap, largest stride first. Also, check for a remainder when modding the
+ * offset with the previous stride. This makes it so that each offset is
+ * only checked once. Returns the offset of the first valid fmap found, which
+ * is the best candidate fmap_scan_best() would pick, or -1.
+ */
+static long int fmap_bsearch_probe(const uint8_t *image, size_t len)
+{
+	size_t stride, offset;
+
+	for (stride = len / 2; stride >= FMAP_BSEARCH_MIN_STRIDE; stride /= 2) {
+		for (offset = 0;
+		     offset + FMAP_SIG_LEN <= len;
+		     offset += stride) {
+			if ((offset % (stride * 2) == 0) && (offset != 0))
+					continue;
+			if (!memcmp(&image[offset],
+			            FMAP_SIGNATURE,
+			            FMAP_SIG_LEN) &&
+			    !fmap_candidate_errors(image, len, offset))
+				return offset;
+		}
+	}
+
+	return -1;
+}
+
+/* if image length is a power of 2, use binary search */
+static long int fmap_bsearch(const uint8_t *image, size_t len)
+{
+	long int offset;
+
+	/*
+	 * Nothing valid at an offset aligned to FMAP_BSEARCH_MIN_STRIDE,
+	 * so the best candidate is less aligned: scan for it.
+	 */
+	offset = fmap_bsearch_probe(image, len);
+	if (offset < 0)
+		offset = fmap_lsearch(image, len);
+
+	return offset;
+}
+
+static int popcnt(unsigned int u)
+{
+	int count;
+
+	/* K&R method */
+	for (count = 0; u; count++)
+		u &= (u - 1);
+
+	return count;
+}
+
+long int fmap_find(const uint8_t *image, unsigned int image_len)
+{
+	long int ret = -1;
+
+	if ((image == NULL) || (image_len == 0))
+		return -1;
+
+	if (popcnt(image_len) == 1)
+		ret = fmap_bsearch(image, image_len);
+	else
+		ret = fmap_lsearch(image, image_len);
+
+	return ret;
+}
+
+/* parallel search: work shared by all threads in fmap_find_parallel() */
+struct fmap_find_job {
+	const uint8_t *image;
+	size_t len;
+	size_t chunk_size;
+	size_t nchunks;
+	size_t next_chunk;	/* next chunk to be claimed by a worker */
+	long int *best;		/* best valid candidate in each chunk */
+};
+
+static void *fmap_find_worker(void *arg)
+{
+	struct fmap_find_job *job = arg;
+	size_t chunk, start, end;
+
+	while ((chunk = __atomic_fetch_add(&job->next_chunk, 1,
+	                                   __ATOMIC_RELAXED)) < job->nchunks) {
+		start = chunk * job->chunk_size;
+		end = start + job->chunk_size;
+		if (end > job->len)
+			end = job->len;
+
+		/* any chunk may hold the best candidate */
+		fmap_scan_best(job->image, job->len, start, end, NULL,
+		               &job->best[chunk]);
+	}
+
+	return NULL;
+}
+
+long int fmap_find_parallel(const uint8_t *image, size_t image_len,
+                            int nthreads)
+{
+	struct fmap_find_job job;
+	pthread_t *threads;
+	long int offset = -1, align, best_align = 0;
+	size_t chunk;
+	int i, started = 0;
+
+	if ((image == NULL) || (image_len == 0) || (nthreads < 0))
+		return -1;
+
+	if (nthreads == 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	memset(&job, 0, sizeof(job));
+	job.image = image;
+	job.len = image_len;
+	job.chunk_size = FMAP_FIND_CHUNK_SIZE;
+	job.nchunks = (job.len + job.chunk_size - 1) / job.chunk_size;
+	job.best = malloc(job.nchunks * sizeof(*job.best));
+	if (!job.best)
+		return -1;
+
+	if (nthreads > job.nchunks)
+		nthreads = job.nchunks;
+
+	/* the calling thread is one of the workers */
+	threads = nthreads > 1 ? calloc(nthreads - 1, sizeof(*threads)) : NULL;
+	if (threads) {
+		for (i = 0; i < nthreads - 1; i++) {
+			if (pthread_create(&threads[started], NULL,
+			                   fmap_find_worker, &job))
+				break;
+			started++;
+		}
+	}
+
+	fmap_find_worker(&job);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	/*
+	 * Same choice as fmap_scan_best() over the whole image. Unlike
+	 * fmap_bsearch(), aligned offsets are not probed first: probing on
+	 * one thread would read every cache line when the fmap is not well
+	 * aligned, before any worker starts.
+	 */
+	for (chunk = 0; chunk < job.nchunks; chunk++) {
+		if (job.best[chunk] < 0)
+			continue;
+		align = fmap_align(job.best[chunk]);
+		if (align > best_align) {
+			best_align = align;
+			offset = job.best[chunk];
+		}
+	}
+	free(job.best);
+
+	return offset;
+}
+
+/*
+ * Streaming search: the file is read one window at a time, and the tail
+ * of each window which could hold the start of a signature is carried over
+ * into the next. Pipes and character devices do not support pread(), so
+ * fall back to read() for those.
+ */
+struct fmap_fd_reader {
+	int fd;
+	off_t pos;		/* file offset of next byte to be read */
+	int use_read;		/* fd is not seekable */
+	int spool;		/* if >= 0, copy of everything read() so far */
+};
+
+static int fmap_fd_pwrite(int fd, const uint8_t *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+		off += ret;
+	}
+
+	return 0;
+}
+
+/* fill buf with up to len bytes, returns number of bytes read or <0 */
+static ssize_t fmap_fd_read(struct fmap_fd_reader *reader,
+                            uint8_t *buf, size_t len)
+{
+	size_t total = 0;
+	ssize_t ret;
+
+	while (total < len) {
+		if (reader->use_read)
+			ret = read(reader->fd, buf + total, len - total);
+		else
+			ret = pread(reader->fd, buf + total,
+			            len - total, reader->pos);
+
+		if (ret < 0 && errno == ESPIPE && !reader->use_read) {
+			reader->use_read = 1;
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+
+		if (reader->use_read && reader->spool >= 0 &&
+		    fmap_fd_pwrite(reader->spool, buf + total, ret,
+		                   reader->pos) < 0)
+			return -1;
+
+		total += ret;
+		reader->pos += ret;
+	}
+
+	return total;
+}
+
+/*
+ * Only offsets aligned to this stride or more are probed by
+ * fmap_find_probe(), a few hundred reads for typical images. Anything less
+ * aligned is left to the windowed scan.
+ */
+#define FMAP_FIND_PROBE_MIN_STRIDE	(64 << 10)
+
+/* returns an fmap copied from offset if a valid one is there, else NULL */
+static struct fmap *fmap_read_candidate(int fd, off_t offset, off_t image_size)
+{
+	struct fmap header, *map;
+	size_t size;
+
+	if (offset + (off_t)sizeof(header) > image_size ||
+	    pread(fd, &header, sizeof(header), offset) != sizeof(header) ||
+	    memcmp(header.signature, FMAP_SIGNATURE, FMAP_SIG_LEN))
+		return NULL;
+
+	size = fmap_size(&header);
+	if (offset + (off_t)size > image_size)
+		return NULL;
+
+	map = fmap_alloc(header.nareas);
+	if (!map)
+		return NULL;
+	if (pread(fd, map, size, offset) != size ||
+	    fmap_candidate_errors((uint8_t *)map, size, 0)) {
+		free(map);
+		return NULL;
+	}
+
+	return map;
+}
+
+/*
+ * Probe offsets aligned to FMAP_FIND_PROBE_MIN_STRIDE or more, largest
+ * stride first, like fmap_bsearch_probe(). Returns the offset of the first
+ * valid fmap found, which is the best candidate the windowed scan would
+ * pick, or -1.
+ */
+static long int fmap_find_probe(int fd, off_t image_size, struct fmap **fmap)
+{
+	off_t stride = 1, offset;
+
+	while (stride * 2 < image_size)
+		stride *= 2;
+
+	for (; stride >= FMAP_FIND_PROBE_MIN_STRIDE; stride /= 2) {
+		for (offset = 0; offset < image_size; offset += stride) {
+			if ((offset % (stride * 2) == 0) && (offset != 0))
+				continue;
+			*fmap = fmap_read_candidate(fd, offset, image_size);
+			if (*fmap)
+				return offset;
+		}
+	}
+
+	return -1;
+}
+
+static long int fmap_find_reader(struct fmap_fd_reader *reader,
+                                 struct fmap **fmap)
+{
+	uint8_t *buf, *tmp;
+	struct fmap *hdr, *map;
+	size_t have = 0, size = FMAP_FIND_WINDOW_SIZE, need;
+	off_t base = 0;		/* file offset of buf[0] */
+	long int c, pos = 0, ret = -1, align, best_align = 0;
+	ssize_t len;
+	struct stat st;
+	int eof = 0;
+
+	if ((reader->fd < 0) || (fmap == NULL))
+		return -1;
+
+	/* a well aligned fmap in a regular file is found without a scan */
+	if (!reader->use_read && !fstat(reader->fd, &st) &&
+	    S_ISREG(st.st_mode)) {
+		ret = fmap_find_probe(reader->fd, st.st_size, fmap);
+		if (ret >= 0)
+			return ret;
+	}
+
+	buf = malloc(size);
+	if (!buf)
+		return -1;
+
+	while (1) {
+		c = fmap_scan(buf, have, pos);
+		hdr = c >= 0 ? (struct fmap *)&buf[c] : NULL;
+
+		/* skip signatures which obviously are not followed by an fmap */
+		need = sizeof(*hdr);
+		if (hdr && c + need <= have) {
+			if (fmap_candidate_errors(buf, c + need, c) &
+			    ~FMAP_ERR_AREAS_TRUNCATED) {
+				pos = c + 1;
+				continue;
+			}
+			need = fmap_size(hdr);
+		}
+
+		/* need more data: no signature yet, or fmap is incomplete */
+		if (c < 0 || c + need > have) {
+			if (eof && c < 0)
+				break;
+			if (eof) {
+				/* truncated by the end of file, try the next */
+				pos = c + 1;
+				continue;
+			}
+
+			/* carry over the tail, which may start a signature */
+			if (c < 0)
+				c = have > FMAP_SIG_LEN - 1 ?
+				    have - (FMAP_SIG_LEN - 1) : 0;
+			memmove(buf, &buf[c], have - c);
+			base += c;
+			have -= c;
+			pos = 0;
+
+			/* the area table may not fit in one window */
+			if (need > size) {
+				tmp = realloc(buf, need);
+				if (!tmp)
+					goto fmap_find_reader_exit;
+				buf = tmp;
+				size = need;
+			}
+
+			len = fmap_fd_read(reader, &buf[have], size - have);
+			if (len < 0)
+				goto fmap_find_reader_exit;
+			if (len < size - have)
+				eof = 1;
+			have += len;
+			continue;
+		}
+
+		pos = c + 1;
+		if (fmap_candidate_errors(buf, have, c))
+			continue;
+
+		/* keep the best candidate, as fmap_scan_best() does */
+		align = fmap_align(base + c);
+		if (align <= best_align)
+			continue;
+
+		map = fmap_alloc(hdr->nareas);
+		if (!map)
+			goto fmap_find_reader_exit;
+		memcpy(map, hdr, need);
+		if (ret >= 0)
+			free(*fmap);
+		*fmap = map;
+		ret = base + c;
+		best_align = align;
+
+		/* nothing is more aligned than offset 0 */
+		if (align == LONG_MAX)
+			break;
+	}
+
+	free(buf);
+	return ret;
+
+fmap_find_reader_exit:
+	if (ret >= 0)
+		free(*fmap);
+	free(buf);
+	return -1;
+}
+
+long int fmap_find_fd(int fd, struct fmap **fmap)
+{
+	struct fmap_fd_reader reader = { .fd = fd, .spool = -1 };
+
+	return fmap_find_reader(&reader, fmap);
+}
+
+/*
+ * room left at offset in the FMAP area of map covering it. returns 0 if
+ * the FMAP area of map is elsewhere, -1 if map has none.
+ */
+static off_t fmap_area_room(const struct fmap *map, off_t offset)
+{
+	off_t room = -1;
+	int i;
+
+	for (i = 0; i < map->nareas; i++) {
+		const struct fmap_area *area = &map->areas[i];
+
+		if (strncmp((const char *)area->name, "FMAP", FMAP_STRLEN))
+			continue;
+		if (offset >= area->offset &&
+		    offset < (off_t)area->offset + area->size)
+			return (off_t)area->offset + area->size - offset;
+		room = 0;
+	}
+
+	return room;
+}
+
+long int fmap_update_fd(int fd, const struct fmap *fmap, long int offset,
+                        size_t room)
+{
+	struct fmap *old = NULL;
+	struct stat st;
+	long int page, start, rc;
+	off_t slot, new_room;
+	uint8_t *map;
+	size_t map_len;
+	int size;
+
+	if (fd < 0 || !fmap || fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return FMAP_UPDATE_ERR_IO;
+
+	size = fmap_size((struct fmap *)fmap);
+	if (size < 0)
+		return FMAP_UPDATE_ERR_IO;
+
+	if (offset < 0) {
+		offset = fmap_find_fd(fd, &old);
+		if (offset < 0)
+			return FMAP_UPDATE_ERR_NOT_FOUND;
+	} else if (offset >= st.st_size) {
+		return FMAP_UPDATE_ERR_NO_ROOM;
+	} else {
+		old = fmap_read_candidate(fd, offset, st.st_size);
+		if (!old && !room)
+			return FMAP_UPDATE_ERR_NOT_FOUND;
+	}
+
+	/* the slot set aside for the old map, else the old map itself */
+	if (room) {
+		slot = room;
+	} else {
+		slot = fmap_area_room(old, offset);
+		if (slot <= 0)
+			slot = fmap_size(old);
+	}
+	if (slot > st.st_size - offset)
+		slot = st.st_size - offset;
+
+	/* the new map has to agree on where it is stored */
+	new_room = fmap_area_room(fmap, offset);
+	if (new_room >= 0 && new_room < slot)
+		slot = new_room;
+
+	rc = FMAP_UPDATE_ERR_NO_ROOM;
+	if (size > slot)
+		goto fmap_update_fd_exit;
+
+	/* map only the pages holding the new fmap */
+	page = sysconf(_SC_PAGESIZE);
+	start = offset - offset % page;
+	map_len = offset - start + size;
+
+	rc = FMAP_UPDATE_ERR_IO;
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+	           fd, start);
+	if (map == MAP_FAILED)
+		goto fmap_update_fd_exit;
+
+	memcpy(map + (offset - start), fmap, size);
+	if (!msync(map, map_len, MS_SYNC))
+		rc = offset;
+	munmap(map, map_len);
+
+fmap_update_fd_exit:
+	fmap_destroy(old);
+	return rc;
+}
+
+/*
+ * read len bytes at file offset off. Streams are read forward as needed,
+ * anything before the current position comes back from the spool.
+ */
+static ssize_t fmap_fd_pread(struct fmap_fd_reader *reader,
+                             uint8_t *buf, size_t len, off_t off)
+{
+	size_t done = 0, n;
+	ssize_t ret;
+
+	if (!reader->use_read) {
+		reader->pos = off;
+		return fmap_fd_read(reader, buf, len);
+	}
+
+	if (off < reader->pos) {
+		n = reader->pos - off < len ? reader->pos - off : len;
+		while (done < n) {
+			ret = pread(reader->spool, buf + done, n - done,
+			            off + done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				return -1;
+			done += ret;
+		}
+	}
+
+	while (done < len) {
+		/* skip ahead, using buf as scratch space */
+		if (reader->pos < off + done) {
+			n = off + done - reader->pos;
+			ret = fmap_fd_read(reader, buf + done,
+			                   n < len - done ? n : len - done);
+			if (ret <= 0)
+				return ret < 0 ? -1 : done;
+			continue;
+		}
+
+		ret = fmap_fd_read(reader, buf + done, len - done);
+		if (ret < 0)
+			return -1;
+		done += ret;
+		break;
+	}
+
+	return done;
+}
+
+/* ring of buffers between the reader thread and the hashing thread */
+#define FMAP_CSUM_STREAM_BUFS		4
+#define FMAP_CSUM_STREAM_BUF_SIZE	(1 << 20)
+
+struct fmap_csum_stream_ring {
+	struct fmap_fd_reader *reader;
+	const struct fmap_extent *extents;	/* ranges to hash, in order */
+	int nextents;
+	uint8_t *buf[FMAP_CSUM_STREAM_BUFS];
+	size_t len[FMAP_CSUM_STREAM_BUFS];
+	unsigned int head;	/* next buffer to fill */
+	unsigned int tail;	/* next buffer to hash */
+	int done;		/* reader finished */
+	int error;		/* reader failed */
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t emptied;
+};
+
+static void *fmap_csum_stream_reader(void *arg)
+{
+	struct fmap_csum_stream_ring *ring = arg;
+	const struct fmap_extent *e;
+	uint64_t pos, n;
+	uint8_t *buf;
+	ssize_t ret;
+	int i, error = 0;
+
+	for (i = 0; i < ring->nextents; i++) {
+		e = &ring->extents[i];
+
+		/* start fetching the next extent while this one is hashed */
+		if (!ring->reader->use_read && i + 1 < ring->nextents)
+			posix_fadvise(ring->reader->fd, e[1].offset,
+			              e[1].size, POSIX_FADV_WILLNEED);
+
+		for (pos = 0; pos < e->size; pos += n) {
+			n = e->size - pos;
+			if (n > FMAP_CSUM_STREAM_BUF_SIZE)
+				n = FMAP_CSUM_STREAM_BUF_SIZE;
+
+			pthread_mutex_lock(&ring->lock);
+			while (ring->head - ring->tail == FMAP_CSUM_STREAM_BUFS)
+				pthread_cond_wait(&ring->emptied, &ring->lock);
+			buf = ring->buf[ring->head % FMAP_CSUM_STREAM_BUFS];
+			pthread_mutex_unlock(&ring->lock);
+
+			ret = fmap_fd_pread(ring->reader, buf, n,
+			                    e->offset + pos);
+			if (ret != n) {
+				fprintf(stderr, "(%s) unable to read 0x%" PRIx64
+				        " bytes at 0x%" PRIx64 "\n", __func__,
+				        n, e->offset + pos);
+				error = 1;
+				goto fmap_csum_stream_reader_exit;
+			}
+
+			pthread_mutex_lock(&ring->lock);
+			ring->len[ring->head % FMAP_CSUM_STREAM_BUFS] = n;
+			ring->head++;
+			pthread_cond_signal(&ring->filled);
+			pthread_mutex_unlock(&ring->lock);
+		}
+	}
+
+fmap_csum_stream_reader_exit:
+	pthread_mutex_lock(&ring->lock);
+	ring->error = error;
+	ring->done = 1;
+	pthread_cond_signal(&ring->filled);
+	pthread_mutex_unlock(&ring->lock);
+	return NULL;
+}
+
+int fmap_get_csum_fd(int fd, const struct fmap_digest *alg,
+                     enum fmap_csum_mode mode, uint8_t **digest)
+{
+	struct fmap_fd_reader reader = { .fd = fd, .spool = -1 };
+	struct fmap_csum_stream_ring ring;
+	struct fmap *fmap = NULL;
+	struct fmap_extent *extents = NULL;
+	FILE *spool = NULL;
+	pthread_t thread;
+	void *ctx = NULL;
+	int i, rc = -1;
+
+	if ((fd < 0) || (digest == NULL))
+		return -1;
+
+	if (alg == NULL)
+		alg = &fmap_digest_sha1;
+
+	/* streams keep a copy of what was read, for areas out of order */
+	if (lseek(fd, 0, SEEK_CUR) < 0 && errno == ESPIPE) {
+		spool = tmpfile();
+		if (spool == NULL)
+			return -1;
+		reader.use_read = 1;
+		reader.spool = fileno(spool);
+	}
+
+	if (fmap_find_reader(&reader, &fmap) < 0)
+		goto fmap_get_csum_fd_exit;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.reader = &reader;
+	ring.nextents = fmap_csum_extents(fmap, mode, &extents);
+	if (ring.nextents < 0)
+		goto fmap_get_csum_fd_exit;
+	ring.extents = extents;
+	for (i = 0; i < FMAP_CSUM_STREAM_BUFS; i++) {
+		ring.buf[i] = malloc(FMAP_CSUM_STREAM_BUF_SIZE);
+		if (ring.buf[i] == NULL)
+			goto fmap_get_csum_fd_free;
+	}
+	ctx = malloc(alg->ctx_size);
+	if (ctx == NULL)
+		goto fmap_get_csum_fd_free;
+	alg->init(ctx);
+
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.filled, NULL);
+	pthread_cond_init(&ring.emptied, NULL);
+
+	if (pthread_create(&thread, NULL, fmap_csum_stream_reader, &ring))
+		goto fmap_get_csum_fd_destroy;
+
+	/* hash buffers in order as the reader fills them */
+	while (1) {
+		unsigned int slot;
+
+		pthread_mutex_lock(&ring.lock);
+		while (ring.head == ring.tail && !ring.done)
+			pthread_cond_wait(&ring.filled, &ring.lock);
+		if (ring.head == ring.tail) {
+			pthread_mutex_unlock(&ring.lock);
+			break;
+		}
+		slot = ring.tail % FMAP_CSUM_STREAM_BUFS;
+		pthread_mutex_unlock(&ring.lock);
+
+		alg->update(ctx, ring.buf[slot], ring.len[slot]);
+
+		pthread_mutex_lock(&ring.lock);
+		ring.tail++;
+		pthread_cond_signal(&ring.emptied);
+		pthread_mutex_unlock(&ring.lock);
+	}
+
+	pthread_join(thread, NULL);
+	if (ring.error)
+		goto fmap_get_csum_fd_destroy;
+
+	*digest = malloc(alg->size);
+	if (*digest == NULL)
+		goto fmap_get_csum_fd_destroy;
+	alg->final(ctx, *digest);
+	rc = alg->size;
+
+fmap_get_csum_fd_destroy:
+	pthread_cond_destroy(&ring.emptied);
+	pthread_cond_destroy(&ring.filled);
+	pthread_mutex_destroy(&ring.lock);
+fmap_get_csum_fd_free:
+	free(ctx);
+	for (i = 0; i < FMAP_CSUM_STREAM_BUFS; i++)
+		free(ring.buf[i]);
+fmap_get_csum_fd_exit:
+	free(extents);
+	free(fmap);
+	if (spool)
+		fclose(spool);
+	return rc;
+}
+
+int fmap_find_all(const uint8_t *image, unsigned int image_len,
+                  struct fmap_candidate **candidates, long int *best)
+{
+	struct fmap_candidate_list found = { NULL, 0, 0 };
+	long int best_offset;
+
+	if ((image == NULL) || (candidates == NULL))
+		return -1;
+
+	if (fmap_scan_best(image, image_len, 0, image_len,
+	                   &found, &best_offset) < 0) {
+		free(found.list);
+		return -1;
+	}
+
+	*candidates = found.list;
+	if (best)
+		*best = best_offset;
+
+	return found.count;
+}
+
+int fmap_print(const struct fmap *fmap)
+{
+	return fmap_print_buffered(stdout, fmap, NULL, 0);
+}
+
+/* get SHA1 sum of all static regions described by the flashmap and copy into
+   *digest (which will be allocated and must be freed by the caller),  */
+int fmap_get_csum(const uint8_t *image, unsigned int image_len, uint8_t **digest)
+{
+	if (image == NULL)
+		return -1;
+
+	return fmap_get_csum_at(image, image_len,
+	                        fmap_find(image, image_len), digest);
+}
+
+int fmap_get_csum_at(const uint8_t *image, unsigned int image_len,
+                     long int fmap_offset, uint8_t **digest)
+{
+	return fmap_get_csum_digest(image, image_len, fmap_offset,
+	                            &fmap_digest_sha1, FMAP_CSUM_LEGACY,
+	                            digest);
+}
+
+/*
+ * fmap_area_outside - find an area lying outside the image
+ *
+ * @fmap:	fmap to check
+ * @image_len:	length of the image the fmap describes
+ * @flags:	only check areas that have all of these flags set
+ *
+ * returns index of the first such area not contained in the image
+ * returns -1 if they all fit
+ */
+static int fmap_area_outside(const struct fmap *fmap, unsigned int image_len,
+                             uint16_t flags)
+{
+	int i;
+
+	for (i = 0; i < fmap->nareas; i++) {
+		const struct fmap_area *area = &fmap->areas[i];
+
+		if ((area->flags & flags) != flags)
+			continue;
+		if ((uint64_t)area->offset + area->size > image_len)
+			return i;
+	}
+
+	return -1;
+}
+
+int fmap_get_csum_digest(const uint8_t *image, unsigned int image_len,
+                         long int fmap_offset, const struct fmap_digest *alg,
+                         enum fmap_csum_mode mode, uint8_t **digest)
+{
+	struct fmap_extent *extents = NULL;
+	struct fmap *fmap;
+	void *ctx = NULL;
+	int i, n, rc = -1;
+
+	if ((image == NULL) || (digest == NULL))
+		return -1;
+
+	if (alg == NULL)
+		alg = &fmap_digest_sha1;
+
+	if ((fmap_offset < 0) ||
+	    (fmap_check_fit(image, image_len, fmap_offset) < 0))
+		return -1;
+	fmap = (struct fmap *)(image + fmap_offset);
+
+	/* sanity check the offsets */
+	i = fmap_area_outside(fmap, image_len, FMAP_AREA_STATIC);
+	if (i >= 0) {
+		fprintf(stderr, "(%s) invalid parameter detected in area %d\n",
+		        __func__, i);
+		return -1;
+	}
+
+	n = fmap_csum_extents(fmap, mode, &extents);
+	if (n < 0)
+		return -1;
+
+	ctx = malloc(alg->ctx_size);
+	if (ctx == NULL)
+		goto fmap_get_csum_digest_exit;
+	alg->init(ctx);
+
+	/* Iterate through the ranges and calculate the checksum piece-wise. */
+	for (i = 0; i < n; i++)
+		alg->update(ctx, image + extents[i].offset, extents[i].size);
+
+	*digest = malloc(alg->size);
+	if (*digest == NULL)
+		goto fmap_get_csum_digest_exit;
+	alg->final(ctx, *digest);
+	rc = alg->size;
+
+fmap_get_csum_digest_exit:
+	free(ctx);
+	free(extents);
+	return rc;
+}
+
+struct fmap_area_csum_work {
+	uint32_t size;		/* sort key */
+	int csum;		/* index into csums */
+};
+
+struct fmap_area_csum_job {
+	const uint8_t *image;
+	const struct fmap *fmap;
+	const struct fmap_digest *alg;
+	struct fmap_area_csum *csums;
+	struct fmap_area_csum_work *order;	/* largest area first */
+	int n;
+	int next;		/* next entry of order to be claimed */
+	int nthreads;		/* size of the pool */
+};
+
+static void *fmap_area_csum_worker(void *arg)
+{
+	struct fmap_area_csum_job *job = arg;
+	const struct fmap_area *area;
+	struct fmap_area_csum *csum;
+	void *ctx;
+	int i, limit = 0;
+
+	ctx = malloc(job->alg->ctx_size);
+	if (ctx == NULL)
+		return NULL;	/* the other workers pick up the slack */
+
+	/* a pool of our own already keeps the CPUs busy, else the caller's
+	   limit applies */
+	if (job->nthreads > 1)
+		limit = fmap_digest_threads(1);
+
+	while ((i = __atomic_fetch_add(&job->next, 1,
+	                               __ATOMIC_RELAXED)) < job->n) {
+		csum = &job->csums[job->order[i].csum];
+		area = &job->fmap->areas[csum->area];
+
+		job->alg->init(ctx);
+		job->alg->update(ctx, job->image + area->offset, area->size);
+		job->alg->final(ctx, csum->digest);
+	}
+
+	if (job->nthreads > 1)
+		fmap_digest_threads(limit);
+	free(ctx);
+	return NULL;
+}
+
+static int fmap_area_csum_cmp(const void *a, const void *b)
+{
+	const struct fmap_area_csum_work *wa = a, *wb = b;
+
+	if (wa->size != wb->size)
+		return wa->size < wb->size ? 1 : -1;
+	return wa->csum - wb->csum;
+}
+
+/* see fmap_get_area_csums() in fmap.h for how the tree is built */
+static int fmap_merkle_root(const struct fmap_digest *alg,
+                            const struct fmap_area_csum *csums, int n,
+                            uint8_t *root)
+{
+	uint8_t *level;
+	void *ctx;
+	int i, width;
+
+	ctx = malloc(alg->ctx_size);
+	level = malloc(n ? n * alg->size : 1);
+	if (!ctx || !level) {
+		free(level);
+		free(ctx);
+		return -1;
+	}
+
+	/* leaves are domain separated from interior nodes */
+	for (i = 0; i < n; i++) {
+		alg->init(ctx);
+		alg->update(ctx, "\x00", 1);
+		alg->update(ctx, csums[i].digest, alg->size);
+		alg->final(ctx, level + i * alg->size);
+	}
+
+	if (n == 0) {
+		alg->init(ctx);
+		alg->final(ctx, level);
+		width = 1;
+	} else {
+		width = n;
+	}
+
+	while (width > 1) {
+		for (i = 0; i < width / 2; i++) {
+			alg->init(ctx);
+			alg->update(ctx, "\x01", 1);
+			alg->update(ctx, level + 2 * i * alg->size,
+			            2 * alg->size);
+			alg->final(ctx, level + i * alg->size);
+		}
+		if (width & 1)
+			memmove(level + i * alg->size,
+			        level + (width - 1) * alg->size, alg->size);
+		width = (width + 1) / 2;
+	}
+
+	memcpy(root, level, alg->size);
+	free(level);
+	free(ctx);
+	return 0;
+}
+
+int fmap_get_area_csums(const uint8_t *image, unsigned int image_len,
+                        long int fmap_offset, const struct fmap_digest *alg,
+                        uint16_t flags, int nthreads,
+                        struct fmap_area_csum **csums, uint8_t *root)
+{
+	struct fmap_area_csum_job job;
+	pthread_t *threads = NULL;
+	int i, n, started = 0, rc = -1;
+
+	if ((image == NULL) || (csums == NULL) || (nthreads < 0))
+		return -1;
+
+	if (alg == NULL)
+		alg = &fmap_digest_sha1;
+	if (alg->size > FMAP_DIGEST_MAX_SIZE)
+		return -1;
+
+	if ((fmap_offset < 0) ||
+	    (fmap_check_fit(image, image_len, fmap_offset) < 0))
+		return -1;
+
+	memset(&job, 0, sizeof(job));
+	job.image = image;
+	job.fmap = (const struct fmap *)(image + fmap_offset);
+	job.alg = alg;
+
+	job.csums = calloc(job.fmap->nareas ? job.fmap->nareas : 1,
+	                   sizeof(*job.csums));
+	job.order = calloc(job.fmap->nareas ? job.fmap->nareas : 1,
+	                   sizeof(*job.order));
+	if (!job.csums || !job.order)
+		goto fmap_get_area_csums_exit;
+
+	/* sanity check the offsets */
+	i = fmap_area_outside(job.fmap, image_len, flags);
+	if (i >= 0) {
+		fprintf(stderr, "(%s) invalid parameter detected in area %d\n",
+		        __func__, i);
+		goto fmap_get_area_csums_exit;
+	}
+
+	for (i = 0, n = 0; i < job.fmap->nareas; i++) {
+		const struct fmap_area *area = &job.fmap->areas[i];
+
+		if ((area->flags & flags) != flags)
+			continue;
+
+		job.csums[n].area = i;
+		job.order[n].size = area->size;
+		job.order[n].csum = n;
+		n++;
+	}
+	job.n = n;
+
+	/* hand out the largest areas first so the pool finishes together */
+	qsort(job.order, n, sizeof(*job.order), fmap_area_csum_cmp);
+
+	if (nthreads == 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > n)
+		nthreads = n;
+	job.nthreads = nthreads;
+
+	/* the calling thread is one of the workers */
+	if (nthreads > 1)
+		threads = calloc(nthreads - 1, sizeof(*threads));
+	if (threads) {
+		for (i = 0; i < nthreads - 1; i++) {
+			if (pthread_create(&threads[started], NULL,
+			                   fmap_area_csum_worker, &job))
+				break;
+			started++;
+		}
+	}
+
+	fmap_area_csum_worker(&job);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	/* every worker failed to allocate its state */
+	if (job.next < n)
+		goto fmap_get_area_csums_exit;
+
+	if (root && (fmap_merkle_root(alg, job.csums, n, root) < 0))
+		goto fmap_get_area_csums_exit;
+
+	*csums = job.csums;
+	job.csums = NULL;
+	rc = n;
+
+fmap_get_area_csums_exit:
+	free(job.order);
+	free(job.csums);
+	return rc;
 }
 
-/* brute force linear search */
-static long int fmap_lsearch(const uint8_t *image, size_t len)
+/* bytes handed to each stream per round of multi-buffer hashing */
+#define FMAP_CSUM_BATCH_CHUNK	(256 << 10)
+
+struct fmap_csum_stream {
+	const uint8_t *image;
+	const struct fmap *fmap;
+	int area;		/* current area */
+	uint32_t pos;		/* position within current area */
+	SHA_CTX ctx;
+};
+
+/* skip to the next static area that still has data, 0 when done */
+static int fmap_csum_stream_next(struct fmap_csum_stream *s)
 {
-	long int offset;
-	int fmap_found = 0;
+	const struct fmap *fmap = s->fmap;
 
-	for (offset = 0; offset < len - strlen(FMAP_SIGNATURE); offset++) {
-		if (!memcmp(&image[offset],
-		            FMAP_SIGNATURE,
-		            strlen(FMAP_SIGNATURE))) {
-			fmap_found = 1;
-			break;
-		}
+	if (fmap == NULL)
+		return 0;
+
+	while (s->area < fmap->nareas) {
+		if ((fmap->areas[s->area].flags & FMAP_AREA_STATIC) &&
+		    (s->pos < fmap->areas[s->area].size))
+			return 1;
+		s->area++;
+		s->pos = 0;
 	}
 
-	if (!fmap_found)
-		return -1;
+	return 0;
+}
 
-	if (offset + fmap_size((struct fmap *)&image[offset]) > len)
+int fmap_get_csum_batch(const uint8_t *const images[],
+                        const unsigned int image_lens[], int n,
+                        uint8_t *digests[])
+{
+	struct fmap_csum_stream *streams = NULL;
+	SHA_CTX **ctx = NULL;
+	const void **data = NULL;
+	int *lens = NULL;
+	int i, rc = -1;
+
+	if ((images == NULL) || (image_lens == NULL) ||
+	    (digests == NULL) || (n < 0))
 		return -1;
 
-	return offset;
-}
+	streams = calloc(n, sizeof(*streams));
+	ctx = calloc(n, sizeof(*ctx));
+	data = calloc(n, sizeof(*data));
+	lens = calloc(n, sizeof(*lens));
+	if (n && (!streams || !ctx || !data || !lens))
+		goto fmap_get_csum_batch_exit;
+
+	rc = SHA_DIGEST_SIZE;
+	for (i = 0; i < n; i++) {
+		struct fmap_csum_stream *s = &streams[i];
+		long int offset;
+		int j;
+
+		digests[i] = NULL;
+		s->image = images[i];
+		SHA_init(&s->ctx);
+
+		if (s->image == NULL) {
+			rc = -1;
+			continue;
+		}
 
-/* if image length is a power of 2, use binary search */
-static long int fmap_bsearch(const uint8_t *image, size_t len)
-{
-	long int offset = -1;
-	int fmap_found = 0, stride;
+		offset = fmap_find(s->image, image_lens[i]);
+		if ((offset < 0) ||
+		    (fmap_check_fit(s->image, image_lens[i], offset) < 0)) {
+			rc = -1;
+			continue;
+		}
+		s->fmap = (const struct fmap *)(s->image + offset);
+
+		/* sanity check all offsets before hashing anything */
+		j = fmap_area_outside(s->fmap, image_lens[i], FMAP_AREA_STATIC);
+		if (j >= 0) {
+			fprintf(stderr, "(%s) invalid parameter detected in "
+			        "image %d area %d\n", __func__, i, j);
+			s->fmap = NULL;
+			rc = -1;
+		}
+	}
 
 	/*
-	 * For efficient operation, we start with the largest stride possible
-	 * and then decrease the stride on each iteration. Also, check for a
-	 * remainder when modding the offset with the previous stride. This
-	 * makes it so that each offset is only checked once.
+	 * Hand every unfinished stream the next chunk of its current area
+	 * so lanes stay evenly loaded until the shortest image runs out.
 	 */
-	for (stride = len / 2; stride >= 1; stride /= 2) {
-		if (fmap_found)
-			break;
-
-		for (offset = 0;
-		     offset < len - strlen(FMAP_SIGNATURE);
-		     offset += stride) {
-			if ((offset % (stride * 2) == 0) && (offset != 0))
-					continue;
-			if (!memcmp(&image[offset],
-			            FMAP_SIGNATURE,
-			            strlen(FMAP_SIGNATURE))) {
-				fmap_found = 1;
-				break;
-			}
+	while (1) {
+		int m = 0;
+
+		for (i = 0; i < n; i++) {
+			struct fmap_csum_stream *s = &streams[i];
+			const struct fmap_area *area;
+			uint32_t chunk;
+
+			if (!fmap_csum_stream_next(s))
+				continue;
+
+			area = &s->fmap->areas[s->area];
+			chunk = area->size - s->pos;
+			if (chunk > FMAP_CSUM_BATCH_CHUNK)
+				chunk = FMAP_CSUM_BATCH_CHUNK;
+
+			ctx[m] = &s->ctx;
+			data[m] = s->image + area->offset + s->pos;
+			lens[m] = chunk;
+			s->pos += chunk;
+			m++;
 		}
+
+		if (!m)
+			break;
+		SHA_update_mb(ctx, data, lens, m);
 	}
 
-	if (!fmap_found)
-		return -1;
+	for (i = 0; i < n; i++) {
+		if (streams[i].fmap == NULL)
+			continue;
 
-	if (offset + fmap_size((struct fmap *)&image[offset]) > len)
-		return -1;
+		digests[i] = malloc(SHA_DIGEST_SIZE);
+		if (digests[i] == NULL) {
+			rc = -1;
+			continue;
+		}
+		memcpy(digests[i], SHA_final(&streams[i].ctx), SHA_DIGEST_SIZE);
+	}
 
-	return offset;
+fmap_get_csum_batch_exit:
+	free(lens);
+	free(data);
+	free(ctx);
+	free(streams);
+	return rc;
 }
 
-static int popcnt(unsigned int u)
+/* convert raw flags field to user-friendly string */
+char *fmap_flags_to_string(uint16_t flags)
 {
-	int count;
+	char *str;
+	size_t len;
 
-	/* K&R method */
-	for (count = 0; u; count++)
-		u &= (u - 1);
+	len = fmap_flags_format(NULL, 0, flags);
+	str = malloc(len + 1);
+	if (str)
+		fmap_flags_format(str, len + 1, flags);
 
-	return count;
+	return str;
 }
 
-long int fmap_find(const uint8_t *image, unsigned int image_len)
+/*
+ * A builder holds the header and a geometrically grown area array, so
+ * appending n areas costs O(n) copies rather than the O(n^2) of a realloc
+ * per area. The packed struct fmap is only assembled by finalize.
+ */
+struct fmap_builder {
+	uint64_t base;
+	uint32_t size;
+	uint8_t name[FMAP_STRLEN];
+	struct fmap_area *areas;
+	int nareas;
+	int capacity;
+};
+
+static void fmap_area_init(struct fmap_area *area,
+                           uint32_t offset, uint32_t size,
+                           const uint8_t *name, uint16_t flags)
 {
-	long int ret = -1;
+	memset(area, 0, sizeof(*area));
+	memcpy(&area->offset, &offset, sizeof(area->offset));
+	memcpy(&area->size, &size, sizeof(area->size));
+	memccpy(&area->name, name, '\0', FMAP_STRLEN);
+	memcpy(&area->flags, &flags, sizeof(area->flags));
+}
 
-	if ((image == NULL) || (image_len == 0))
-		return -1;
+struct fmap_builder *fmap_builder_create(uint64_t base, uint32_t size,
+                                         const uint8_t *name)
+{
+	struct fmap_builder *builder;
 
-	if (popcnt(image_len) == 1)
-		ret = fmap_bsearch(image, image_len);
-	else
-		ret = fmap_lsearch(image, image_len);
+	if (name == NULL)
+		return NULL;
 
-	return ret;
+	builder = calloc(1, sizeof(*builder));
+	if (!builder)
+		return NULL;
+
+	builder->base = base;
+	builder->size = size;
+	memccpy(&builder->name, name, '\0', FMAP_STRLEN);
+
+	return builder;
 }
 
-int fmap_print(const struct fmap *fmap)
+void fmap_builder_destroy(struct fmap_builder *builder)
 {
-	int i;
-	struct kv_pair *kv = NULL;
-	const uint8_t *tmp;
-
-        kv = kv_pair_new();
-	if (!kv)
-		return -1;
-
-	tmp = fmap->signature;
-	kv_pair_fmt(kv, "fmap_signature",
-	                "0x%02x%02x%02x%02x%02x%02x%02x%02x",
-			tmp[0], tmp[1], tmp[2], tmp[3],
-			tmp[4], tmp[5], tmp[6], tmp[7]);
-	kv_pair_fmt(kv, "fmap_ver_major", "%d", fmap->ver_major);
-	kv_pair_fmt(kv, "fmap_ver_minor","%d", fmap->ver_minor);
-	kv_pair_fmt(kv, "fmap_base", "0x%016llx",
-	            (unsigned long long)fmap->base);
-	kv_pair_fmt(kv, "fmap_size", "0x%04x", fmap->size);
-	kv_pair_fmt(kv, "fmap_name", "%s", fmap->name);
-	kv_pair_fmt(kv, "fmap_nareas", "%d", fmap->nareas);
-	kv_pair_print(kv);
-	kv_pair_free(kv);
+	if (builder == NULL)
+		return;
 
-	for (i = 0; i < fmap->nareas; i++) {
-		struct kv_pair *kv;
-		uint16_t flags;
-		char *str;
+	free(builder->areas);
+	free(builder);
+}
 
-		kv = kv_pair_new();
-		if (!kv)
-			return -1;
+/* make room for n more areas, doubling the capacity as needed */
+static int fmap_builder_reserve(struct fmap_builder *builder, int n)
+{
+	struct fmap_area *areas;
+	int capacity;
 
-		kv_pair_fmt(kv, "area_offset", "0x%08x",
-				fmap->areas[i].offset);
-		kv_pair_fmt(kv, "area_size", "0x%08x",
-				fmap->areas[i].size);
-		kv_pair_fmt(kv, "area_name", "%s",
-				fmap->areas[i].name);
-		kv_pair_fmt(kv, "area_flags_raw", "0x%02x",
-				fmap->areas[i].flags);
-
-		/* Print descriptive strings for flags rather than the field */
-		flags = fmap->areas[i].flags;
-		if ((str = fmap_flags_to_string(flags)) == NULL)
-			return -1;
-		kv_pair_fmt(kv, "area_flags", "%s", str );
-		free(str);
+	if (n > 0xffff - builder->nareas)
+		return -1;
+	if (builder->nareas + n <= builder->capacity)
+		return 0;
 
-		kv_pair_print(kv);
-		kv_pair_free(kv);
-	}
+	capacity = builder->capacity ? builder->capacity : 16;
+	while (capacity < builder->nareas + n)
+		capacity *= 2;
+	if (capacity > 0xffff)
+		capacity = 0xffff;
+
+	areas = realloc(builder->areas, capacity * sizeof(*areas));
+	if (areas == NULL)
+		return -1;
 
+	builder->areas = areas;
+	builder->capacity = capacity;
 	return 0;
 }
 
-/* get SHA1 sum of all static regions described by the flashmap and copy into
-   *digest (which will be allocated and must be freed by the caller),  */
-int fmap_get_csum(const uint8_t *image, unsigned int image_len, uint8_t **digest)
+int fmap_builder_append_area(struct fmap_builder *builder,
+                             uint32_t offset, uint32_t size,
+                             const uint8_t *name, uint16_t flags)
 {
-	int i;
-	struct fmap *fmap;
-	int fmap_offset;
-	SHA_CTX ctx;
-
-	if (image == NULL)
+	if (!builder || !name)
 		return -1;
 
-	if ((fmap_offset = fmap_find(image, image_len)) < 0)
+	if (fmap_builder_reserve(builder, 1) < 0)
 		return -1;
-	fmap = (struct fmap *)(image + fmap_offset);
 
-	SHA_init(&ctx);
+	fmap_area_init(&builder->areas[builder->nareas],
+	               offset, size, name, flags);
+	return builder->nareas++;
+}
 
-	/* Iterate through flash map and calculate the checksum piece-wise. */
-	for (i = 0; i < fmap->nareas; i++) {
-		/* skip non-static areas */
-		if (!(fmap->areas[i].flags & FMAP_AREA_STATIC))
-			continue;
+int fmap_builder_append_areas(struct fmap_builder *builder,
+                              const struct fmap_area *areas, int n)
+{
+	if (!builder || n < 0 || (n && !areas))
+		return -1;
 
-		/* sanity check the offset */
-		if (fmap->areas[i].size + fmap->areas[i].offset > image_len) {
-			fprintf(stderr,
-			        "(%s) invalid parameter detected in area %d\n",
-			        __func__, i);
-			return -1;
-		}
+	if (fmap_builder_reserve(builder, n) < 0)
+		return -1;
 
-		SHA_update(&ctx,
-		           image + fmap->areas[i].offset,
-		           fmap->areas[i].size);
-	}
+	memcpy(&builder->areas[builder->nareas], areas, n * sizeof(*areas));
+	builder->nareas += n;
+	return builder->nareas;
+}
+
+/* sort key for finalize: offset, then order of appending */
+struct fmap_builder_order {
+	uint32_t offset;
+	int index;
+};
 
-	SHA_final(&ctx);
-	*digest = malloc(SHA_DIGEST_SIZE);
-	memcpy(*digest, ctx.buf, SHA_DIGEST_SIZE);
+static int fmap_builder_order_cmp(const void *a, const void *b)
+{
+	const struct fmap_builder_order *oa = a, *ob = b;
 
-	return SHA_DIGEST_SIZE;
+	if (oa->offset != ob->offset)
+		return oa->offset < ob->offset ? -1 : 1;
+	return oa->index - ob->index;
 }
 
-/* convert raw flags field to user-friendly string */
-char *fmap_flags_to_string(uint16_t flags)
+struct fmap *fmap_builder_finalize(struct fmap_builder *builder)
 {
-	char *str = NULL;
-	int i, total_size;
-
-	str = malloc(1);
-	str[0] = '\0';
-	total_size = 1;
+	struct fmap_builder_order *order = NULL;
+	struct fmap *fmap = NULL;
+	uint32_t offset, size;
+	int i;
 
-	for (i = 0; i < sizeof(flags) * CHAR_BIT; i++) {
-		if (!flags)
-			break;
+	if (builder == NULL)
+		return NULL;
 
-		if (flags & (1 << i)) {
-			const char *tmp = val2str(1 << i, flag_lut);
-
-			total_size += strlen(tmp);
-			str = realloc(str, total_size);
-			strcat(str, tmp);
-			
-			flags &= ~(1 << i);
-			if (flags) {
-				total_size++;
-				str = realloc(str, total_size);
-				strcat(str, ",");
-			}
+	order = malloc((builder->nareas ? builder->nareas : 1) *
+	               sizeof(*order));
+	if (!order)
+		goto fmap_builder_finalize_exit;
+
+	for (i = 0; i < builder->nareas; i++) {
+		memcpy(&offset, &builder->areas[i].offset, sizeof(offset));
+		memcpy(&size, &builder->areas[i].size, sizeof(size));
+
+		/* areas must lie within the firmware image */
+		if ((uint64_t)offset + size > builder->size) {
+			fprintf(stderr, "area \"%.*s\" at 0x%08x+0x%x exceeds "
+			        "firmware size 0x%x\n", FMAP_STRLEN,
+			        builder->areas[i].name, offset, size,
+			        builder->size);
+			goto fmap_builder_finalize_exit;
 		}
-	}
 
-	return str;
-}
-
-/* allocate and initialize a new fmap structure */
-struct fmap *fmap_create(uint64_t base, uint32_t size, uint8_t *name)
-{
-	struct fmap *fmap;
+		order[i].offset = offset;
+		order[i].index = i;
+	}
+	qsort(order, builder->nareas, sizeof(*order), fmap_builder_order_cmp);
 
-	fmap = malloc(sizeof(*fmap));
+	fmap = fmap_alloc(builder->nareas);
 	if (!fmap)
-		return NULL;
+		goto fmap_builder_finalize_exit;
 
 	memset(fmap, 0, sizeof(*fmap));
 	memcpy(&fmap->signature, FMAP_SIGNATURE, strlen(FMAP_SIGNATURE));
 	fmap->ver_major = VERSION_MAJOR;
 	fmap->ver_minor = VERSION_MINOR;
-	fmap->base = base;
-	fmap->size = size;
-	memccpy(&fmap->name, name, '\0', FMAP_STRLEN);
-
+	fmap->base = builder->base;
+	fmap->size = builder->size;
+	memcpy(&fmap->name, builder->name, FMAP_STRLEN);
+	fmap->nareas = builder->nareas;
+	for (i = 0; i < builder->nareas; i++)
+		fmap->areas[i] = builder->areas[order[i].index];
+
+fmap_builder_finalize_exit:
+	free(order);
+	fmap_builder_destroy(builder);
 	return fmap;
 }
 
+struct fmap *fmap_create(uint64_t base, uint32_t size, uint8_t *name)
+{
+	return fmap_builder_finalize(fmap_builder_create(base, size, name));
+}
+
 /* free memory used by an fmap structure */
 void fmap_destroy(struct fmap *fmap) {
 	free(fmap);
@@ -322,7 +1852,9 @@ int fmap_append_area(struct fmap **fmap,
                      const uint8_t *name, uint16_t flags)
 {
 	struct fmap_area *area;
+	struct fmap *tmp;
 	int orig_size, new_size;
+	size_t capacity;
 
 	if ((fmap == NULL || *fmap == NULL) || (name == NULL))
 		return -1;
@@ -334,16 +1866,17 @@ int fmap_append_area(struct fmap **fmap,
 	orig_size = fmap_size(*fmap);
 	new_size = orig_size + sizeof(*area);
 
-	*fmap = realloc(*fmap, new_size);
-	if (*fmap == NULL)
-		return -1;
+	/* only grow when the area count crosses a power of 2 */
+	capacity = fmap_area_capacity((*fmap)->nareas + 1);
+	if (capacity > fmap_area_capacity((*fmap)->nareas)) {
+		tmp = realloc(*fmap, sizeof(*tmp) + capacity * sizeof(*area));
+		if (tmp == NULL)
+			return -1;
+		*fmap = tmp;
+	}
 
 	area = (struct fmap_area *)((uint8_t *)*fmap + orig_size);
-	memset(area, 0, sizeof(*area));
-	memcpy(&area->offset, &offset, sizeof(area->offset));
-	memcpy(&area->size, &size, sizeof(area->size));
-	memccpy(&area->name, name, '\0', FMAP_STRLEN);
-	memcpy(&area->flags, &flags, sizeof(area->flags));
+	fmap_area_init(area, offset, size, name, flags);
 
 	(*fmap)->nareas++;
 	return new_size;
@@ -433,7 +1966,8 @@ static int fmap_print_test(struct fmap *fmap)
 
 static int fmap_get_csum_test(struct fmap *fmap)
 {
-	uint8_t *digest = NULL, *image = NULL;
+	uint8_t *digest = NULL, *expected = NULL, *image = NULL, *zeroes;
+	uint8_t sha256[SHA256_DIGEST_SIZE];
 	/* assume 0x100-0x10100 is marked "static" and is filled with 0x00 */
 	int image_size = 0x20000;
 	uint8_t csum[SHA_DIGEST_SIZE] = {
@@ -460,32 +1994,464 @@ static int fmap_get_csum_test(struct fmap *fmap)
 		printf("FAILURE: checksum is incorrect\n");
 		goto fmap_get_csum_test_exit;
 	}
+	free(digest);
+	digest = NULL;
+
+	/* the static area is 64KB of zeroes */
+	zeroes = calloc(0x10000, 1);
+	SHA256(zeroes, 0x10000, sha256);
+	free(zeroes);
+	if ((fmap_get_csum_digest(image, image_size,
+	                          fmap_find(image, image_size),
+	                          &fmap_digest_sha256, FMAP_CSUM_LEGACY,
+	                          &digest) != SHA256_DIGEST_SIZE) ||
+	    memcmp(digest, sha256, SHA256_DIGEST_SIZE)) {
+		printf("FAILURE: SHA-256 checksum is incorrect\n");
+		goto fmap_get_csum_test_exit;
+	}
+	free(digest);
+	digest = NULL;
+
+	/* stray signatures, one more aligned, must not hide the fmap */
+	memset(image, 0, image_size);
+	memcpy(&image[0x100], FMAP_SIGNATURE, FMAP_SIG_LEN);
+	memset(&image[0x10000], 0xff, 0x100);
+	memcpy(&image[0x10000], FMAP_SIGNATURE, FMAP_SIG_LEN);
+	memcpy(&image[0x18000], fmap, fmap_size(fmap));
+	if ((fmap_get_csum(image, image_size, &digest) != SHA_DIGEST_SIZE) ||
+	    (fmap_get_csum_at(image, image_size, 0x18000,
+	                      &expected) != SHA_DIGEST_SIZE) ||
+	    memcmp(digest, expected, SHA_DIGEST_SIZE)) {
+		printf("FAILURE: checksum did not use fmap after stray "
+		       "signatures\n");
+		goto fmap_get_csum_test_exit;
+	}
+
+	status = pass;
+fmap_get_csum_test_exit:
+	free(image);
+	free(digest);
+	free(expected);
+	return status;
+}
+
+static int fmap_get_csum_batch_test(struct fmap *fmap)
+{
+	enum { NIMAGES = 11, IMAGE_SIZE = 0x20000 };
+	uint8_t *images[NIMAGES] = { NULL };
+	unsigned int lens[NIMAGES];
+	uint8_t *digests[NIMAGES] = { NULL };
+	uint8_t *expected = NULL;
+	struct fmap *bad = NULL;
+	int i, j;
+
+	status = fail;
+
+	if (fmap_get_csum_batch(NULL, lens, NIMAGES, digests) >= 0) {
+		printf("FAILURE: failed to abort on NULL pointer input\n");
+		goto fmap_get_csum_batch_test_exit;
+	}
+
+	/* more images than lanes, each with different static contents */
+	for (i = 0; i < NIMAGES; i++) {
+		lens[i] = IMAGE_SIZE;
+		images[i] = malloc(lens[i]);
+		for (j = 0; j < lens[i]; j++)
+			images[i][j] = i * 31 + j;
+		memcpy(images[i], fmap, fmap_size(fmap));
+	}
+
+	if (fmap_get_csum_batch((const uint8_t *const *)images, lens,
+	                        NIMAGES, digests) != SHA_DIGEST_SIZE) {
+		printf("FAILURE: failed to calculate batch checksums\n");
+		goto fmap_get_csum_batch_test_exit;
+	}
+
+	for (i = 0; i < NIMAGES; i++) {
+		if (fmap_get_csum(images[i], lens[i], &expected) < 0 ||
+		    memcmp(digests[i], expected, SHA_DIGEST_SIZE)) {
+			printf("FAILURE: batch checksum %d is incorrect\n", i);
+			goto fmap_get_csum_batch_test_exit;
+		}
+		free(expected);
+		expected = NULL;
+		free(digests[i]);
+		digests[i] = NULL;
+	}
+
+	/* an image without an fmap fails without spoiling the others */
+	memset(images[3], 0, fmap_size(fmap));
+	if (fmap_get_csum_batch((const uint8_t *const *)images, lens,
+	                        NIMAGES, digests) >= 0) {
+		printf("FAILURE: failed to report image without fmap\n");
+		goto fmap_get_csum_batch_test_exit;
+	}
+	if (digests[3] != NULL) {
+		printf("FAILURE: digest returned for image without fmap\n");
+		goto fmap_get_csum_batch_test_exit;
+	}
+	if (fmap_get_csum(images[4], lens[4], &expected) < 0 ||
+	    digests[4] == NULL ||
+	    memcmp(digests[4], expected, SHA_DIGEST_SIZE)) {
+		printf("FAILURE: batch checksum is incorrect after error\n");
+		goto fmap_get_csum_batch_test_exit;
+	}
+	for (i = 0; i < NIMAGES; i++) {
+		free(digests[i]);
+		digests[i] = NULL;
+	}
+	free(expected);
+	expected = NULL;
+
+	/* an area whose end wraps around 32 bits must be rejected */
+	bad = fmap_create(0, IMAGE_SIZE, (uint8_t *)"wrap");
+	fmap_append_area(&bad, 0xfffff000, 0x2000, (const uint8_t *)"WRAP",
+	                 FMAP_AREA_STATIC);
+	memcpy(images[5], bad, fmap_size(bad));
+	if (fmap_get_csum_batch((const uint8_t *const *)images, lens,
+	                        NIMAGES, digests) >= 0 ||
+	    digests[5] != NULL) {
+		printf("FAILURE: failed to reject area wrapping around\n");
+		goto fmap_get_csum_batch_test_exit;
+	}
+
+	status = pass;
+fmap_get_csum_batch_test_exit:
+	fmap_destroy(bad);
+	free(expected);
+	for (i = 0; i < NIMAGES; i++) {
+		free(images[i]);
+		free(digests[i]);
+	}
+	return status;
+}
+
+static int fmap_get_area_csums_test(void)
+{
+	const struct {
+		uint32_t offset, size;
+		const char *name;
+		uint16_t flags;
+	} areas[] = {
+		{ 0x1000, 0x3000, "A", FMAP_AREA_STATIC },
+		{ 0x4000, 0x1000, "B", 0 },
+		{ 0x5000, 0x0800, "C", FMAP_AREA_STATIC | FMAP_AREA_RO },
+		{ 0x6000, 0x2000, "D", FMAP_AREA_STATIC },
+		{ 0x8000, 0x0000, "E", FMAP_AREA_RO },
+	};
+	int image_size = 0x10000;
+	uint8_t *image = NULL;
+	struct fmap *fmap = NULL;
+	struct fmap_area_csum *csums = NULL;
+	uint8_t root[SHA_DIGEST_SIZE], expected[SHA_DIGEST_SIZE];
+	uint8_t node[1 + 2 * SHA_DIGEST_SIZE], leaf[1 + SHA_DIGEST_SIZE];
+	uint8_t leaves[3][SHA_DIGEST_SIZE];
+	int i, nthreads;
+
+	status = fail;
+
+	fmap = fmap_create(0, image_size, (uint8_t *)"test");
+	for (i = 0; i < ARRAY_SIZE(areas); i++) {
+		if (fmap_append_area(&fmap, areas[i].offset, areas[i].size,
+		                     (const uint8_t *)areas[i].name,
+		                     areas[i].flags) < 0) {
+			printf("FAILURE: failed to append area\n");
+			goto fmap_get_area_csums_test_exit;
+		}
+	}
+
+	image = malloc(image_size);
+	for (i = 0; i < image_size; i++)
+		image[i] = i * 13 + (i >> 9);
+	memcpy(image, fmap, fmap_size(fmap));
+
+	if (fmap_get_area_csums(NULL, image_size, 0, NULL, 0, 1,
+	                        &csums, root) >= 0 ||
+	    fmap_get_area_csums(image, image_size, -1, NULL, 0, 1,
+	                        &csums, root) >= 0) {
+		printf("FAILURE: failed to abort on invalid input\n");
+		goto fmap_get_area_csums_test_exit;
+	}
+
+	/*
+	 * A, C and D are static, with leaves L(x) = H(0 || x):
+	 * root = H(1 || H(1 || L(A) || L(C)) || L(D))
+	 */
+	for (nthreads = 0; nthreads <= 3; nthreads++) {
+		if (fmap_get_area_csums(image, image_size, 0, NULL,
+		                        FMAP_AREA_STATIC, nthreads,
+		                        &csums, root) != 3) {
+			printf("FAILURE: failed to get area checksums\n");
+			goto fmap_get_area_csums_test_exit;
+		}
+
+		for (i = 0; i < 3; i++) {
+			int area = csums[i].area;
+
+			SHA(image + areas[area].offset, areas[area].size,
+			    expected);
+			if ((area != (int[]){ 0, 2, 3 }[i]) ||
+			    memcmp(csums[i].digest, expected,
+			           SHA_DIGEST_SIZE)) {
+				printf("FAILURE: area checksum %d is "
+				       "incorrect\n", i);
+				goto fmap_get_area_csums_test_exit;
+			}
+		}
+
+		for (i = 0; i < 3; i++) {
+			leaf[0] = 0x00;
+			memcpy(leaf + 1, csums[i].digest, SHA_DIGEST_SIZE);
+			SHA(leaf, sizeof(leaf), leaves[i]);
+		}
+		node[0] = 0x01;
+		memcpy(node + 1, leaves[0], SHA_DIGEST_SIZE);
+		memcpy(node + 1 + SHA_DIGEST_SIZE, leaves[1], SHA_DIGEST_SIZE);
+		SHA(node, sizeof(node), node + 1);
+		memcpy(node + 1 + SHA_DIGEST_SIZE, leaves[2], SHA_DIGEST_SIZE);
+		SHA(node, sizeof(node), expected);
+		if (memcmp(root, expected, SHA_DIGEST_SIZE)) {
+			printf("FAILURE: merkle root is incorrect\n");
+			goto fmap_get_area_csums_test_exit;
+		}
+
+		free(csums);
+		csums = NULL;
+	}
+
+	/* no flags selects every area, including empty ones */
+	if (fmap_get_area_csums(image, image_size, 0, &fmap_digest_sha256,
+	                        0, 2, &csums, NULL) != ARRAY_SIZE(areas) ||
+	    csums[4].area != 4) {
+		printf("FAILURE: failed to checksum all areas\n");
+		goto fmap_get_area_csums_test_exit;
+	}
+	free(csums);
+	csums = NULL;
+
+	/* areas past the end of the image are rejected */
+	if (fmap_get_area_csums(image, 0x7000, 0, NULL, FMAP_AREA_STATIC, 1,
+	                        &csums, root) >= 0) {
+		printf("FAILURE: failed to detect area out of bounds\n");
+		goto fmap_get_area_csums_test_exit;
+	}
+
+	status = pass;
+fmap_get_area_csums_test_exit:
+	free(csums);
+	free(image);
+	fmap_destroy(fmap);
+	return status;
+}
+
+static int fmap_plan_extents_test(void)
+{
+	/* unsorted, overlapping, touching, nested, empty and non-static */
+	const struct {
+		uint32_t offset, size;
+		uint16_t flags;
+	} areas[] = {
+		{ 0x6000, 0x1000, FMAP_AREA_STATIC },
+		{ 0x1000, 0x2000, FMAP_AREA_STATIC },
+		{ 0x2800, 0x1000, FMAP_AREA_STATIC | FMAP_AREA_RO },
+		{ 0x3800, 0x0800, FMAP_AREA_STATIC },
+		{ 0x5000, 0x0800, 0 },
+		{ 0x6100, 0x0100, FMAP_AREA_STATIC },
+		{ 0x7800, 0x0000, FMAP_AREA_STATIC },
+		{ 0x8000, 0x0400, FMAP_AREA_STATIC },
+	};
+	const struct fmap_extent expected_extents[] = {
+		{ 0x1000, 0x3000 },
+		{ 0x6000, 0x1000 },
+		{ 0x8000, 0x0400 },
+	};
+	int image_size = 0x10000;
+	uint8_t *image = NULL, *digest = NULL, *legacy = NULL;
+	uint8_t expected[SHA_DIGEST_SIZE];
+	struct fmap *fmap = NULL;
+	struct fmap_extent *extents = NULL;
+	SHA_CTX ctx;
+	int i, n;
+
+	status = fail;
+
+	fmap = fmap_create(0, image_size, (uint8_t *)"plan");
+	for (i = 0; i < ARRAY_SIZE(areas); i++)
+		fmap_append_area(&fmap, areas[i].offset, areas[i].size,
+		                 (const uint8_t *)"area", areas[i].flags);
+
+	if (fmap_plan_extents(NULL, 0, &extents) >= 0) {
+		printf("FAILURE: failed to abort on NULL pointer input\n");
+		goto fmap_plan_extents_test_exit;
+	}
+
+	n = fmap_plan_extents(fmap, FMAP_AREA_STATIC, &extents);
+	if ((n != ARRAY_SIZE(expected_extents)) ||
+	    memcmp(extents, expected_extents, sizeof(expected_extents))) {
+		printf("FAILURE: static extents are incorrect\n");
+		goto fmap_plan_extents_test_exit;
+	}
+	free(extents);
+	extents = NULL;
+
+	/* every area but the empty one is covered when selecting all */
+	n = fmap_plan_extents(fmap, 0, &extents);
+	if ((n != 4) || (extents[1].offset != 0x5000) ||
+	    (extents[1].size != 0x0800)) {
+		printf("FAILURE: extents of all areas are incorrect\n");
+		goto fmap_plan_extents_test_exit;
+	}
+	free(extents);
+	extents = NULL;
+
+	image = malloc(image_size);
+	for (i = 0; i < image_size; i++)
+		image[i] = i * 5 + (i >> 8);
+	memcpy(image, fmap, fmap_size(fmap));
+
+	/* the coalesced digest covers each static byte once, in order */
+	SHA_init(&ctx);
+	for (i = 0; i < ARRAY_SIZE(expected_extents); i++)
+		SHA_update(&ctx, image + expected_extents[i].offset,
+		           expected_extents[i].size);
+	memcpy(expected, SHA_final(&ctx), SHA_DIGEST_SIZE);
+
+	if ((fmap_get_csum_digest(image, image_size, 0, NULL,
+	                          FMAP_CSUM_COALESCED, &digest) !=
+	     SHA_DIGEST_SIZE) ||
+	    memcmp(digest, expected, SHA_DIGEST_SIZE)) {
+		printf("FAILURE: coalesced checksum is incorrect\n");
+		goto fmap_plan_extents_test_exit;
+	}
+
+	/* the legacy digest hashes the table as it is */
+	if ((fmap_get_csum(image, image_size, &legacy) != SHA_DIGEST_SIZE) ||
+	    !memcmp(legacy, digest, SHA_DIGEST_SIZE)) {
+		printf("FAILURE: legacy checksum is not independent\n");
+		goto fmap_plan_extents_test_exit;
+	}
+
+	status = pass;
+fmap_plan_extents_test_exit:
+	free(legacy);
+	free(digest);
+	free(extents);
+	free(image);
+	fmap_destroy(fmap);
+	return status;
+}
+
+static int fmap_size_test(struct fmap *fmap)
+{
+	status = fail;
+
+	if (fmap_size(NULL) >= 0) {
+		printf("FAILURE: failed to abort on NULL pointer input\n");
+		goto fmap_size_test_exit;
+	}
 
 	status = pass;
-fmap_get_csum_test_exit:
-	free(image);
-	free(digest);
+fmap_size_test_exit:
 	return status;
 }
 
-static int fmap_size_test(struct fmap *fmap)
+static int fmap_builder_test(void)
 {
+	struct fmap_builder *builder;
+	struct fmap *fmap = NULL;
+	struct fmap_area areas[256];
+	int i, j, n = 0;
+
 	status = fail;
 
-	if (fmap_size(NULL) >= 0) {
+	if (fmap_builder_create(0, 0, NULL) ||
+	    (fmap_builder_append_area(NULL, 0, 0, (const uint8_t *)"x", 0) >= 0) ||
+	    (fmap_builder_append_areas(NULL, areas, 1) >= 0) ||
+	    fmap_builder_finalize(NULL)) {
 		printf("FAILURE: failed to abort on NULL pointer input\n");
-		goto fmap_size_test_exit;
+		goto fmap_builder_test_exit;
+	}
+
+	/* fill to the limit in bulk, highest offsets first */
+	builder = fmap_builder_create(0x1000, 0xffff * 0x10,
+	                              (const uint8_t *)"builder");
+	for (i = 0; i < 0xffff; i += j) {
+		for (j = 0; j < 256 && i + j < 0xffff; j++) {
+			memset(&areas[j], 0, sizeof(areas[j]));
+			areas[j].offset = (0xffff - 1 - i - j) * 0x10;
+			areas[j].size = 0x10;
+			snprintf((char *)areas[j].name, FMAP_STRLEN,
+			         "AREA_%05x", 0xffff - 1 - i - j);
+		}
+		n = fmap_builder_append_areas(builder, areas, j);
+		if (n != i + j) {
+			printf("FAILURE: failed to append areas\n");
+			fmap_builder_destroy(builder);
+			goto fmap_builder_test_exit;
+		}
+	}
+	if ((fmap_builder_append_area(builder, 0, 0,
+	                              (const uint8_t *)"extra", 0) >= 0) ||
+	    (fmap_builder_append_areas(builder, areas, 1) >= 0)) {
+		printf("FAILURE: failed to detect too many areas\n");
+		fmap_builder_destroy(builder);
+		goto fmap_builder_test_exit;
+	}
+
+	fmap = fmap_builder_finalize(builder);
+	if (!fmap || fmap->nareas != 0xffff || fmap->base != 0x1000 ||
+	    strcmp((char *)fmap->name, "builder")) {
+		printf("FAILURE: failed to finalize fmap\n");
+		goto fmap_builder_test_exit;
+	}
+	for (i = 0; i < fmap->nareas; i++) {
+		char name[FMAP_STRLEN];
+
+		snprintf(name, sizeof(name), "AREA_%05x", i);
+		if (fmap->areas[i].offset != i * 0x10 ||
+		    strcmp((char *)fmap->areas[i].name, name)) {
+			printf("FAILURE: areas not sorted by offset\n");
+			goto fmap_builder_test_exit;
+		}
+	}
+	fmap_destroy(fmap);
+
+	/* equal offsets keep their order, areas past the end are refused */
+	builder = fmap_builder_create(0, 0x1000, (const uint8_t *)"order");
+	fmap_builder_append_area(builder, 0x100, 0x10,
+	                         (const uint8_t *)"second", 0);
+	fmap_builder_append_area(builder, 0, 0x1000, (const uint8_t *)"all", 0);
+	fmap_builder_append_area(builder, 0x100, 0x20,
+	                         (const uint8_t *)"third", 0);
+	fmap = fmap_builder_finalize(builder);
+	if (!fmap || strcmp((char *)fmap->areas[0].name, "all") ||
+	    strcmp((char *)fmap->areas[1].name, "second") ||
+	    strcmp((char *)fmap->areas[2].name, "third")) {
+		printf("FAILURE: finalize reordered equal offsets\n");
+		goto fmap_builder_test_exit;
+	}
+	fmap_destroy(fmap);
+
+	builder = fmap_builder_create(0, 0x1000, (const uint8_t *)"bounds");
+	fmap_builder_append_area(builder, 0xf00, 0x101,
+	                         (const uint8_t *)"overflow", 0);
+	fmap = fmap_builder_finalize(builder);
+	if (fmap) {
+		printf("FAILURE: failed to reject area past end of image\n");
+		goto fmap_builder_test_exit;
 	}
 
 	status = pass;
-fmap_size_test_exit:
+fmap_builder_test_exit:
+	fmap_destroy(fmap);
 	return status;
 }
 
 /* this test re-allocates the fmap, so it gets a double-pointer */
 static int fmap_append_area_test(struct fmap **fmap)
 {
-	int total_size;
+	struct fmap *big = NULL;
+	int total_size, i;
 	uint16_t nareas_orig;
 	/* test_area will be used by fmap_csum_test and find_area_test */
 	struct fmap_area test_area = {
@@ -527,8 +2493,28 @@ static int fmap_append_area_test(struct fmap **fmap)
 		goto fmap_append_area_test_exit;
 	}
 
+	/* areas survive the structure growing across powers of 2 */
+	big = fmap_create(0, 0x100000, (uint8_t *)"big");
+	for (i = 0; big && i < 1000; i++) {
+		if (fmap_append_area(&big, i * 0x100, 0x100,
+		                     (const uint8_t *)"area", 0) !=
+		    sizeof(*big) + (i + 1) * sizeof(test_area)) {
+			printf("FAILURE: failed to append area %d\n", i);
+			goto fmap_append_area_test_exit;
+		}
+	}
+	for (i = 0; big && i < 1000; i++) {
+		if (big->areas[i].offset != i * 0x100)
+			break;
+	}
+	if (!big || big->nareas != 1000 || i != 1000) {
+		printf("FAILURE: areas lost while appending\n");
+		goto fmap_append_area_test_exit;
+	}
+
 	status = pass;
 fmap_append_area_test_exit:
+	fmap_destroy(big);
 	return status;
 }
 
@@ -610,6 +2596,76 @@ fmap_flags_to_string_test_exit:
 
 }
 
+/* compare each available scanner against a naive search */
+static int fmap_scan_test(void)
+{
+	fmap_scan_fn scanners[] = {
+		fmap_scan_scalar,
+#ifdef FMAP_SCAN_HAVE_SIMD
+		fmap_scan_sse2,
+		fmap_scan_avx2,
+#endif
+	};
+	uint8_t buf[160];
+	size_t len, offset, i;
+
+	status = fail;
+
+	for (i = 0; i < ARRAY_SIZE(scanners); i++) {
+#ifdef FMAP_SCAN_HAVE_SIMD
+		if (scanners[i] == fmap_scan_avx2 &&
+		    !__builtin_cpu_supports("avx2"))
+			continue;
+#endif
+		/* decoys: partial signatures everywhere */
+		for (offset = 0; offset < sizeof(buf); offset++)
+			buf[offset] = "__FMAP_X"[offset % 8];
+
+		if (scanners[i](buf, sizeof(buf), 0) >= 0) {
+			printf("FAILURE: scanner %zu returned false positive\n",
+			       i);
+			goto fmap_scan_test_exit;
+		}
+
+		/* images shorter than the signature */
+		for (len = 0; len < FMAP_SIG_LEN; len++) {
+			if (scanners[i](buf, len, 0) >= 0) {
+				printf("FAILURE: scanner %zu overran %zu-byte "
+				       "image\n", i, len);
+				goto fmap_scan_test_exit;
+			}
+		}
+
+		/* signature at every possible offset */
+		for (offset = 0;
+		     offset + FMAP_SIG_LEN <= sizeof(buf); offset++) {
+			memset(buf, '_', sizeof(buf));
+			memcpy(&buf[offset], FMAP_SIGNATURE, FMAP_SIG_LEN);
+
+			if (scanners[i](buf, sizeof(buf), 0) != offset) {
+				printf("FAILURE: scanner %zu missed signature "
+				       "at offset %zu\n", i, offset);
+				goto fmap_scan_test_exit;
+			}
+			if (scanners[i](buf, sizeof(buf), offset + 1) >= 0) {
+				printf("FAILURE: scanner %zu ignored start "
+				       "offset %zu\n", i, offset + 1);
+				goto fmap_scan_test_exit;
+			}
+			/* truncated by one byte */
+			if (scanners[i](buf, offset + FMAP_SIG_LEN - 1, 0) >= 0) {
+				printf("FAILURE: scanner %zu matched truncated "
+				       "signature at offset %zu\n", i, offset);
+				goto fmap_scan_test_exit;
+			}
+		}
+	}
+
+	status = pass;
+fmap_scan_test_exit:
+	return status;
+}
+
 static int fmap_find_test(struct fmap *fmap)
 {
 	uint8_t *buf;
@@ -664,6 +2720,35 @@ static int fmap_find_test(struct fmap *fmap)
 		goto fmap_find_test_exit;
 	}
 
+	/* both prefer the most aligned of several fmaps */
+	memset(buf, 0, total_size);
+	memcpy(&buf[0x1003], fmap, fmap_size(fmap));
+	memcpy(&buf[0x2010], fmap, fmap_size(fmap));
+	if (fmap_find(buf, total_size) != 0x2010) {
+		printf("FAILURE: bsearch did not pick most aligned fmap\n");
+		goto fmap_find_test_exit;
+	}
+	if (fmap_find(buf, total_size - 1) != 0x2010) {
+		printf("FAILURE: lsearch did not pick most aligned fmap\n");
+		goto fmap_find_test_exit;
+	}
+
+	/* stray signatures before the fmap, even more aligned ones */
+	memset(buf, 0, total_size);
+	memcpy(&buf[0x100], FMAP_SIGNATURE, FMAP_SIG_LEN);
+	memset(&buf[0x100 + FMAP_SIG_LEN], 0xff, 0x40);
+	memcpy(&buf[0x1000], fmap, fmap_size(fmap));
+	((struct fmap *)&buf[0x1000])->nareas = 0xffff;
+	memcpy(&buf[0x2345], fmap, fmap_size(fmap));
+	if (fmap_find(buf, total_size) != 0x2345) {
+		printf("FAILURE: bsearch did not skip stray signatures\n");
+		goto fmap_find_test_exit;
+	}
+	if (fmap_find(buf, total_size - 1) != 0x2345) {
+		printf("FAILURE: lsearch did not skip stray signatures\n");
+		goto fmap_find_test_exit;
+	}
+
 	/* test overrun detection */
 	memset(buf, 0, total_size);
 	memcpy(&buf[total_size - fmap_size(fmap) + 1],
@@ -684,6 +2769,648 @@ fmap_find_test_exit:
 	return status;
 }
 
+static int fmap_find_parallel_test(struct fmap *fmap)
+{
+	uint8_t *buf;
+	size_t total_size, offset;
+	struct fmap *bogus;
+	int nthreads;
+
+	status = fail;
+
+	total_size = FMAP_FIND_CHUNK_SIZE * 4 + 1;
+	buf = calloc(total_size, 1);
+
+	if (fmap_find_parallel(NULL, total_size, 4) >= 0 ||
+	    fmap_find_parallel(buf, 0, 4) >= 0 ||
+	    fmap_find_parallel(buf, total_size, -1) >= 0) {
+		printf("FAILURE: failed to abort on invalid input\n");
+		goto fmap_find_parallel_test_exit;
+	}
+
+	for (nthreads = 0; nthreads <= 8; nthreads++) {
+		memset(buf, 0, total_size);
+		if (fmap_find_parallel(buf, total_size, nthreads) >= 0) {
+			printf("FAILURE: returned false positive\n");
+			goto fmap_find_parallel_test_exit;
+		}
+
+		/* signature straddles the boundary between two chunks */
+		offset = FMAP_FIND_CHUNK_SIZE * 2 - 3;
+		memcpy(&buf[offset], fmap, fmap_size(fmap));
+		if (fmap_find_parallel(buf, total_size, nthreads) != offset) {
+			printf("FAILURE: failed to find fmap across chunks "
+			       "with %d threads\n", nthreads);
+			goto fmap_find_parallel_test_exit;
+		}
+
+		/* a later fmap must not win over an earlier one */
+		memcpy(&buf[total_size - fmap_size(fmap)],
+		       fmap, fmap_size(fmap));
+		if (fmap_find_parallel(buf, total_size, nthreads) != offset) {
+			printf("FAILURE: did not return lowest offset "
+			       "with %d threads\n", nthreads);
+			goto fmap_find_parallel_test_exit;
+		}
+
+		/* like fmap_find(), an earlier fmap which overruns is
+		   skipped */
+		memcpy(&buf[16], fmap, fmap_size(fmap));
+		bogus = (struct fmap *)&buf[16];
+		bogus->nareas = 0xffff;
+		memcpy(&buf[0x800], fmap, fmap_size(fmap));
+		if (fmap_find(buf, 0x1001) != 0x800 ||
+		    fmap_find_parallel(buf, 0x1001, nthreads) != 0x800) {
+			printf("FAILURE: did not match fmap_find() with "
+			       "overrun and %d threads\n", nthreads);
+			goto fmap_find_parallel_test_exit;
+		}
+
+		/* the most aligned valid fmap wins, as in fmap_find() */
+		if (fmap_find_parallel(buf, 0x1000, nthreads) != 0x800) {
+			printf("FAILURE: failed to prefer aligned fmap with %d "
+			       "threads\n", nthreads);
+			goto fmap_find_parallel_test_exit;
+		}
+
+		/* ... also when it is in a later chunk and below any stride
+		   fmap_bsearch() probes */
+		memset(buf, 0, total_size);
+		memcpy(&buf[0x1003], fmap, fmap_size(fmap));
+		offset = FMAP_FIND_CHUNK_SIZE * 2 + 0x30;
+		memcpy(&buf[offset], fmap, fmap_size(fmap));
+		memcpy(&buf[FMAP_FIND_CHUNK_SIZE * 3 + 0x18], fmap,
+		       fmap_size(fmap));
+		if (fmap_find(buf, total_size - 1) != offset ||
+		    fmap_find_parallel(buf, total_size - 1, nthreads) !=
+		    offset) {
+			printf("FAILURE: did not match fmap_find() in power "
+			       "of 2 image with %d threads\n", nthreads);
+			goto fmap_find_parallel_test_exit;
+		}
+	}
+
+	status = pass;
+fmap_find_parallel_test_exit:
+	free(buf);
+	return status;
+}
+
+static int fmap_find_all_test(struct fmap *fmap)
+{
+	uint8_t *buf;
+	size_t total_size = 0x10000;
+	struct fmap_candidate *candidates = NULL;
+	struct fmap *bad_bounds;
+	long int best;
+	int count;
+	const struct fmap_candidate expected[] = {
+		{ 0x13, FMAP_ERR_VERSION | FMAP_ERR_NAME |
+		        FMAP_ERR_AREAS_TRUNCATED },
+		{ 0x1000, 0 },
+		{ 0x3001, FMAP_ERR_AREA_BOUNDS },
+		{ 0x8000 - 0x20, 0 },
+		{ 0x10000 - 0x20, FMAP_ERR_HEADER_TRUNCATED },
+	};
+
+	status = fail;
+
+	buf = calloc(total_size, 1);
+
+	if (fmap_find_all(NULL, total_size, &candidates, &best) >= 0 ||
+	    fmap_find_all(buf, total_size, NULL, &best) >= 0) {
+		printf("FAILURE: failed to abort on NULL pointer input\n");
+		goto fmap_find_all_test_exit;
+	}
+
+	if (fmap_find_all(buf, total_size, &candidates, &best) != 0 ||
+	    best >= 0) {
+		printf("FAILURE: fmap_find_all returned false positive\n");
+		goto fmap_find_all_test_exit;
+	}
+	free(candidates);
+	candidates = NULL;
+
+	/* stray signature followed by garbage */
+	memset(&buf[0x13], 0xff, 0x100);
+	memcpy(&buf[0x13], FMAP_SIGNATURE, FMAP_SIG_LEN);
+
+	memcpy(&buf[0x1000], fmap, fmap_size(fmap));
+
+	memcpy(&buf[0x3001], fmap, fmap_size(fmap));
+	bad_bounds = (struct fmap *)&buf[0x3001];
+	bad_bounds->areas[0].size = bad_bounds->size;
+
+	/* valid, but less aligned than 0x1000 */
+	memcpy(&buf[0x8000 - 0x20], fmap, fmap_size(fmap));
+
+	memcpy(&buf[total_size - 0x20], FMAP_SIGNATURE, FMAP_SIG_LEN);
+
+	count = fmap_find_all(buf, total_size, &candidates, &best);
+	if (count != ARRAY_SIZE(expected)) {
+		printf("FAILURE: fmap_find_all found %d candidates, "
+		       "expected %zu\n", count, ARRAY_SIZE(expected));
+		goto fmap_find_all_test_exit;
+	}
+
+	for (count = 0; count < ARRAY_SIZE(expected); count++) {
+		if (candidates[count].offset != expected[count].offset ||
+		    candidates[count].errors != expected[count].errors) {
+			printf("FAILURE: candidate at 0x%lx has errors 0x%x, "
+			       "expected 0x%lx with errors 0x%x\n",
+			       candidates[count].offset,
+			       candidates[count].errors,
+			       expected[count].offset,
+			       expected[count].errors);
+			goto fmap_find_all_test_exit;
+		}
+	}
+
+	if (best != 0x1000) {
+		printf("FAILURE: fmap_find_all picked 0x%lx\n", best);
+		goto fmap_find_all_test_exit;
+	}
+
+	status = pass;
+fmap_find_all_test_exit:
+	free(candidates);
+	free(buf);
+	return status;
+}
+
+static int fmap_find_fd_test(struct fmap *fmap)
+{
+	uint8_t *buf;
+	size_t total_size = FMAP_FIND_WINDOW_SIZE * 3;
+	struct fmap *found = NULL;
+	FILE *fp = NULL;
+	int pipefd[2] = { -1, -1 };
+	unsigned int i;
+	const size_t offsets[] = {
+		0,
+		0x1234,
+		FMAP_FIND_WINDOW_SIZE - 3,	/* signature straddles windows */
+		FMAP_FIND_WINDOW_SIZE - 20,	/* header straddles windows */
+		FMAP_FIND_WINDOW_SIZE * 2 - sizeof(struct fmap) - 1,
+		total_size - fmap_size(fmap),
+	};
+
+	status = fail;
+
+	buf = calloc(total_size, 1);
+	fp = tmpfile();
+	if (!buf || !fp) {
+		printf("FAILURE: unable to set up fmap_find_fd test\n");
+		goto fmap_find_fd_test_exit;
+	}
+
+	if (fmap_find_fd(-1, &found) >= 0 ||
+	    fmap_find_fd(fileno(fp), NULL) >= 0) {
+		printf("FAILURE: failed to abort on invalid input\n");
+		goto fmap_find_fd_test_exit;
+	}
+
+	for (i = 0; i <= ARRAY_SIZE(offsets); i++) {
+		/* a signature which is not followed by a header is skipped */
+		memset(buf, 0, total_size);
+		memset(&buf[0x100], 0xff, 0x40);
+		memcpy(&buf[0x100], FMAP_SIGNATURE, FMAP_SIG_LEN);
+
+		if (i > 0)
+			memcpy(&buf[offsets[i - 1]], fmap, fmap_size(fmap));
+
+		if (ftruncate(fileno(fp), 0) ||
+		    pwrite(fileno(fp), buf, total_size, 0) != total_size) {
+			printf("FAILURE: unable to write test file\n");
+			goto fmap_find_fd_test_exit;
+		}
+
+		if (i == 0) {
+			if (fmap_find_fd(fileno(fp), &found) >= 0) {
+				printf("FAILURE: fmap_find_fd returned false "
+				       "positive\n");
+				goto fmap_find_fd_test_exit;
+			}
+			continue;
+		}
+
+		if (fmap_find_fd(fileno(fp), &found) != offsets[i - 1] ||
+		    memcmp(found, fmap, fmap_size(fmap))) {
+			printf("FAILURE: fmap_find_fd failed to find fmap at "
+			       "0x%zx\n", offsets[i - 1]);
+			goto fmap_find_fd_test_exit;
+		}
+
+		/* the fmap read can be extended like any other */
+		if (fmap_append_area(&found, 0, 0x10,
+		                     (const uint8_t *)"extra", 0) < 0 ||
+		    found->nareas != fmap->nareas + 1) {
+			printf("FAILURE: unable to append to fmap read\n");
+			goto fmap_find_fd_test_exit;
+		}
+		fmap_destroy(found);
+		found = NULL;
+	}
+
+	/* truncated area table */
+	if (ftruncate(fileno(fp), total_size - 1) ||
+	    fmap_find_fd(fileno(fp), &found) >= 0) {
+		printf("FAILURE: fmap_find_fd failed to catch overrun\n");
+		goto fmap_find_fd_test_exit;
+	}
+
+	/* pipes can not be seeked, so the fmap must be found using read(),
+	   and the most aligned one is still preferred */
+	memset(buf, 0, 0x4000);
+	memcpy(&buf[0x1003], fmap, fmap_size(fmap));
+	memcpy(&buf[0x2340], fmap, fmap_size(fmap));
+	if (pipe(pipefd) || write(pipefd[1], buf, 0x4000) != 0x4000) {
+		printf("FAILURE: unable to write test pipe\n");
+		goto fmap_find_fd_test_exit;
+	}
+	close(pipefd[1]);
+	pipefd[1] = -1;
+
+	if (fmap_find_fd(pipefd[0], &found) != 0x2340 ||
+	    memcmp(found, fmap, fmap_size(fmap))) {
+		printf("FAILURE: fmap_find_fd failed to find fmap in pipe\n");
+		goto fmap_find_fd_test_exit;
+	}
+	fmap_destroy(found);
+	found = NULL;
+
+	/* a header whose area table runs past the end is passed over */
+	memset(buf, 0, 0x5000);
+	memcpy(&buf[0x100], fmap, sizeof(*fmap));
+	((struct fmap *)&buf[0x100])->nareas = 1000;
+	memcpy(&buf[0x2345], fmap, fmap_size(fmap));
+	if (ftruncate(fileno(fp), 0) ||
+	    pwrite(fileno(fp), buf, 0x5000, 0) != 0x5000) {
+		printf("FAILURE: unable to write test file\n");
+		goto fmap_find_fd_test_exit;
+	}
+	if (fmap_find_fd(fileno(fp), &found) != 0x2345) {
+		printf("FAILURE: fmap_find_fd stopped at truncated fmap\n");
+		goto fmap_find_fd_test_exit;
+	}
+	fmap_destroy(found);
+	found = NULL;
+
+	/* aligned fmaps are found by probing, as fmap_find() does */
+	memset(buf, 0, 0x100000);
+	memcpy(&buf[0x200], FMAP_SIGNATURE "\0 read fmap", 20);
+	memcpy(&buf[0x10000], fmap, fmap_size(fmap));
+	if (ftruncate(fileno(fp), 0) ||
+	    pwrite(fileno(fp), buf, 0x100000, 0) != 0x100000) {
+		printf("FAILURE: unable to write test file\n");
+		goto fmap_find_fd_test_exit;
+	}
+	if (fmap_find(buf, 0x100000) != 0x10000 ||
+	    fmap_find_fd(fileno(fp), &found) != 0x10000) {
+		printf("FAILURE: fmap_find_fd did not prefer aligned fmap\n");
+		goto fmap_find_fd_test_exit;
+	}
+	fmap_destroy(found);
+	found = NULL;
+
+	/*
+	 * A more aligned, invalid fmap must not be picked by any search, in
+	 * any image length: the most aligned valid fmap is used.
+	 */
+	memset(&buf[0x200], 0, FMAP_SIG_LEN);
+	((struct fmap *)&buf[0x10000])->nareas = 0xffff;
+	memcpy(&buf[0x4321], fmap, fmap_size(fmap));
+	memcpy(&buf[0x8010], fmap, fmap_size(fmap));
+	for (i = 0; i < 2; i++) {
+		size_t len = i ? 0xfff00 : 0x100000;
+
+		if (ftruncate(fileno(fp), 0) ||
+		    pwrite(fileno(fp), buf, len, 0) != len) {
+			printf("FAILURE: unable to write test file\n");
+			goto fmap_find_fd_test_exit;
+		}
+		if (fmap_find(buf, len) != 0x8010 ||
+		    fmap_find_parallel(buf, len, 2) != 0x8010 ||
+		    fmap_find_fd(fileno(fp), &found) != 0x8010) {
+			printf("FAILURE: searches disagree in a 0x%zx byte "
+			       "image\n", len);
+			goto fmap_find_fd_test_exit;
+		}
+		fmap_destroy(found);
+		found = NULL;
+	}
+
+	status = pass;
+fmap_find_fd_test_exit:
+	if (pipefd[0] >= 0)
+		close(pipefd[0]);
+	if (pipefd[1] >= 0)
+		close(pipefd[1]);
+	if (fp)
+		fclose(fp);
+	fmap_destroy(found);
+	free(buf);
+	return status;
+}
+
+/* build a map of nareas 0x100-byte areas, the first being FMAP at 0x1000 */
+static struct fmap *fmap_update_test_map(int nareas, int with_fmap_area)
+{
+	struct fmap_builder *builder;
+	char name[FMAP_STRLEN];
+	int i;
+
+	builder = fmap_builder_create(0, 0x10000, (uint8_t *)"update");
+	if (!builder)
+		return NULL;
+
+	if (with_fmap_area)
+		fmap_builder_append_area(builder, 0x1000, 0x800,
+		                         (uint8_t *)"FMAP", FMAP_AREA_STATIC);
+	for (i = 0; i < nareas; i++) {
+		snprintf(name, sizeof(name), "AREA_%d", i);
+		fmap_builder_append_area(builder, 0x2000 + i * 0x100, 0x100,
+		                         (uint8_t *)name, 0);
+	}
+
+	return fmap_builder_finalize(builder);
+}
+
+static int fmap_update_fd_test(void)
+{
+	size_t image_size = 0x10000;
+	uint8_t *image = NULL, *check = NULL;
+	struct fmap *old = NULL, *map = NULL, *found = NULL;
+	FILE *fp;
+	int fd;
+
+	status = fail;
+
+	image = malloc(image_size);
+	check = malloc(image_size);
+	fp = tmpfile();
+	old = fmap_update_test_map(4, 1);
+	if (!image || !check || !fp || !old) {
+		printf("FAILURE: unable to set up fmap_update_fd test\n");
+		goto fmap_update_fd_test_exit;
+	}
+	fd = fileno(fp);
+
+	memset(image, 0xff, image_size);
+	if (pwrite(fd, image, image_size, 0) != image_size) {
+		printf("FAILURE: unable to write test file\n");
+		goto fmap_update_fd_test_exit;
+	}
+
+	if (fmap_update_fd(-1, old, -1, 0) >= 0 ||
+	    fmap_update_fd(fd, NULL, -1, 0) >= 0) {
+		printf("FAILURE: failed to abort on invalid input\n");
+		goto fmap_update_fd_test_exit;
+	}
+
+	/* a stray signature is not taken for an fmap to replace */
+	memcpy(&image[0], FMAP_SIGNATURE, FMAP_SIG_LEN);
+	if (pwrite(fd, image, FMAP_SIG_LEN, 0) != FMAP_SIG_LEN ||
+	    fmap_update_fd(fd, old, -1, 0) != FMAP_UPDATE_ERR_NOT_FOUND ||
+	    fmap_update_fd(fd, old, 0, 0) != FMAP_UPDATE_ERR_NOT_FOUND) {
+		printf("FAILURE: fmap_update_fd replaced nonexistent fmap\n");
+		goto fmap_update_fd_test_exit;
+	}
+
+	/* explicit offset into an image without an fmap needs a size */
+	if (fmap_update_fd(fd, old, 0x1000, 0) != FMAP_UPDATE_ERR_NOT_FOUND ||
+	    fmap_update_fd(fd, old, image_size, 0x800) !=
+	    FMAP_UPDATE_ERR_NO_ROOM ||
+	    fmap_update_fd(fd, old, 0x1000, 0x100) !=
+	    FMAP_UPDATE_ERR_NO_ROOM ||
+	    fmap_update_fd(fd, old, 0x1000, 0x800) != 0x1000) {
+		printf("FAILURE: fmap_update_fd mishandled explicit offset\n");
+		goto fmap_update_fd_test_exit;
+	}
+	memcpy(&image[0x1000], old, fmap_size(old));
+
+	/* the FMAP area of the new map has to cover where it is stored */
+	if (fmap_update_fd(fd, old, 0x4000, 0x800) !=
+	    FMAP_UPDATE_ERR_NO_ROOM) {
+		printf("FAILURE: fmap_update_fd stored fmap outside its "
+		       "FMAP area\n");
+		goto fmap_update_fd_test_exit;
+	}
+
+	/* a larger map which fits the FMAP area replaces the old one */
+	map = fmap_update_test_map(20, 1);
+	if (!map || fmap_update_fd(fd, map, -1, 0) != 0x1000) {
+		printf("FAILURE: fmap_update_fd failed to replace fmap\n");
+		goto fmap_update_fd_test_exit;
+	}
+	memcpy(&image[0x1000], map, fmap_size(map));
+	fmap_destroy(map);
+
+	if (pread(fd, check, image_size, 0) != image_size ||
+	    memcmp(check, image, image_size) ||
+	    fmap_find_fd(fd, &found) != 0x1000 ||
+	    found->nareas != 21) {
+		printf("FAILURE: image differs after fmap_update_fd\n");
+		goto fmap_update_fd_test_exit;
+	}
+
+	/* 0x800 bytes hold no more than 47 areas */
+	map = fmap_update_test_map(60, 1);
+	if (!map || fmap_update_fd(fd, map, -1, 0) != FMAP_UPDATE_ERR_NO_ROOM) {
+		printf("FAILURE: fmap_update_fd overflowed FMAP area\n");
+		goto fmap_update_fd_test_exit;
+	}
+	fmap_destroy(map);
+
+	/* without an FMAP area, the old map itself is the limit */
+	map = fmap_update_test_map(21, 0);
+	if (!map || fmap_update_fd(fd, map, 0x1000, 0) != 0x1000) {
+		printf("FAILURE: fmap_update_fd failed to shrink fmap\n");
+		goto fmap_update_fd_test_exit;
+	}
+	fmap_destroy(map);
+	map = fmap_update_test_map(22, 0);
+	if (!map || fmap_update_fd(fd, map, -1, 0) != FMAP_UPDATE_ERR_NO_ROOM) {
+		printf("FAILURE: fmap_update_fd grew fmap without room\n");
+		goto fmap_update_fd_test_exit;
+	}
+	fmap_destroy(map);
+
+	/* an explicit size makes room, up to the new map's FMAP area */
+	map = fmap_update_test_map(60, 0);
+	if (!map || fmap_update_fd(fd, map, -1, 0x1000) != 0x1000) {
+		printf("FAILURE: fmap_update_fd ignored given size\n");
+		goto fmap_update_fd_test_exit;
+	}
+	fmap_destroy(map);
+	map = fmap_update_test_map(48, 1);
+	if (!map || fmap_update_fd(fd, map, -1, 0) != FMAP_UPDATE_ERR_NO_ROOM) {
+		printf("FAILURE: fmap_update_fd overflowed new FMAP area\n");
+		goto fmap_update_fd_test_exit;
+	}
+
+	status = pass;
+
+fmap_update_fd_test_exit:
+	if (fp)
+		fclose(fp);
+	fmap_destroy(found);
+	fmap_destroy(map);
+	fmap_destroy(old);
+	free(check);
+	free(image);
+	return status;
+}
+
+struct fmap_pipe_writer {
+	int fd;
+	const uint8_t *buf;
+	size_t len;
+};
+
+static void *fmap_pipe_writer(void *arg)
+{
+	struct fmap_pipe_writer *w = arg;
+	ssize_t ret;
+
+	/* the reader may stop early, so no SIGPIPE */
+	while (w->len) {
+		ret = send(w->fd, w->buf, w->len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		w->buf += ret;
+		w->len -= ret;
+	}
+	close(w->fd);
+	return NULL;
+}
+
+/* feed len bytes of image through a stream and checksum the other end */
+static int fmap_get_csum_pipe(const uint8_t *image, size_t len,
+                              enum fmap_csum_mode mode, uint8_t **digest)
+{
+	struct fmap_pipe_writer w;
+	pthread_t thread;
+	int pipefd[2], rc;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pipefd))
+		return -1;
+
+	w.fd = pipefd[1];
+	w.buf = image;
+	w.len = len;
+	if (pthread_create(&thread, NULL, fmap_pipe_writer, &w)) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -1;
+	}
+
+	rc = fmap_get_csum_fd(pipefd[0], NULL, mode, digest);
+
+	/* let the writer finish if the reader stopped early */
+	close(pipefd[0]);
+	pthread_join(thread, NULL);
+	return rc;
+}
+
+static int fmap_get_csum_fd_test(void)
+{
+	/* areas out of order, some before the fmap and spanning buffers */
+	const struct {
+		uint32_t offset, size;
+		uint16_t flags;
+	} areas[] = {
+		{ 0x400000, 0x1f0000, FMAP_AREA_STATIC },
+		{ 0x001000, 0x1ff000, FMAP_AREA_STATIC },
+		{ 0x200000, 0x100000, 0 },
+		{ 0x5f0000, 0x000123, FMAP_AREA_STATIC },
+	};
+	size_t image_size = 0x600000, fmap_offset = 0x300100;
+	uint8_t *image = NULL, *digest = NULL, *expected = NULL;
+	struct fmap *fmap = NULL;
+	FILE *fp = NULL;
+	size_t i;
+
+	status = fail;
+
+	if (fmap_get_csum_fd(-1, NULL, FMAP_CSUM_LEGACY, &digest) >= 0) {
+		printf("FAILURE: failed to abort on invalid input\n");
+		goto fmap_get_csum_fd_test_exit;
+	}
+
+	fmap = fmap_create(0, image_size, (uint8_t *)"stream");
+	for (i = 0; i < ARRAY_SIZE(areas); i++)
+		fmap_append_area(&fmap, areas[i].offset, areas[i].size,
+		                 (const uint8_t *)"area", areas[i].flags);
+	image = malloc(image_size);
+	for (i = 0; i < image_size; i++)
+		image[i] = i * 3 + (i >> 16);
+	memcpy(image + fmap_offset, fmap, fmap_size(fmap));
+
+	if (fmap_get_csum_at(image, image_size, fmap_offset,
+	                     &expected) != SHA_DIGEST_SIZE) {
+		printf("FAILURE: failed to calculate reference checksum\n");
+		goto fmap_get_csum_fd_test_exit;
+	}
+
+	fp = tmpfile();
+	if (!fp || fwrite(image, image_size, 1, fp) != 1 || fflush(fp)) {
+		printf("FAILURE: failed to write temporary file\n");
+		goto fmap_get_csum_fd_test_exit;
+	}
+	if ((fmap_get_csum_fd(fileno(fp), NULL, FMAP_CSUM_LEGACY,
+	                      &digest) != SHA_DIGEST_SIZE) ||
+	    memcmp(digest, expected, SHA_DIGEST_SIZE)) {
+		printf("FAILURE: streamed file checksum is incorrect\n");
+		goto fmap_get_csum_fd_test_exit;
+	}
+	free(digest);
+	digest = NULL;
+
+	if ((fmap_get_csum_pipe(image, image_size, FMAP_CSUM_LEGACY,
+	                        &digest) != SHA_DIGEST_SIZE) ||
+	    memcmp(digest, expected, SHA_DIGEST_SIZE)) {
+		printf("FAILURE: streamed pipe checksum is incorrect\n");
+		goto fmap_get_csum_fd_test_exit;
+	}
+	free(digest);
+	digest = NULL;
+	free(expected);
+	expected = NULL;
+
+	/* coalesced ranges, streamed front to back */
+	if ((fmap_get_csum_digest(image, image_size, fmap_offset, NULL,
+	                          FMAP_CSUM_COALESCED, &expected) !=
+	     SHA_DIGEST_SIZE) ||
+	    (fmap_get_csum_pipe(image, image_size, FMAP_CSUM_COALESCED,
+	                        &digest) != SHA_DIGEST_SIZE) ||
+	    memcmp(digest, expected, SHA_DIGEST_SIZE)) {
+		printf("FAILURE: streamed coalesced checksum is incorrect\n");
+		goto fmap_get_csum_fd_test_exit;
+	}
+	free(digest);
+	digest = NULL;
+
+	/* the last area is cut off */
+	if (fmap_get_csum_pipe(image, 0x5f0100, FMAP_CSUM_LEGACY,
+	                       &digest) >= 0) {
+		printf("FAILURE: failed to detect truncated stream\n");
+		goto fmap_get_csum_fd_test_exit;
+	}
+
+	status = pass;
+fmap_get_csum_fd_test_exit:
+	if (fp)
+		fclose(fp);
+	free(digest);
+	free(expected);
+	free(image);
+	fmap_destroy(fmap);
+	return status;
+}
+
 int fmap_test()
 {
 	int rc = EXIT_SUCCESS;
@@ -702,7 +3429,8 @@ int fmap_test()
 		goto fmap_test_exit;
 	}
 
-	if (fmap_find_test(my_fmap)) {
+	if (fmap_scan_test() || fmap_find_test(my_fmap) ||
+	    fmap_find_parallel_test(my_fmap)) {
 		rc = EXIT_FAILURE;
 		goto fmap_test_exit;
 	}
@@ -713,7 +3441,15 @@ int fmap_test()
 	}
 
 	rc |= fmap_find_area_test(my_fmap);
+	rc |= fmap_find_all_test(my_fmap);
+	rc |= fmap_find_fd_test(my_fmap);
+	rc |= fmap_update_fd_test();
+	rc |= fmap_get_csum_fd_test();
 	rc |= fmap_get_csum_test(my_fmap);
+	rc |= fmap_get_csum_batch_test(my_fmap);
+	rc |= fmap_get_area_csums_test();
+	rc |= fmap_plan_extents_test();
+	rc |= fmap_builder_test();
 	rc |= fmap_size_test(my_fmap);
 	rc |= fmap_flags_to_string_test();
 	rc |= fmap_print_test(my_fmap);
@@ -37,6 +37,9 @@
 #define FLASHMAP_LIB_FMAP_H__
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
 
 #include <valstr.h>
 
@@ -78,14 +81,146 @@ struct fmap {
  * @image:	binary image
  * @len:	length of binary image
  *
- * This function does no error checking. The caller is responsible for
- * verifying that the contents are sane.
+ * Signatures are validated as fmap_find_all() does, so a stray signature,
+ * e.g. in a data area, does not hide the real fmap. The result is the best
+ * candidate fmap_find_all() would report: the valid one at the most
+ * aligned offset, or the lowest such offset if there is a tie. Offsets
+ * aligned to large powers of 2 are probed first in images whose length is
+ * a power of 2, which does not change the result.
  *
  * returns offset of FMAP signature to indicate success
- * returns <0 to indicate failure
+ * returns <0 to indicate failure, including when no candidate is valid
  */
 extern long int fmap_find(const uint8_t *image, unsigned int len);
 
+/*
+ * fmap_find_parallel - find FMAP signature in a binary image using threads
+ *
+ * @image:	binary image
+ * @len:	length of binary image
+ * @nthreads:	number of threads to use, or 0 to use one per online CPU
+ *
+ * The image is split into chunks which are scanned concurrently. The
+ * result is the same as that of fmap_find(): the valid candidate at the
+ * most aligned offset, or the lowest such offset if there is a tie.
+ *
+ * returns offset of FMAP signature to indicate success
+ * returns <0 to indicate failure
+ */
+extern long int fmap_find_parallel(const uint8_t *image, size_t len,
+                                   int nthreads);
+
+/*
+ * fmap_find_fd - find FMAP signature in a file and read the fmap
+ *
+ * @fd:		file descriptor to read from
+ * @fmap:	double-pointer to store location of fmap
+ *
+ * The file is read sequentially through a fixed-size window, so memory use
+ * does not depend on the size of the file. Regular files are read from
+ * the beginning using pread(). Pipes, character devices and other files
+ * which can not be seeked are read from their current position with
+ * read(), in which case the returned offset is relative to that position.
+ *
+ * Candidates are validated as fmap_find_all() does, and the result is the
+ * one fmap_find() would pick from the whole file: the valid fmap at the
+ * most aligned offset, or the lowest such offset if there is a tie. In
+ * regular files, offsets aligned to 64KB or more are probed first, so a
+ * well aligned fmap is found without reading the rest of the file. Only
+ * the header and area table of candidates are kept. The fmap is allocated
+ * and must be freed by the caller using fmap_destroy().
+ *
+ * returns offset of FMAP signature to indicate success
+ * returns <0 to indicate failure
+ */
+extern long int fmap_find_fd(int fd, struct fmap **fmap);
+
+/*
+ * fmap_copy_fd - copy a range of a file, e.g. an area of an image
+ *
+ * @in_fd:	regular file to copy from, its file offset is not used
+ * @offset:	offset of range in in_fd
+ * @len:	length of range
+ * @out_fd:	file, pipe or socket to copy to, at its current position
+ *
+ * Where the kernel supports it the data is copied without passing
+ * through user space: copy_file_range() is tried first, then sendfile().
+ * Anything else, such as files opened with O_APPEND, is copied through
+ * a buffer.
+ *
+ * returns 0 to indicate success
+ * returns <0 to indicate failure, including a range past the end of in_fd
+ */
+extern int fmap_copy_fd(int in_fd, off_t offset, size_t len, int out_fd);
+
+/* fmap_update_fd() failures */
+enum fmap_update_errors {
+	FMAP_UPDATE_ERR_IO		= -1,	/* bad arguments, I/O error */
+	FMAP_UPDATE_ERR_NOT_FOUND	= -2,	/* no fmap to replace */
+	FMAP_UPDATE_ERR_NO_ROOM		= -3,	/* new fmap does not fit */
+};
+
+/*
+ * fmap_update_fd - store an fmap inside an existing image, in place
+ *
+ * @fd:		regular file holding the image, open for reading and writing
+ * @fmap:	fmap to store
+ * @offset:	where to store fmap, or <0 to replace the fmap in the image
+ * @room:	bytes set aside for fmap at offset, or 0 to use the slot of
+ *		the fmap stored there
+ *
+ * The slot of an fmap is its FMAP area, if it has one covering the map,
+ * else the map itself. Unless @room is given, a valid fmap must already
+ * be stored at @offset. If the new fmap has an FMAP area, it must cover
+ * where the new fmap is stored as well. The image is never grown. Only
+ * the pages holding the new fmap are mapped, written and flushed to
+ * storage; the rest of the image is neither read nor written beyond what
+ * finding the old fmap takes.
+ *
+ * returns offset fmap was stored at to indicate success
+ * returns <0 (see enum fmap_update_errors) to indicate failure
+ */
+extern long int fmap_update_fd(int fd, const struct fmap *fmap,
+                               long int offset, size_t room);
+
+/* problems found with an fmap candidate by fmap_find_all() */
+enum fmap_candidate_errors {
+	FMAP_ERR_HEADER_TRUNCATED	= 1 << 0,	/* header past image end */
+	FMAP_ERR_AREAS_TRUNCATED	= 1 << 1,	/* areas past image end */
+	FMAP_ERR_VERSION		= 1 << 2,	/* unknown major version */
+	FMAP_ERR_AREA_BOUNDS		= 1 << 3,	/* area exceeds fmap size */
+	FMAP_ERR_NAME			= 1 << 4,	/* name not terminated */
+};
+
+struct fmap_candidate {
+	long int offset;		/* offset of signature in image */
+	unsigned int errors;		/* enum fmap_candidate_errors mask,
+					   0 if the fmap is valid */
+};
+
+/*
+ * fmap_find_all - find and validate every FMAP signature in a binary image
+ *
+ * @image:	binary image
+ * @len:	length of binary image
+ * @candidates:	double-pointer to store location of candidate array
+ * @best:	location to store offset of best valid candidate (may be NULL)
+ *
+ * The image is scanned once. Each signature found is checked for a
+ * supported version, a header and area table which fit within the image,
+ * areas which fit within the size recorded in the header, and terminated
+ * names. The best candidate is the valid one at the most aligned offset,
+ * or the lowest such offset if there is a tie. *best is set to -1 if no
+ * candidate is valid.
+ *
+ * The candidate array is allocated and must be freed by the caller.
+ *
+ * returns number of candidates found if successful
+ * returns <0 to indicate failure
+ */
+extern int fmap_find_all(const uint8_t *image, unsigned int len,
+                         struct fmap_candidate **candidates, long int *best);
+
 /*
  * fmap_print - Print contents of flash map data structure
  *
@@ -96,6 +231,126 @@ extern long int fmap_find(const uint8_t *image, unsigned int len);
  */
 extern int fmap_print(const struct fmap *map);
 
+/*
+ * fmap_output - output context for printing fmaps
+ *
+ * Holds the output format, the destination and the output buffer, so
+ * several contexts can print at the same time, e.g. from different threads,
+ * without sharing any state. fmap_print() prints to stdout in the format
+ * set with kv_pair_set_style().
+ */
+struct fmap_output;
+
+/*
+ * fmap_output_create_file, fmap_output_create_fd - create an output context
+ * writing to a stream or file descriptor
+ *
+ * @fp/@fd:	destination
+ *
+ * Output is buffered and written out when the buffer fills up and at the
+ * end of every fmap_output_print().
+ *
+ * returns pointer to newly allocated context if successful
+ * returns NULL to indicate failure
+ */
+extern struct fmap_output *fmap_output_create_file(FILE *fp);
+extern struct fmap_output *fmap_output_create_fd(int fd);
+
+/*
+ * fmap_output_create_memory - create an output context collecting output
+ * in memory, see fmap_output_data()
+ *
+ * returns pointer to newly allocated context if successful
+ * returns NULL to indicate failure
+ */
+extern struct fmap_output *fmap_output_create_memory(void);
+
+/* flush and free an output context */
+extern void fmap_output_destroy(struct fmap_output *out);
+
+/*
+ * fmap_output_set_format - select the output format of a context
+ *
+ * @out:	output context
+ * @format:	"pair" (the default), "value", "long", "json", "csv" or "tlv"
+ *
+ * returns 0 if successful
+ * returns <0 to indicate failure or an unknown format
+ */
+extern int fmap_output_set_format(struct fmap_output *out, const char *format);
+
+/*
+ * fmap_output_print - print contents of flash map data structure
+ *
+ * @out:	output context
+ * @map:	raw map data
+ *
+ * returns 0 to indiciate success
+ * returns <0 to indicate failure
+ */
+extern int fmap_output_print(struct fmap_output *out, const struct fmap *map);
+
+/*
+ * fmap_output_data - get output collected by a memory context
+ *
+ * @out:	output context created by fmap_output_create_memory()
+ * @len:	set to length of output
+ *
+ * The data is not terminated and stays valid until the next print to, or
+ * clear or destroy of, the context.
+ *
+ * returns pointer to the output if successful
+ * returns NULL to indicate failure
+ */
+extern const char *fmap_output_data(const struct fmap_output *out,
+                                    size_t *len);
+
+/* discard output collected by a memory context, keeping its buffer */
+extern void fmap_output_clear(struct fmap_output *out);
+
+/*
+ * Tags used by fmap_print() in the binary TLV style. Each record is a tag
+ * byte (FMAP_TLV_FMAP, then FMAP_TLV_AREA for every area) and a length
+ * byte, followed by that many bytes of fields. Each field is again a tag
+ * byte and a length byte followed by its value: the little-endian bytes
+ * stored in the fmap for numbers and the signature, and the bytes before
+ * the first NUL for names.
+ */
+enum fmap_tlv_tag {
+	FMAP_TLV_FMAP		= 0x01,
+	FMAP_TLV_AREA		= 0x02,
+
+	FMAP_TLV_SIGNATURE	= 0x10,
+	FMAP_TLV_VER_MAJOR	= 0x11,
+	FMAP_TLV_VER_MINOR	= 0x12,
+	FMAP_TLV_BASE		= 0x13,
+	FMAP_TLV_SIZE		= 0x14,
+	FMAP_TLV_NAME		= 0x15,
+	FMAP_TLV_NAREAS		= 0x16,
+
+	FMAP_TLV_AREA_OFFSET	= 0x20,
+	FMAP_TLV_AREA_SIZE	= 0x21,
+	FMAP_TLV_AREA_NAME	= 0x22,
+	FMAP_TLV_AREA_FLAGS	= 0x23,
+};
+
+/*
+ * fmap_print_buffered - Print contents of flash map through a buffer
+ *
+ * @fp:		stream to print to
+ * @map:	raw map data
+ * @buf:	output buffer, or NULL to use an internal one
+ * @size:	size of output buffer
+ *
+ * Produces the same output as fmap_print() without allocating memory,
+ * writing to @fp only when the buffer fills up and at the end.
+ *
+ * returns 0 to indiciate success
+ * returns <0 to indicate failure
+ */
+extern int fmap_print_buffered(FILE *fp, const struct fmap *map,
+                               char *buf, size_t size);
+
 /*
  * fmap_get_csum - get the checksum of static regions of an image
  *
@@ -113,6 +368,256 @@ extern int fmap_print(const struct fmap *map);
 extern int fmap_get_csum(const uint8_t *image,
                          unsigned int image_len, uint8_t **digest);
 
+/*
+ * fmap_get_csum_at - get the checksum of static regions of an image
+ *
+ * @image:	image to checksum
+ * @len:	length of image
+ * @fmap_offset: offset of the fmap within image, e.g. from fmap_find()
+ * @digest:	double-pointer to store location of first byte of digest
+ *
+ * Same as fmap_get_csum(), but uses the fmap at the given offset rather
+ * than searching for one.
+ *
+ * returns digest length if successful
+ * returns <0 to indicate error
+ */
+extern int fmap_get_csum_at(const uint8_t *image, unsigned int image_len,
+                            long int fmap_offset, uint8_t **digest);
+
+/*
+ * fmap_get_csum_batch - get the checksums of static regions of many images
+ *
+ * @images:	array of n images to checksum
+ * @image_lens:	array of n image lengths
+ * @n:		number of images
+ * @digests:	array of n pointers to store location of each digest
+ *
+ * Same as calling fmap_get_csum() for each image, but the images are
+ * hashed side by side using the multi-buffer SHA-1 engine. Each digest
+ * is allocated and must be freed by the caller. Digests for images that
+ * could not be checksummed are set to NULL.
+ *
+ * returns digest length if all images were checksummed
+ * returns <0 to indicate error with any image
+ */
+extern int fmap_get_csum_batch(const uint8_t *const images[],
+                               const unsigned int image_lens[], int n,
+                               uint8_t *digests[]);
+
+/*
+ * struct fmap_digest - digest algorithm used to checksum images
+ *
+ * @name:	name of the algorithm, as given to fmap_digest_find()
+ * @size:	length of the digest in bytes
+ * @ctx_size:	size of the state the caller provides to the callbacks
+ * @init:	reset state
+ * @update:	hash more data
+ * @final:	finish hashing and write size bytes of digest
+ */
+struct fmap_digest {
+	const char *name;
+	unsigned int size;
+	size_t ctx_size;
+	void (*init)(void *ctx);
+	void (*update)(void *ctx, const void *data, size_t len);
+	void (*final)(void *ctx, uint8_t *digest);
+};
+
+/*
+ * Built-in digest algorithms. fmap_digest_sha256_tree hashes 1MB chunks
+ * independently (and in parallel) as SHA-256(0x00 || chunk), then returns
+ * SHA-256(0x01 || chunk digests || 64-bit little-endian input length).
+ */
+extern const struct fmap_digest fmap_digest_sha1;
+extern const struct fmap_digest fmap_digest_sha256;
+extern const struct fmap_digest fmap_digest_sha256_tree;
+
+/* NULL-terminated list of the built-in digest algorithms */
+extern const struct fmap_digest *const fmap_digests[];
+
+/*
+ * fmap_digest_find - find a built-in digest algorithm by name
+ *
+ * @name:	name of algorithm, case insensitive
+ *
+ * returns pointer to the algorithm if successful
+ * returns NULL if no algorithm of that name exists
+ */
+extern const struct fmap_digest *fmap_digest_find(const char *name);
+
+/*
+ * fmap_digest_threads - limit threads digests start on the calling thread
+ *
+ * @nthreads:	most threads a digest such as sha256-tree may use for one
+ *		update, 1 to hash on the calling thread only, or 0 for one
+ *		per online CPU (the default)
+ *
+ * Only updates made on the calling thread are affected. Worker threads of
+ * a pool which already keeps the CPUs busy, such as that of
+ * fmap_get_area_csums(), set a limit of 1 so digests they run do not start
+ * threads on top of it.
+ *
+ * returns previous limit of the calling thread
+ * returns <0 to indicate failure, if nthreads is negative
+ */
+extern int fmap_digest_threads(int nthreads);
+
+/*
+ * struct fmap_extent - contiguous range of an image
+ *
+ * @offset:	offset of first byte
+ * @size:	number of bytes
+ */
+struct fmap_extent {
+	uint64_t offset;
+	uint64_t size;
+};
+
+/*
+ * fmap_plan_extents - merge selected areas into sequential extents
+ *
+ * @fmap:	fmap structure to parse
+ * @flags:	only areas with all of these flags set are used, 0 for all
+ * @extents:	double-pointer to store location of extents
+ *
+ * The selected areas are sorted by offset, and areas that overlap or
+ * touch are merged, so every byte is covered by exactly one extent and
+ * the extents can be read front to back. Empty areas are dropped. The
+ * array is allocated and must be freed by the caller.
+ *
+ * returns number of extents if successful
+ * returns <0 to indicate failure
+ */
+extern int fmap_plan_extents(const struct fmap *fmap, uint16_t flags,
+                             struct fmap_extent **extents);
+
+/* which bytes of the static areas make up a checksum, and in what order */
+enum fmap_csum_mode {
+	/* static areas in table order, overlaps hashed again (fmap_get_csum) */
+	FMAP_CSUM_LEGACY = 0,
+	/* static bytes in offset order, each once (fmap_plan_extents) */
+	FMAP_CSUM_COALESCED,
+};
+
+/*
+ * fmap_get_csum_digest - get the checksum of static regions of an image
+ *
+ * @image:	image to checksum
+ * @len:	length of image
+ * @fmap_offset: offset of the fmap within image, e.g. from fmap_find()
+ * @alg:	digest algorithm to use, NULL for SHA-1
+ * @mode:	which ranges are hashed, in what order
+ * @digest:	double-pointer to store location of first byte of digest
+ *
+ * Same as fmap_get_csum_at(), but with a choice of digest algorithm and
+ * mode. The coalesced digest only depends on which bytes are static, not
+ * on how the areas covering them are laid out in the table.
+ *
+ * returns digest length if successful
+ * returns <0 to indicate error
+ */
+extern int fmap_get_csum_digest(const uint8_t *image, unsigned int image_len,
+                                long int fmap_offset,
+                                const struct fmap_digest *alg,
+                                enum fmap_csum_mode mode, uint8_t **digest);
+
+/*
+ * fmap_get_csum_checkpoint - get the checksum of static regions of an image,
+ *                            reusing work saved by a previous call
+ *
+ * @image:	image to checksum
+ * @len:	length of image
+ * @fmap_offset: offset of the fmap within image, e.g. from fmap_find()
+ * @path:	checkpoint file, created or replaced on success
+ * @digest:	double-pointer to store location of first byte of digest
+ *
+ * Produces the same SHA-1 digest as fmap_get_csum_at(). The checkpoint
+ * holds the SHA-1 midstate after each static area, so hashing resumes
+ * after the last static area that is unchanged since the checkpoint was
+ * written. A missing or unusable checkpoint just means a full rehash.
+ *
+ * Unchanged areas are recognized by a fast 64-bit fingerprint, which is
+ * not collision resistant: a crafted image can keep the fingerprint of
+ * the image the checkpoint was written for and get its stale digest.
+ * Only use checkpoints for images from a trusted source, never to verify
+ * an image received from elsewhere.
+ *
+ * returns digest length if successful
+ * returns <0 to indicate error
+ */
+extern int fmap_get_csum_checkpoint(const uint8_t *image,
+                                    unsigned int image_len,
+                                    long int fmap_offset, const char *path,
+                                    uint8_t **digest);
+
+/*
+ * fmap_get_csum_fd - get the checksum of static regions of an image file
+ *
+ * @fd:		file descriptor to read image from, may be a pipe
+ * @alg:	digest algorithm to use, NULL for SHA-1
+ * @mode:	which ranges are hashed, in what order
+ * @digest:	double-pointer to store location of first byte of digest
+ *
+ * Same result as fmap_get_csum_digest(), but the image is streamed rather
+ * than mapped: a reader thread fills a small ring of buffers with the
+ * ranges to hash while the calling thread hashes them, and the next range
+ * is prefetched with posix_fadvise(). The coalesced mode reads the image
+ * strictly front to back. Memory use does not depend on image
+ * size. Input that cannot seek is copied to a temporary file as it is
+ * read, so that areas before the fmap or out of order can be revisited.
+ *
+ * returns digest length if successful
+ * returns <0 to indicate error
+ */
+extern int fmap_get_csum_fd(int fd, const struct fmap_digest *alg,
+                            enum fmap_csum_mode mode, uint8_t **digest);
+
+/* largest digest produced by any of the built-in algorithms */
+#define FMAP_DIGEST_MAX_SIZE	32
+
+/*
+ * struct fmap_area_csum - digest of a single area
+ *
+ * @area:	index of the area in the fmap
+ * @digest:	digest of the area contents, alg->size bytes are used
+ */
+struct fmap_area_csum {
+	int area;
+	uint8_t digest[FMAP_DIGEST_MAX_SIZE];
+};
+
+/*
+ * fmap_get_area_csums - get the checksum of each area of an image
+ *
+ * @image:	image to checksum
+ * @len:	length of image
+ * @fmap_offset: offset of the fmap within image, e.g. from fmap_find()
+ * @alg:	digest algorithm to use, NULL for SHA-1
+ * @flags:	only areas with all of these flags set are hashed, 0 for all
+ * @nthreads:	number of threads to hash with, 0 for one per CPU
+ * @csums:	double-pointer to store location of per-area digests
+ * @root:	buffer of alg->size bytes to store Merkle root, may be NULL
+ *
+ * Selected areas are hashed independently on a pool of threads. The
+ * resulting array is in area order and must be freed by the caller.
+ *
+ * The Merkle root is built over the area digests in that order: each
+ * digest becomes a leaf alg(0x00 || digest), then each pair of adjacent
+ * nodes is replaced by alg(0x01 || left || right) and an odd node at the
+ * end of a level moves up unchanged, until one node remains. The root of
+ * a single area is its leaf; with no areas it is the digest of empty
+ * input.
+ *
+ * returns number of areas hashed if successful
+ * returns <0 to indicate error
+ */
+extern int fmap_get_area_csums(const uint8_t *image, unsigned int image_len,
+                               long int fmap_offset,
+                               const struct fmap_digest *alg,
+                               uint16_t flags, int nthreads,
+                               struct fmap_area_csum **csums, uint8_t *root);
+
 
 /*
  * fmap_flags_to_string - convert raw flags field into user-friendly string
@@ -130,6 +635,20 @@ extern int fmap_get_csum(const uint8_t *image,
  */
 char *fmap_flags_to_string(uint16_t flags);
 
+/*
+ * fmap_flags_format - write user-friendly flags string into a buffer
+ *
+ * @buf:	buffer to write to, may be NULL if @size is 0
+ * @size:	size of buffer
+ * @flags:	raw flags
+ *
+ * Like fmap_flags_to_string() without allocating. The string is always
+ * terminated when @size is non-zero, like snprintf().
+ *
+ * returns length of the complete string, excluding the terminator
+ */
+size_t fmap_flags_format(char *buf, size_t size, uint16_t flags);
+
 /*
  * fmap_create - allocate and initialize a new fmap structure
  *
@@ -160,7 +679,7 @@ extern void fmap_destroy(struct fmap *fmap);
 extern int fmap_size(struct fmap *fmap);
 
 /*
- * fmap_append_area - realloc an existing flashmap and append an area
+ * fmap_append_area - append an area to an existing flashmap
  *
  * @fmap:	double pointer to existing flashmap
  * @offset:	offset of area
@@ -168,6 +687,12 @@ extern int fmap_size(struct fmap *fmap);
  * @name:	name of area
  * @flags:	area flags
  *
+ * The flashmap must have been allocated by this library, e.g. by
+ * fmap_create(), fmap_builder_finalize() or fmap_find_fd(). Those leave
+ * room for the number of areas rounded up to a power of 2, so the
+ * structure is only reallocated, and *fmap changed, when the number of
+ * areas crosses one. Appending n areas takes O(n) copies in total.
+ *
  * returns total size of reallocated flashmap structure if successful
  * returns <0 to indicate failure
  */
@@ -175,6 +700,72 @@ extern int fmap_append_area(struct fmap **fmap,
                             uint32_t offset, uint32_t size,
                             const uint8_t *name, uint16_t flags);
 
+/*
+ * fmap_builder - incrementally assemble a flashmap
+ *
+ * Areas are collected in an array grown geometrically, and the packed
+ * struct fmap is allocated once by fmap_builder_finalize().
+ */
+struct fmap_builder;
+
+/*
+ * fmap_builder_create - start building a new flashmap
+ *
+ * @base:	base address of firmware within address space
+ * @size:	size of the firmware (bytes)
+ * @name:	name of firmware
+ *
+ * returns pointer to newly allocated builder if successful
+ * returns NULL to indicate failure
+ */
+extern struct fmap_builder *fmap_builder_create(uint64_t base, uint32_t size,
+                                                const uint8_t *name);
+
+/* free memory used by a builder which was not finalized */
+extern void fmap_builder_destroy(struct fmap_builder *builder);
+
+/*
+ * fmap_builder_append_area - add an area to a builder
+ *
+ * @builder:	flashmap builder
+ * @offset:	offset of area
+ * @size:	size of area
+ * @name:	name of area
+ * @flags:	area flags
+ *
+ * returns index of the new area in append order if successful
+ * returns <0 to indicate failure
+ */
+extern int fmap_builder_append_area(struct fmap_builder *builder,
+                                    uint32_t offset, uint32_t size,
+                                    const uint8_t *name, uint16_t flags);
+
+/*
+ * fmap_builder_append_areas - add an array of areas to a builder
+ *
+ * @builder:	flashmap builder
+ * @areas:	areas to copy
+ * @n:		number of areas
+ *
+ * returns total number of areas in the builder if successful
+ * returns <0 to indicate failure
+ */
+extern int fmap_builder_append_areas(struct fmap_builder *builder,
+                                     const struct fmap_area *areas, int n);
+
+/*
+ * fmap_builder_finalize - emit the flashmap and free the builder
+ *
+ * @builder:	flashmap builder, which is freed whether or not this succeeds
+ *
+ * Areas are sorted by offset, keeping the append order of areas at the
+ * same offset, and each must lie within the firmware size.
+ *
+ * returns pointer to newly allocated flashmap if successful
+ * returns NULL to indicate failure
+ */
+extern struct fmap *fmap_builder_finalize(struct fmap_builder *builder);
+
 /*
  * fmap_find_area - find an fmap_area entry (by name) and return pointer to it
  *
@@ -186,7 +777,302 @@ extern int fmap_append_area(struct fmap **fmap,
  */
 extern struct fmap_area *fmap_find_area(struct fmap *fmap, const char *name);
 
+/*
+ * fmap_name_index - hash and sorted index over area names
+ *
+ * Built once from an fmap to answer repeated name queries without a linear
+ * scan per lookup. The index refers to the areas of the fmap it was built
+ * from, so it must be rebuilt if that fmap is changed, reallocated (e.g. by
+ * fmap_append_area) or freed.
+ */
+struct fmap_name_index;
+
+/*
+ * fmap_name_index_create - build a name index for an fmap
+ *
+ * @fmap:	fmap structure to index
+ *
+ * returns pointer to newly allocated index if successful
+ * returns NULL to indicate failure
+ */
+extern struct fmap_name_index *fmap_name_index_create(struct fmap *fmap);
+
+/* free memory used by a name index */
+extern void fmap_name_index_destroy(struct fmap_name_index *idx);
+
+/*
+ * fmap_name_index_find - find an area by exact name in O(1)
+ *
+ * @idx:	name index
+ * @name:	name of area to find
+ *
+ * Where several areas share a name, the first one is returned, as with
+ * fmap_find_area().
+ *
+ * returns a pointer to the entry in the indexed fmap if successful
+ * returns NULL to indicate failure or if no matching area entry is found
+ */
+extern struct fmap_area *fmap_name_index_find(const struct fmap_name_index *idx,
+                                              const char *name);
+
+/*
+ * fmap_name_index_prefix - find all areas whose name starts with prefix
+ *
+ * @idx:	name index
+ * @prefix:	name prefix, "" matches every area
+ * @areas:	set to an allocated array of matching areas sorted by name,
+ * 		which the caller must free()
+ *
+ * returns the number of matching areas if successful
+ * returns <0 to indicate failure
+ */
+extern int fmap_name_index_prefix(const struct fmap_name_index *idx,
+                                  const char *prefix,
+                                  struct fmap_area ***areas);
+
+/*
+ * fmap_name_index_glob - find all areas whose name matches a shell pattern
+ *
+ * @idx:	name index
+ * @pattern:	fnmatch(3) pattern, e.g. "RW_*"
+ * @areas:	set to an allocated array of matching areas sorted by name,
+ * 		which the caller must free()
+ *
+ * Only the range of names sharing the literal prefix of the pattern is
+ * scanned.
+ *
+ * returns the number of matching areas if successful
+ * returns <0 to indicate failure
+ */
+extern int fmap_name_index_glob(const struct fmap_name_index *idx,
+                                const char *pattern,
+                                struct fmap_area ***areas);
+
+/*
+ * fmap_area_index - interval index over area offsets
+ *
+ * Built once from an fmap to answer "which areas cover this offset?" in
+ * O(log n + k) instead of scanning every area. Like fmap_name_index, it
+ * refers to the areas of the fmap it was built from and must be rebuilt if
+ * that fmap is changed, reallocated or freed.
+ */
+struct fmap_area_index;
+
+/*
+ * fmap_area_index_create - build an interval index for an fmap
+ *
+ * @fmap:	fmap structure to index
+ *
+ * returns pointer to newly allocated index if successful
+ * returns NULL to indicate failure
+ */
+extern struct fmap_area_index *fmap_area_index_create(struct fmap *fmap);
+
+/* free memory used by an interval index */
+extern void fmap_area_index_destroy(struct fmap_area_index *idx);
+
+/*
+ * fmap_area_at - find the area covering an offset
+ *
+ * @idx:	interval index
+ * @offset:	offset relative to base
+ *
+ * Where areas are nested or overlap, the innermost one is returned: the
+ * one starting last, then the smallest.
+ *
+ * returns a pointer to the entry in the indexed fmap if successful
+ * returns NULL to indicate failure or if no area covers offset
+ */
+extern struct fmap_area *fmap_area_at(const struct fmap_area_index *idx,
+                                      uint64_t offset);
+
+/*
+ * fmap_area_index_overlap - find all areas overlapping a range
+ *
+ * @idx:	interval index
+ * @offset:	start of range relative to base
+ * @size:	size of range in bytes
+ * @areas:	array filled with up to @max overlapping areas, by offset
+ * @max:	number of entries in @areas
+ *
+ * returns the total number of overlapping areas, which may exceed @max
+ * returns <0 to indicate failure
+ */
+extern int fmap_area_index_overlap(const struct fmap_area_index *idx,
+                                   uint64_t offset, uint64_t size,
+                                   struct fmap_area **areas, int max);
+
+/*
+ * fmap_area_at_batch - resolve many offsets in one pass
+ *
+ * @idx:	interval index
+ * @offsets:	offsets relative to base, sorted in ascending order
+ * @count:	number of offsets
+ * @areas:	filled with the fmap area index for each offset, as chosen by
+ * 		fmap_area_at(), or -1 where no area covers it
+ *
+ * returns 0 if successful
+ * returns <0 to indicate failure, including unsorted offsets
+ */
+extern int fmap_area_at_batch(const struct fmap_area_index *idx,
+                              const uint64_t *offsets, size_t count,
+                              int *areas);
+
+/*
+ * fmap_view - read-only view of an fmap inside an image
+ *
+ * A view is validated once by fmap_view_init() and then read in place,
+ * without copying or allocating, so it can be used directly on mmap() or
+ * pread() buffers. The image must stay mapped while the view is in use.
+ */
+struct fmap_view {
+	const uint8_t *image;
+	size_t len;		/* bytes of image which may be accessed */
+	size_t offset;		/* offset of the fmap within image */
+	uint16_t nareas;
+};
+
+/* a string inside the fmap, not necessarily NUL-terminated */
+struct fmap_str {
+	const char *ptr;
+	size_t len;
+};
+
+/* an area read from a view, with fields in host order */
+struct fmap_view_area {
+	uint32_t offset;
+	uint32_t size;
+	uint16_t flags;
+	struct fmap_str name;
+	unsigned int index;	/* position in the area table */
+};
+
+/* returns 1 if str equals the NUL-terminated string s, 0 otherwise */
+extern int fmap_str_eq(struct fmap_str str, const char *s);
+
+/*
+ * fmap_view_init - validate an fmap inside an image and set up a view
+ *
+ * @view:	view to initialize
+ * @image:	binary image
+ * @len:	length of image
+ * @offset:	offset of the fmap, e.g. as returned by fmap_find()
+ *
+ * Checks the signature and that the header and whole area table lie
+ * within the image. The areas themselves may still point outside it.
+ *
+ * returns 0 if successful
+ * returns <0 to indicate failure
+ */
+extern int fmap_view_init(struct fmap_view *view, const uint8_t *image,
+                          size_t len, long int offset);
+
+/* header accessors for a validated view */
+extern uint64_t fmap_view_base(const struct fmap_view *view);
+extern uint32_t fmap_view_size(const struct fmap_view *view);
+extern struct fmap_str fmap_view_name(const struct fmap_view *view);
+
+/*
+ * fmap_view_area - read an area from a view
+ *
+ * @view:	validated view
+ * @i:		index of area
+ * @area:	filled with the area's fields
+ *
+ * returns 0 if successful
+ * returns <0 to indicate failure or if i is out of range
+ */
+extern int fmap_view_area(const struct fmap_view *view, unsigned int i,
+                          struct fmap_view_area *area);
+
+/*
+ * fmap_view_next - iterate over the areas of a view
+ *
+ * @view:	validated view
+ * @iter:	iterator, set to 0 before the first call
+ * @area:	filled with the next area
+ *
+ * returns 1 if an area was read, 0 when there are no more areas
+ */
+extern int fmap_view_next(const struct fmap_view *view, unsigned int *iter,
+                          struct fmap_view_area *area);
+
+/*
+ * fmap_view_area_data - get the contents of an area
+ *
+ * @view:	validated view
+ * @area:	area read from view
+ *
+ * returns pointer to the area within the image if it lies entirely inside
+ * returns NULL to indicate failure
+ */
+extern const uint8_t *fmap_view_area_data(const struct fmap_view *view,
+                                          const struct fmap_view_area *area);
+
+/*
+ * fmap_view_find_area - find the first area with a given name
+ *
+ * @view:	validated view
+ * @name:	name of area to find
+ * @area:	filled with the area's fields
+ *
+ * returns 0 if successful
+ * returns <0 to indicate failure or if no matching area is found
+ */
+extern int fmap_view_find_area(const struct fmap_view *view, const char *name,
+                               struct fmap_view_area *area);
+
+/* layout problems found by fmap_validate() */
+enum fmap_issue_type {
+	FMAP_ISSUE_BOUNDS,	/* area extends past the firmware size */
+	FMAP_ISSUE_OVERLAP,	/* areas overlap without one containing the
+				   other */
+	FMAP_ISSUE_GAP,		/* range not covered by any area */
+	FMAP_ISSUE_ALIGN,	/* area offset or size is misaligned */
+	FMAP_ISSUE_NESTED,	/* area lies within another, which is not an
+				   error */
+};
+
+struct fmap_issue {
+	enum fmap_issue_type type;
+	int area;		/* index of area, -1 for gaps */
+	int other;		/* index of enclosing or overlapped area, or -1 */
+	uint64_t offset;	/* range the issue applies to */
+	uint64_t size;
+};
+
+/*
+ * fmap_validate - check the area layout of an fmap
+ *
+ * @fmap:	fmap structure to check
+ * @align:	required alignment of area offsets and sizes, a power of two,
+ * 		or 0 to skip the alignment check
+ * @issues:	set to an allocated array of issues found, which the caller
+ * 		must free()
+ *
+ * Areas are checked against the firmware size and alignment, and against
+ * each other with a single sweep in offset order. Every intersecting pair
+ * of areas is reported once, against the area starting later: as
+ * FMAP_ISSUE_NESTED if it lies within the other area, or FMAP_ISSUE_OVERLAP
+ * otherwise. Empty areas are only checked for bounds and alignment.
+ *
+ * returns the number of issues if successful
+ * returns <0 to indicate failure
+ */
+extern int fmap_validate(const struct fmap *fmap, uint32_t align,
+                         struct fmap_issue **issues);
+
+/* returns a short name for an issue type, e.g. "overlap" */
+extern const char *fmap_issue_type_to_string(enum fmap_issue_type type);
+
 /* unit testing stuff */
 extern int fmap_test();
+extern int fmap_index_test();
+extern int fmap_view_test();
+extern int fmap_validate_test();
+extern int fmap_output_test();
+extern int fmap_digest_test();
+extern int fmap_checkpoint_test();
+extern int fmap_extract_test();
 
 #endif	/* FLASHMAP_LIB_FMAP_H__*/
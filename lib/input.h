@@ -53,6 +53,48 @@ struct kv_attr {
 extern int input_interactive(const char *outfile);
 extern int input_kv_pair(const char *infile, const char *outfile);
 
+/*
+ * input_kv_pair_update - encode a kv-pair file into an existing image
+ *
+ * @infile:	kv-pair input
+ * @image:	firmware image to update in place
+ * @offset:	offset of fmap in image, or <0 to replace the fmap found there
+ * @room:	bytes set aside for the fmap at offset, or 0 if unknown
+ *
+ * See fmap_update_fd() for how the room for the new fmap is determined.
+ *
+ * returns EXIT_SUCCESS to indicate success
+ * returns EXIT_FAILURE to indicate failure
+ */
+extern int input_kv_pair_update(const char *infile, const char *image,
+                                long int offset, size_t room);
+
+/*
+ * input_kv_pair_batch - encode many kv-pair files on a pool of threads
+ *
+ * @pairs:	input and output paths, alternating
+ * @npairs:	number of input/output pairs
+ * @nthreads:	number of threads to use, 0 for one per online CPU
+ *
+ * Every pair is attempted even if some fail.
+ *
+ * returns EXIT_SUCCESS if every pair was encoded
+ * returns EXIT_FAILURE otherwise
+ */
+extern int input_kv_pair_batch(char *const pairs[], unsigned int npairs,
+                               int nthreads);
+
+/*
+ * input_kv_pair_manifest - encode every pair listed in a manifest
+ *
+ * @manifest:	file with one "<input> <output>" pair per line
+ * @nthreads:	number of threads to use, 0 for one per online CPU
+ *
+ * returns EXIT_SUCCESS if every pair was encoded
+ * returns EXIT_FAILURE otherwise
+ */
+extern int input_kv_pair_manifest(const char *manifest, int nthreads);
+
 /* unit testing stuff */
 extern int input_kv_pair_test();
 
@@ -34,10 +34,16 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <fmap.h>
 
@@ -45,39 +51,145 @@
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
+/* longest value accepted for any key; names and flag lists are far shorter */
+#define KV_VALUE_MAX	256
+
+/* number of area lines a parser thread claims at a time */
+#define KV_PARSE_CHUNK	1024
+
+/*
+ * Where a line came from, for error messages. Parsing with a NULL source
+ * is silent; the parallel area parser uses this and re-parses the first bad
+ * line afterwards to report it.
+ */
+struct kv_src {
+	const char *file;
+	unsigned int line;	/* 1-based */
+};
+
+static void kv_err(const struct kv_src *src, const char *fmt, ...)
+{
+	char msg[512];
+	va_list ap;
+
+	if (!src)
+		return;
+
+	/* one call, so messages from concurrent jobs do not interleave */
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "%s:%u: %s", src->file, src->line, msg);
+}
+
+/*
+ * Every key the kv-pair format knows about. Header keys and area keys are
+ * each contiguous so parse_header() and parse_area() can index their
+ * kv_attr tables by (key - first key of the record).
+ */
+enum kv_key {
+	KV_FMAP_SIGNATURE,
+	KV_FMAP_VER_MAJOR,
+	KV_FMAP_VER_MINOR,
+	KV_FMAP_BASE,
+	KV_FMAP_SIZE,
+	KV_FMAP_NAME,
+	KV_FMAP_NAREAS,
+	KV_AREA_OFFSET,
+	KV_AREA_SIZE,
+	KV_AREA_NAME,
+	KV_AREA_FLAGS,
+	KV_KEY_COUNT,
+};
+
+static const struct {
+	const char *str;
+	size_t len;
+} kv_keys[KV_KEY_COUNT] = {
+	[KV_FMAP_SIGNATURE]	= { "fmap_signature", 14 },
+	[KV_FMAP_VER_MAJOR]	= { "fmap_ver_major", 14 },
+	[KV_FMAP_VER_MINOR]	= { "fmap_ver_minor", 14 },
+	[KV_FMAP_BASE]		= { "fmap_base", 9 },
+	[KV_FMAP_SIZE]		= { "fmap_size", 9 },
+	[KV_FMAP_NAME]		= { "fmap_name", 9 },
+	[KV_FMAP_NAREAS]	= { "fmap_nareas", 11 },
+	[KV_AREA_OFFSET]	= { "area_offset", 11 },
+	[KV_AREA_SIZE]		= { "area_size", 9 },
+	[KV_AREA_NAME]		= { "area_name", 9 },
+	[KV_AREA_FLAGS]		= { "area_flags", 10 },
+};
+
+/*
+ * Perfect hash over kv_keys: the first character tells fmap_ from area_,
+ * the sixth picks the field and the third-from-last separates the two
+ * version keys. Every key is at least 9 characters long, so a candidate
+ * shorter than 6 cannot match and is rejected before hashing.
+ */
+#define KV_HASH(s, len)	((2 * (unsigned char)(s)[0] + \
+			  3 * (unsigned char)(s)[5] + \
+			  (unsigned char)(s)[(len) - 3]) & 15)
+
+static const signed char kv_hash_slots[16] = {
+	-1, -1, KV_AREA_OFFSET, KV_FMAP_BASE,
+	KV_AREA_SIZE, KV_AREA_FLAGS, -1, KV_FMAP_NAME,
+	KV_FMAP_VER_MAJOR, -1, KV_FMAP_SIGNATURE, KV_FMAP_NAREAS,
+	KV_FMAP_VER_MINOR, KV_AREA_NAME, KV_FMAP_SIZE, -1,
+};
+
 /*
- * extract_value - Extract value from key="value" string
+ * kv_key_lookup - map a key token onto its kv_key
  *
- * line: string to extract value from
+ * @key:	start of key, not necessarily NULL-terminated
+ * @len:	length of key
  *
- * returns allocated, NULL-terminated copy of value
+ * returns kv_key value if key is known
+ * returns <0 for unknown keys
+ */
+static int kv_key_lookup(const char *key, size_t len)
+{
+	int id;
+
+	if (len < 6)
+		return -1;
+
+	id = kv_hash_slots[KV_HASH(key, len)];
+	if (id < 0 || kv_keys[id].len != len ||
+	    memcmp(kv_keys[id].str, key, len))
+		return -1;
+
+	return id;
+}
+
+/* token separators; cheaper than isspace() in the per-character loops */
+static inline int kv_is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/*
+ * extract_value - Locate value in a "value" token without copying it
+ *
+ * @p:		start of token, expected to be the opening quote
+ * @end:	end of input
+ * @len:	location to store length of value
+ *
+ * returns pointer to first character of value inside the input
  * returns NULL to indicate failure
  */
-static char *extract_value(const char *line, size_t len) {
-	char *val, *c;
-	int i = 0;
+static const char *extract_value(const char *p, const char *end, size_t *len)
+{
+	const char *close;
 
-	if (!line)
+	if (!p || p >= end || *p != '"')
 		return NULL;
 
-	c = strchr(line, '"');
-	c++;
-
-	val = calloc(len, 1);
-	while (*c != '"') {
-		if (c == line + len) {
-			fprintf(stderr,
-			        "overrun detected: missing end-quote?\n");
-			free(val);
-			val = NULL;
-			break;
-		}
-		val[i] = *c;
-		i++;
-		c++;
-	}
+	p++;
+	close = memchr(p, '"', end - p);
+	if (!close)
+		return NULL;
 
-	return val;
+	*len = close - p;
+	return p;
 }
 
 static int do_strcpy(void *dest, const char *src, size_t max_len)
@@ -122,7 +234,7 @@ static int do_flags(void *dest, const char *src, size_t len)
 	unsigned int i;
 	uint16_t flags = 0;	/* TODO: can remove uint16_t assumption? */
 
-	if (!dest || !src)
+	if (!dest || !src || len > sizeof(flags))
 		return -1;
 
 	if (strlen(src) == 0) {
@@ -151,213 +263,878 @@ static int do_flags(void *dest, const char *src, size_t len)
  */
 static int do_strtoul(void *dest, const char *src, size_t len)
 {
-	void *x;
+	union {
+		uint8_t u8;
+		uint16_t u16;
+		uint32_t u32;
+		uint64_t u64;
+	} x;
 
 	if (!dest || !src)
 		return -1;
 
 	switch(len) {
 	case 1:
-		x = malloc(len);
-		*(uint8_t *)x = (uint8_t)strtoul(src, NULL, 0);
+		x.u8 = (uint8_t)strtoul(src, NULL, 0);
 		break;
 	case 2:
-		x = malloc(len);
-		*(uint16_t *)x = (uint16_t)strtoul(src, NULL, 0);
+		x.u16 = (uint16_t)strtoul(src, NULL, 0);
 		break;
 	case 4:
-		x = malloc(len);
-		*(uint32_t *)x = (uint32_t)strtoull(src, NULL, 0);
+		x.u32 = (uint32_t)strtoull(src, NULL, 0);
 		break;
 	case 8:
-		x = malloc(len);
-		*(uint64_t *)x = (uint64_t)strtoull(src, NULL, 0);
+		x.u64 = (uint64_t)strtoull(src, NULL, 0);
 		break;
 	default:
 		return -1;
 	}
 
-	memcpy(dest, x, len);
-	free(x);
+	memcpy(dest, &x, len);
 	return 0;
 }
 
-static int doit(const char *line,
+/*
+ * doit - tokenize one line and dispatch its values to handlers
+ *
+ * @src:	origin of line for error messages, NULL to parse silently
+ * @line:	start of line, not necessarily NULL-terminated
+ * @len:	length of line
+ * @first:	kv_key of kv_attrs[0]; kv_attrs[i] handles key first + i
+ * @kv_attrs:	attribute table for this kind of record
+ * @num_entries:	number of entries in kv_attrs
+ *
+ * The line is walked once. Keys outside of kv_attrs, including longer keys
+ * sharing a prefix with a wanted one (e.g. area_flags_raw), are skipped. If
+ * a key appears more than once its first value is used.
+ *
+ * returns 0 to indicate success
+ * returns <0 to indicate failure
+ */
+static int doit(const struct kv_src *src, const char *line, size_t len,
+                enum kv_key first,
                 struct kv_attr kv_attrs[], unsigned int num_entries)
 {
-	int rc = 0;
-	unsigned int i;
+	const char *p = line, *end = line + len;
+	char value[KV_VALUE_MAX];
+	unsigned int seen = 0, i;
 
-	for (i = 0; i < num_entries; i++) {
-		const char *p = line;
-		char *value = NULL;
+	while (p < end) {
+		const char *key, *val;
+		size_t key_len, val_len;
+		int id;
 
-		/* Ignore out partial key matches, e.g. foo= vs. foo_bar= */
-		while ((p = strstr(p, kv_attrs[i].key)) != NULL) {
-			if (*(p + strlen(kv_attrs[i].key)) == '=') {
-				break;
-			}
+		while (p < end && kv_is_space(*p))
 			p++;
-		}
-
-		if (p == NULL) {
-			fprintf(stderr, "key \"%s\" not found, aborting\n",
-			        kv_attrs[i].key);
-			rc = -1;
+		if (p == end)
 			break;
-		}
 
-		/* found key, extract value from remainder of input string */
-		if (!(value = extract_value(p, strlen(p)))) {
-			fprintf(stderr,
-			        "failed to extract value from \"%s\"\n", p);
-			rc = -1;
-			free(value);
-			break;
+		key = p;
+		while (p < end && *p != '=' && !kv_is_space(*p))
+			p++;
+		key_len = p - key;
+		if (p == end || *p != '=')
+			continue;	/* bare word, not a key="value" pair */
+
+		if (!(val = extract_value(p + 1, end, &val_len))) {
+			kv_err(src, "failed to extract value for \"%.*s\" "
+			       "(missing quote?)\n", (int)key_len, key);
+			return -1;
 		}
-
-		if (kv_attrs[i].handler(kv_attrs[i].dest, value, kv_attrs[i].len)) {
-			fprintf(stderr, "failed to process \"%s\"\n", value);
-			rc = -1;
-			free(value);
-			break;
+		p = val + val_len + 1;
+
+		id = kv_key_lookup(key, key_len) - (int)first;
+		if (id < 0 || (unsigned int)id >= num_entries ||
+		    (seen & (1U << id)))
+			continue;
+		seen |= 1U << id;
+
+		if (val_len >= sizeof(value)) {
+			kv_err(src, "value for \"%s\" is too long\n",
+			       kv_attrs[id].key);
+			return -1;
+		}
+		memcpy(value, val, val_len);
+		value[val_len] = '\0';
+
+		if (kv_attrs[id].handler(kv_attrs[id].dest, value,
+		                         kv_attrs[id].len)) {
+			kv_err(src, "failed to process %s=\"%s\"\n",
+			       kv_attrs[id].key, value);
+			return -1;
 		}
+	}
 
-		free(value);
+	for (i = 0; i < num_entries; i++) {
+		if (!(seen & (1U << i))) {
+			kv_err(src, "key \"%s\" not found, aborting\n",
+			       kv_attrs[i].key);
+			return -1;
+		}
 	}
 
-	return rc;
+	return 0;
 }
 
-static int parse_header(const char *line, struct fmap *fmap) {
+static int parse_header(const struct kv_src *src,
+                        const char *line, size_t len, struct fmap *fmap)
+{
 	struct kv_attr kv_attrs[] = {
-		{ .key = "fmap_signature",
+		[KV_FMAP_SIGNATURE - KV_FMAP_SIGNATURE] = {
+		  .key = "fmap_signature",
 		  .dest = &fmap->signature,
 		  .len = strlen(FMAP_SIGNATURE),
 		  .handler = do_signature,
 		},
-		{ .key = "fmap_ver_major",
+		[KV_FMAP_VER_MAJOR - KV_FMAP_SIGNATURE] = {
+		  .key = "fmap_ver_major",
 		  .dest = &fmap->ver_major,
 		  .len = sizeof(fmap->ver_major),
 		  .handler = do_strtoul,
 		},
-		{ .key = "fmap_ver_minor",
+		[KV_FMAP_VER_MINOR - KV_FMAP_SIGNATURE] = {
+		  .key = "fmap_ver_minor",
 		  .dest = &fmap->ver_minor,
 		  .len = sizeof(fmap->ver_minor),
 		  .handler = do_strtoul,
 		},
-		{ .key = "fmap_base",
+		[KV_FMAP_BASE - KV_FMAP_SIGNATURE] = {
+		  .key = "fmap_base",
 		  .dest = &fmap->base,
 		  .len = sizeof(fmap->base),
 		  .handler = do_strtoul,
 		},
-		{ .key = "fmap_size",
+		[KV_FMAP_SIZE - KV_FMAP_SIGNATURE] = {
+		  .key = "fmap_size",
 		  .dest = &fmap->size,
 		  .len = sizeof(fmap->size),
 		  .handler = do_strtoul,
 		},
-		{ .key = "fmap_name",
+		[KV_FMAP_NAME - KV_FMAP_SIGNATURE] = {
+		  .key = "fmap_name",
 		  .dest = &fmap->name,
 		  .len = FMAP_STRLEN,	/* treated as a maximum length */
 		  .handler = do_strcpy,
 		},
-		{ .key = "fmap_nareas",
+		[KV_FMAP_NAREAS - KV_FMAP_SIGNATURE] = {
+		  .key = "fmap_nareas",
 		  .dest = &fmap->nareas,
 		  .len = sizeof(fmap->nareas),
 		  .handler = do_strtoul,
 		},
 	};
 
-	return doit(line, kv_attrs, ARRAY_SIZE(kv_attrs));
+	return doit(src, line, len, KV_FMAP_SIGNATURE,
+	            kv_attrs, ARRAY_SIZE(kv_attrs));
 }
 
-static int parse_area(const char *line, struct fmap_area *area) {
+static int parse_area(const struct kv_src *src,
+                      const char *line, size_t len, struct fmap_area *area)
+{
 	struct kv_attr kv_attrs[] = {
-		{ .key = "area_offset",
+		[KV_AREA_OFFSET - KV_AREA_OFFSET] = {
+		  .key = "area_offset",
 		  .dest = &area->offset,
 		  .len = sizeof(area->offset),
 		  .handler = do_strtoul,
 		},
-		{ .key = "area_size",
+		[KV_AREA_SIZE - KV_AREA_OFFSET] = {
+		  .key = "area_size",
 		  .dest = &area->size,
 		  .len = sizeof(area->size),
 		  .handler = do_strtoul,
 		},
-		{ .key = "area_name",
+		[KV_AREA_NAME - KV_AREA_OFFSET] = {
+		  .key = "area_name",
 		  .dest = &area->name,
 		  .len = FMAP_STRLEN,	/* treated as a maximum length */
 		  .handler = do_strcpy,
 		},
-		{ .key = "area_flags",
+		[KV_AREA_FLAGS - KV_AREA_OFFSET] = {
+		  .key = "area_flags",
 		  .dest = &area->flags,
 		  .len = sizeof(area->flags),
 		  .handler = do_flags,
 		},
 	};
 
-	return doit(line, kv_attrs, ARRAY_SIZE(kv_attrs));
+	return doit(src, line, len, KV_AREA_OFFSET,
+	            kv_attrs, ARRAY_SIZE(kv_attrs));
 }
 
-int input_kv_pair(const char *infile, const char *outfile)
+/*
+ * Newline scanners: store the offsets of up to @max newlines found in
+ * buf[start..len) into @nl and return how many were stored.
+ */
+typedef size_t (*kv_nl_scan_fn)(const char *buf, size_t len, size_t start,
+                                size_t *nl, size_t max);
+
+static size_t kv_nl_scan_scalar(const char *buf, size_t len, size_t start,
+                                size_t *nl, size_t max)
+{
+	const char *p = buf + start, *end = buf + len;
+	size_t n = 0;
+
+	while (n < max && p < end && (p = memchr(p, '\n', end - p))) {
+		nl[n++] = p - buf;
+		p++;
+	}
+
+	return n;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+#define KV_NL_SCAN_HAVE_SIMD
+
+__attribute__((target("sse2")))
+static size_t kv_nl_scan_sse2(const char *buf, size_t len, size_t start,
+                              size_t *nl, size_t max)
+{
+	const __m128i lf = _mm_set1_epi8('\n');
+	size_t offset = start, n = 0;
+
+	while (len >= 16 && offset <= len - 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)&buf[offset]);
+		unsigned int mask;
+
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, lf));
+		while (mask) {
+			if (n == max)
+				return n;
+			nl[n++] = offset + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+		offset += 16;
+	}
+
+	return n + kv_nl_scan_scalar(buf, len, offset, nl + n, max - n);
+}
+
+__attribute__((target("avx2")))
+static size_t kv_nl_scan_avx2(const char *buf, size_t len, size_t start,
+                              size_t *nl, size_t max)
+{
+	const __m256i lf = _mm256_set1_epi8('\n');
+	size_t offset = start, n = 0;
+
+	while (len >= 32 && offset <= len - 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)&buf[offset]);
+		unsigned int mask;
+
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, lf));
+		while (mask) {
+			if (n == max)
+				return n;
+			nl[n++] = offset + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+		offset += 32;
+	}
+
+	return n + kv_nl_scan_sse2(buf, len, offset, nl + n, max - n);
+}
+#endif
+
+/* pick the fastest scanner supported by the CPU we are running on */
+static kv_nl_scan_fn kv_nl_scan_select(void)
 {
-	char line[LINE_MAX];
-	FILE *fp_in, *fp_out;
+#ifdef KV_NL_SCAN_HAVE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return kv_nl_scan_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return kv_nl_scan_sse2;
+#endif
+	return kv_nl_scan_scalar;
+}
+
+struct kv_parse_job {
+	const char *buf;
+	size_t body;		/* offset of first area line */
+	const size_t *ends;	/* offset just past the end of each area line */
 	struct fmap *fmap;
-	int area;
-	int rc = EXIT_SUCCESS;
-	size_t total_size = 0;
+	unsigned int nchunks;
+	unsigned int next_chunk;	/* next chunk to be claimed by a worker */
+	unsigned int error;	/* lowest bad area index, UINT_MAX if none */
+};
+
+static size_t kv_area_line(const struct kv_parse_job *job, unsigned int i,
+                           size_t *len)
+{
+	size_t start = i ? job->ends[i - 1] + 1 : job->body;
+
+	*len = job->ends[i] - start;
+	return start;
+}
+
+static void *kv_parse_worker(void *arg)
+{
+	struct kv_parse_job *job = arg;
+	unsigned int chunk, i, end, best;
+	size_t start, len;
+
+	/* chunks are claimed in ascending order */
+	while ((chunk = __atomic_fetch_add(&job->next_chunk, 1,
+	                                   __ATOMIC_RELAXED)) < job->nchunks) {
+		i = chunk * KV_PARSE_CHUNK;
+
+		/* an error in an earlier chunk is the one to report */
+		if (i > __atomic_load_n(&job->error, __ATOMIC_RELAXED))
+			break;
+
+		end = i + KV_PARSE_CHUNK;
+		if (end > job->fmap->nareas)
+			end = job->fmap->nareas;
+
+		for (; i < end; i++) {
+			start = kv_area_line(job, i, &len);
+			if (!parse_area(NULL, job->buf + start, len,
+			                &job->fmap->areas[i]))
+				continue;
+
+			best = __atomic_load_n(&job->error, __ATOMIC_RELAXED);
+			while (i < best &&
+			       !__atomic_compare_exchange_n(&job->error, &best,
+			                                    i, 0,
+			                                    __ATOMIC_RELAXED,
+			                                    __ATOMIC_RELAXED))
+				;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Buffers reused from one input to the next, so that encoding many
+ * layouts in a row does not allocate for each of them.
+ */
+struct kv_parser {
+	size_t *ends;		/* end of each area line */
+	unsigned int ends_cap;
+	struct fmap *fmap;	/* result of last successful parse */
+	unsigned int areas_cap;
+	char *buf;		/* contents of inputs which cannot be mapped */
+	size_t buf_cap;
+};
+
+static void kv_parser_release(struct kv_parser *parser)
+{
+	free(parser->ends);
+	free(parser->fmap);
+	free(parser->buf);
+	memset(parser, 0, sizeof(*parser));
+}
+
+/*
+ * kv_parse_buffer - parse kv-pair text into an fmap
+ *
+ * @parser:	buffers to parse with
+ * @file:	name of input, used in error messages
+ * @buf:	text to parse, not necessarily NULL-terminated
+ * @len:	length of text
+ * @nthreads:	threads to parse area lines with, 0 for one per online CPU
+ * @bad_line:	if not NULL, set to the 1-based line of the first error
+ *
+ * The first line is the header, and each of the following fmap_nareas
+ * lines describes one area. Area lines are parsed in parallel straight
+ * into their slot in the returned fmap.
+ *
+ * returns fmap, owned by parser and valid until its next use, on success
+ * returns NULL to indicate failure
+ */
+static struct fmap *kv_parse_buffer(struct kv_parser *parser,
+                                    const char *file, const char *buf,
+                                    size_t len, int nthreads,
+                                    unsigned int *bad_line)
+{
+	struct kv_src src = { .file = file, .line = 1 };
+	struct kv_parse_job job;
+	struct fmap header, *fmap;
+	size_t *ends, header_len, start, area_len;
+	unsigned int nlines;
+	pthread_t *threads;
+	const char *nl;
+	int i, started = 0;
+
+	memset(&job, 0, sizeof(job));
+	nl = memchr(buf, '\n', len);
+	header_len = nl ? (size_t)(nl - buf) : len;
+	if (parse_header(&src, buf, header_len, &header))
+		goto kv_parse_buffer_fail;
+
+	/* one slot more than needed so that surplus lines are noticed */
+	if (parser->ends_cap < header.nareas + 1U) {
+		ends = realloc(parser->ends, (header.nareas + 1) * sizeof(*ends));
+		if (!ends)
+			goto kv_parse_buffer_fail;
+		parser->ends = ends;
+		parser->ends_cap = header.nareas + 1;
+	}
+	ends = parser->ends;
+
+	job.buf = buf;
+	job.body = nl ? header_len + 1 : len;
+	job.ends = ends;
+	nlines = kv_nl_scan_select()(buf, len, job.body,
+	                             ends, header.nareas + 1);
+
+	/* last line need not be terminated */
+	start = nlines ? ends[nlines - 1] + 1 : job.body;
+	if (nlines <= header.nareas && start < len)
+		ends[nlines++] = len;
+
+	if (nlines != header.nareas) {
+		src.line = nlines > header.nareas ? header.nareas + 2
+		                                  : nlines + 1;
+		kv_err(&src, "found %s area lines than fmap_nareas=\"%u\"\n",
+		       nlines > header.nareas ? "more" : "fewer",
+		       header.nareas);
+		goto kv_parse_buffer_fail;
+	}
+
+	if (!parser->fmap || parser->areas_cap < header.nareas) {
+		fmap = realloc(parser->fmap, sizeof(*fmap) +
+		               sizeof(fmap->areas[0]) * header.nareas);
+		if (!fmap)
+			goto kv_parse_buffer_fail;
+		parser->fmap = fmap;
+		parser->areas_cap = header.nareas;
+	}
+	fmap = parser->fmap;
+	memcpy(fmap, &header, sizeof(header));
+
+	job.fmap = fmap;
+	job.nchunks = (header.nareas + KV_PARSE_CHUNK - 1) / KV_PARSE_CHUNK;
+	job.error = UINT_MAX;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > (int)job.nchunks)
+		nthreads = job.nchunks;
+
+	/* the calling thread is one of the workers */
+	threads = nthreads > 1 ? calloc(nthreads - 1, sizeof(*threads)) : NULL;
+	if (threads) {
+		for (i = 0; i < nthreads - 1; i++) {
+			if (pthread_create(&threads[started], NULL,
+			                   kv_parse_worker, &job))
+				break;
+			started++;
+		}
+	}
+
+	kv_parse_worker(&job);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	if (job.error != UINT_MAX) {
+		/* parse the first bad line again, this time saying why */
+		src.line = job.error + 2;
+		start = kv_area_line(&job, job.error, &area_len);
+		parse_area(&src, buf + start, area_len,
+		           &fmap->areas[job.error]);
+		goto kv_parse_buffer_fail;
+	}
+
+	return fmap;
+
+kv_parse_buffer_fail:
+	if (bad_line)
+		*bad_line = src.line;
+	return NULL;
+}
+
+/*
+ * kv_load - map a file, or read all of it if it cannot be mapped
+ *
+ * @parser:	buffers to read unmappable files into
+ * @path:	file to load
+ * @len:	location to store length of contents
+ * @mapped:	location to store whether contents must be munmap()ed
+ *
+ * returns pointer to contents to indicate success
+ * returns NULL to indicate failure, with errno set
+ */
+static char *kv_load(struct kv_parser *parser, const char *path,
+                     size_t *len, int *mapped)
+{
+	struct stat st;
+	char *buf;
+	size_t size = 0;
+	ssize_t ret;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf != MAP_FAILED) {
+			madvise(buf, st.st_size, MADV_WILLNEED);
+			close(fd);
+			*len = st.st_size;
+			*mapped = 1;
+			return buf;
+		}
+	}
+
+	/* pipes and the like cannot be mapped */
+	for (;;) {
+		if (size == parser->buf_cap) {
+			size_t cap = parser->buf_cap ? parser->buf_cap * 2
+			                             : 1 << 16;
+
+			buf = realloc(parser->buf, cap);
+			if (!buf)
+				goto kv_load_fail;
+			parser->buf = buf;
+			parser->buf_cap = cap;
+		}
+
+		ret = read(fd, parser->buf + size, parser->buf_cap - size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			goto kv_load_fail;
+		if (ret == 0)
+			break;
+		size += ret;
+	}
+
+	close(fd);
+	*len = size;
+	*mapped = 0;
+	return parser->buf;
+
+kv_load_fail:
+	err = errno;
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+/* create or truncate @path and store @len bytes of @data in it */
+static int kv_write_file(const char *path, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "cannot open file \"%s\" (%s)\n",
+		        path, strerror(errno));
+		return -1;
+	}
+
+	/* a regular file takes it all in one go */
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		p += ret;
+		len -= ret;
+	}
+
+	if (close(fd) || len) {
+		fprintf(stderr, "failed to write fmap binary \"%s\"\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * kv_encode - encode one kv-pair file into an fmap binary
+ *
+ * @parser:	buffers to parse with
+ * @infile:	kv-pair input
+ * @outfile:	binary output, only created if the input is valid
+ * @nthreads:	threads to parse area lines with, 0 for one per online CPU
+ *
+ * returns 0 to indicate success
+ * returns <0 to indicate failure
+ */
+static int kv_encode(struct kv_parser *parser,
+                     const char *infile, const char *outfile, int nthreads)
+{
+	struct fmap *fmap;
+	char *buf;
+	size_t len;
+	int mapped, rc = -1;
 
-	fp_in = fopen(infile, "r");
-	if (!fp_in) {
+	buf = kv_load(parser, infile, &len, &mapped);
+	if (!buf) {
 		fprintf(stderr, "cannot open file \"%s\" (%s)\n",
 		        infile, strerror(errno));
-		rc = EXIT_FAILURE;
-		goto input_kv_pair_exit_1;
+		return -1;
 	}
 
-	fp_out = fopen(outfile, "w");
-	if (!fp_out) {
+	fmap = kv_parse_buffer(parser, infile, buf, len, nthreads, NULL);
+	if (fmap)
+		rc = kv_write_file(outfile, fmap, sizeof(*fmap) +
+		                   sizeof(fmap->areas[0]) * fmap->nareas);
+
+	if (mapped)
+		munmap(buf, len);
+	return rc;
+}
+
+int input_kv_pair(const char *infile, const char *outfile)
+{
+	struct kv_parser parser;
+	int rc;
+
+	memset(&parser, 0, sizeof(parser));
+	rc = kv_encode(&parser, infile, outfile, 0);
+	kv_parser_release(&parser);
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int input_kv_pair_update(const char *infile, const char *image,
+                         long int offset, size_t room)
+{
+	struct kv_parser parser;
+	struct fmap *fmap;
+	char *buf;
+	size_t len;
+	long int ret;
+	int fd, mapped, rc = EXIT_FAILURE;
+
+	memset(&parser, 0, sizeof(parser));
+	buf = kv_load(&parser, infile, &len, &mapped);
+	if (!buf) {
 		fprintf(stderr, "cannot open file \"%s\" (%s)\n",
 		        infile, strerror(errno));
-		rc = EXIT_FAILURE;
-		goto input_kv_pair_exit_1;
+		goto input_kv_pair_update_exit_1;
 	}
 
-	fmap = malloc(sizeof(*fmap));
+	fmap = kv_parse_buffer(&parser, infile, buf, len, 0, NULL);
 	if (!fmap)
-		goto input_kv_pair_exit_2;
-
-	/* assume first line contains fmap header */
-	memset(line, 0, sizeof(line));
-	if (!fgets(line, sizeof(line), fp_in) || parse_header(line, fmap)) {
-		fprintf(stderr, "failed to parse header\n");
-		rc = EXIT_FAILURE;
-		goto input_kv_pair_exit_2;
-	}
-
-	total_size = sizeof(*fmap) + (sizeof(fmap->areas[0]) * fmap->nareas);
-	fmap = realloc(fmap, total_size);
-	memset(line, 0, sizeof(line));
-	area = 0;
-	while (fgets(line, sizeof(line), fp_in)) {
-		if (parse_area(line, &fmap->areas[area])) {
-			rc = EXIT_FAILURE;
-			goto input_kv_pair_exit_2;
+		goto input_kv_pair_update_exit_2;
+
+	fd = open(image, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "cannot open file \"%s\" (%s)\n",
+		        image, strerror(errno));
+		goto input_kv_pair_update_exit_2;
+	}
+
+	ret = fmap_update_fd(fd, fmap, offset, room);
+	switch (ret) {
+	case FMAP_UPDATE_ERR_NOT_FOUND:
+		if (offset < 0)
+			fprintf(stderr, "no fmap found in \"%s\"\n", image);
+		else
+			fprintf(stderr, "no fmap found at 0x%lx in \"%s\", "
+			        "give its size to write a new one\n",
+			        offset, image);
+		break;
+	case FMAP_UPDATE_ERR_NO_ROOM:
+		fprintf(stderr, "fmap with %u areas does not fit in \"%s\"\n",
+		        fmap->nareas, image);
+		break;
+	case FMAP_UPDATE_ERR_IO:
+		fprintf(stderr, "failed to update \"%s\" (%s)\n",
+		        image, strerror(errno));
+		break;
+	default:
+		rc = EXIT_SUCCESS;
+		break;
+	}
+	close(fd);
+
+input_kv_pair_update_exit_2:
+	if (mapped)
+		munmap(buf, len);
+input_kv_pair_update_exit_1:
+	kv_parser_release(&parser);
+	return rc;
+}
+
+struct kv_batch_job {
+	char *const *pairs;
+	unsigned int npairs;
+	unsigned int next_pair;	/* next pair to be claimed by a worker */
+	unsigned int failed;	/* number of pairs which failed to encode */
+};
+
+static void *kv_batch_worker(void *arg)
+{
+	struct kv_batch_job *job = arg;
+	struct kv_parser parser;
+	unsigned int i;
+
+	memset(&parser, 0, sizeof(parser));
+	while ((i = __atomic_fetch_add(&job->next_pair, 1,
+	                               __ATOMIC_RELAXED)) < job->npairs) {
+		/* jobs run side by side, so each parses on one thread */
+		if (kv_encode(&parser, job->pairs[i * 2],
+		              job->pairs[i * 2 + 1], 1))
+			__atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+	}
+	kv_parser_release(&parser);
+
+	return NULL;
+}
+
+int input_kv_pair_batch(char *const pairs[], unsigned int npairs,
+                        int nthreads)
+{
+	struct kv_batch_job job;
+	pthread_t *threads;
+	int i, started = 0;
+
+	if (!pairs || nthreads < 0)
+		return EXIT_FAILURE;
+
+	memset(&job, 0, sizeof(job));
+	job.pairs = pairs;
+	job.npairs = npairs;
+
+	if (nthreads == 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > (int)npairs)
+		nthreads = npairs;
+
+	/* the calling thread is one of the workers */
+	threads = nthreads > 1 ? calloc(nthreads - 1, sizeof(*threads)) : NULL;
+	if (threads) {
+		for (i = 0; i < nthreads - 1; i++) {
+			if (pthread_create(&threads[started], NULL,
+			                   kv_batch_worker, &job))
+				break;
+			started++;
 		}
-		memset(line, 0, sizeof(line));
-		area++;
 	}
 
-	if (fwrite(fmap, 1, total_size, fp_out) != total_size) {
-		fprintf(stderr, "failed to write fmap binary\n");
-		rc = EXIT_FAILURE;
+	kv_batch_worker(&job);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	if (job.failed) {
+		fprintf(stderr, "%u of %u fmap binaries failed to encode\n",
+		        job.failed, npairs);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * kv_manifest_split - split manifest text into input/output path pairs
+ *
+ * @text:	manifest, modified in place to terminate each path
+ * @len:	length of manifest, text[len] must be writable
+ * @pairs:	location to store allocated array of paths
+ * @file:	name of manifest, used in error messages
+ *
+ * Each line names an input and an output separated by whitespace. Blank
+ * lines and lines starting with '#' are skipped.
+ *
+ * returns number of pairs to indicate success
+ * returns <0 to indicate failure
+ */
+static int kv_manifest_split(char *text, size_t len, char ***pairs,
+                             const char *file)
+{
+	struct kv_src src = { .file = file, .line = 0 };
+	char *p = text, *end = text + len, *eol, **v = NULL, **tmp;
+	char *word[3];
+	unsigned int n = 0, cap = 0, nwords;
+
+	for (; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		*eol = '\0';
+		src.line++;
+
+		for (nwords = 0; nwords < 3; nwords++) {
+			while (p < eol && kv_is_space(*p))
+				p++;
+			if (p == eol || (nwords == 0 && *p == '#'))
+				break;
+			word[nwords] = p;
+			while (p < eol && !kv_is_space(*p))
+				p++;
+			if (p < eol)
+				*p++ = '\0';
+		}
+
+		if (nwords == 0)
+			continue;
+		if (nwords != 2) {
+			kv_err(&src, "expected \"<input> <output>\"\n");
+			goto kv_manifest_split_fail;
+		}
+
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			tmp = realloc(v, cap * 2 * sizeof(*v));
+			if (!tmp)
+				goto kv_manifest_split_fail;
+			v = tmp;
+		}
+		v[n * 2] = word[0];
+		v[n * 2 + 1] = word[1];
+		n++;
 	}
 
-input_kv_pair_exit_2:
-	free(fmap);
-	fclose(fp_in);
-	fclose(fp_out);
-input_kv_pair_exit_1:
+	*pairs = v;
+	return n;
+
+kv_manifest_split_fail:
+	free(v);
+	return -1;
+}
+
+int input_kv_pair_manifest(const char *manifest, int nthreads)
+{
+	struct kv_parser parser;
+	char *buf, *text = NULL, **pairs = NULL;
+	size_t len;
+	int mapped, npairs, rc = EXIT_FAILURE;
+
+	memset(&parser, 0, sizeof(parser));
+	buf = kv_load(&parser, manifest, &len, &mapped);
+	if (!buf) {
+		fprintf(stderr, "cannot open file \"%s\" (%s)\n",
+		        manifest, strerror(errno));
+		goto input_kv_pair_manifest_exit;
+	}
+
+	/* paths are terminated in place, so work on a private copy */
+	text = malloc(len + 1);
+	if (text) {
+		memcpy(text, buf, len);
+		text[len] = '\0';
+	}
+	if (mapped)
+		munmap(buf, len);
+	if (!text)
+		goto input_kv_pair_manifest_exit;
+
+	npairs = kv_manifest_split(text, len, &pairs, manifest);
+	if (npairs >= 0)
+		rc = input_kv_pair_batch(pairs, npairs, nthreads);
+
+input_kv_pair_manifest_exit:
+	free(pairs);
+	free(text);
+	kv_parser_release(&parser);
 	return rc;
 }
 
@@ -366,12 +1143,40 @@ input_kv_pair_exit_1:
  * Unit testing stuff done here so we do not need to expose static functions.
  */
 
+static int kv_key_lookup_test() {
+	int rc = 0;
+	unsigned int i;
+	const char *unknown[] = {
+		"area_flags_raw", "fmap_", "area_sizes", "fmap_ver_mxnor", "",
+	};
+
+	for (i = 0; i < KV_KEY_COUNT; i++) {
+		if (kv_key_lookup(kv_keys[i].str, strlen(kv_keys[i].str)) !=
+		    (int)i) {
+			printf("FAILURE: kv_key_lookup failed for \"%s\"\n",
+			       kv_keys[i].str);
+			rc |= 1;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(unknown); i++) {
+		if (kv_key_lookup(unknown[i], strlen(unknown[i])) >= 0) {
+			printf("FAILURE: kv_key_lookup matched \"%s\"\n",
+			       unknown[i]);
+			rc |= 1;
+		}
+	}
+
+	return rc;
+}
+
 static int extract_value_test() {
 	int rc = 0, len = 512;
 	char kv[len];
-	char *ret;
+	const char *ret;
+	size_t val_len = 0;
 
-	if (extract_value(NULL, 0)) {
+	if (extract_value(NULL, NULL, &val_len)) {
 		printf("FAILURE: extract_value_test NULL case not "
 		       "handled properly\n");
 		rc |= 1;
@@ -379,22 +1184,30 @@ static int extract_value_test() {
 
 	/* normal case */
 	sprintf(kv, "foo=\"bar\"");
-	ret = extract_value(kv, len);
-	if (strcmp(ret, "bar")) {
-		printf("FAILURE: \"%s\" != \"%s\"\n", ret, "bar");
+	ret = extract_value(kv + 4, kv + strlen(kv), &val_len);
+	if (!ret || val_len != 3 || strncmp(ret, "bar", val_len)) {
+		printf("FAILURE: \"%.*s\" != \"%s\"\n",
+		       ret ? (int)val_len : 0, ret ? ret : "", "bar");
 		rc |= 1;
 	}
-	free(ret);
 
 	/* missing end quote */
 	memset(kv, 0, sizeof(kv));
 	sprintf(kv, "foo=\"bar");
-	ret = extract_value(kv, len);
+	ret = extract_value(kv + 4, kv + strlen(kv), &val_len);
 	if (ret) {
 		printf("FAILURE: missing end-quote not caught\n");
 		rc |= 1;
 	}
 
+	/* missing opening quote */
+	sprintf(kv, "foo=bar\"");
+	ret = extract_value(kv + 4, kv + strlen(kv), &val_len);
+	if (ret) {
+		printf("FAILURE: missing opening quote not caught\n");
+		rc |= 1;
+	}
+
 	return rc;
 }
 
@@ -519,15 +1332,22 @@ static int do_flags_test() {
 	uint16_t dest, tmp;
 	char src[512];
 
-	if ((do_flags(NULL, src, strlen(src)) == 0) ||
-	    (do_flags(&dest, NULL, strlen(src)) == 0)) {
+	sprintf(src, "static");
+	if ((do_flags(NULL, src, sizeof(dest)) == 0) ||
+	    (do_flags(&dest, NULL, sizeof(dest)) == 0)) {
 		printf("FAILURE: do_flags NULL case not handled properly\n");
 		rc |= 1;
 	}
 
+	/* destination larger than the flags field */
+	if (do_flags(&dest, src, sizeof(dest) + 1) == 0) {
+		printf("FAILURE: do_flags failed to catch bad length\n");
+		rc |= 1;
+	}
+
 	/* convert each flag individually */
 	for (i = 0; i < ARRAY_SIZE(flag_lut) && flag_lut[i].str; i++) {
-		do_flags(&dest, flag_lut[i].str, strlen(flag_lut[i].str));
+		do_flags(&dest, flag_lut[i].str, sizeof(dest));
 		if (dest != str2val(flag_lut[i].str, flag_lut)) {
 			printf("FAILURE: do_flags failed to convert %s\n",
 			       flag_lut[i].str);
@@ -548,7 +1368,7 @@ static int do_flags_test() {
 
 	}
 
-	do_flags(&dest, src, strlen(src));
+	do_flags(&dest, src, sizeof(dest));
 	if (dest != tmp) {
 		printf("FAILURE: do_flags %04x != %04x, src: %s\n",
 		       dest, tmp, src);
@@ -574,7 +1394,7 @@ static int doit_test() {
 	struct fmap fmap;
 	struct fmap_area fmap_area;
 	struct kv_attr attr[] = {
-		{ .key = "foo",
+		{ .key = "area_name",
 		  .dest = &dest,
 		  .len = LINE_MAX,
 		  .handler = do_strcpy,
@@ -585,40 +1405,69 @@ static int doit_test() {
 	sprintf(line, "fmap_signature=\"0x5f5f50414d465f5f\" "
 	              "fmap_ver_major=\"1\" fmap_ver_minor=\"0\" "
 		      "fmap_base=\"0x00000000ffe00000\" fmap_size=\"0x200000\" "
-		      "fmap_name=\"System BIOS\" fmap_nareas=\"4\"");
-	rc |= parse_header(line, &fmap);
+		      "fmap_name=\"System BIOS\" fmap_nareas=\"4\"\n");
+	if (parse_header(NULL, line, strlen(line), &fmap) ||
+	    fmap.base != 0xffe00000 || fmap.size != 0x200000 ||
+	    fmap.nareas != 4 || strcmp((char *)fmap.name, "System BIOS")) {
+		printf("FAILURE: doit failed to parse header\n");
+		rc |= 1;
+	}
 
-	/* parse a valid fmap area line */
-	sprintf(line, "area_offset=\"0x00040000\" area_size=\"0x00180000\" "
-	              "area_name=\"FV_MAIN\" area_flags=\"static,compressed\"");
-	rc |= parse_area(line, &fmap_area);
+	/* parse a valid fmap area line, keys in any order */
+	sprintf(line, "area_flags_raw=\"0x03\" area_flags=\"static,compressed\" "
+	              "area_name=\"FV_MAIN\" area_size=\"0x00180000\" "
+	              "area_offset=\"0x00040000\"");
+	if (parse_area(NULL, line, strlen(line), &fmap_area) ||
+	    fmap_area.offset != 0x40000 || fmap_area.size != 0x180000 ||
+	    fmap_area.flags != (FMAP_AREA_STATIC | FMAP_AREA_COMPRESSED) ||
+	    strcmp((char *)fmap_area.name, "FV_MAIN")) {
+		printf("FAILURE: doit failed to parse area\n");
+		rc |= 1;
+	}
 
 	/* partially matched key should be ignored */
-	sprintf(line, "foo_bar=\"foobar\" foo=\"bar\"");
-	if (doit(line, attr, 1) || strcmp(attr[0].dest, "bar")) {
+	sprintf(line, "area_name_x=\"foobar\" area_name=\"bar\"");
+	if (doit(NULL, line, strlen(line), KV_AREA_NAME, attr, 1) ||
+	    strcmp(attr[0].dest, "bar")) {
 		printf("FAILURE: doit failed to ignore partial key match "
 		       "(expected \"bar\", got \"%s\")\n",(char *)attr[0].dest);
 		rc |= 1;
 	}
 
+	/* first of several values for the same key wins */
+	sprintf(line, "area_name=\"first\" area_name=\"second\"");
+	if (doit(NULL, line, strlen(line), KV_AREA_NAME, attr, 1) ||
+	    strcmp(attr[0].dest, "first")) {
+		printf("FAILURE: doit did not keep first value "
+		       "(got \"%s\")\n", (char *)attr[0].dest);
+		rc |= 1;
+	}
+
+	/* value outside of line length must not be seen */
+	sprintf(line, "area_name=\"bar\"");
+	if (doit(NULL, line, strlen(line) - 1, KV_AREA_NAME, attr, 1) == 0) {
+		printf("FAILURE: doit read past end of line\n");
+		rc |= 1;
+	}
+
 	/* nonexitent key */
 	sprintf(line, "nonexistent=\"value\"");
-	if (doit(line, attr, 1) == 0) {
+	if (doit(NULL, line, strlen(line), KV_AREA_NAME, attr, 1) == 0) {
 		printf("FAILURE: doit returned false positive\n");
 		rc |= 1;
 	}
 
 	/* bad value (missing end quote) */
-	sprintf(line, "foo=\"bar");
-	if (doit(line, attr, 1) == 0) {
+	sprintf(line, "area_name=\"bar");
+	if (doit(NULL, line, strlen(line), KV_AREA_NAME, attr, 1) == 0) {
 		printf("FAILURE: doit did not catch bad key\n");
 		rc |= 1;
 	}
 
 	/* handler failure */
-	sprintf(line, "foo=\"bar\"");
+	sprintf(line, "area_name=\"bar\"");
 	attr[0].handler = dummy_handler;
-	if (doit(line, attr, 1) == 0) {
+	if (doit(NULL, line, strlen(line), KV_AREA_NAME, attr, 1) == 0) {
 		printf("FAILURE: handler should have failed\n");
 		rc |= 1;
 	}
@@ -626,15 +1475,278 @@ static int doit_test() {
 	return rc;
 }
 
+static int kv_nl_scan_test() {
+	int rc = 0;
+	char buf[300];
+	size_t expect[sizeof(buf)], got[sizeof(buf)];
+	size_t start, max, n_expect, n_got, i;
+	kv_nl_scan_fn scan = kv_nl_scan_select();
+
+	srand(0x0a0a);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = rand() % 7 ? 'x' : '\n';
+
+	/* every start alignment, with and without running out of slots */
+	for (start = 0; start < 64; start++) {
+		for (max = 0; max < 48; max += 5) {
+			n_expect = kv_nl_scan_scalar(buf, sizeof(buf), start,
+			                             expect, max);
+			n_got = scan(buf, sizeof(buf), start, got, max);
+			if (n_got != n_expect ||
+			    memcmp(got, expect, n_got * sizeof(got[0]))) {
+				printf("FAILURE: newline scan mismatch at "
+				       "start %zu, max %zu\n", start, max);
+				rc |= 1;
+			}
+		}
+	}
+
+	return rc;
+}
+
+/* build kv text for nareas areas, with area bad (if < nareas) broken */
+static char *kv_parse_test_text(unsigned int nareas, unsigned int bad,
+                                int trailing_newline)
+{
+	size_t size = 256 + (size_t)nareas * 160 + LINE_MAX * 2, len;
+	char *text = malloc(size);
+	unsigned int i;
+
+	if (!text)
+		return NULL;
+
+	len = sprintf(text, "fmap_signature=\"0x5f5f464d41505f5f\" "
+	              "fmap_ver_major=\"1\" fmap_ver_minor=\"1\" "
+	              "fmap_base=\"0x1000\" fmap_size=\"0x%x\" "
+	              "fmap_name=\"kv parse test\" fmap_nareas=\"%u\"",
+	              nareas * 0x100, nareas);
+	for (i = 0; i < nareas; i++) {
+		len += sprintf(text + len, "\narea_offset=\"0x%08x\" ",
+		               i * 0x100);
+		if (i != bad)
+			len += sprintf(text + len, "area_size=\"0x100\" ");
+		len += sprintf(text + len, "area_name=\"AREA_%u\" "
+		               "area_flags_raw=\"0x%02x\" area_flags=\"%s\"",
+		               i, i % 3, i % 3 ? "static" : "");
+	}
+
+	/* a line longer than LINE_MAX must not be split */
+	if (nareas) {
+		memset(text + len, ' ', LINE_MAX);
+		len += LINE_MAX;
+		len += sprintf(text + len, "area_comment=\"long\"");
+	}
+
+	if (trailing_newline)
+		len += sprintf(text + len, "\n");
+
+	return text;
+}
+
+static int kv_parse_buffer_test() {
+	int rc = 0;
+	unsigned int nareas = 5000, i, line;
+	int nthreads, trailing;
+	struct kv_parser parser;
+	struct fmap *fmap;
+	char *text, *p;
+
+	memset(&parser, 0, sizeof(parser));
+
+	for (trailing = 0; trailing < 2; trailing++) {
+		for (nthreads = 1; nthreads <= 4; nthreads += 3) {
+			text = kv_parse_test_text(nareas, nareas, trailing);
+			fmap = kv_parse_buffer(&parser, "test", text, strlen(text),
+			                       nthreads, NULL);
+			if (!fmap || fmap->nareas != nareas ||
+			    fmap->size != nareas * 0x100) {
+				printf("FAILURE: failed to parse %u areas "
+				       "using %d threads\n", nareas, nthreads);
+				rc |= 1;
+				free(text);
+				continue;
+			}
+
+			for (i = 0; i < nareas; i++) {
+				char name[FMAP_STRLEN];
+
+				snprintf(name, sizeof(name), "AREA_%u", i);
+				if (fmap->areas[i].offset != i * 0x100 ||
+				    fmap->areas[i].size != 0x100 ||
+				    fmap->areas[i].flags !=
+				    (i % 3 ? FMAP_AREA_STATIC : 0) ||
+				    strcmp((char *)fmap->areas[i].name, name)) {
+					printf("FAILURE: area %u parsed "
+					       "incorrectly\n", i);
+					rc |= 1;
+					break;
+				}
+			}
+
+			free(text);
+		}
+	}
+
+	/* the first bad line is reported, however the work is split */
+	text = kv_parse_test_text(nareas, 3000, 1);
+	line = 0;
+	if (kv_parse_buffer(&parser, "test", text, strlen(text), 4, &line) ||
+	    line != 3002) {
+		printf("FAILURE: expected error on line 3002, got %u\n", line);
+		rc |= 1;
+	}
+	free(text);
+
+	/* more area lines than the header announces */
+	text = kv_parse_test_text(nareas, nareas, 1);
+	strcat(text, "area_offset=\"0\"\n");
+	line = 0;
+	if (kv_parse_buffer(&parser, "test", text, strlen(text), 1, &line) ||
+	    line != nareas + 2) {
+		printf("FAILURE: surplus area line not caught (line %u)\n",
+		       line);
+		rc |= 1;
+	}
+
+	/* fewer area lines than the header announces */
+	p = strrchr(text, '\n');
+	*p = '\0';
+	p = strrchr(text, '\n');
+	*p = '\0';
+	p = strrchr(text, '\n');
+	*p = '\0';
+	line = 0;
+	if (kv_parse_buffer(&parser, "test", text, strlen(text), 1, &line) ||
+	    line != nareas) {
+		printf("FAILURE: missing area line not caught (line %u)\n",
+		       line);
+		rc |= 1;
+	}
+	free(text);
+
+	/* header only, no areas and no newline */
+	text = kv_parse_test_text(0, 0, 0);
+	fmap = kv_parse_buffer(&parser, "test", text, strlen(text), 0, NULL);
+	if (!fmap || fmap->nareas != 0) {
+		printf("FAILURE: failed to parse fmap without areas\n");
+		rc |= 1;
+	}
+	free(text);
+
+	/* empty input */
+	line = 0;
+	if (kv_parse_buffer(&parser, "test", "", 0, 0, &line) || line != 1) {
+		printf("FAILURE: empty input not caught\n");
+		rc |= 1;
+	}
+
+	kv_parser_release(&parser);
+	return rc;
+}
+
+static int kv_batch_test() {
+	int rc = 0;
+	unsigned int i, njobs = 8, bad = 5, nareas;
+	char dir[] = "/tmp/fmap_kv_batch_XXXXXX";
+	char paths[8 * 2][64], manifest[64], *pairs[8 * 2];
+	char *text, *data, *list;
+	struct kv_parser parser, reader;
+	struct fmap *fmap;
+	size_t len;
+	int mapped;
+
+	memset(&parser, 0, sizeof(parser));
+	memset(&reader, 0, sizeof(reader));
+	if (!mkdtemp(dir)) {
+		printf("FAILURE: cannot create %s\n", dir);
+		return 1;
+	}
+
+	list = malloc(njobs * 2 * sizeof(paths[0]) + 64);
+	sprintf(list, "# input output\n\n");
+	for (i = 0; i < njobs; i++) {
+		sprintf(paths[i * 2], "%s/in%u.txt", dir, i);
+		sprintf(paths[i * 2 + 1], "%s/out%u.bin", dir, i);
+		pairs[i * 2] = paths[i * 2];
+		pairs[i * 2 + 1] = paths[i * 2 + 1];
+		sprintf(list + strlen(list), "  %s\t%s\r\n",
+		        paths[i * 2], paths[i * 2 + 1]);
+
+		nareas = 100 + i * 37;
+		text = kv_parse_test_text(nareas, i == bad ? 3 : nareas, 1);
+		kv_write_file(paths[i * 2], text, strlen(text));
+		free(text);
+	}
+	sprintf(manifest, "%s/manifest", dir);
+	kv_write_file(manifest, list, strlen(list));
+
+	/* one bad input fails the batch but not the other jobs */
+	if (input_kv_pair_manifest(manifest, 3) != EXIT_FAILURE ||
+	    !access(paths[bad * 2 + 1], F_OK)) {
+		printf("FAILURE: bad batch job not caught\n");
+		rc |= 1;
+	}
+
+	for (i = 0; i < njobs; i++) {
+		if (i == bad)
+			continue;
+
+		text = kv_load(&reader, paths[i * 2], &len, &mapped);
+		fmap = text ? kv_parse_buffer(&parser, paths[i * 2], text,
+		                              len, 1, NULL) : NULL;
+		if (text && mapped)
+			munmap(text, len);
+		data = fmap ? kv_load(&reader, paths[i * 2 + 1],
+		                      &len, &mapped) : NULL;
+		if (!data || len != sizeof(*fmap) +
+		    sizeof(fmap->areas[0]) * fmap->nareas ||
+		    memcmp(data, fmap, len)) {
+			printf("FAILURE: batch output %u is wrong\n", i);
+			rc |= 1;
+		}
+		if (data && mapped)
+			munmap(data, len);
+	}
+
+	/* the same pairs given directly, without the bad one */
+	pairs[bad * 2] = pairs[0];
+	pairs[bad * 2 + 1] = pairs[1];
+	if (input_kv_pair_batch(pairs, njobs, 0) != EXIT_SUCCESS) {
+		printf("FAILURE: batch of good inputs failed\n");
+		rc |= 1;
+	}
+
+	/* malformed manifest */
+	sprintf(list, "%s %s extra\n", paths[0], paths[1]);
+	kv_write_file(manifest, list, strlen(list));
+	if (input_kv_pair_manifest(manifest, 1) != EXIT_FAILURE) {
+		printf("FAILURE: malformed manifest not caught\n");
+		rc |= 1;
+	}
+
+	for (i = 0; i < njobs * 2; i++)
+		unlink(paths[i]);
+	unlink(manifest);
+	rmdir(dir);
+	free(list);
+	kv_parser_release(&parser);
+	kv_parser_release(&reader);
+	return rc;
+}
+
 int input_kv_pair_test()
 {
 	int rc = EXIT_SUCCESS;
 
+	rc |= kv_key_lookup_test();
 	rc |= extract_value_test();
 	rc |= trivial_helper_function_tests();
 	rc |= do_strtoul_test();
 	rc |= do_flags_test();
 	rc |= doit_test();
+	rc |= kv_nl_scan_test();
+	rc |= kv_parse_buffer_test();
+	rc |= kv_batch_test();
 
 	if (rc)
 		printf("FAILED\n");
@@ -36,6 +36,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 
 #include "kv_pair.h"
 
@@ -52,6 +53,136 @@ enum kv_pair_style kv_pair_get_style()
 	return _style;
 }
 
+/*
+ * Pairs appended to a list, and their strings, are carved out of a bump
+ * arena owned by the node they were appended to, normally the list head
+ * from kv_pair_new(). Freeing or resetting the list releases or rewinds
+ * the arena as a whole rather than each pair and string separately.
+ */
+#define KV_ARENA_MIN_BLOCK	4096
+
+struct kv_arena_block {
+	struct kv_arena_block *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct kv_arena {
+	struct kv_arena_block *first;
+	struct kv_arena_block *cur;
+	struct kv_arena *next_free;	/* used while freeing a list */
+};
+
+static void kv_arena_free(struct kv_arena *arena)
+{
+	struct kv_arena_block *block, *next;
+
+	for (block = arena->first; block != NULL; block = next) {
+		next = block->next;
+		free(block);
+	}
+	free(arena);
+}
+
+static void kv_arena_rewind(struct kv_arena *arena)
+{
+	struct kv_arena_block *block;
+
+	for (block = arena->first; block != NULL; block = block->next)
+		block->used = 0;
+	arena->cur = arena->first;
+}
+
+/* make at least len contiguous bytes available in the current block */
+static int kv_arena_reserve(struct kv_arena *arena, size_t len)
+{
+	struct kv_arena_block *block;
+	size_t size;
+
+	/* after a rewind, reuse the blocks already allocated */
+	while (arena->cur && arena->cur->size - arena->cur->used < len &&
+	       arena->cur->next) {
+		arena->cur = arena->cur->next;
+		arena->cur->used = 0;
+	}
+	if (arena->cur && arena->cur->size - arena->cur->used >= len)
+		return 0;
+
+	size = arena->cur ? arena->cur->size * 2 : KV_ARENA_MIN_BLOCK;
+	while (size < len)
+		size *= 2;
+
+	block = malloc(sizeof(*block) + size);
+	if (!block)
+		return -1;
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+
+	if (arena->cur)
+		arena->cur->next = block;
+	else
+		arena->first = block;
+	arena->cur = block;
+	return 0;
+}
+
+/* mark len reserved bytes as used, keeping pairs pointer-aligned */
+static void kv_arena_commit(struct kv_arena *arena, size_t len)
+{
+	struct kv_arena_block *block = arena->cur;
+
+	len = (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	block->used = len < block->size - block->used ?
+	              block->used + len : block->size;
+}
+
+static void *kv_arena_alloc(struct kv_arena *arena, size_t len)
+{
+	void *p;
+
+	if (kv_arena_reserve(arena, len) < 0)
+		return NULL;
+
+	p = arena->cur->data + arena->cur->used;
+	kv_arena_commit(arena, len);
+	return p;
+}
+
+static char *kv_arena_strdup(struct kv_arena *arena, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p;
+
+	p = kv_arena_alloc(arena, len);
+	if (p)
+		memcpy(p, s, len);
+	return p;
+}
+
+/* arena pairs are appended to, created on first use */
+static struct kv_arena *kv_pair_arena(struct kv_pair *kv_list)
+{
+	if (!kv_list->arena)
+		kv_list->arena = calloc(1, sizeof(*kv_list->arena));
+	return kv_list->arena;
+}
+
+/* link a pair allocated from the arena of kv_list in at the end */
+static void kv_pair_link(struct kv_pair *kv_list, struct kv_pair *kv_new)
+{
+	struct kv_pair *kv_ptr;
+
+	/* the tail is only a hint, as pairs may be added via other nodes */
+	kv_ptr = kv_list->tail ? kv_list->tail : kv_list;
+	while (kv_ptr->next != NULL)
+		kv_ptr = kv_ptr->next;
+
+	kv_ptr->next = kv_new;
+	kv_list->tail = kv_new;
+}
+
 struct kv_pair *kv_pair_new(void)
 {
 	struct kv_pair *kv;
@@ -66,35 +197,46 @@ struct kv_pair *kv_pair_new(void)
 struct kv_pair *kv_pair_add(struct kv_pair *kv_list,
                             const char *key, const char *value)
 {
+	struct kv_arena *arena;
 	struct kv_pair *kv_new;
-	struct kv_pair *kv_ptr;
 
-	kv_new = kv_pair_new();
+	/* first in the list if no list provided */
+	if (!kv_list) {
+		kv_new = kv_pair_new();
+		if (!kv_new)
+			return NULL;
+
+		if (key) {
+			kv_new->key = strdup(key);
+			if (!kv_new->key)
+				goto kv_pair_add_failed;
+		}
+		if (value) {
+			kv_new->value = strdup(value);
+			if (!kv_new->value)
+				goto kv_pair_add_failed;
+		}
+		return kv_new;
+	}
+
+	arena = kv_pair_arena(kv_list);
+	if (!arena)
+		return NULL;
+
+	kv_new = kv_arena_alloc(arena, sizeof(*kv_new));
 	if (!kv_new)
 		return NULL;
+	memset(kv_new, 0, sizeof(*kv_new));
+	kv_new->in_arena = 1;
 
 	/* save key=value strings if provided */
-	if (key) {
-		kv_new->key = strdup(key);
-		if (!kv_new->key)
-			goto kv_pair_add_failed;
-	}
-	if (value) {
-		kv_new->value = strdup(value);
-		if (!kv_new->value)
-			goto kv_pair_add_failed;
-	}
-
-	/* first in the list if no list provided */
-	if (kv_list) {
-		/* find the end of list */
-		for (kv_ptr = kv_list; kv_ptr->next != NULL;
-		     kv_ptr = kv_ptr->next)
-			;
+	if (key && !(kv_new->key = kv_arena_strdup(arena, key)))
+		return NULL;
+	if (value && !(kv_new->value = kv_arena_strdup(arena, value)))
+		return NULL;
 
-		/* link in the new pair at the end */
-		kv_ptr->next = kv_new;
-	}
+	/* link in the new pair at the end */
+	kv_pair_link(kv_list, kv_new);
 
 	/* return pointer to the new pair */
 	return kv_new;
@@ -120,44 +262,141 @@ struct kv_pair *kv_pair_add_bool(struct kv_pair *kv_list,
 struct kv_pair *kv_pair_fmt(struct kv_pair *kv_list,
         		    const char *kv_key, const char *format, ...)
 {
-	char kv_value[KV_PAIR_MAX_VALUE_LEN];
+	struct kv_arena *arena;
+	struct kv_pair *kv_new;
+	char *kv_value;
+	size_t space;
 	va_list vptr;
+	int len;
 
-	memset(kv_value, 0, sizeof(kv_value));
+	if (!kv_list) {
+		char buf[KV_PAIR_MAX_VALUE_LEN];
+
+		va_start(vptr, format);
+		vsnprintf(buf, sizeof(buf), format, vptr);
+		va_end(vptr);
+		return kv_pair_add(NULL, kv_key, buf);
+	}
+
+	arena = kv_pair_arena(kv_list);
+	if (!arena)
+		return NULL;
+	kv_new = kv_arena_alloc(arena, sizeof(*kv_new));
+	if (!kv_new)
+		return NULL;
+	memset(kv_new, 0, sizeof(*kv_new));
+	kv_new->in_arena = 1;
+
+	/* format straight into the arena, values are truncated as before */
+	if (kv_arena_reserve(arena, 1) < 0)
+		return NULL;
+	kv_value = arena->cur->data + arena->cur->used;
+	space = arena->cur->size - arena->cur->used;
+	if (space > KV_PAIR_MAX_VALUE_LEN)
+		space = KV_PAIR_MAX_VALUE_LEN;
 
 	va_start(vptr, format);
-	vsnprintf(kv_value, sizeof(kv_value), format, vptr);
+	len = vsnprintf(kv_value, space, format, vptr);
 	va_end(vptr);
+	if (len < 0)
+		return NULL;
+
+	if ((size_t)len >= space && space < KV_PAIR_MAX_VALUE_LEN) {
+		/* did not fit in what was left of the block */
+		space = (size_t)len + 1 < KV_PAIR_MAX_VALUE_LEN ?
+		        (size_t)len + 1 : KV_PAIR_MAX_VALUE_LEN;
+		if (kv_arena_reserve(arena, space) < 0)
+			return NULL;
+		kv_value = arena->cur->data + arena->cur->used;
+
+		va_start(vptr, format);
+		vsnprintf(kv_value, space, format, vptr);
+		va_end(vptr);
+	}
+	kv_arena_commit(arena, strlen(kv_value) + 1);
+	kv_new->value = kv_value;
 
-	return kv_pair_add(kv_list, kv_key, kv_value);
+	if (kv_key && !(kv_new->key = kv_arena_strdup(arena, kv_key)))
+		return NULL;
+
+	kv_pair_link(kv_list, kv_new);
+	return kv_new;
 }
 
-void kv_pair_free(struct kv_pair *kv_list)
+/*
+ * Free nodes and strings that were allocated individually, and queue the
+ * arenas found along the list on *arenas, since later pairs in the list
+ * may live in them.
+ */
+static void kv_pair_release(struct kv_pair *kv_list, struct kv_arena **arenas)
 {
 	struct kv_pair *kv_ptr = kv_list;
 	struct kv_pair *kv_next;
 
 	while (kv_ptr != NULL) {
+		kv_next = kv_ptr->next;
+
+		if (kv_ptr->arena) {
+			kv_ptr->arena->next_free = *arenas;
+			*arenas = kv_ptr->arena;
+			kv_ptr->arena = NULL;
+		}
+
 		/* free key/value strings */
-		if (kv_ptr->key)
+		if (!kv_ptr->in_arena) {
 			free(kv_ptr->key);
-		if (kv_ptr->value)
 			free(kv_ptr->value);
+			free(kv_ptr);
+		}
 
-		/* free current pair move to next */
-		kv_next = kv_ptr->next;
-		free(kv_ptr);
+		/* move to next */
 		kv_ptr = kv_next;
 	}
 }
 
+void kv_pair_free(struct kv_pair *kv_list)
+{
+	struct kv_arena *arenas = NULL, *next;
+
+	kv_pair_release(kv_list, &arenas);
+	for (; arenas != NULL; arenas = next) {
+		next = arenas->next_free;
+		kv_arena_free(arenas);
+	}
+}
+
+void kv_pair_reset(struct kv_pair *kv_list)
+{
+	struct kv_arena *arena, *arenas = NULL, *next;
+
+	if (!kv_list)
+		return;
+
+	/* keep this node's arena for the next record, free everything else */
+	arena = kv_list->arena;
+	kv_list->arena = NULL;
+	kv_pair_release(kv_list->next, &arenas);
+	for (; arenas != NULL; arenas = next) {
+		next = arenas->next_free;
+		kv_arena_free(arenas);
+	}
+
+	kv_list->next = NULL;
+	kv_list->tail = NULL;
+	kv_list->arena = arena;
+	if (arena)
+		kv_arena_rewind(arena);
+}
+
 void kv_pair_print_to_file(FILE* fp, struct kv_pair *kv_list,
                            enum kv_pair_style style)
 {
 	struct kv_pair *kv_ptr;
 
+	/* the JSON, CSV and TLV record styles are left to the fmap printer */
 	switch (style) {
 	case KV_STYLE_PAIR:
+	default:
 		for (kv_ptr = kv_list; kv_ptr != NULL; kv_ptr = kv_ptr->next) {
 			if (kv_ptr->key && kv_ptr->value) {
 				fprintf(fp, "%s=\"%s\" ",
@@ -219,3 +458,122 @@ int kv_pair_size(struct kv_pair *kv_list) {
 	}
 	return count;
 }
+
+/*
+ * LCOV_EXCL_START
+ * Unit testing stuff done here so we do not need to expose static functions.
+ */
+int kv_pair_test(void)
+{
+	static const struct {
+		enum kv_pair_style style;
+		const char *expected;
+	} styles[] = {
+		{ KV_STYLE_PAIR, "a=\"1\" b=\"x y\" \n" },
+		{ KV_STYLE_VALUE, "1 | x y\n" },
+		{ KV_STYLE_LONG, "a                    | 1\n"
+		                 "b                    | x y\n\n" },
+		{ KV_STYLE_JSON, "a=\"1\" b=\"x y\" \n" },
+		{ KV_STYLE_CSV, "a=\"1\" b=\"x y\" \n" },
+		{ KV_STYLE_TLV, "a=\"1\" b=\"x y\" \n" },
+	};
+	struct kv_pair *kv, *kv_ptr, *single = NULL, *style_kv = NULL;
+	char key[32], long_value[KV_PAIR_MAX_VALUE_LEN * 2], *out = NULL;
+	size_t out_len;
+	FILE *fp;
+	int i, round, rc = 1;
+
+	kv = kv_pair_new();
+	if (!kv)
+		return 1;
+
+	style_kv = kv_pair_add(NULL, "a", "1");
+	kv_pair_add(style_kv, "b", "x y");
+
+	/* refill the same list a few times, enough to need more blocks */
+	for (round = 0; round < 3; round++) {
+		kv_pair_reset(kv);
+		for (i = 0; i < 1000; i++) {
+			snprintf(key, sizeof(key), "key%d", i);
+			if (!kv_pair_fmt(kv, key, "%d", i * round)) {
+				printf("FAILURE: failed to add pair %d\n", i);
+				goto kv_pair_test_exit;
+			}
+		}
+		kv_pair_add_bool(kv, "bool", round);
+
+		if (kv_pair_size(kv) != 1001) {
+			printf("FAILURE: list has %d pairs\n", kv_pair_size(kv));
+			goto kv_pair_test_exit;
+		}
+
+		/* pairs stay in order of addition */
+		for (i = 0, kv_ptr = kv->next; i < 1000;
+		     i++, kv_ptr = kv_ptr->next) {
+			snprintf(key, sizeof(key), "key%d", i);
+			if (strcmp(kv_ptr->key, key) ||
+			    atoi(kv_ptr->value) != i * round) {
+				printf("FAILURE: pair %d is incorrect\n", i);
+				goto kv_pair_test_exit;
+			}
+		}
+		if (strcmp(kv_pair_get_value(kv, "bool"), round ? "yes" : "no")) {
+			printf("FAILURE: boolean pair is incorrect\n");
+			goto kv_pair_test_exit;
+		}
+	}
+
+	/* values are truncated to KV_PAIR_MAX_VALUE_LEN - 1 characters */
+	memset(long_value, 'x', sizeof(long_value) - 1);
+	long_value[sizeof(long_value) - 1] = '\0';
+	kv_pair_fmt(kv, "long", "%s", long_value);
+	if (strlen(kv_pair_get_value(kv, "long")) != KV_PAIR_MAX_VALUE_LEN - 1) {
+		printf("FAILURE: long value was not truncated\n");
+		goto kv_pair_test_exit;
+	}
+
+	/* pairs can also be added through any node in the list */
+	kv_pair_add(kv->next, "inner", "value");
+	kv_pair_add(kv, "outer", "value");
+	for (kv_ptr = kv; kv_ptr->next; kv_ptr = kv_ptr->next)
+		;
+	if (strcmp(kv_ptr->key, "outer") || !kv_pair_get_value(kv, "inner")) {
+		printf("FAILURE: failed to append through inner node\n");
+		goto kv_pair_test_exit;
+	}
+
+	/* the record styles print lists like KV_STYLE_PAIR */
+	for (i = 0; i < sizeof(styles) / sizeof(styles[0]); i++) {
+		fp = open_memstream(&out, &out_len);
+		kv_pair_print_to_file(fp, style_kv, styles[i].style);
+		fclose(fp);
+		if (strcmp(out, styles[i].expected)) {
+			printf("FAILURE: style %d printed \"%s\"\n",
+			       styles[i].style, out);
+			goto kv_pair_test_exit;
+		}
+		free(out);
+		out = NULL;
+	}
+
+	/* without a list, a standalone pair is created */
+	single = kv_pair_fmt(NULL, "single", "%s", "pair");
+	if (!single || strcmp(single->value, "pair")) {
+		printf("FAILURE: failed to create standalone pair\n");
+		goto kv_pair_test_exit;
+	}
+	kv_pair_add(single, "second", "pair");
+	if (kv_pair_size(single) != 2) {
+		printf("FAILURE: failed to append to standalone pair\n");
+		goto kv_pair_test_exit;
+	}
+
+	rc = 0;
+kv_pair_test_exit:
+	free(out);
+	kv_pair_free(style_kv);
+	kv_pair_free(single);
+	kv_pair_free(kv);
+	return rc;
+}
+/* LCOV_EXCL_STOP */
@@ -48,12 +48,23 @@ enum kv_pair_style {
 	KV_STYLE_VALUE,		/* | value1 | value2 | */
 	KV_STYLE_LONG,		/* key1         | value1 */
 				/* key2         | value2 */
+	/* fmap printer only, see fmap_output_set_format() */
+	KV_STYLE_JSON,		/* {"key1":"value1","key2":"value2"} */
+	KV_STYLE_CSV,		/* value1,value2 */
+	KV_STYLE_TLV,		/* binary, see enum fmap_tlv_tag */
 };
 
+struct kv_arena;
+
 struct kv_pair {
 	char *key;
 	char *value;
 	struct kv_pair *next;
+
+	/* internal bookkeeping, see kv_pair.c */
+	struct kv_pair *tail;		/* last pair added through this node */
+	struct kv_arena *arena;		/* storage for pairs added to it */
+	int in_arena;			/* allocated from another's arena */
 };
 
 extern enum kv_pair_style kv_pair_get_style();
@@ -117,11 +128,23 @@ extern struct kv_pair *kv_pair_fmt(struct kv_pair *kv_list,
  */
 extern void kv_pair_free(struct kv_pair *kv_list);
 
+/*
+ * kv_pair_reset  -  remove all pairs after the first, keeping its storage
+ *                   so the list can be refilled without allocating
+ *
+ * @kv_list:    pointer to key=value list
+ */
+extern void kv_pair_reset(struct kv_pair *kv_list);
+
 /*
  * kv_pair_print  -  print a key=value pair list
  *
  * @kv_list:    pointer to key=value list
  * @style:      print style
+ *
+ * KV_STYLE_JSON, KV_STYLE_CSV and KV_STYLE_TLV describe whole fmap records
+ * and are only supported by the fmap printer. Lists are printed in
+ * KV_STYLE_PAIR for them.
  */
 extern void kv_pair_print_to_file(FILE* fp, struct kv_pair *kv_list,
                                   enum kv_pair_style style);
@@ -150,4 +173,7 @@ extern const char *kv_pair_get_value(struct kv_pair *kv_list,
  */
 extern int kv_pair_size(struct kv_pair *kv_list);
 
+/* unit testing stuff */
+extern int kv_pair_test(void);
+
 #endif /* FLASHMAP_LIB_KV_PAIR_H__ */
@@ -27,235 +27,339 @@
 
 #include "sha.h"
 
-// Some machines lack byteswap.h and endian.h.  These have to use the
-// slower code, even if they're little-endian.
+#include <stdio.h>
+#include <string.h>
 
-#if defined(HAVE_ENDIAN_H) && defined(HAVE_LITTLE_ENDIAN)
+// The block transform is picked at runtime: SHA-NI where the CPU has the
+// SHA extensions, an SSSE3 message schedule on other x86 CPUs, and portable
+// C everywhere else. All of them process whole 64-byte blocks straight from
+// the caller's buffer; SHA_update() only copies partial blocks into ctx->buf.
 
-#include <byteswap.h>
-#include <memory.h>
+typedef void (*sha1_blocks_fn)(uint32_t state[5], const uint8_t* data,
+                               size_t nblocks);
 
-// This version is about 28% faster than the generic version below,
-// but assumes little-endianness.
-
-static inline uint32_t ror27(uint32_t val) {
-    return (val >> 27) | (val << 5);
-}
-static inline uint32_t ror2(uint32_t val) {
-    return (val >> 2) | (val << 30);
-}
-static inline uint32_t ror31(uint32_t val) {
-    return (val >> 31) | (val << 1);
-}
+#define rol(bits, value) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
-static void SHA1_Transform(SHA_CTX* ctx) {
-    uint32_t W[80];
-    register uint32_t A, B, C, D, E;
+#define SHA_K1 0x5A827999
+#define SHA_K2 0x6ED9EBA1
+#define SHA_K3 0x8F1BBCDC
+#define SHA_K4 0xCA62C1D6
+
+#define SHA_F1(B,C,D) (D^(B&(C^D)))
+#define SHA_F2(B,C,D) (B^C^D)
+#define SHA_F3(B,C,D) ((B&C)|(D&(B|C)))
+#define SHA_F4(B,C,D) (B^C^D)
+
+// The portable version keeps a rolling 16-word message schedule and expands
+// it as the rounds go, which keeps compilers from vectorizing the schedule
+// into overlapping loads and stores.
+#define SHA_W(t)                                                        \
+    ((t) < 16 ? W[t] :                                                  \
+     (W[(t) & 15] = rol(1, W[((t) + 13) & 15] ^ W[((t) + 8) & 15] ^     \
+                           W[((t) + 2) & 15] ^ W[(t) & 15])))
+
+#define SHA_GROUND(F,K,A,B,C,D,E,t)             \
+    E += rol(5,A) + F(B,C,D) + K + SHA_W(t);    \
+    B = rol(30,B);
+
+#define SHA_GROUNDS5(F,K,t)                     \
+    SHA_GROUND(F,K,A,B,C,D,E,t + 0)             \
+    SHA_GROUND(F,K,E,A,B,C,D,t + 1)             \
+    SHA_GROUND(F,K,D,E,A,B,C,t + 2)             \
+    SHA_GROUND(F,K,C,D,E,A,B,t + 3)             \
+    SHA_GROUND(F,K,B,C,D,E,A,t + 4)
+
+#define SHA_GROUNDS20(F,K,t)                    \
+    SHA_GROUNDS5(F,K,t + 0)                     \
+    SHA_GROUNDS5(F,K,t + 5)                     \
+    SHA_GROUNDS5(F,K,t + 10)                    \
+    SHA_GROUNDS5(F,K,t + 15)
+
+static void SHA1_transform_generic(uint32_t state[5], const uint8_t* p,
+                                   size_t nblocks) {
+    uint32_t W[16];
+    uint32_t A, B, C, D, E;
     int t;
 
-    A = ctx->state[0];
-    B = ctx->state[1];
-    C = ctx->state[2];
-    D = ctx->state[3];
-    E = ctx->state[4];
-
-#define SHA_F1(A,B,C,D,E,t)                     \
-    E += ror27(A) +                             \
-        (W[t] = bswap_32(ctx->buf.w[t])) +      \
-        (D^(B&(C^D))) + 0x5A827999;             \
-    B = ror2(B);
-
-    for (t = 0; t < 15; t += 5) {
-        SHA_F1(A,B,C,D,E,t + 0);
-        SHA_F1(E,A,B,C,D,t + 1);
-        SHA_F1(D,E,A,B,C,t + 2);
-        SHA_F1(C,D,E,A,B,t + 3);
-        SHA_F1(B,C,D,E,A,t + 4);
-    }
-    SHA_F1(A,B,C,D,E,t + 0);  // 16th one, t == 15
-
-#undef SHA_F1
-
-#define SHA_F1(A,B,C,D,E,t)                                     \
-    E += ror27(A) +                                             \
-        (W[t] = ror31(W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16])) +   \
-        (D^(B&(C^D))) + 0x5A827999;                             \
-    B = ror2(B);
-
-    SHA_F1(E,A,B,C,D,t + 1);
-    SHA_F1(D,E,A,B,C,t + 2);
-    SHA_F1(C,D,E,A,B,t + 3);
-    SHA_F1(B,C,D,E,A,t + 4);
-
-#undef SHA_F1
-
-#define SHA_F2(A,B,C,D,E,t)                                     \
-    E += ror27(A) +                                             \
-        (W[t] = ror31(W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16])) +   \
-        (B^C^D) + 0x6ED9EBA1;                                   \
-    B = ror2(B);
-
-    for (t = 20; t < 40; t += 5) {
-        SHA_F2(A,B,C,D,E,t + 0);
-        SHA_F2(E,A,B,C,D,t + 1);
-        SHA_F2(D,E,A,B,C,t + 2);
-        SHA_F2(C,D,E,A,B,t + 3);
-        SHA_F2(B,C,D,E,A,t + 4);
-    }
-
-#undef SHA_F2
-
-#define SHA_F3(A,B,C,D,E,t)                                     \
-    E += ror27(A) +                                             \
-        (W[t] = ror31(W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16])) +   \
-        ((B&C)|(D&(B|C))) + 0x8F1BBCDC;                         \
-    B = ror2(B);
-
-    for (; t < 60; t += 5) {
-        SHA_F3(A,B,C,D,E,t + 0);
-        SHA_F3(E,A,B,C,D,t + 1);
-        SHA_F3(D,E,A,B,C,t + 2);
-        SHA_F3(C,D,E,A,B,t + 3);
-        SHA_F3(B,C,D,E,A,t + 4);
-    }
-
-#undef SHA_F3
-
-#define SHA_F4(A,B,C,D,E,t)                                     \
-    E += ror27(A) +                                             \
-        (W[t] = ror31(W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16])) +   \
-        (B^C^D) + 0xCA62C1D6;                                   \
-    B = ror2(B);
+    while (nblocks--) {
+        for (t = 0; t < 16; ++t) {
+            uint32_t tmp =  *p++ << 24;
+            tmp |= *p++ << 16;
+            tmp |= *p++ << 8;
+            tmp |= *p++;
+            W[t] = tmp;
+        }
 
-    for (; t < 80; t += 5) {
-        SHA_F4(A,B,C,D,E,t + 0);
-        SHA_F4(E,A,B,C,D,t + 1);
-        SHA_F4(D,E,A,B,C,t + 2);
-        SHA_F4(C,D,E,A,B,t + 3);
-        SHA_F4(B,C,D,E,A,t + 4);
+        A = state[0];
+        B = state[1];
+        C = state[2];
+        D = state[3];
+        E = state[4];
+
+        SHA_GROUNDS20(SHA_F1, SHA_K1, 0)
+        SHA_GROUNDS20(SHA_F2, SHA_K2, 20)
+        SHA_GROUNDS20(SHA_F3, SHA_K3, 40)
+        SHA_GROUNDS20(SHA_F4, SHA_K4, 60)
+
+        state[0] += A;
+        state[1] += B;
+        state[2] += C;
+        state[3] += D;
+        state[4] += E;
     }
-
-#undef SHA_F4
-
-    ctx->state[0] += A;
-    ctx->state[1] += B;
-    ctx->state[2] += C;
-    ctx->state[3] += D;
-    ctx->state[4] += E;
 }
 
-void SHA_update(SHA_CTX* ctx, const void* data, int len) {
-    int i = ctx->count % sizeof(ctx->buf);
-    const uint8_t* p = (const uint8_t*)data;
-
-    ctx->count += len;
-
-    while (len > sizeof(ctx->buf) - i) {
-        memcpy(&ctx->buf.b[i], p, sizeof(ctx->buf) - i);
-        len -= sizeof(ctx->buf) - i;
-        p += sizeof(ctx->buf) - i;
-        SHA1_Transform(ctx);
-        i = 0;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHA_HAVE_X86
+
+// The SSSE3 version expands the message schedule four words at a time
+// while the scalar rounds run, so both execute in parallel. W[t+3] depends
+// on W[t], so its lane is computed without that term and patched up after:
+// rol1(x ^ W[t]) == rol1(x) ^ rol1(W[t]).
+#define SHA_SSSE3_SCHED(M0,M1,M2,M3)                                    \
+    x = _mm_xor_si128(_mm_srli_si128(M3, 4), M2);                       \
+    x = _mm_xor_si128(x, _mm_alignr_epi8(M1, M0, 8));                   \
+    x = _mm_xor_si128(x, M0);                                           \
+    x = _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31));      \
+    k = _mm_slli_si128(x, 12);                                          \
+    k = _mm_or_si128(_mm_slli_epi32(k, 1), _mm_srli_epi32(k, 31));      \
+    M0 = _mm_xor_si128(x, k);
+
+// Rounds t..t+3 from M0, while computing the schedule for rounds t+16..t+19
+// into M0. The register names rotate along with the rounds, so each group
+// of four starts on a different one of A-E.
+#define SHA_SSSE3_GROUP(F,K,t,M0,M1,M2,M3)                              \
+    _mm_storeu_si128((__m128i*)WK, _mm_add_epi32(M0, _mm_set1_epi32(K)));\
+    SHA_SSSE3_SCHED(M0,M1,M2,M3)                                        \
+    SHA_SSSE3_QUAD(F,t)
+
+#define SHA_SSSE3_QUAD(F,t)                                             \
+    SHA_QROUND(F,t + 0) SHA_QROUND(F,t + 1)                             \
+    SHA_QROUND(F,t + 2) SHA_QROUND(F,t + 3)
+
+// One round, with W[t] + K already stored in WK[t % 4] and the A-E
+// rotation expressed through the round number.
+#define SHA_ROUND(F,A,B,C,D,E,i)                \
+    E += rol(5,A) + F(B,C,D) + WK[i];           \
+    B = rol(30,B);
+
+#define SHA_QROUND(F,t)                                                 \
+    switch ((t) % 5) {                                                  \
+    case 0: SHA_ROUND(F,A,B,C,D,E,(t) % 4) break;                       \
+    case 1: SHA_ROUND(F,E,A,B,C,D,(t) % 4) break;                       \
+    case 2: SHA_ROUND(F,D,E,A,B,C,(t) % 4) break;                       \
+    case 3: SHA_ROUND(F,C,D,E,A,B,(t) % 4) break;                       \
+    case 4: SHA_ROUND(F,B,C,D,E,A,(t) % 4) break;                       \
     }
 
-    while (len--) {
-        ctx->buf.b[i++] = *p++;
-        if (i == sizeof(ctx->buf)) {
-            SHA1_Transform(ctx);
-            i = 0;
-        }
+__attribute__((target("ssse3")))
+static void SHA1_transform_ssse3(uint32_t state[5], const uint8_t* p,
+                                 size_t nblocks) {
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                       4, 5, 6, 7, 0, 1, 2, 3);
+    __m128i M0, M1, M2, M3, x, k;
+    uint32_t A, B, C, D, E;
+    uint32_t WK[4];
+
+    while (nblocks--) {
+        M0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 0)), bswap);
+        M1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), bswap);
+        M2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), bswap);
+        M3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 48)), bswap);
+        p += 64;
+
+        A = state[0];
+        B = state[1];
+        C = state[2];
+        D = state[3];
+        E = state[4];
+
+        SHA_SSSE3_GROUP(SHA_F1, SHA_K1, 0, M0, M1, M2, M3)
+        SHA_SSSE3_GROUP(SHA_F1, SHA_K1, 4, M1, M2, M3, M0)
+        SHA_SSSE3_GROUP(SHA_F1, SHA_K1, 8, M2, M3, M0, M1)
+        SHA_SSSE3_GROUP(SHA_F1, SHA_K1, 12, M3, M0, M1, M2)
+        SHA_SSSE3_GROUP(SHA_F1, SHA_K1, 16, M0, M1, M2, M3)
+        SHA_SSSE3_GROUP(SHA_F2, SHA_K2, 20, M1, M2, M3, M0)
+        SHA_SSSE3_GROUP(SHA_F2, SHA_K2, 24, M2, M3, M0, M1)
+        SHA_SSSE3_GROUP(SHA_F2, SHA_K2, 28, M3, M0, M1, M2)
+        SHA_SSSE3_GROUP(SHA_F2, SHA_K2, 32, M0, M1, M2, M3)
+        SHA_SSSE3_GROUP(SHA_F2, SHA_K2, 36, M1, M2, M3, M0)
+        SHA_SSSE3_GROUP(SHA_F3, SHA_K3, 40, M2, M3, M0, M1)
+        SHA_SSSE3_GROUP(SHA_F3, SHA_K3, 44, M3, M0, M1, M2)
+        SHA_SSSE3_GROUP(SHA_F3, SHA_K3, 48, M0, M1, M2, M3)
+        SHA_SSSE3_GROUP(SHA_F3, SHA_K3, 52, M1, M2, M3, M0)
+        SHA_SSSE3_GROUP(SHA_F3, SHA_K3, 56, M2, M3, M0, M1)
+        SHA_SSSE3_GROUP(SHA_F4, SHA_K4, 60, M3, M0, M1, M2)
+        SHA_SSSE3_GROUP(SHA_F4, SHA_K4, 64, M0, M1, M2, M3)
+        SHA_SSSE3_GROUP(SHA_F4, SHA_K4, 68, M1, M2, M3, M0)
+        SHA_SSSE3_GROUP(SHA_F4, SHA_K4, 72, M2, M3, M0, M1)
+        SHA_SSSE3_GROUP(SHA_F4, SHA_K4, 76, M3, M0, M1, M2)
+
+        state[0] += A;
+        state[1] += B;
+        state[2] += C;
+        state[3] += D;
+        state[4] += E;
     }
 }
 
-
-const uint8_t* SHA_final(SHA_CTX* ctx) {
-    uint64_t cnt = ctx->count * 8;
-    int i;
-
-    SHA_update(ctx, (uint8_t*)"\x80", 1);
-    while ((ctx->count % sizeof(ctx->buf)) != (sizeof(ctx->buf) - 8)) {
-        SHA_update(ctx, (uint8_t*)"\0", 1);
-    }
-    for (i = 0; i < 8; ++i) {
-        uint8_t tmp = cnt >> ((7 - i) * 8);
-        SHA_update(ctx, &tmp, 1);
-    }
-
-    for (i = 0; i < 5; i++) {
-        ctx->buf.w[i] = bswap_32(ctx->state[i]);
+// Four rounds using the SHA extensions, while advancing the message
+// schedule for the rounds that follow.
+#define SHA_NI_ROUNDS4(Ea,Eb,M0,M1,M2,M3,f)             \
+    Ea = _mm_sha1nexte_epu32(Ea, M0);                   \
+    Eb = ABCD;                                          \
+    M1 = _mm_sha1msg2_epu32(M1, M0);                    \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, Ea, f);            \
+    M3 = _mm_sha1msg1_epu32(M3, M0);                    \
+    M2 = _mm_xor_si128(M2, M0);
+
+__attribute__((target("sha,sse4.1")))
+static void SHA1_transform_shani(uint32_t state[5], const uint8_t* p,
+                                 size_t nblocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+                                         0x08090a0b0c0d0e0fULL);
+    __m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1;
+    __m128i MSG0, MSG1, MSG2, MSG3;
+
+    ABCD = _mm_loadu_si128((const __m128i*)state);
+    ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+    E0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while (nblocks--) {
+        ABCD_SAVE = ABCD;
+        E0_SAVE = E0;
+
+        // rounds 0-15 consume the message block itself
+        MSG0 = _mm_loadu_si128((const __m128i*)(p + 0));
+        MSG0 = _mm_shuffle_epi8(MSG0, bswap);
+        E0 = _mm_add_epi32(E0, MSG0);
+        E1 = ABCD;
+        ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+        MSG1 = _mm_loadu_si128((const __m128i*)(p + 16));
+        MSG1 = _mm_shuffle_epi8(MSG1, bswap);
+        E1 = _mm_sha1nexte_epu32(E1, MSG1);
+        E0 = ABCD;
+        ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+        MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+
+        MSG2 = _mm_loadu_si128((const __m128i*)(p + 32));
+        MSG2 = _mm_shuffle_epi8(MSG2, bswap);
+        E0 = _mm_sha1nexte_epu32(E0, MSG2);
+        E1 = ABCD;
+        ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+        MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+        MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+        MSG3 = _mm_loadu_si128((const __m128i*)(p + 48));
+        MSG3 = _mm_shuffle_epi8(MSG3, bswap);
+        E1 = _mm_sha1nexte_epu32(E1, MSG3);
+        E0 = ABCD;
+        MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+        ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+        MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+        MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+        // rounds 16-79
+        SHA_NI_ROUNDS4(E0,E1,MSG0,MSG1,MSG2,MSG3,0);
+        SHA_NI_ROUNDS4(E1,E0,MSG1,MSG2,MSG3,MSG0,1);
+        SHA_NI_ROUNDS4(E0,E1,MSG2,MSG3,MSG0,MSG1,1);
+        SHA_NI_ROUNDS4(E1,E0,MSG3,MSG0,MSG1,MSG2,1);
+        SHA_NI_ROUNDS4(E0,E1,MSG0,MSG1,MSG2,MSG3,1);
+        SHA_NI_ROUNDS4(E1,E0,MSG1,MSG2,MSG3,MSG0,1);
+        SHA_NI_ROUNDS4(E0,E1,MSG2,MSG3,MSG0,MSG1,2);
+        SHA_NI_ROUNDS4(E1,E0,MSG3,MSG0,MSG1,MSG2,2);
+        SHA_NI_ROUNDS4(E0,E1,MSG0,MSG1,MSG2,MSG3,2);
+        SHA_NI_ROUNDS4(E1,E0,MSG1,MSG2,MSG3,MSG0,2);
+        SHA_NI_ROUNDS4(E0,E1,MSG2,MSG3,MSG0,MSG1,2);
+        SHA_NI_ROUNDS4(E1,E0,MSG3,MSG0,MSG1,MSG2,3);
+        SHA_NI_ROUNDS4(E0,E1,MSG0,MSG1,MSG2,MSG3,3);
+        SHA_NI_ROUNDS4(E1,E0,MSG1,MSG2,MSG3,MSG0,3);
+        SHA_NI_ROUNDS4(E0,E1,MSG2,MSG3,MSG0,MSG1,3);
+        SHA_NI_ROUNDS4(E1,E0,MSG3,MSG0,MSG1,MSG2,3);
+
+        E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+        ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+
+        p += 64;
     }
 
-    return ctx->buf.b;
+    ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+    _mm_storeu_si128((__m128i*)state, ABCD);
+    state[4] = _mm_extract_epi32(E0, 3);
 }
 
-#else   // #if defined(HAVE_ENDIAN_H) && defined(HAVE_LITTLE_ENDIAN)
+#endif  // SHA_HAVE_X86
 
-#define rol(bits, value) (((value) << (bits)) | ((value) >> (32 - (bits))))
+// Cached result of SHA1_select(), NULL until the first SHA_update().
+static sha1_blocks_fn SHA1_blocks;
 
-static void SHA1_transform(SHA_CTX *ctx) {
-    uint32_t W[80];
-    uint32_t A, B, C, D, E;
-    uint8_t *p = ctx->buf;
-    int t;
+static sha1_blocks_fn SHA1_select(void) {
+#ifdef SHA_HAVE_X86
+    unsigned int eax, ebx, ecx, edx;
 
-    for(t = 0; t < 16; ++t) {
-        uint32_t tmp =  *p++ << 24;
-        tmp |= *p++ << 16;
-        tmp |= *p++ << 8;
-        tmp |= *p++;
-        W[t] = tmp;
-    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+        (ebx & bit_SHA) &&
+        __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+        (ecx & bit_SSE4_1))
+        return SHA1_transform_shani;
 
-    for(; t < 80; t++) {
-        W[t] = rol(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
-    }
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3))
+        return SHA1_transform_ssse3;
+#endif
+    return SHA1_transform_generic;
+}
 
-    A = ctx->state[0];
-    B = ctx->state[1];
-    C = ctx->state[2];
-    D = ctx->state[3];
-    E = ctx->state[4];
-
-    for(t = 0; t < 80; t++) {
-        uint32_t tmp = rol(5,A) + E + W[t];
-
-        if (t < 20)
-            tmp += (D^(B&(C^D))) + 0x5A827999;
-        else if ( t < 40)
-            tmp += (B^C^D) + 0x6ED9EBA1;
-        else if ( t < 60)
-            tmp += ((B&C)|(D&(B|C))) + 0x8F1BBCDC;
-        else
-            tmp += (B^C^D) + 0xCA62C1D6;
-
-        E = D;
-        D = C;
-        C = rol(30,B);
-        B = A;
-        A = tmp;
-    }
+static void SHA1_transform(uint32_t state[5], const uint8_t* data,
+                           size_t nblocks) {
+    sha1_blocks_fn fn = __atomic_load_n(&SHA1_blocks, __ATOMIC_RELAXED);
 
-    ctx->state[0] += A;
-    ctx->state[1] += B;
-    ctx->state[2] += C;
-    ctx->state[3] += D;
-    ctx->state[4] += E;
+    if (!fn) {
+        fn = SHA1_select();
+        __atomic_store_n(&SHA1_blocks, fn, __ATOMIC_RELAXED);
+    }
+    fn(state, data, nblocks);
 }
 
-void SHA_update(SHA_CTX *ctx, const void *data, int len) {
+void SHA_update(SHA_CTX* ctx, const void* data, int len) {
     int i = ctx->count % sizeof(ctx->buf);
     const uint8_t* p = (const uint8_t*)data;
+    size_t nblocks;
+
+    if (len <= 0)
+        return;
 
     ctx->count += len;
 
-    while (len--) {
-        ctx->buf[i++] = *p++;
-        if (i == sizeof(ctx->buf)) {
-            SHA1_transform(ctx);
-            i = 0;
-        }
+    // complete a partially filled block first
+    if (i) {
+        int n = sizeof(ctx->buf) - i;
+
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + i, p, n);
+        p += n;
+        len -= n;
+        i += n;
+        if (i < sizeof(ctx->buf))
+            return;
+        SHA1_transform(ctx->state, ctx->buf, 1);
+    }
+
+    nblocks = len / sizeof(ctx->buf);
+    if (nblocks) {
+        SHA1_transform(ctx->state, p, nblocks);
+        p += nblocks * sizeof(ctx->buf);
+        len -= nblocks * sizeof(ctx->buf);
     }
+
+    memcpy(ctx->buf, p, len);
 }
+
 const uint8_t *SHA_final(SHA_CTX *ctx) {
     uint8_t *p = ctx->buf;
     uint64_t cnt = ctx->count * 8;
@@ -281,8 +385,6 @@ const uint8_t *SHA_final(SHA_CTX *ctx) {
     return ctx->buf;
 }
 
-#endif // endianness
-
 void SHA_init(SHA_CTX* ctx) {
     ctx->state[0] = 0x67452301;
     ctx->state[1] = 0xEFCDAB89;
@@ -305,3 +407,106 @@ const uint8_t* SHA(const void *data, int len, uint8_t *digest) {
     }
     return digest;
 }
+
+/*
+ * LCOV_EXCL_START
+ * Unit testing stuff done here so we do not need to expose static functions.
+ */
+static int SHA_known_answer_test(const char* name) {
+    static const struct {
+        const char* msg;
+        int repeat;
+        uint8_t digest[SHA_DIGEST_SIZE];
+    } kats[] = {
+        { "", 1,
+          { 0xda, 0x39, 0xa3, 0xee, 0x5e, 0x6b, 0x4b, 0x0d, 0x32, 0x55,
+            0xbf, 0xef, 0x95, 0x60, 0x18, 0x90, 0xaf, 0xd8, 0x07, 0x09 } },
+        { "abc", 1,
+          { 0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+            0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d } },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+          { 0x84, 0x98, 0x3e, 0x44, 0x1c, 0x3b, 0xd2, 0x6e, 0xba, 0xae,
+            0x4a, 0xa1, 0xf9, 0x51, 0x29, 0xe5, 0xe5, 0x46, 0x70, 0xf1 } },
+        { "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+          "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 10000,
+          { 0x34, 0xaa, 0x97, 0x3c, 0xd4, 0xc4, 0xda, 0xa4, 0xf6, 0x1e,
+            0xeb, 0x2b, 0xdb, 0xad, 0x27, 0x31, 0x65, 0x34, 0x01, 0x6f } },
+    };
+    int rc = 0, i, j;
+
+    for (i = 0; i < sizeof(kats) / sizeof(kats[0]); i++) {
+        SHA_CTX ctx;
+
+        SHA_init(&ctx);
+        for (j = 0; j < kats[i].repeat; j++)
+            SHA_update(&ctx, kats[i].msg, strlen(kats[i].msg));
+        if (memcmp(SHA_final(&ctx), kats[i].digest, SHA_DIGEST_SIZE)) {
+            printf("FAILURE: %s SHA-1 known answer test %d failed\n",
+                   name, i);
+            rc |= 1;
+        }
+    }
+
+    return rc;
+}
+
+int SHA_test() {
+    const struct {
+        const char* name;
+        sha1_blocks_fn fn;
+    } impls[] = {
+        { "generic", SHA1_transform_generic },
+#ifdef SHA_HAVE_X86
+        { "ssse3", SHA1_transform_ssse3 },
+        { "sha-ni", SHA1_transform_shani },
+#endif
+    };
+    sha1_blocks_fn best = SHA1_select();
+    sha1_blocks_fn saved = __atomic_load_n(&SHA1_blocks, __ATOMIC_RELAXED);
+    uint8_t msg[300], expected[sizeof(msg) / 7 + 1][SHA_DIGEST_SIZE];
+    int rc = 0, i, len, split;
+
+    for (i = 0; i < sizeof(msg); i++)
+        msg[i] = i * 131 + 7;
+
+    // references come from the generic code, checked against fixed vectors
+    // first, so no implementation under test is used to check itself
+    __atomic_store_n(&SHA1_blocks, SHA1_transform_generic, __ATOMIC_RELAXED);
+    rc |= SHA_known_answer_test("reference");
+    for (len = 0; len <= sizeof(msg); len += 7)
+        SHA(msg, len, expected[len / 7]);
+
+    for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+#ifdef SHA_HAVE_X86
+        if (best == SHA1_transform_generic &&
+            impls[i].fn != SHA1_transform_generic)
+            continue;
+        if (best != SHA1_transform_shani &&
+            impls[i].fn == SHA1_transform_shani)
+            continue;
+#endif
+        __atomic_store_n(&SHA1_blocks, impls[i].fn, __ATOMIC_RELAXED);
+        rc |= SHA_known_answer_test(impls[i].name);
+
+        // every length and split point must agree with the generic code
+        for (len = 0; len <= sizeof(msg); len += 7) {
+            for (split = 0; split <= len; split += 13) {
+                SHA_CTX ctx;
+
+                SHA_init(&ctx);
+                SHA_update(&ctx, msg, split);
+                SHA_update(&ctx, msg + split, len - split);
+                if (memcmp(SHA_final(&ctx), expected[len / 7],
+                           SHA_DIGEST_SIZE)) {
+                    printf("FAILURE: %s SHA-1 mismatch, len %d split %d\n",
+                           impls[i].name, len, split);
+                    rc |= 1;
+                }
+            }
+        }
+    }
+
+    __atomic_store_n(&SHA1_blocks, saved, __ATOMIC_RELAXED);
+    return rc;
+}
+/* LCOV_EXCL_STOP */
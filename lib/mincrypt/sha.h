@@ -37,14 +37,7 @@ extern "C" {
 typedef struct SHA_CTX {
     uint64_t count;
     uint32_t state[5];
-#if defined(HAVE_ENDIAN_H) && defined(HAVE_LITTLE_ENDIAN)
-    union {
-        uint8_t b[64];
-        uint32_t w[16];
-    } buf;
-#else
     uint8_t buf[64];
-#endif
 } SHA_CTX;
 
 void SHA_init(SHA_CTX* ctx);
@@ -56,6 +49,21 @@ const uint8_t* SHA(const void* data, int len, uint8_t* digest);
 
 #define SHA_DIGEST_SIZE 20
 
+/*
+ * Multi-buffer interface. Equivalent to calling SHA_update(ctx[i], data[i],
+ * len[i]) for each of the n contexts, but whole blocks from up to
+ * SHA_MB_LANES streams are hashed at once in SIMD lanes. Any n is accepted,
+ * n <= 0 does nothing.
+ */
+#define SHA_MB_LANES 8
+
+void SHA_update_mb(SHA_CTX* const ctx[], const void* const data[],
+                   const int len[], int n);
+
+/* unit testing stuff */
+int SHA_test();
+int SHA_mb_test();
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,438 @@
+/* sha256.c
+**
+** Copyright 2008, The Android Open Source Project
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**     * Redistributions of source code must retain the above copyright
+**       notice, this list of conditions and the following disclaimer.
+**     * Redistributions in binary form must reproduce the above copyright
+**       notice, this list of conditions and the following disclaimer in the
+**       documentation and/or other materials provided with the distribution.
+**     * Neither the name of Google Inc. nor the names of its contributors may
+**       be used to endorse or promote products derived from this software
+**       without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY Google Inc. ``AS IS'' AND ANY EXPRESS OR
+** IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+** MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+** EVENT SHALL Google Inc. BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+** SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+** PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+** OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+** WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+** OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+** ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "sha256.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Same structure as sha.c: the block transform is picked at runtime, SHA-NI
+// where the CPU has the SHA extensions and portable C everywhere else, and
+// SHA256_update() only copies partial blocks into ctx->buf.
+
+typedef void (*sha256_blocks_fn)(uint32_t state[8], const uint8_t* data,
+                                 size_t nblocks);
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ror(bits, value) (((value) >> (bits)) | ((value) << (32 - (bits))))
+
+#define SHA256_S0(x) (ror(2,x) ^ ror(13,x) ^ ror(22,x))
+#define SHA256_S1(x) (ror(6,x) ^ ror(11,x) ^ ror(25,x))
+#define SHA256_s0(x) (ror(7,x) ^ ror(18,x) ^ ((x) >> 3))
+#define SHA256_s1(x) (ror(17,x) ^ ror(19,x) ^ ((x) >> 10))
+
+#define SHA256_CH(E,F,G) (G ^ (E & (F ^ G)))
+#define SHA256_MAJ(A,B,C) ((A & B) | (C & (A | B)))
+
+// Rolling 16-word message schedule, as in the portable SHA-1 code.
+#define SHA256_W(t)                                                     \
+    ((t) < 16 ? W[t] :                                                  \
+     (W[(t) & 15] += SHA256_s1(W[((t) + 14) & 15]) + W[((t) + 9) & 15] +\
+                     SHA256_s0(W[((t) + 1) & 15])))
+
+#define SHA256_ROUND(A,B,C,D,E,F,G,H,t)                                 \
+    H += SHA256_S1(E) + SHA256_CH(E,F,G) + K[t] + SHA256_W(t);          \
+    D += H;                                                             \
+    H += SHA256_S0(A) + SHA256_MAJ(A,B,C);
+
+#define SHA256_ROUNDS8(t)                                               \
+    SHA256_ROUND(A,B,C,D,E,F,G,H,t + 0)                                 \
+    SHA256_ROUND(H,A,B,C,D,E,F,G,t + 1)                                 \
+    SHA256_ROUND(G,H,A,B,C,D,E,F,t + 2)                                 \
+    SHA256_ROUND(F,G,H,A,B,C,D,E,t + 3)                                 \
+    SHA256_ROUND(E,F,G,H,A,B,C,D,t + 4)                                 \
+    SHA256_ROUND(D,E,F,G,H,A,B,C,t + 5)                                 \
+    SHA256_ROUND(C,D,E,F,G,H,A,B,t + 6)                                 \
+    SHA256_ROUND(B,C,D,E,F,G,H,A,t + 7)
+
+static void SHA256_transform_generic(uint32_t state[8], const uint8_t* p,
+                                     size_t nblocks) {
+    uint32_t W[16];
+    uint32_t A, B, C, D, E, F, G, H;
+    int t;
+
+    while (nblocks--) {
+        for (t = 0; t < 16; ++t) {
+            uint32_t tmp =  *p++ << 24;
+            tmp |= *p++ << 16;
+            tmp |= *p++ << 8;
+            tmp |= *p++;
+            W[t] = tmp;
+        }
+
+        A = state[0];
+        B = state[1];
+        C = state[2];
+        D = state[3];
+        E = state[4];
+        F = state[5];
+        G = state[6];
+        H = state[7];
+
+        SHA256_ROUNDS8(0)
+        SHA256_ROUNDS8(8)
+        SHA256_ROUNDS8(16)
+        SHA256_ROUNDS8(24)
+        SHA256_ROUNDS8(32)
+        SHA256_ROUNDS8(40)
+        SHA256_ROUNDS8(48)
+        SHA256_ROUNDS8(56)
+
+        state[0] += A;
+        state[1] += B;
+        state[2] += C;
+        state[3] += D;
+        state[4] += E;
+        state[5] += F;
+        state[6] += G;
+        state[7] += H;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHA256_HAVE_X86
+
+// Rounds 4i..4i+3 from message words MC. While they run, MN gets its
+// second schedule step (needs MP and MC) and MP its first one, so the
+// schedule stays four words ahead of the rounds. i is a constant, so the
+// conditions fold away.
+#define SHA256_NI_ROUNDS4(i,MP,MC,MN)                                   \
+    MSG = _mm_add_epi32(MC, _mm_loadu_si128((const __m128i*)&K[4 * (i)]));\
+    STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);                \
+    if ((i) >= 3 && (i) <= 14) {                                        \
+        TMP = _mm_alignr_epi8(MC, MP, 4);                               \
+        MN = _mm_add_epi32(MN, TMP);                                    \
+        MN = _mm_sha256msg2_epu32(MN, MC);                              \
+    }                                                                   \
+    MSG = _mm_shuffle_epi32(MSG, 0x0E);                                 \
+    STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);                \
+    if ((i) >= 1 && (i) <= 12)                                          \
+        MP = _mm_sha256msg1_epu32(MP, MC);
+
+#define SHA256_NI_LOAD(M,off)                                           \
+    M = _mm_loadu_si128((const __m128i*)(p + (off)));                   \
+    M = _mm_shuffle_epi8(M, bswap);
+
+__attribute__((target("sha,sse4.1")))
+static void SHA256_transform_shani(uint32_t state[8], const uint8_t* p,
+                                   size_t nblocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                         0x0405060700010203ULL);
+    __m128i STATE0, STATE1, ABEF_SAVE, CDGH_SAVE, MSG, TMP;
+    __m128i MSG0, MSG1, MSG2, MSG3;
+
+    // the instructions want the state as ABEF and CDGH
+    TMP = _mm_loadu_si128((const __m128i*)&state[0]);
+    STATE1 = _mm_loadu_si128((const __m128i*)&state[4]);
+    TMP = _mm_shuffle_epi32(TMP, 0xB1);
+    STATE1 = _mm_shuffle_epi32(STATE1, 0x1B);
+    STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);
+    STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);
+
+    while (nblocks--) {
+        ABEF_SAVE = STATE0;
+        CDGH_SAVE = STATE1;
+
+        SHA256_NI_LOAD(MSG0, 0)
+        SHA256_NI_ROUNDS4(0,MSG3,MSG0,MSG1)
+        SHA256_NI_LOAD(MSG1, 16)
+        SHA256_NI_ROUNDS4(1,MSG0,MSG1,MSG2)
+        SHA256_NI_LOAD(MSG2, 32)
+        SHA256_NI_ROUNDS4(2,MSG1,MSG2,MSG3)
+        SHA256_NI_LOAD(MSG3, 48)
+        SHA256_NI_ROUNDS4(3,MSG2,MSG3,MSG0)
+        SHA256_NI_ROUNDS4(4,MSG3,MSG0,MSG1)
+        SHA256_NI_ROUNDS4(5,MSG0,MSG1,MSG2)
+        SHA256_NI_ROUNDS4(6,MSG1,MSG2,MSG3)
+        SHA256_NI_ROUNDS4(7,MSG2,MSG3,MSG0)
+        SHA256_NI_ROUNDS4(8,MSG3,MSG0,MSG1)
+        SHA256_NI_ROUNDS4(9,MSG0,MSG1,MSG2)
+        SHA256_NI_ROUNDS4(10,MSG1,MSG2,MSG3)
+        SHA256_NI_ROUNDS4(11,MSG2,MSG3,MSG0)
+        SHA256_NI_ROUNDS4(12,MSG3,MSG0,MSG1)
+        SHA256_NI_ROUNDS4(13,MSG0,MSG1,MSG2)
+        SHA256_NI_ROUNDS4(14,MSG1,MSG2,MSG3)
+        SHA256_NI_ROUNDS4(15,MSG2,MSG3,MSG0)
+
+        STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+        STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+
+        p += 64;
+    }
+
+    TMP = _mm_shuffle_epi32(STATE0, 0x1B);
+    STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);
+    STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0);
+    STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);
+    _mm_storeu_si128((__m128i*)&state[0], STATE0);
+    _mm_storeu_si128((__m128i*)&state[4], STATE1);
+}
+
+#endif  // SHA256_HAVE_X86
+
+// Cached result of SHA256_select(), NULL until the first SHA256_update().
+static sha256_blocks_fn SHA256_blocks;
+
+static sha256_blocks_fn SHA256_select(void) {
+#ifdef SHA256_HAVE_X86
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+        (ebx & bit_SHA) &&
+        __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+        (ecx & bit_SSE4_1))
+        return SHA256_transform_shani;
+#endif
+    return SHA256_transform_generic;
+}
+
+static void SHA256_transform(uint32_t state[8], const uint8_t* data,
+                             size_t nblocks) {
+    sha256_blocks_fn fn = __atomic_load_n(&SHA256_blocks, __ATOMIC_RELAXED);
+
+    if (!fn) {
+        fn = SHA256_select();
+        __atomic_store_n(&SHA256_blocks, fn, __ATOMIC_RELAXED);
+    }
+    fn(state, data, nblocks);
+}
+
+void SHA256_update(SHA256_CTX* ctx, const void* data, int len) {
+    int i = ctx->count % sizeof(ctx->buf);
+    const uint8_t* p = (const uint8_t*)data;
+    size_t nblocks;
+
+    if (len <= 0)
+        return;
+
+    ctx->count += len;
+
+    // complete a partially filled block first
+    if (i) {
+        int n = sizeof(ctx->buf) - i;
+
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + i, p, n);
+        p += n;
+        len -= n;
+        i += n;
+        if (i < sizeof(ctx->buf))
+            return;
+        SHA256_transform(ctx->state, ctx->buf, 1);
+    }
+
+    nblocks = len / sizeof(ctx->buf);
+    if (nblocks) {
+        SHA256_transform(ctx->state, p, nblocks);
+        p += nblocks * sizeof(ctx->buf);
+        len -= nblocks * sizeof(ctx->buf);
+    }
+
+    memcpy(ctx->buf, p, len);
+}
+
+const uint8_t* SHA256_final(SHA256_CTX* ctx) {
+    uint8_t *p = ctx->buf;
+    uint64_t cnt = ctx->count * 8;
+    int i;
+
+    SHA256_update(ctx, (uint8_t*)"\x80", 1);
+    while ((ctx->count % sizeof(ctx->buf)) != (sizeof(ctx->buf) - 8)) {
+        SHA256_update(ctx, (uint8_t*)"\0", 1);
+    }
+    for (i = 0; i < 8; ++i) {
+        uint8_t tmp = cnt >> ((7 - i) * 8);
+        SHA256_update(ctx, &tmp, 1);
+    }
+
+    for (i = 0; i < 8; i++) {
+        uint32_t tmp = ctx->state[i];
+        *p++ = tmp >> 24;
+        *p++ = tmp >> 16;
+        *p++ = tmp >> 8;
+        *p++ = tmp >> 0;
+    }
+
+    return ctx->buf;
+}
+
+void SHA256_init(SHA256_CTX* ctx) {
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->count = 0;
+}
+
+/* Convenience function */
+const uint8_t* SHA256(const void* data, int len, uint8_t* digest) {
+    const uint8_t* p;
+    int i;
+    SHA256_CTX ctx;
+    SHA256_init(&ctx);
+    SHA256_update(&ctx, data, len);
+    p = SHA256_final(&ctx);
+    for (i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+        digest[i] = *p++;
+    }
+    return digest;
+}
+
+/*
+ * LCOV_EXCL_START
+ * Unit testing stuff done here so we do not need to expose static functions.
+ */
+static int SHA256_known_answer_test(const char* name) {
+    static const struct {
+        const char* msg;
+        int repeat;
+        uint8_t digest[SHA256_DIGEST_SIZE];
+    } kats[] = {
+        { "", 1,
+          { 0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14,
+            0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+            0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c,
+            0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55 } },
+        { "abc", 1,
+          { 0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+            0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+            0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+            0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad } },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+          { 0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8,
+            0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+            0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67,
+            0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1 } },
+        { "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+          "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 10000,
+          { 0xcd, 0xc7, 0x6e, 0x5c, 0x99, 0x14, 0xfb, 0x92,
+            0x81, 0xa1, 0xc7, 0xe2, 0x84, 0xd7, 0x3e, 0x67,
+            0xf1, 0x80, 0x9a, 0x48, 0xa4, 0x97, 0x20, 0x0e,
+            0x04, 0x6d, 0x39, 0xcc, 0xc7, 0x11, 0x2c, 0xd0 } },
+    };
+    int rc = 0, i, j;
+
+    for (i = 0; i < sizeof(kats) / sizeof(kats[0]); i++) {
+        SHA256_CTX ctx;
+
+        SHA256_init(&ctx);
+        for (j = 0; j < kats[i].repeat; j++)
+            SHA256_update(&ctx, kats[i].msg, strlen(kats[i].msg));
+        if (memcmp(SHA256_final(&ctx), kats[i].digest,
+                   SHA256_DIGEST_SIZE)) {
+            printf("FAILURE: %s SHA-256 known answer test %d failed\n",
+                   name, i);
+            rc |= 1;
+        }
+    }
+
+    return rc;
+}
+
+int SHA256_test() {
+    const struct {
+        const char* name;
+        sha256_blocks_fn fn;
+    } impls[] = {
+        { "generic", SHA256_transform_generic },
+#ifdef SHA256_HAVE_X86
+        { "sha-ni", SHA256_transform_shani },
+#endif
+    };
+    sha256_blocks_fn best = SHA256_select();
+    sha256_blocks_fn saved = __atomic_load_n(&SHA256_blocks, __ATOMIC_RELAXED);
+    uint8_t msg[300], expected[sizeof(msg) / 7 + 1][SHA256_DIGEST_SIZE];
+    int rc = 0, i, len, split;
+
+    for (i = 0; i < sizeof(msg); i++)
+        msg[i] = i * 131 + 7;
+
+    // references come from the generic code, checked against fixed vectors
+    // first, so no implementation under test is used to check itself
+    __atomic_store_n(&SHA256_blocks, SHA256_transform_generic,
+                     __ATOMIC_RELAXED);
+    rc |= SHA256_known_answer_test("reference");
+    for (len = 0; len <= sizeof(msg); len += 7)
+        SHA256(msg, len, expected[len / 7]);
+
+    for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (impls[i].fn != SHA256_transform_generic && impls[i].fn != best)
+            continue;
+
+        __atomic_store_n(&SHA256_blocks, impls[i].fn, __ATOMIC_RELAXED);
+        rc |= SHA256_known_answer_test(impls[i].name);
+
+        // every length and split point must agree with the generic code
+        for (len = 0; len <= sizeof(msg); len += 7) {
+            for (split = 0; split <= len; split += 13) {
+                SHA256_CTX ctx;
+
+                SHA256_init(&ctx);
+                SHA256_update(&ctx, msg, split);
+                SHA256_update(&ctx, msg + split, len - split);
+                if (memcmp(SHA256_final(&ctx), expected[len / 7],
+                           SHA256_DIGEST_SIZE)) {
+                    printf("FAILURE: %s SHA-256 mismatch, "
+                           "len %d split %d\n", impls[i].name, len, split);
+                    rc |= 1;
+                }
+            }
+        }
+    }
+
+    __atomic_store_n(&SHA256_blocks, saved, __ATOMIC_RELAXED);
+    return rc;
+}
+/* LCOV_EXCL_STOP */
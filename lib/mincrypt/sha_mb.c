@@ -0,0 +1,340 @@
+/* sha_mb.c
+**
+** Copyright 2008, The Android Open Source Project
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**     * Redistributions of source code must retain the above copyright
+**       notice, this list of conditions and the following disclaimer.
+**     * Redistributions in binary form must reproduce the above copyright
+**       notice, this list of conditions and the following disclaimer in the
+**       documentation and/or other materials provided with the distribution.
+**     * Neither the name of Google Inc. nor the names of its contributors may
+**       be used to endorse or promote products derived from this software
+**       without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY Google Inc. ``AS IS'' AND ANY EXPRESS OR
+** IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+** MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+** EVENT SHALL Google Inc. BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+** SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+** PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+** OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+** WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+** OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+** ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "sha.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Multi-buffer SHA-1: SHA_MB_LANES independent streams are hashed at once,
+// one per 32-bit lane of a vector. The rounds are the same as in sha.c, just
+// applied to vectors. GCC lowers the vector type to AVX2 when the CPU has
+// it and to pairs of SSE2 registers (or plain integers) otherwise.
+
+#if defined(__GNUC__)
+
+typedef uint32_t sha_mb_vec __attribute__((vector_size(4 * SHA_MB_LANES)));
+
+#define rol(bits, value) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+#define SHA_K1 0x5A827999
+#define SHA_K2 0x6ED9EBA1
+#define SHA_K3 0x8F1BBCDC
+#define SHA_K4 0xCA62C1D6
+
+#define SHA_F1(B,C,D) (D^(B&(C^D)))
+#define SHA_F2(B,C,D) (B^C^D)
+#define SHA_F3(B,C,D) ((B&C)|(D&(B|C)))
+#define SHA_F4(B,C,D) (B^C^D)
+
+#define SHA_W(t)                                                        \
+    ((t) < 16 ? W[t] :                                                  \
+     (W[(t) & 15] = rol(1, W[((t) + 13) & 15] ^ W[((t) + 8) & 15] ^     \
+                           W[((t) + 2) & 15] ^ W[(t) & 15])))
+
+#define SHA_MB_ROUND(F,K,A,B,C,D,E,t)           \
+    E += rol(5,A) + F(B,C,D) + K + SHA_W(t);    \
+    B = rol(30,B);
+
+#define SHA_MB_ROUNDS5(F,K,t)                   \
+    SHA_MB_ROUND(F,K,A,B,C,D,E,t + 0)           \
+    SHA_MB_ROUND(F,K,E,A,B,C,D,t + 1)           \
+    SHA_MB_ROUND(F,K,D,E,A,B,C,t + 2)           \
+    SHA_MB_ROUND(F,K,C,D,E,A,B,t + 3)           \
+    SHA_MB_ROUND(F,K,B,C,D,E,A,t + 4)
+
+#define SHA_MB_ROUNDS20(F,K,t)                  \
+    SHA_MB_ROUNDS5(F,K,t + 0)                   \
+    SHA_MB_ROUNDS5(F,K,t + 5)                   \
+    SHA_MB_ROUNDS5(F,K,t + 10)                  \
+    SHA_MB_ROUNDS5(F,K,t + 15)
+
+// Runs nblocks blocks through each of the first n contexts. Lanes beyond n
+// repeat the first stream and their results are thrown away.
+static inline __attribute__((always_inline))
+void SHA1_mb_blocks(SHA_CTX* const ctx[], const uint8_t* const data[],
+                    int n, size_t nblocks) {
+    sha_mb_vec A, B, C, D, E, A0, B0, C0, D0, E0;
+    sha_mb_vec W[16];
+    uint32_t tmp[5][SHA_MB_LANES];
+    const uint8_t* p[SHA_MB_LANES];
+    int i, t;
+
+    for (i = 0; i < SHA_MB_LANES; i++) {
+        const SHA_CTX* c = ctx[i < n ? i : 0];
+
+        p[i] = data[i < n ? i : 0];
+        for (t = 0; t < 5; t++)
+            tmp[t][i] = c->state[t];
+    }
+    memcpy(&A, tmp[0], sizeof(A));
+    memcpy(&B, tmp[1], sizeof(B));
+    memcpy(&C, tmp[2], sizeof(C));
+    memcpy(&D, tmp[3], sizeof(D));
+    memcpy(&E, tmp[4], sizeof(E));
+
+    while (nblocks--) {
+        for (t = 0; t < 16; t++) {
+            uint32_t w[SHA_MB_LANES];
+
+            for (i = 0; i < SHA_MB_LANES; i++) {
+                const uint8_t* q = p[i] + t * 4;
+                w[i] = (uint32_t)q[0] << 24 | q[1] << 16 | q[2] << 8 | q[3];
+            }
+            memcpy(&W[t], w, sizeof(W[t]));
+        }
+        for (i = 0; i < SHA_MB_LANES; i++)
+            p[i] += 64;
+
+        A0 = A;
+        B0 = B;
+        C0 = C;
+        D0 = D;
+        E0 = E;
+
+        SHA_MB_ROUNDS20(SHA_F1, SHA_K1, 0)
+        SHA_MB_ROUNDS20(SHA_F2, SHA_K2, 20)
+        SHA_MB_ROUNDS20(SHA_F3, SHA_K3, 40)
+        SHA_MB_ROUNDS20(SHA_F4, SHA_K4, 60)
+
+        A += A0;
+        B += B0;
+        C += C0;
+        D += D0;
+        E += E0;
+    }
+
+    memcpy(tmp[0], &A, sizeof(A));
+    memcpy(tmp[1], &B, sizeof(B));
+    memcpy(tmp[2], &C, sizeof(C));
+    memcpy(tmp[3], &D, sizeof(D));
+    memcpy(tmp[4], &E, sizeof(E));
+    for (i = 0; i < n; i++) {
+        for (t = 0; t < 5; t++)
+            ctx[i]->state[t] = tmp[t][i];
+    }
+}
+
+static void SHA1_mb_blocks_default(SHA_CTX* const ctx[],
+                                   const uint8_t* const data[],
+                                   int n, size_t nblocks) {
+    SHA1_mb_blocks(ctx, data, n, nblocks);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA_MB_HAVE_AVX2
+
+__attribute__((target("avx2")))
+static void SHA1_mb_blocks_avx2(SHA_CTX* const ctx[],
+                                const uint8_t* const data[],
+                                int n, size_t nblocks) {
+    SHA1_mb_blocks(ctx, data, n, nblocks);
+}
+#endif
+
+typedef void (*sha1_mb_blocks_fn)(SHA_CTX* const ctx[],
+                                  const uint8_t* const data[],
+                                  int n, size_t nblocks);
+
+// Cached result of SHA1_mb_select(), NULL until the first SHA_update_mb().
+static sha1_mb_blocks_fn SHA1_mb_selected;
+
+static sha1_mb_blocks_fn SHA1_mb_select(void) {
+#ifdef SHA_MB_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SHA1_mb_blocks_avx2;
+#endif
+    return SHA1_mb_blocks_default;
+}
+
+static sha1_mb_blocks_fn SHA1_mb_get(void) {
+    sha1_mb_blocks_fn fn = __atomic_load_n(&SHA1_mb_selected,
+                                           __ATOMIC_RELAXED);
+
+    if (!fn) {
+        fn = SHA1_mb_select();
+        __atomic_store_n(&SHA1_mb_selected, fn, __ATOMIC_RELAXED);
+    }
+    return fn;
+}
+
+#endif  // __GNUC__
+
+// Streams are handled this many at a time, so the bookkeeping below has a
+// fixed size no matter how many the caller passes.
+#define SHA_MB_GROUP 64
+
+static void SHA_update_mb_group(SHA_CTX* const ctx[],
+                                const void* const data[],
+                                const int len[], int n) {
+    const uint8_t* p[SHA_MB_GROUP];
+    int left[SHA_MB_GROUP];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        int partial = ctx[i]->count % sizeof(ctx[i]->buf);
+
+        p[i] = (const uint8_t*)data[i];
+        left[i] = len[i];
+
+        // finish any partially filled block one stream at a time
+        if (partial && left[i] > 0) {
+            int fill = sizeof(ctx[i]->buf) - partial;
+
+            if (fill > left[i])
+                fill = left[i];
+            SHA_update(ctx[i], p[i], fill);
+            p[i] += fill;
+            left[i] -= fill;
+        }
+    }
+
+#if defined(__GNUC__)
+    {
+        sha1_mb_blocks_fn fn = SHA1_mb_get();
+        SHA_CTX* lane_ctx[SHA_MB_LANES];
+        const uint8_t* lane_data[SHA_MB_LANES];
+        int lane_idx[SHA_MB_LANES];
+
+        // Fill the lanes with whichever streams still have whole blocks
+        // left, run them until the shortest one runs out, and repeat.
+        while (1) {
+            int lanes = 0, j;
+            size_t nblocks = 0;
+
+            for (i = 0; i < n && lanes < SHA_MB_LANES; i++) {
+                size_t blocks = left[i] / sizeof(ctx[i]->buf);
+
+                if (!blocks)
+                    continue;
+                if (!lanes || blocks < nblocks)
+                    nblocks = blocks;
+                lane_ctx[lanes] = ctx[i];
+                lane_data[lanes] = p[i];
+                lane_idx[lanes] = i;
+                lanes++;
+            }
+
+            // a single stream is faster through the regular transform
+            if (lanes < 2)
+                break;
+
+            fn(lane_ctx, lane_data, lanes, nblocks);
+            for (j = 0; j < lanes; j++) {
+                int bytes = nblocks * sizeof(ctx[0]->buf);
+
+                i = lane_idx[j];
+                ctx[i]->count += bytes;
+                p[i] += bytes;
+                left[i] -= bytes;
+            }
+        }
+    }
+#endif
+
+    // whatever is left: a single stream's blocks and partial tails
+    for (i = 0; i < n; i++) {
+        if (left[i] > 0)
+            SHA_update(ctx[i], p[i], left[i]);
+    }
+}
+
+void SHA_update_mb(SHA_CTX* const ctx[], const void* const data[],
+                   const int len[], int n) {
+    int i;
+
+    for (i = 0; i < n; i += SHA_MB_GROUP)
+        SHA_update_mb_group(ctx + i, data + i, len + i,
+                            n - i < SHA_MB_GROUP ? n - i : SHA_MB_GROUP);
+}
+
+/*
+ * LCOV_EXCL_START
+ * Unit testing stuff done here so we do not need to expose static functions.
+ */
+int SHA_mb_test() {
+    // more streams than one group, so groups are split and combined
+    enum { NSTREAMS = SHA_MB_GROUP + SHA_MB_LANES + 3 };
+    static uint8_t msg[NSTREAMS][1000];
+    SHA_CTX ctxs[NSTREAMS];
+    SHA_CTX* ctx[NSTREAMS];
+    const void* data[NSTREAMS];
+    int len[NSTREAMS];
+    uint8_t expected[SHA_DIGEST_SIZE];
+    int rc = 0, i, j, n, round;
+
+    for (i = 0; i < NSTREAMS; i++) {
+        for (j = 0; j < sizeof(msg[i]); j++)
+            msg[i][j] = i * 251 + j * 7;
+    }
+
+    // vary the number of streams, their lengths and the update sizes
+    for (n = 1; n <= NSTREAMS; n++) {
+        for (i = 0; i < n; i++) {
+            SHA_init(&ctxs[i]);
+            ctx[i] = &ctxs[i];
+        }
+
+        for (round = 0; round < 3; round++) {
+            for (i = 0; i < n; i++) {
+                len[i] = (i * 97 + round * 131 + n * 13) % 320;
+                data[i] = msg[i] + round * 320;
+            }
+            SHA_update_mb(ctx, data, len, n);
+        }
+
+        for (i = 0; i < n; i++) {
+            SHA_CTX ref;
+
+            SHA_init(&ref);
+            for (round = 0; round < 3; round++) {
+                SHA_update(&ref, msg[i] + round * 320,
+                           (i * 97 + round * 131 + n * 13) % 320);
+            }
+            memcpy(expected, SHA_final(&ref), SHA_DIGEST_SIZE);
+
+            if (memcmp(SHA_final(ctx[i]), expected, SHA_DIGEST_SIZE)) {
+                printf("FAILURE: multi-buffer SHA-1 mismatch, "
+                       "stream %d of %d\n", i, n);
+                rc |= 1;
+            }
+        }
+    }
+
+    // no streams at all is not an error
+    SHA_init(&ctxs[0]);
+    SHA_update_mb(ctx, data, len, 0);
+    SHA_update_mb(ctx, data, len, -1);
+    if (ctxs[0].count) {
+        printf("FAILURE: multi-buffer SHA-1 used streams with n <= 0\n");
+        rc |= 1;
+    }
+
+    return rc;
+}
+/* LCOV_EXCL_STOP */
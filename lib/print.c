@@ -0,0 +1,968 @@
+/*
+ * Copyright 2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Streaming fmap printer. Records are formatted field by field straight
+ * into the output buffer of an output context, which is written out
+ * whenever it fills up, so printing needs no allocation however many areas
+ * there are. In the pair, value and long styles the output matches what
+ * kv_pair_print() produces for the same fields. The JSON, CSV and TLV
+ * styles are only produced here.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <fmap.h>
+#include <valstr.h>
+
+#include "kv_pair.h"
+
+/* size of the output buffer used when the caller does not provide one */
+#define FMAP_PRINT_BUFSIZE	(64 << 10)
+
+/* names of the individual flag bits, filled in once from flag_lut */
+static const char *fmap_flag_names[sizeof(uint16_t) * CHAR_BIT];
+static size_t fmap_flag_lens[sizeof(uint16_t) * CHAR_BIT];
+static pthread_once_t fmap_flag_names_once = PTHREAD_ONCE_INIT;
+
+static void fmap_flag_names_init(void)
+{
+	int i;
+
+	for (i = 0; i < sizeof(uint16_t) * CHAR_BIT; i++) {
+		fmap_flag_names[i] = val2str(1 << i, flag_lut);
+		fmap_flag_lens[i] = strlen(fmap_flag_names[i]);
+	}
+}
+
+size_t fmap_flags_format(char *buf, size_t size, uint16_t flags)
+{
+	size_t len = 0, n;
+	int i;
+
+	pthread_once(&fmap_flag_names_once, fmap_flag_names_init);
+
+	for (i = 0; flags; i++) {
+		if (!(flags & (1 << i)))
+			continue;
+		flags &= ~(1 << i);
+
+		n = fmap_flag_lens[i] + (flags ? 1 : 0);
+		if (len + n < size) {
+			memcpy(buf + len, fmap_flag_names[i], fmap_flag_lens[i]);
+			if (flags)
+				buf[len + n - 1] = ',';
+		}
+		len += n;
+	}
+
+	if (size)
+		buf[len < size ? len : size - 1] = '\0';
+	return len;
+}
+
+enum fmap_output_sink {
+	FMAP_SINK_FILE,
+	FMAP_SINK_FD,
+	FMAP_SINK_MEMORY,
+};
+
+/*
+ * Everything printing needs is kept here rather than in globals, so any
+ * number of contexts can be used at once, e.g. one per thread.
+ */
+struct fmap_output {
+	enum kv_pair_style style;
+	enum fmap_output_sink sink;
+	FILE *fp;
+	int fd;
+	char *buf;		/* output buffer, or all output for memory */
+	size_t size;
+	size_t len;
+	int own_buf;		/* buf was allocated by the context */
+	int error;
+	const char *columns;	/* first key of the last CSV header row */
+};
+
+static int fmap_out_sink(struct fmap_output *out, const char *s, size_t len)
+{
+	ssize_t n;
+
+	switch (out->sink) {
+	case FMAP_SINK_FILE:
+		return fwrite(s, 1, len, out->fp) == len ? 0 : -1;
+	case FMAP_SINK_FD:
+		while (len) {
+			n = write(out->fd, s, len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return -1;
+			s += n;
+			len -= n;
+		}
+		return 0;
+	case FMAP_SINK_MEMORY:
+		break;
+	}
+
+	return -1;
+}
+
+static void fmap_out_flush(struct fmap_output *out)
+{
+	/* memory output simply stays in the buffer */
+	if (out->sink == FMAP_SINK_MEMORY)
+		return;
+
+	if (out->len && fmap_out_sink(out, out->buf, out->len) < 0)
+		out->error = 1;
+	out->len = 0;
+}
+
+static void fmap_out_write(struct fmap_output *out, const char *s, size_t len)
+{
+	char *buf;
+	size_t size;
+
+	if (out->size - out->len < len && out->sink == FMAP_SINK_MEMORY) {
+		for (size = out->size; size - out->len < len; size *= 2)
+			;
+		buf = realloc(out->buf, size);
+		if (!buf) {
+			out->error = 1;
+			return;
+		}
+		out->buf = buf;
+		out->size = size;
+	} else if (out->size - out->len < len) {
+		fmap_out_flush(out);
+
+		/* too big to buffer at all */
+		if (len > out->size) {
+			if (fmap_out_sink(out, s, len) < 0)
+				out->error = 1;
+			return;
+		}
+	}
+
+	memcpy(out->buf + out->len, s, len);
+	out->len += len;
+}
+
+#define fmap_out_str(out, s)	fmap_out_write(out, s, strlen(s))
+
+static void fmap_out_byte(struct fmap_output *out, uint8_t c)
+{
+	fmap_out_write(out, (const char *)&c, 1);
+}
+
+/* a JSON string, with anything but printable ASCII escaped */
+static void fmap_out_json(struct fmap_output *out, const char *s, size_t len)
+{
+	static const char digits[] = "0123456789abcdef";
+	char esc[6] = { '\\', 'u', '0', '0' };
+	size_t i, start = 0;
+
+	fmap_out_byte(out, '"');
+	for (i = 0; i < len; i++) {
+		uint8_t c = s[i];
+
+		if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\')
+			continue;
+
+		fmap_out_write(out, s + start, i - start);
+		if (c == '"' || c == '\\') {
+			esc[1] = c;
+			fmap_out_write(out, esc, 2);
+		} else {
+			esc[1] = 'u';
+			esc[4] = digits[c >> 4];
+			esc[5] = digits[c & 0xf];
+			fmap_out_write(out, esc, 6);
+		}
+		start = i + 1;
+	}
+	fmap_out_write(out, s + start, len - start);
+	fmap_out_byte(out, '"');
+}
+
+/* a CSV field, quoted as in RFC 4180 when it needs to be */
+static void fmap_out_csv(struct fmap_output *out, const char *s, size_t len)
+{
+	size_t i, start = 0;
+
+	for (i = 0; i < len; i++) {
+		if (strchr(",\"\r\n", s[i]) && s[i])
+			break;
+	}
+	if (i == len) {
+		fmap_out_write(out, s, len);
+		return;
+	}
+
+	fmap_out_byte(out, '"');
+	for (i = 0; i < len; i++) {
+		if (s[i] != '"')
+			continue;
+		fmap_out_write(out, s + start, i + 1 - start);
+		start = i;	/* write the quote twice */
+	}
+	fmap_out_write(out, s + start, len - start);
+	fmap_out_byte(out, '"');
+}
+
+/*
+ * One field of a record, with its value already formatted. The value is
+ * large enough for the flags string with every bit set. For TLV output,
+ * the field's bytes as stored in the fmap are used instead, and fields
+ * without them are left out.
+ */
+struct fmap_field {
+	const char *key;
+	char value[128];
+	size_t len;
+	uint8_t tag;
+	const uint8_t *raw;
+	size_t raw_len;
+};
+
+static void fmap_out_record(struct fmap_output *out, uint8_t tag,
+                            const struct fmap_field *fields, int n)
+{
+	enum kv_pair_style style = out->style;
+	static const char pad[20] = "                    ";
+	size_t klen, len;
+	int i;
+
+	switch (style) {
+	case KV_STYLE_JSON:
+		fmap_out_byte(out, '{');
+		break;
+	case KV_STYLE_CSV:
+		/* name the columns whenever the kind of record changes */
+		if (out->columns == fields[0].key)
+			break;
+		out->columns = fields[0].key;
+		for (i = 0; i < n; i++) {
+			fmap_out_str(out, fields[i].key);
+			fmap_out_byte(out, i < n - 1 ? ',' : '\n');
+		}
+		break;
+	case KV_STYLE_TLV:
+		for (i = 0, len = 0; i < n; i++) {
+			if (fields[i].raw)
+				len += 2 + fields[i].raw_len;
+		}
+		fmap_out_byte(out, tag);
+		fmap_out_byte(out, len);
+		break;
+	default:
+		break;
+	}
+
+	for (i = 0; i < n; i++) {
+		switch (style) {
+		case KV_STYLE_PAIR:
+			fmap_out_str(out, fields[i].key);
+			fmap_out_write(out, "=\"", 2);
+			fmap_out_write(out, fields[i].value, fields[i].len);
+			fmap_out_write(out, "\" ", 2);
+			break;
+		case KV_STYLE_VALUE:
+			fmap_out_write(out, fields[i].value, fields[i].len);
+			if (i < n - 1)
+				fmap_out_write(out, " | ", 3);
+			break;
+		case KV_STYLE_LONG:
+			klen = strlen(fields[i].key);
+			fmap_out_write(out, fields[i].key, klen);
+			if (klen < sizeof(pad))
+				fmap_out_write(out, pad, sizeof(pad) - klen);
+			fmap_out_write(out, " | ", 3);
+			fmap_out_write(out, fields[i].value, fields[i].len);
+			fmap_out_write(out, "\n", 1);
+			break;
+		case KV_STYLE_JSON:
+			fmap_out_json(out, fields[i].key,
+			              strlen(fields[i].key));
+			fmap_out_byte(out, ':');
+			fmap_out_json(out, fields[i].value, fields[i].len);
+			if (i < n - 1)
+				fmap_out_byte(out, ',');
+			break;
+		case KV_STYLE_CSV:
+			fmap_out_csv(out, fields[i].value, fields[i].len);
+			if (i < n - 1)
+				fmap_out_byte(out, ',');
+			break;
+		case KV_STYLE_TLV:
+			if (!fields[i].raw)
+				break;
+			fmap_out_byte(out, fields[i].tag);
+			fmap_out_byte(out, fields[i].raw_len);
+			fmap_out_write(out, (const char *)fields[i].raw,
+			               fields[i].raw_len);
+			break;
+		}
+	}
+
+	switch (style) {
+	case KV_STYLE_JSON:
+		fmap_out_write(out, "}\n", 2);
+		break;
+	case KV_STYLE_TLV:
+		break;
+	default:
+		fmap_out_write(out, "\n", 1);
+		break;
+	}
+}
+
+/* the raw bytes of a field, which are stored little-endian */
+static void fmap_field_raw(struct fmap_field *f, uint8_t tag,
+                           const void *raw, size_t len)
+{
+	f->tag = tag;
+	f->raw = raw;
+	f->raw_len = len;
+}
+
+#define FMAP_FIELD_RAW(f, tag, ptr, type, member)			\
+	fmap_field_raw(f, tag, (const uint8_t *)(ptr) +			\
+	               offsetof(type, member), sizeof((ptr)->member))
+
+/* "0x" followed by at least width hex digits */
+static void fmap_field_hex(struct fmap_field *f, const char *key,
+                           uint64_t val, int width)
+{
+	static const char digits[] = "0123456789abcdef";
+	int n = 1;
+
+	while (n < 16 && (val >> (4 * n)))
+		n++;
+	if (n < width)
+		n = width;
+
+	f->key = key;
+	f->value[0] = '0';
+	f->value[1] = 'x';
+	f->len = n + 2;
+	f->raw = NULL;
+	for (; n > 0; n--, val >>= 4)
+		f->value[n + 1] = digits[val & 0xf];
+}
+
+static void fmap_field_dec(struct fmap_field *f, const char *key,
+                           unsigned int val)
+{
+	char tmp[16];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+
+	f->key = key;
+	f->len = n;
+	f->raw = NULL;
+	while (n--)
+		f->value[f->len - 1 - n] = tmp[n];
+}
+
+/* names are given without their padding, in TLV output too */
+static void fmap_field_name(struct fmap_field *f, const char *key,
+                            uint8_t tag, const uint8_t *name)
+{
+	const uint8_t *end = memchr(name, '\0', FMAP_STRLEN);
+
+	f->key = key;
+	f->len = end ? (size_t)(end - name) : FMAP_STRLEN;
+	memcpy(f->value, name, f->len);
+	fmap_field_raw(f, tag, name, f->len);
+}
+
+static const struct valstr fmap_output_formats[] = {
+	{ KV_STYLE_PAIR, "pair" },
+	{ KV_STYLE_VALUE, "value" },
+	{ KV_STYLE_LONG, "long" },
+	{ KV_STYLE_JSON, "json" },
+	{ KV_STYLE_CSV, "csv" },
+	{ KV_STYLE_TLV, "tlv" },
+	{ 0, NULL },
+};
+
+static struct fmap_output *fmap_output_create(enum fmap_output_sink sink,
+                                              size_t size)
+{
+	struct fmap_output *out;
+
+	out = calloc(1, sizeof(*out));
+	if (!out)
+		return NULL;
+
+	out->buf = malloc(size);
+	if (!out->buf) {
+		free(out);
+		return NULL;
+	}
+	out->size = size;
+	out->own_buf = 1;
+	out->sink = sink;
+	out->style = KV_STYLE_PAIR;
+	out->fd = -1;
+
+	return out;
+}
+
+struct fmap_output *fmap_output_create_file(FILE *fp)
+{
+	struct fmap_output *out;
+
+	if (!fp)
+		return NULL;
+
+	out = fmap_output_create(FMAP_SINK_FILE, FMAP_PRINT_BUFSIZE);
+	if (out)
+		out->fp = fp;
+	return out;
+}
+
+struct fmap_output *fmap_output_create_fd(int fd)
+{
+	struct fmap_output *out;
+
+	if (fd < 0)
+		return NULL;
+
+	out = fmap_output_create(FMAP_SINK_FD, FMAP_PRINT_BUFSIZE);
+	if (out)
+		out->fd = fd;
+	return out;
+}
+
+struct fmap_output *fmap_output_create_memory(void)
+{
+	/* grown as needed */
+	return fmap_output_create(FMAP_SINK_MEMORY, 4096);
+}
+
+void fmap_output_destroy(struct fmap_output *out)
+{
+	if (!out)
+		return;
+
+	fmap_out_flush(out);
+	if (out->own_buf)
+		free(out->buf);
+	free(out);
+}
+
+int fmap_output_set_format(struct fmap_output *out, const char *format)
+{
+	int i;
+
+	if (!out || !format)
+		return -1;
+
+	for (i = 0; fmap_output_formats[i].str; i++) {
+		if (!strcasecmp(format, fmap_output_formats[i].str)) {
+			out->style = fmap_output_formats[i].val;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+const char *fmap_output_data(const struct fmap_output *out, size_t *len)
+{
+	if (!out || !len || out->sink != FMAP_SINK_MEMORY)
+		return NULL;
+
+	*len = out->len;
+	return out->buf;
+}
+
+void fmap_output_clear(struct fmap_output *out)
+{
+	if (out && out->sink == FMAP_SINK_MEMORY)
+		out->len = 0;
+}
+
+int fmap_output_print(struct fmap_output *out, const struct fmap *fmap)
+{
+	struct fmap_field fields[7];
+	const uint8_t *sig;
+	int i;
+
+	if (!out || !fmap)
+		return -1;
+
+	/* each fmap starts a new CSV table */
+	out->columns = NULL;
+	out->error = 0;
+
+	sig = fmap->signature;
+	fmap_field_hex(&fields[0], "fmap_signature",
+	               (uint64_t)sig[0] << 56 | (uint64_t)sig[1] << 48 |
+	               (uint64_t)sig[2] << 40 | (uint64_t)sig[3] << 32 |
+	               (uint64_t)sig[4] << 24 | (uint64_t)sig[5] << 16 |
+	               (uint64_t)sig[6] << 8 | (uint64_t)sig[7], 16);
+	FMAP_FIELD_RAW(&fields[0], FMAP_TLV_SIGNATURE,
+	               fmap, struct fmap, signature);
+	fmap_field_dec(&fields[1], "fmap_ver_major", fmap->ver_major);
+	FMAP_FIELD_RAW(&fields[1], FMAP_TLV_VER_MAJOR,
+	               fmap, struct fmap, ver_major);
+	fmap_field_dec(&fields[2], "fmap_ver_minor", fmap->ver_minor);
+	FMAP_FIELD_RAW(&fields[2], FMAP_TLV_VER_MINOR,
+	               fmap, struct fmap, ver_minor);
+	fmap_field_hex(&fields[3], "fmap_base", fmap->base, 16);
+	FMAP_FIELD_RAW(&fields[3], FMAP_TLV_BASE, fmap, struct fmap, base);
+	fmap_field_hex(&fields[4], "fmap_size", fmap->size, 4);
+	FMAP_FIELD_RAW(&fields[4], FMAP_TLV_SIZE, fmap, struct fmap, size);
+	fmap_field_name(&fields[5], "fmap_name", FMAP_TLV_NAME, fmap->name);
+	fmap_field_dec(&fields[6], "fmap_nareas", fmap->nareas);
+	FMAP_FIELD_RAW(&fields[6], FMAP_TLV_NAREAS,
+	               fmap, struct fmap, nareas);
+	fmap_out_record(out, FMAP_TLV_FMAP, fields, 7);
+
+	for (i = 0; i < fmap->nareas; i++) {
+		const struct fmap_area *area = &fmap->areas[i];
+
+		fmap_field_hex(&fields[0], "area_offset", area->offset, 8);
+		FMAP_FIELD_RAW(&fields[0], FMAP_TLV_AREA_OFFSET,
+		               area, struct fmap_area, offset);
+		fmap_field_hex(&fields[1], "area_size", area->size, 8);
+		FMAP_FIELD_RAW(&fields[1], FMAP_TLV_AREA_SIZE,
+		               area, struct fmap_area, size);
+		fmap_field_name(&fields[2], "area_name", FMAP_TLV_AREA_NAME,
+		                area->name);
+		fmap_field_hex(&fields[3], "area_flags_raw", area->flags, 2);
+		FMAP_FIELD_RAW(&fields[3], FMAP_TLV_AREA_FLAGS,
+		               area, struct fmap_area, flags);
+
+		/* Print descriptive strings for flags rather than the field */
+		fields[4].key = "area_flags";
+		fields[4].len = fmap_flags_format(fields[4].value,
+		                                  sizeof(fields[4].value),
+		                                  area->flags);
+		fields[4].raw = NULL;
+		fmap_out_record(out, FMAP_TLV_AREA, fields, 5);
+	}
+
+	fmap_out_flush(out);
+	return out->error ? -1 : 0;
+}
+
+int fmap_print_buffered(FILE *fp, const struct fmap *fmap,
+                        char *buf, size_t size)
+{
+	char internal[FMAP_PRINT_BUFSIZE];
+	struct fmap_output out = {
+		.style = kv_pair_get_style(),
+		.sink = FMAP_SINK_FILE,
+		.fp = fp,
+		.fd = -1,
+		.buf = buf && size ? buf : internal,
+		.size = buf && size ? size : sizeof(internal),
+	};
+
+	if (!fp)
+		return -1;
+
+	return fmap_output_print(&out, fmap);
+}
+
+/*
+ * LCOV_EXCL_START
+ * Unit testing stuff done here so we do not need to expose static functions.
+ */
+
+/* the kv_pair based printer fmap_print() used to be */
+static void fmap_print_kv(FILE *fp, const struct fmap *fmap)
+{
+	struct kv_pair *kv;
+	const uint8_t *tmp = fmap->signature;
+	char *str;
+	int i;
+
+	kv = kv_pair_new();
+	kv_pair_fmt(kv, "fmap_signature",
+	            "0x%02x%02x%02x%02x%02x%02x%02x%02x",
+	            tmp[0], tmp[1], tmp[2], tmp[3],
+	            tmp[4], tmp[5], tmp[6], tmp[7]);
+	kv_pair_fmt(kv, "fmap_ver_major", "%d", fmap->ver_major);
+	kv_pair_fmt(kv, "fmap_ver_minor","%d", fmap->ver_minor);
+	kv_pair_fmt(kv, "fmap_base", "0x%016llx",
+	            (unsigned long long)fmap->base);
+	kv_pair_fmt(kv, "fmap_size", "0x%04x", fmap->size);
+	kv_pair_fmt(kv, "fmap_name", "%s", fmap->name);
+	kv_pair_fmt(kv, "fmap_nareas", "%d", fmap->nareas);
+	kv_pair_print_to_file(fp, kv, kv_pair_get_style());
+
+	for (i = 0; i < fmap->nareas; i++) {
+		kv_pair_reset(kv);
+		kv_pair_fmt(kv, "area_offset", "0x%08x", fmap->areas[i].offset);
+		kv_pair_fmt(kv, "area_size", "0x%08x", fmap->areas[i].size);
+		kv_pair_fmt(kv, "area_name", "%s", fmap->areas[i].name);
+		kv_pair_fmt(kv, "area_flags_raw", "0x%02x",
+		            fmap->areas[i].flags);
+		str = fmap_flags_to_string(fmap->areas[i].flags);
+		kv_pair_fmt(kv, "area_flags", "%s", str);
+		free(str);
+		kv_pair_print_to_file(fp, kv, kv_pair_get_style());
+	}
+
+	kv_pair_free(kv);
+}
+
+static int fmap_print_buffered_test(void)
+{
+	static const enum kv_pair_style styles[] = {
+		KV_STYLE_PAIR, KV_STYLE_VALUE, KV_STYLE_LONG,
+	};
+	enum kv_pair_style orig_style = kv_pair_get_style();
+	struct fmap *fmap;
+	char *expected = NULL, *actual = NULL, buf[7], flags[8], csv[512];
+	size_t expected_len, actual_len;
+	FILE *fp;
+	int i, rc = 1;
+
+	fmap = fmap_create(0x12345678abcdULL, 0x123456, (uint8_t *)"print");
+	for (i = 0; i < 300; i++) {
+		char name[FMAP_STRLEN + 1];
+
+		snprintf(name, sizeof(name), "AREA_%d", i * 997);
+		fmap_append_area(&fmap, i * 0x1000, i * 0x33,
+		                 (const uint8_t *)name, i * 0xdd);
+	}
+	fmap_append_area(&fmap, 0, 0, (const uint8_t *)"ALL_FLAGS", 0xffff);
+	fmap_append_area(&fmap, 0x10, 0x20, (const uint8_t *)"a,\"b\"\\\t", 1);
+
+	if (fmap_print_buffered(NULL, fmap, NULL, 0) >= 0 ||
+	    fmap_print_buffered(stdout, NULL, NULL, 0) >= 0) {
+		printf("FAILURE: failed to abort on NULL pointer input\n");
+		goto fmap_print_buffered_test_exit;
+	}
+
+	if ((fmap_flags_format(flags, sizeof(flags), 0x5) != 9) ||
+	    strcmp(flags, "static,")) {
+		printf("FAILURE: flags string not truncated correctly\n");
+		goto fmap_print_buffered_test_exit;
+	}
+
+	for (i = 0; i < sizeof(styles) / sizeof(styles[0]); i++) {
+		kv_pair_set_style(styles[i]);
+
+		fp = open_memstream(&expected, &expected_len);
+		fmap_print_kv(fp, fmap);
+		fclose(fp);
+
+		/* a tiny buffer makes every record straddle flushes */
+		fp = open_memstream(&actual, &actual_len);
+		if (fmap_print_buffered(fp, fmap, buf, sizeof(buf)) < 0 ||
+		    fmap_print_buffered(fp, fmap, NULL, 0) < 0) {
+			printf("FAILURE: failed to print fmap\n");
+			fclose(fp);
+			goto fmap_print_buffered_test_exit;
+		}
+		fclose(fp);
+
+		if ((actual_len != 2 * expected_len) ||
+		    memcmp(actual, expected, expected_len) ||
+		    memcmp(actual + expected_len, expected, expected_len)) {
+			printf("FAILURE: output differs in style %d\n",
+			       styles[i]);
+			goto fmap_print_buffered_test_exit;
+		}
+
+		free(expected);
+		free(actual);
+		expected = actual = NULL;
+	}
+
+	/* JSON has one object per record, with strings escaped */
+	kv_pair_set_style(KV_STYLE_JSON);
+	fp = open_memstream(&actual, &actual_len);
+	fmap_print_buffered(fp, fmap, buf, sizeof(buf));
+	fclose(fp);
+	snprintf(csv, sizeof(csv),
+	         "{\"fmap_signature\":\"0x5f5f464d41505f5f\","
+	         "\"fmap_ver_major\":\"%d\",\"fmap_ver_minor\":\"%d\","
+	         "\"fmap_base\":\"0x000012345678abcd\","
+	         "\"fmap_size\":\"0x123456\",\"fmap_name\":\"print\","
+	         "\"fmap_nareas\":\"302\"}\n",
+	         VERSION_MAJOR, VERSION_MINOR);
+	if (strncmp(actual, csv, strlen(csv)) ||
+	    !strstr(actual, "\n{\"area_offset\":\"0x00000000\","
+	                    "\"area_size\":\"0x00000000\","
+	                    "\"area_name\":\"AREA_0\",") ||
+	    !strstr(actual, "\"area_name\":\"a,\\\"b\\\"\\\\\\u0009\",") ||
+	    actual[actual_len - 2] != '}' || actual[actual_len - 1] != '\n') {
+		printf("FAILURE: JSON output is incorrect\n");
+		goto fmap_print_buffered_test_exit;
+	}
+	free(actual);
+	actual = NULL;
+
+	/* CSV has a row naming the columns before each kind of record */
+	kv_pair_set_style(KV_STYLE_CSV);
+	fp = open_memstream(&actual, &actual_len);
+	fmap_print_buffered(fp, fmap, buf, sizeof(buf));
+	fclose(fp);
+	snprintf(csv, sizeof(csv),
+	         "fmap_signature,fmap_ver_major,fmap_ver_minor,fmap_base,"
+	         "fmap_size,fmap_name,fmap_nareas\n"
+	         "0x5f5f464d41505f5f,%d,%d,0x000012345678abcd,0x123456,"
+	         "print,302\n"
+	         "area_offset,area_size,area_name,area_flags_raw,area_flags\n"
+	         "0x00000000,0x00000000,AREA_0,0x00,\n",
+	         VERSION_MAJOR, VERSION_MINOR);
+	if (strncmp(actual, csv, strlen(csv)) ||
+	    !strstr(actual, "\n0x00000010,0x00000020,\"a,\"\"b\"\"\\\t\","
+	                    "0x01,static\n") ||
+	    strstr(actual + strlen(csv), "area_offset")) {
+		printf("FAILURE: CSV output is incorrect\n");
+		goto fmap_print_buffered_test_exit;
+	}
+	free(actual);
+	actual = NULL;
+
+	/* walk the TLV records back over the fmap */
+	kv_pair_set_style(KV_STYLE_TLV);
+	fp = open_memstream(&actual, &actual_len);
+	fmap_print_buffered(fp, fmap, buf, sizeof(buf));
+	fclose(fp);
+	for (i = 0, expected_len = 0; expected_len < actual_len; i++) {
+		const uint8_t *rec = (const uint8_t *)actual + expected_len;
+		const struct fmap_area *area = &fmap->areas[i - 1];
+		size_t off;
+
+		expected_len += 2 + rec[1];
+		if ((expected_len > actual_len) ||
+		    (rec[0] != (i ? FMAP_TLV_AREA : FMAP_TLV_FMAP)))
+			break;
+		if (!i) {
+			if ((rec[1] != 43) || (rec[2] != FMAP_TLV_SIGNATURE) ||
+			    memcmp(&rec[4], FMAP_SIGNATURE, 8))
+				break;
+			continue;
+		}
+
+		/* offset, size, name and flags */
+		off = 2;
+		if ((rec[off] != FMAP_TLV_AREA_OFFSET) || (rec[off + 1] != 4) ||
+		    memcmp(&rec[off + 2], &area->offset, 4))
+			break;
+		off += 2 + 4 + 2 + 4;
+		if ((rec[off] != FMAP_TLV_AREA_NAME) ||
+		    (rec[off + 1] != strlen((const char *)area->name)) ||
+		    memcmp(&rec[off + 2], area->name, rec[off + 1]))
+			break;
+		off += 2 + rec[off + 1];
+		if ((rec[off] != FMAP_TLV_AREA_FLAGS) ||
+		    memcmp(&rec[off + 2], &area->flags, 2) ||
+		    (off + 4 != 2 + rec[1]))
+			break;
+	}
+	if ((i != fmap->nareas + 1) || (expected_len != actual_len)) {
+		printf("FAILURE: TLV output is incorrect at record %d\n", i);
+		goto fmap_print_buffered_test_exit;
+	}
+
+	rc = 0;
+fmap_print_buffered_test_exit:
+	kv_pair_set_style(orig_style);
+	free(expected);
+	free(actual);
+	fmap_destroy(fmap);
+	return rc;
+}
+/* each thread prints one fmap in its own format to its own context */
+struct fmap_output_test_job {
+	const struct fmap *fmap;
+	const char *format;
+	struct fmap_output *out;
+	int rc;
+};
+
+static void *fmap_output_test_worker(void *arg)
+{
+	struct fmap_output_test_job *job = arg;
+	int i;
+
+	job->rc = fmap_output_set_format(job->out, job->format);
+	for (i = 0; i < 20 && !job->rc; i++)
+		job->rc = fmap_output_print(job->out, job->fmap);
+
+	return NULL;
+}
+
+static int fmap_output_threads_test(void)
+{
+	static const char *formats[] = {
+		"pair", "VALUE", "long", "json", "csv", "tlv",
+	};
+	struct fmap_output_test_job jobs[6];
+	pthread_t threads[6];
+	struct fmap *fmap;
+	struct fmap_output *out = NULL;
+	char *expected = NULL, path[] = "/tmp/fmap_output_XXXXXX", *data;
+	const char *actual;
+	size_t expected_len, actual_len;
+	FILE *fp;
+	int i, j, fd = -1, rc = 1;
+
+	fmap = fmap_create(0, 0x100000, (uint8_t *)"threads");
+	for (i = 0; i < 500; i++)
+		fmap_append_area(&fmap, i * 0x100, 0x100,
+		                 (const uint8_t *)"AREA", i & 7);
+
+	for (i = 0; i < 6; i++) {
+		jobs[i].fmap = fmap;
+		jobs[i].format = formats[i];
+		jobs[i].out = fmap_output_create_memory();
+		pthread_create(&threads[i], NULL, fmap_output_test_worker,
+		               &jobs[i]);
+	}
+	for (i = 0; i < 6; i++)
+		pthread_join(threads[i], NULL);
+
+	/* every context must hold its own output, uninterleaved */
+	for (i = 0; i < 6; i++) {
+		if (jobs[i].rc) {
+			printf("FAILURE: failed to print %s\n", formats[i]);
+			goto fmap_output_threads_test_exit;
+		}
+
+		out = fmap_output_create_memory();
+		fmap_output_set_format(out, formats[i]);
+		fmap_output_print(out, fmap);
+		actual = fmap_output_data(out, &actual_len);
+		expected = malloc(actual_len);
+		memcpy(expected, actual, actual_len);
+		expected_len = actual_len;
+		fmap_output_destroy(out);
+		out = NULL;
+
+		actual = fmap_output_data(jobs[i].out, &actual_len);
+		if (actual_len != 20 * expected_len) {
+			printf("FAILURE: %s output has wrong length\n",
+			       formats[i]);
+			goto fmap_output_threads_test_exit;
+		}
+		for (j = 0; j < 20; j++) {
+			if (memcmp(actual + j * expected_len, expected,
+			           expected_len)) {
+				printf("FAILURE: %s output is corrupted\n",
+				       formats[i]);
+				goto fmap_output_threads_test_exit;
+			}
+		}
+
+		free(expected);
+		expected = NULL;
+	}
+
+	if (fmap_output_create_file(NULL) || fmap_output_create_fd(-1) ||
+	    fmap_output_data(NULL, &actual_len) ||
+	    (fmap_output_set_format(jobs[0].out, "xml") >= 0) ||
+	    (fmap_output_print(NULL, fmap) >= 0)) {
+		printf("FAILURE: failed to abort on invalid input\n");
+		goto fmap_output_threads_test_exit;
+	}
+
+	/* file descriptors get the same bytes as memory */
+	fd = mkstemp(path);
+	unlink(path);
+	out = fmap_output_create_fd(fd);
+	if (!out || fmap_output_data(out, &actual_len) ||
+	    (fmap_output_print(out, fmap) < 0)) {
+		printf("FAILURE: failed to print to file descriptor\n");
+		goto fmap_output_threads_test_exit;
+	}
+	fmap_output_destroy(out);
+	out = NULL;
+
+	fp = fdopen(fd, "r");
+	fd = -1;
+	rewind(fp);
+	data = malloc(1 << 20);
+	actual_len = fread(data, 1, 1 << 20, fp);
+	fclose(fp);
+	expected_len = 0;
+	actual = fmap_output_data(jobs[0].out, &expected_len);
+	i = (actual_len != expected_len / 20) ||
+	    memcmp(data, actual, actual_len);
+	free(data);
+	if (i) {
+		printf("FAILURE: file descriptor output is incorrect\n");
+		goto fmap_output_threads_test_exit;
+	}
+
+	fmap_output_clear(jobs[0].out);
+	fmap_output_data(jobs[0].out, &actual_len);
+	if (actual_len) {
+		printf("FAILURE: failed to clear memory output\n");
+		goto fmap_output_threads_test_exit;
+	}
+
+	rc = 0;
+fmap_output_threads_test_exit:
+	if (fd >= 0)
+		close(fd);
+	for (i = 0; i < 6; i++)
+		fmap_output_destroy(jobs[i].out);
+	fmap_output_destroy(out);
+	free(expected);
+	fmap_destroy(fmap);
+	return rc;
+}
+
+int fmap_output_test(void)
+{
+	int rc = 0;
+
+	rc |= fmap_print_buffered_test();
+	rc |= fmap_output_threads_test();
+
+	return rc;
+}
+/* LCOV_EXCL_STOP */
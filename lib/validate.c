@@ -0,0 +1,364 @@
+/*
+ * Copyright 2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Layout validation. Areas are sorted by offset, largest first among areas
+ * starting together, and swept once while keeping the areas that contain
+ * the current offset in a min-heap ordered by end. Areas ending before the
+ * current one starts leave the heap; every area still in it intersects the
+ * current one, which is nested in those ending at or after its end and
+ * overlaps the others partially. Anything left uncovered by the areas swept
+ * so far is a gap. This is O(n log n) for the sort and the heap, plus O(k)
+ * for the k intersecting pairs reported.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fmap.h>
+#include <valstr.h>
+
+const struct valstr fmap_issue_lut[] = {
+	{ FMAP_ISSUE_BOUNDS, "bounds" },
+	{ FMAP_ISSUE_OVERLAP, "overlap" },
+	{ FMAP_ISSUE_GAP, "gap" },
+	{ FMAP_ISSUE_ALIGN, "align" },
+	{ FMAP_ISSUE_NESTED, "nested" },
+};
+
+struct fmap_validate_area {
+	uint64_t start;
+	uint64_t end;
+	int index;
+};
+
+static int fmap_validate_cmp(const void *a, const void *b)
+{
+	const struct fmap_validate_area *va = a, *vb = b;
+
+	if (va->start != vb->start)
+		return va->start < vb->start ? -1 : 1;
+	/* enclosing areas first */
+	if (va->end != vb->end)
+		return va->end > vb->end ? -1 : 1;
+	return va->index - vb->index;
+}
+
+/* min-heap of indexes into the sorted areas, ordered by end */
+static void fmap_heap_push(const struct fmap_validate_area *areas,
+                           int *heap, int *n, int i)
+{
+	int pos = (*n)++;
+
+	while (pos && areas[heap[(pos - 1) / 2]].end > areas[i].end) {
+		heap[pos] = heap[(pos - 1) / 2];
+		pos = (pos - 1) / 2;
+	}
+	heap[pos] = i;
+}
+
+static void fmap_heap_pop(const struct fmap_validate_area *areas,
+                          int *heap, int *n)
+{
+	int last = heap[--(*n)], pos = 0, child;
+
+	while ((child = 2 * pos + 1) < *n) {
+		if (child + 1 < *n &&
+		    areas[heap[child + 1]].end < areas[heap[child]].end)
+			child++;
+		if (areas[heap[child]].end >= areas[last].end)
+			break;
+		heap[pos] = heap[child];
+		pos = child;
+	}
+	heap[pos] = last;
+}
+
+struct fmap_issue_list {
+	struct fmap_issue *issues;
+	int n;
+	int capacity;
+};
+
+static int fmap_issue_add(struct fmap_issue_list *list,
+                          enum fmap_issue_type type, int area, int other,
+                          uint64_t offset, uint64_t size)
+{
+	struct fmap_issue *issue;
+
+	if (list->n == list->capacity) {
+		int capacity = list->capacity ? list->capacity * 2 : 16;
+
+		issue = realloc(list->issues, capacity * sizeof(*issue));
+		if (issue == NULL)
+			return -1;
+		list->issues = issue;
+		list->capacity = capacity;
+	}
+
+	issue = &list->issues[list->n++];
+	issue->type = type;
+	issue->area = area;
+	issue->other = other;
+	issue->offset = offset;
+	issue->size = size;
+	return 0;
+}
+
+int fmap_validate(const struct fmap *fmap, uint32_t align,
+                  struct fmap_issue **issues)
+{
+	struct fmap_validate_area *areas = NULL, *a;
+	struct fmap_issue_list list = { NULL, 0, 0 };
+	int *heap = NULL, active = 0;
+	uint64_t covered = 0;
+	int i, j, rc = -1;
+
+	if (!fmap || !issues)
+		return -1;
+
+	/* alignment must be a power of two, 0 or 1 to skip the check */
+	if (align & (align - 1))
+		return -1;
+
+	areas = malloc((fmap->nareas ? fmap->nareas : 1) * sizeof(*areas));
+	heap = malloc((fmap->nareas ? fmap->nareas : 1) * sizeof(*heap));
+	if (!areas || !heap)
+		goto fmap_validate_exit;
+
+	for (i = 0; i < fmap->nareas; i++) {
+		uint32_t offset = fmap->areas[i].offset;
+		uint32_t size = fmap->areas[i].size;
+
+		areas[i].start = offset;
+		areas[i].end = (uint64_t)offset + size;
+		areas[i].index = i;
+
+		if ((areas[i].end > fmap->size) &&
+		    fmap_issue_add(&list, FMAP_ISSUE_BOUNDS, i, -1,
+		                   offset, size) < 0)
+			goto fmap_validate_exit;
+
+		if ((align > 1) && ((offset | size) & (align - 1)) &&
+		    fmap_issue_add(&list, FMAP_ISSUE_ALIGN, i, -1,
+		                   offset, size) < 0)
+			goto fmap_validate_exit;
+	}
+
+	qsort(areas, fmap->nareas, sizeof(*areas), fmap_validate_cmp);
+
+	for (i = 0; i < fmap->nareas; i++) {
+		a = &areas[i];
+
+		/* empty areas cover nothing, so cannot overlap or fill gaps */
+		if (a->start == a->end)
+			continue;
+
+		if (a->start > covered &&
+		    fmap_issue_add(&list, FMAP_ISSUE_GAP, -1, -1,
+		                   covered, a->start - covered) < 0)
+			goto fmap_validate_exit;
+		if (a->end > covered)
+			covered = a->end;
+
+		/* areas ending before this one starts cannot intersect it */
+		while (active && areas[heap[0]].end <= a->start)
+			fmap_heap_pop(areas, heap, &active);
+
+		/* every area left contains the start of this one */
+		for (j = 0; j < active; j++) {
+			struct fmap_validate_area *o = &areas[heap[j]];
+			int nested = o->end >= a->end;
+
+			if (fmap_issue_add(&list, nested ? FMAP_ISSUE_NESTED :
+			                   FMAP_ISSUE_OVERLAP, a->index,
+			                   o->index, a->start,
+			                   (nested ? a->end : o->end) -
+			                   a->start) < 0)
+				goto fmap_validate_exit;
+		}
+
+		fmap_heap_push(areas, heap, &active, i);
+	}
+
+	if (covered < fmap->size &&
+	    fmap_issue_add(&list, FMAP_ISSUE_GAP, -1, -1,
+	                   covered, fmap->size - covered) < 0)
+		goto fmap_validate_exit;
+
+	*issues = list.issues;
+	list.issues = NULL;
+	rc = list.n;
+
+fmap_validate_exit:
+	free(list.issues);
+	free(heap);
+	free(areas);
+	return rc;
+}
+
+const char *fmap_issue_type_to_string(enum fmap_issue_type type)
+{
+	return val2str(type, fmap_issue_lut);
+}
+
+/*
+ * LCOV_EXCL_START
+ * Unit testing stuff done here so we do not need to expose static functions.
+ */
+
+/* number of issues of a type, optionally only those involving one area */
+static int fmap_issue_count(const struct fmap_issue *issues, int n,
+                            enum fmap_issue_type type, int area)
+{
+	int i, count = 0;
+
+	for (i = 0; i < n; i++) {
+		if (issues[i].type == type &&
+		    (area < 0 || issues[i].area == area))
+			count++;
+	}
+
+	return count;
+}
+
+int fmap_validate_test(void)
+{
+	struct fmap *fmap;
+	struct fmap_issue *issues = NULL;
+	int i, n, rc = 1;
+
+	fmap = fmap_create(0, 0x10000, (uint8_t *)"validate");
+	fmap_append_area(&fmap, 0x0000, 0x4000, (const uint8_t *)"RO", 0);
+	fmap_append_area(&fmap, 0x0000, 0x1000, (const uint8_t *)"RO_A", 0);
+	fmap_append_area(&fmap, 0x1000, 0x3000, (const uint8_t *)"RO_B", 0);
+	/* straddles RO and RW */
+	fmap_append_area(&fmap, 0x3800, 0x1000, (const uint8_t *)"BAD", 0);
+	fmap_append_area(&fmap, 0x4000, 0x4000, (const uint8_t *)"RW", 0);
+	/* gap at 0x8000, then past the end of the image */
+	fmap_append_area(&fmap, 0x9001, 0x7000, (const uint8_t *)"TAIL", 0);
+	fmap_append_area(&fmap, 0x2000, 0, (const uint8_t *)"EMPTY", 0);
+
+	if ((fmap_validate(NULL, 0, &issues) >= 0) ||
+	    (fmap_validate(fmap, 0, NULL) >= 0) ||
+	    (fmap_validate(fmap, 3, &issues) >= 0)) {
+		printf("FAILURE: failed to abort on invalid input\n");
+		goto fmap_validate_test_exit;
+	}
+
+	n = fmap_validate(fmap, 0x1000, &issues);
+	if (n < 0) {
+		printf("FAILURE: failed to validate fmap\n");
+		goto fmap_validate_test_exit;
+	}
+
+	if ((fmap_issue_count(issues, n, FMAP_ISSUE_NESTED, 1) != 1) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_NESTED, 2) != 1) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_NESTED, -1) != 2)) {
+		printf("FAILURE: nested areas not found\n");
+		goto fmap_validate_test_exit;
+	}
+	/* BAD overlaps RO and RO_B, RW overlaps BAD */
+	if ((fmap_issue_count(issues, n, FMAP_ISSUE_OVERLAP, -1) != 3) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_OVERLAP, 3) != 2) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_OVERLAP, 4) != 1)) {
+		printf("FAILURE: overlapping areas not found\n");
+		goto fmap_validate_test_exit;
+	}
+	if ((fmap_issue_count(issues, n, FMAP_ISSUE_BOUNDS, -1) != 1) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_BOUNDS, 5) != 1) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_ALIGN, -1) != 2) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_ALIGN, 3) != 1) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_ALIGN, 5) != 1)) {
+		printf("FAILURE: bounds or alignment issues not found\n");
+		goto fmap_validate_test_exit;
+	}
+	for (i = 0; i < n; i++) {
+		if (issues[i].type == FMAP_ISSUE_GAP)
+			break;
+	}
+	if ((fmap_issue_count(issues, n, FMAP_ISSUE_GAP, -1) != 1) ||
+	    (issues[i].offset != 0x8000) || (issues[i].size != 0x1001)) {
+		printf("FAILURE: gap not found\n");
+		goto fmap_validate_test_exit;
+	}
+	free(issues);
+	issues = NULL;
+
+	/* an overlap with an enclosing area does not hide later ones */
+	fmap_destroy(fmap);
+	fmap = fmap_create(0, 0x200, (uint8_t *)"chain");
+	fmap_append_area(&fmap, 0x00, 0x100, (const uint8_t *)"X", 0);
+	fmap_append_area(&fmap, 0x50, 0x100, (const uint8_t *)"A", 0);
+	fmap_append_area(&fmap, 0x90, 0x090, (const uint8_t *)"C", 0);
+	n = fmap_validate(fmap, 0, &issues);
+	if ((fmap_issue_count(issues, n, FMAP_ISSUE_OVERLAP, -1) != 2) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_OVERLAP, 1) != 1) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_OVERLAP, 2) != 1) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_NESTED, -1) != 1) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_NESTED, 2) != 1)) {
+		printf("FAILURE: overlap with enclosing area missed\n");
+		goto fmap_validate_test_exit;
+	}
+	for (i = 0; i < n; i++) {
+		if (issues[i].type == FMAP_ISSUE_OVERLAP &&
+		    issues[i].area == 2 && (issues[i].other != 0 ||
+		    issues[i].offset != 0x90 || issues[i].size != 0x70)) {
+			printf("FAILURE: wrong overlap reported\n");
+			goto fmap_validate_test_exit;
+		}
+	}
+	free(issues);
+	issues = NULL;
+
+	/* a large, properly nested and aligned layout has no errors */
+	fmap_destroy(fmap);
+	fmap = fmap_create(0, 0xffff * 0x1000, (uint8_t *)"large");
+	fmap_append_area(&fmap, 0, 0xffff * 0x1000, (const uint8_t *)"ALL", 0);
+	for (i = 0xfffe - 1; i >= 0; i--)
+		fmap_append_area(&fmap, i * 0x1000, 0x1000,
+		                 (const uint8_t *)"SUB", 0);
+	n = fmap_validate(fmap, 0x1000, &issues);
+	if ((n != 0xfffe) ||
+	    (fmap_issue_count(issues, n, FMAP_ISSUE_NESTED, -1) != n)) {
+		printf("FAILURE: clean layout reported %d issues\n", n);
+		goto fmap_validate_test_exit;
+	}
+
+	rc = 0;
+fmap_validate_test_exit:
+	free(issues);
+	fmap_destroy(fmap);
+	return rc;
+}
+/* LCOV_EXCL_STOP */
@@ -29,7 +29,10 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
 #include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <valstr.h>
@@ -63,3 +66,66 @@ uint32_t str2val(const char *str, const struct valstr *vs)
 
 	return vs[i].val;
 }
+
+int str2num(const char *str, long long min, long long max, long long *val)
+{
+	char *end;
+	long long n;
+
+	if (!str || !val)
+		return -1;
+
+	errno = 0;
+	n = strtoll(str, &end, 0);
+	if (errno || end == str || *end || n < min || n > max)
+		return -1;
+
+	*val = n;
+	return 0;
+}
+
+/*
+ * LCOV_EXCL_START
+ * Unit testing stuff done here so we do not need to expose static functions.
+ */
+int valstr_test(void)
+{
+	const struct {
+		const char *str;
+		long long val;
+	} good[] = {
+		{ "0", 0 }, { "42", 42 }, { "0xff", 0xff }, { "010", 8 },
+		{ "255", 255 },
+	};
+	const char *bad[] = {
+		"", "junk", "1M", "12 ", "0x", "-1", "256",
+		"99999999999999999999999",
+	};
+	long long val;
+	int i, rc = 0;
+
+	for (i = 0; i < sizeof(good) / sizeof(good[0]); i++) {
+		if (str2num(good[i].str, 0, 255, &val) < 0 ||
+		    val != good[i].val) {
+			printf("FAILURE: str2num rejected \"%s\"\n",
+			       good[i].str);
+			rc |= 1;
+		}
+	}
+
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		if (str2num(bad[i], 0, 255, &val) >= 0) {
+			printf("FAILURE: str2num accepted \"%s\"\n", bad[i]);
+			rc |= 1;
+		}
+	}
+
+	if (str2num(NULL, 0, 255, &val) >= 0 ||
+	    str2num("1", 0, 255, NULL) >= 0) {
+		printf("FAILURE: str2num failed to abort on NULL input\n");
+		rc |= 1;
+	}
+
+	return rc;
+}
+/* LCOV_EXCL_STOP */
@@ -75,4 +75,23 @@ const char *val2str(uint32_t val, const struct valstr *vs);
  */
 uint32_t str2val(const char *str, const struct valstr *vs);
 
+/*
+ * str2num  -  convert string to number
+ *
+ * @str:        string to convert, decimal, octal (0 prefix) or hex (0x)
+ * @min:        smallest value accepted
+ * @max:        largest value accepted
+ * @val:        location to store value
+ *
+ * The whole string must be a number, so "1M", "junk" or "" are rejected
+ * rather than read as a prefix or as 0.
+ *
+ * returns 0 to indicate success
+ * returns <0 if str is not a number between min and max
+ */
+int str2num(const char *str, long long min, long long max, long long *val);
+
+/* unit testing stuff */
+extern int valstr_test(void);
+
 #endif	/* FLASHMAP_LIB_VALSTR_H__ */
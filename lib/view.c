@@ -0,0 +1,275 @@
+/*
+ * Copyright 2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Read-only views of an fmap in place inside an image. The header and
+ * area table are validated once against the image length; after that,
+ * every accessor reads fields with memcpy() so packed and unaligned
+ * tables are handled without copying the table or allocating.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fmap.h>
+
+#define FMAP_AREA_TABLE	offsetof(struct fmap, areas)
+
+/* strings in the fmap are NUL-padded, but need not be NUL-terminated */
+static struct fmap_str fmap_str(const uint8_t *s)
+{
+	struct fmap_str str = { (const char *)s, 0 };
+	const uint8_t *end = memchr(s, '\0', FMAP_STRLEN);
+
+	str.len = end ? (size_t)(end - s) : FMAP_STRLEN;
+	return str;
+}
+
+int fmap_str_eq(struct fmap_str str, const char *s)
+{
+	return s && strlen(s) == str.len && !memcmp(str.ptr, s, str.len);
+}
+
+int fmap_view_init(struct fmap_view *view, const uint8_t *image,
+                   size_t len, long int offset)
+{
+	uint16_t nareas;
+
+	if (!view || !image || offset < 0)
+		return -1;
+
+	if ((size_t)offset > len || len - offset < FMAP_AREA_TABLE)
+		return -1;
+
+	if (memcmp(image + offset, FMAP_SIGNATURE, strlen(FMAP_SIGNATURE)))
+		return -1;
+
+	memcpy(&nareas, image + offset + offsetof(struct fmap, nareas),
+	       sizeof(nareas));
+	if (len - offset - FMAP_AREA_TABLE <
+	    (size_t)nareas * sizeof(struct fmap_area))
+		return -1;
+
+	view->image = image;
+	view->len = len;
+	view->offset = offset;
+	view->nareas = nareas;
+	return 0;
+}
+
+/* header field of the viewed fmap */
+#define FMAP_VIEW_FIELD(view, field)					\
+	((view)->image + (view)->offset + offsetof(struct fmap, field))
+
+uint64_t fmap_view_base(const struct fmap_view *view)
+{
+	uint64_t base;
+
+	memcpy(&base, FMAP_VIEW_FIELD(view, base), sizeof(base));
+	return base;
+}
+
+uint32_t fmap_view_size(const struct fmap_view *view)
+{
+	uint32_t size;
+
+	memcpy(&size, FMAP_VIEW_FIELD(view, size), sizeof(size));
+	return size;
+}
+
+struct fmap_str fmap_view_name(const struct fmap_view *view)
+{
+	return fmap_str(FMAP_VIEW_FIELD(view, name));
+}
+
+int fmap_view_area(const struct fmap_view *view, unsigned int i,
+                   struct fmap_view_area *area)
+{
+	const uint8_t *p;
+
+	if (!view || !area || i >= view->nareas)
+		return -1;
+
+	p = FMAP_VIEW_FIELD(view, areas) + i * sizeof(struct fmap_area);
+	memcpy(&area->offset, p + offsetof(struct fmap_area, offset),
+	       sizeof(area->offset));
+	memcpy(&area->size, p + offsetof(struct fmap_area, size),
+	       sizeof(area->size));
+	memcpy(&area->flags, p + offsetof(struct fmap_area, flags),
+	       sizeof(area->flags));
+	area->name = fmap_str(p + offsetof(struct fmap_area, name));
+	area->index = i;
+
+	return 0;
+}
+
+int fmap_view_next(const struct fmap_view *view, unsigned int *iter,
+                   struct fmap_view_area *area)
+{
+	if (!iter || fmap_view_area(view, *iter, area) < 0)
+		return 0;
+
+	(*iter)++;
+	return 1;
+}
+
+const uint8_t *fmap_view_area_data(const struct fmap_view *view,
+                                   const struct fmap_view_area *area)
+{
+	if (!view || !area)
+		return NULL;
+
+	if ((uint64_t)area->offset + area->size > view->len)
+		return NULL;
+
+	return view->image + area->offset;
+}
+
+int fmap_view_find_area(const struct fmap_view *view, const char *name,
+                        struct fmap_view_area *area)
+{
+	unsigned int i = 0;
+
+	if (!view || !name || !area)
+		return -1;
+
+	while (fmap_view_next(view, &i, area)) {
+		if (fmap_str_eq(area->name, name))
+			return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * LCOV_EXCL_START
+ * Unit testing stuff done here so we do not need to expose static functions.
+ */
+int fmap_view_test(void)
+{
+	struct fmap *fmap;
+	struct fmap_view view;
+	struct fmap_view_area area;
+	uint8_t *image = NULL;
+	size_t image_len = 0x10000, fmap_len;
+	unsigned int i;
+	const long int offset = 0x1001;	/* deliberately unaligned */
+	char name[FMAP_STRLEN + 1];
+	int rc = 1;
+
+	fmap = fmap_create(0xff000000, image_len, (uint8_t *)"view");
+	fmap_append_area(&fmap, 0, 0x1000, (const uint8_t *)"FIRST", 0);
+	fmap_append_area(&fmap, 0x1000, 0x1000, (const uint8_t *)"FMAP",
+	                 FMAP_AREA_STATIC);
+	/* a name using all FMAP_STRLEN bytes has no terminator */
+	memset(name, 'N', FMAP_STRLEN);
+	name[FMAP_STRLEN] = '\0';
+	fmap_append_area(&fmap, 0x2000, 0x20000, (const uint8_t *)name,
+	                 FMAP_AREA_RO);
+	fmap_len = fmap_size(fmap);
+
+	image = calloc(1, image_len);
+	memcpy(image + offset, fmap, fmap_len);
+	memset(image + 0x2000, 0xa5, 0x100);
+
+	if ((fmap_view_init(NULL, image, image_len, offset) >= 0) ||
+	    (fmap_view_init(&view, NULL, image_len, offset) >= 0)) {
+		printf("FAILURE: failed to abort on NULL pointer input\n");
+		goto fmap_view_test_exit;
+	}
+
+	/* every truncation of the area table is refused */
+	for (i = 0; i < fmap_len; i++) {
+		if (fmap_view_init(&view, image, offset + i, offset) >= 0) {
+			printf("FAILURE: accepted fmap truncated to %u "
+			       "bytes\n", i);
+			goto fmap_view_test_exit;
+		}
+	}
+	if ((fmap_view_init(&view, image, image_len, -1) >= 0) ||
+	    (fmap_view_init(&view, image, image_len, offset + 1) >= 0) ||
+	    (fmap_view_init(&view, image, image_len, image_len + 1) >= 0)) {
+		printf("FAILURE: accepted invalid fmap offset\n");
+		goto fmap_view_test_exit;
+	}
+
+	if (fmap_view_init(&view, image, offset + fmap_len, offset) < 0) {
+		printf("FAILURE: failed to validate fmap\n");
+		goto fmap_view_test_exit;
+	}
+	if ((view.nareas != 3) || (fmap_view_base(&view) != 0xff000000) ||
+	    (fmap_view_size(&view) != image_len) ||
+	    !fmap_str_eq(fmap_view_name(&view), "view")) {
+		printf("FAILURE: header fields are incorrect\n");
+		goto fmap_view_test_exit;
+	}
+
+	i = 0;
+	while (fmap_view_next(&view, &i, &area)) {
+		if ((area.offset != fmap->areas[area.index].offset) ||
+		    (area.size != fmap->areas[area.index].size) ||
+		    (area.flags != fmap->areas[area.index].flags)) {
+			printf("FAILURE: area %u is incorrect\n", area.index);
+			goto fmap_view_test_exit;
+		}
+	}
+	if ((i != 3) || (fmap_view_area(&view, 3, &area) >= 0)) {
+		printf("FAILURE: iterated past the area table\n");
+		goto fmap_view_test_exit;
+	}
+
+	if ((fmap_view_find_area(&view, name, &area) < 0) ||
+	    (area.name.len != FMAP_STRLEN) || (area.index != 2)) {
+		printf("FAILURE: failed to find unterminated name\n");
+		goto fmap_view_test_exit;
+	}
+	/* this area runs past the end of the viewed bytes */
+	if (fmap_view_area_data(&view, &area)) {
+		printf("FAILURE: returned data outside the image\n");
+		goto fmap_view_test_exit;
+	}
+
+	if ((fmap_view_find_area(&view, "FIRS", &area) >= 0) ||
+	    (fmap_view_find_area(&view, "FIRST", &area) < 0) ||
+	    (fmap_view_area_data(&view, &area) != image)) {
+		printf("FAILURE: failed to find area \"FIRST\"\n");
+		goto fmap_view_test_exit;
+	}
+
+	rc = 0;
+fmap_view_test_exit:
+	free(image);
+	fmap_destroy(fmap);
+	return rc;
+}
+/* LCOV_EXCL_STOP */